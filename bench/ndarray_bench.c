@@ -0,0 +1,349 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ndarray.h"
+
+// Benchmarks the main kernels over a sweep of sizes and writes the best time of each case,
+// with the GFLOP/s and GB/s it works out to, as CSV or JSON:
+//
+//   ndarray_bench [--format csv|json] [--output path] [--sizes 64,128,...] [--min-time seconds]
+//                 [--threads count]
+//
+// Byte counts are the least traffic each op needs (every input read and output written once),
+// so GB/s can be compared against the machine's memory bandwidth
+
+#define MAX_SIZES 32
+#define LSTSQ_DEGREE 3
+#define LSTSQ_SAMPLES_PER_SIZE 64
+
+struct BenchResult
+{
+    const char *benchmark;
+    const char *variant;
+    int size;
+    double seconds;
+    double flops;
+    double bytes;
+};
+
+struct BenchResults
+{
+    struct BenchResult *results;
+    int count;
+    int capacity;
+};
+
+// Operands of one case, shared by all the run functions
+struct BenchCase
+{
+    struct NDArray *a;
+    struct NDArray *b;
+    struct NDArray *out;
+    enum NDArrayUfunc op;
+    int axis;
+    int transpose;
+};
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Best time of run over at least three repeats and minTime seconds, after one warm up run to
+// start the thread pool, size the scratch buffers and fault in the outputs
+static double timeRun(void (*run)(struct BenchCase *), struct BenchCase *bench, double minTime)
+{
+    run(bench);
+    double best = 0;
+    double start = now();
+    for (int repeat = 0; repeat < 3 || now() - start < minTime; repeat++)
+    {
+        double begin = now();
+        run(bench);
+        double elapsed = now() - begin;
+        if (repeat == 0 || elapsed < best)
+        {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+static void addResult(struct BenchResults *results, const char *benchmark, const char *variant, int size,
+                      double seconds, double flops, double bytes)
+{
+    if (results->count == results->capacity)
+    {
+        results->capacity = results->capacity > 0 ? 2 * results->capacity : 64;
+        results->results = realloc(results->results, sizeof(struct BenchResult) * results->capacity);
+    }
+    struct BenchResult *result = &results->results[results->count++];
+    result->benchmark = benchmark;
+    result->variant = variant;
+    result->size = size;
+    result->seconds = seconds;
+    result->flops = flops;
+    result->bytes = bytes;
+    fprintf(stderr, "%-14s %-12s %6d  %10.6f s  %8.2f GFLOP/s  %8.2f GB/s\n", benchmark, variant, size, seconds,
+            flops / seconds * 1e-9, bytes / seconds * 1e-9);
+}
+
+// Uniform values in [0, 1) from a fixed seed, so every run sees the same data
+static struct NDArray *randomArray(int *shape, int ndim, unsigned *seed)
+{
+    struct NDArray *array = NDArray_zeros(shape, ndim);
+    for (int i = 0; i < array->dataCount; i++)
+    {
+        *seed = *seed * 1664525u + 1013904223u;
+        array->data[i] = (NDARRAY_TYPE)((*seed >> 8) * (1.0 / (1 << 24)));
+    }
+    return array;
+}
+
+static void runMatmul(struct BenchCase *bench)
+{
+    NDArray_matmul_out(bench->a, bench->b, bench->out);
+}
+
+static void runInv(struct BenchCase *bench)
+{
+    NDArray_inv_out(bench->a, bench->out);
+}
+
+static void runBinary(struct BenchCase *bench)
+{
+    NDArray_binary_out(bench->op, bench->a, bench->b, bench->out);
+}
+
+static void runSum(struct BenchCase *bench)
+{
+    NDArray_sum_out(bench->a, bench->axis, bench->out);
+}
+
+// Flatten a view of a, which has to copy the data first when the view is transposed
+static void runReshape(struct BenchCase *bench)
+{
+    struct NDArray *view = NDArray_copy(bench->a);
+    if (bench->transpose)
+    {
+        NDArray_swapAxes(view, 0, 1);
+    }
+    int shape[] = {-1};
+    NDArray_reshape(view, shape, 1);
+    NDArray_free(view);
+}
+
+// The whole fit from examples/least_squares.c: the Vandermonde matrix of the inputs, then QR
+static void runLeastSquares(struct BenchCase *bench)
+{
+    struct NDArray *coefficients = NDArray_polyfit(bench->a, bench->b, LSTSQ_DEGREE);
+    NDArray_free(coefficients);
+}
+
+// Evaluate a polynomial of degree LSTSQ_DEGREE, held in b, at every element of a
+static void runPolyval(struct BenchCase *bench)
+{
+    NDArray_polyval_out(bench->b, bench->a, bench->out);
+}
+
+static void benchSize(struct BenchResults *results, int n, double minTime)
+{
+    double s = sizeof(NDARRAY_TYPE);
+    double n2 = (double)n * n;
+    unsigned seed = 12345;
+    int square[] = {n, n};
+    int row[] = {1, n};
+    struct BenchCase bench = {0};
+    bench.a = randomArray(square, 2, &seed);
+    bench.b = randomArray(square, 2, &seed);
+    bench.out = NDArray_zeros(square, 2);
+
+    addResult(results, "matmul", "", n, timeRun(runMatmul, &bench, minTime), 2 * n2 * n, 3 * n2 * s);
+
+    // Diagonally dominant, so the inverse is well conditioned at every size
+    struct NDArray *b = bench.b;
+    bench.b = 0;
+    for (int i = 0; i < n; i++)
+    {
+        bench.a->data[i * n + i] += n;
+    }
+    addResult(results, "inv", "", n, timeRun(runInv, &bench, minTime), 2 * n2 * n, 2 * n2 * s);
+
+    static const struct
+    {
+        const char *name;
+        enum NDArrayUfunc op;
+    } ops[] = {{"add", NDARRAY_ADD}, {"multiply", NDARRAY_MULTIPLY}};
+    struct NDArray *transposed = NDArray_copy(b);
+    NDArray_swapAxes(transposed, 0, 1);
+    struct NDArray *broadcast = randomArray(row, 2, &seed);
+    for (int i = 0; i < 2; i++)
+    {
+        bench.op = ops[i].op;
+        bench.b = b;
+        addResult(results, ops[i].name, "contiguous", n, timeRun(runBinary, &bench, minTime), n2, 3 * n2 * s);
+        bench.b = transposed;
+        addResult(results, ops[i].name, "transposed", n, timeRun(runBinary, &bench, minTime), n2, 3 * n2 * s);
+        bench.b = broadcast;
+        addResult(results, ops[i].name, "broadcast", n, timeRun(runBinary, &bench, minTime), n2, (2 * n2 + n) * s);
+    }
+    NDArray_free(transposed);
+    NDArray_free(broadcast);
+
+    // Horner's scheme takes a multiply and an add per coefficient after the first
+    int coefficients[] = {LSTSQ_DEGREE + 1};
+    bench.b = randomArray(coefficients, 1, &seed);
+    addResult(results, "polyval", "", n, timeRun(runPolyval, &bench, minTime), 2.0 * LSTSQ_DEGREE * n2,
+              2 * n2 * s);
+    NDArray_free(bench.b);
+    NDArray_free(bench.out);
+
+    int vector[] = {n};
+    bench.out = NDArray_zeros(vector, 1);
+    static const char *const axes[] = {"axis0", "axis1"};
+    for (int axis = 0; axis < 2; axis++)
+    {
+        bench.axis = axis;
+        addResult(results, "sum", axes[axis], n, timeRun(runSum, &bench, minTime), n2, (n2 + n) * s);
+    }
+    NDArray_free(bench.out);
+    bench.out = 0;
+
+    bench.transpose = 0;
+    addResult(results, "reshape", "view", n, timeRun(runReshape, &bench, minTime), 0, 0);
+    bench.transpose = 1;
+    addResult(results, "reshape", "copy", n, timeRun(runReshape, &bench, minTime), 0, 2 * n2 * s);
+    NDArray_free(bench.a);
+    NDArray_free(b);
+
+    // Householder QR of an m x p matrix takes about 2 m p^2 flops
+    int m = LSTSQ_SAMPLES_PER_SIZE * n;
+    int p = LSTSQ_DEGREE + 1;
+    int samples[] = {m};
+    bench.a = randomArray(samples, 1, &seed);
+    bench.b = randomArray(samples, 1, &seed);
+    addResult(results, "least_squares", "qr", n, timeRun(runLeastSquares, &bench, minTime),
+              2.0 * m * p * p + (double)m * p, ((double)m * p + 2.0 * m) * s);
+    NDArray_free(bench.a);
+    NDArray_free(bench.b);
+}
+
+static void writeCsv(FILE *file, struct BenchResults *results)
+{
+    fprintf(file, "benchmark,variant,size,threads,seconds,gflops,gbps\n");
+    for (int i = 0; i < results->count; i++)
+    {
+        struct BenchResult *result = &results->results[i];
+        fprintf(file, "%s,%s,%d,%d,%.9g,%.6g,%.6g\n", result->benchmark, result->variant, result->size,
+                NDArray_getNumThreads(), result->seconds, result->flops / result->seconds * 1e-9,
+                result->bytes / result->seconds * 1e-9);
+    }
+}
+
+static void writeJson(FILE *file, struct BenchResults *results)
+{
+    fprintf(file, "{\n  \"dtype\": \"%s\",\n  \"threads\": %d,\n  \"isa\": %d,\n  \"results\": [\n",
+            sizeof(NDARRAY_TYPE) == sizeof(float) ? "float32" : "float64", NDArray_getNumThreads(), NDArray_isa());
+    for (int i = 0; i < results->count; i++)
+    {
+        struct BenchResult *result = &results->results[i];
+        fprintf(file,
+                "    {\"benchmark\": \"%s\", \"variant\": \"%s\", \"size\": %d, \"seconds\": %.9g, "
+                "\"gflops\": %.6g, \"gbps\": %.6g}%s\n",
+                result->benchmark, result->variant, result->size, result->seconds,
+                result->flops / result->seconds * 1e-9, result->bytes / result->seconds * 1e-9,
+                i + 1 < results->count ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+}
+
+static int usage(const char *program)
+{
+    fprintf(stderr,
+            "usage: %s [--format csv|json] [--output path] [--sizes 64,128,...] [--min-time seconds] "
+            "[--threads count]\n",
+            program);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int sizes[MAX_SIZES] = {64, 128, 256, 512, 1024, 2048};
+    int sizeCount = 6;
+    double minTime = 0.2;
+    int json = 0;
+    const char *output = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc)
+        {
+            return usage(argv[0]);
+        }
+        const char *value = argv[++i];
+        if (strcmp(argv[i - 1], "--format") == 0 && (strcmp(value, "csv") == 0 || strcmp(value, "json") == 0))
+        {
+            json = strcmp(value, "json") == 0;
+        }
+        else if (strcmp(argv[i - 1], "--output") == 0)
+        {
+            output = value;
+        }
+        else if (strcmp(argv[i - 1], "--min-time") == 0)
+        {
+            minTime = atof(value);
+        }
+        else if (strcmp(argv[i - 1], "--threads") == 0)
+        {
+            NDArray_setNumThreads(atoi(value));
+        }
+        else if (strcmp(argv[i - 1], "--sizes") == 0)
+        {
+            sizeCount = 0;
+            for (char *end = (char *)value; *end != 0 && sizeCount < MAX_SIZES;)
+            {
+                long size = strtol(end, &end, 10);
+                if (size <= 0 || (*end != ',' && *end != 0))
+                {
+                    return usage(argv[0]);
+                }
+                sizes[sizeCount++] = (int)size;
+                end += *end == ',';
+            }
+        }
+        else
+        {
+            return usage(argv[0]);
+        }
+    }
+
+    struct BenchResults results = {0};
+    for (int i = 0; i < sizeCount; i++)
+    {
+        benchSize(&results, sizes[i], minTime);
+    }
+
+    FILE *file = output != 0 ? fopen(output, "w") : stdout;
+    if (file == 0)
+    {
+        fprintf(stderr, "can't write %s\n", output);
+        return 1;
+    }
+    if (json)
+    {
+        writeJson(file, &results);
+    }
+    else
+    {
+        writeCsv(file, &results);
+    }
+    if (file != stdout)
+    {
+        fclose(file);
+    }
+    free(results.results);
+    return 0;
+}
@@ -6,69 +6,33 @@
 
 struct NDArray *createA(float *temps, float *volts, int n, int k)
 {
-    int shape[] = {n, k + 1};
-    struct NDArray *X = NDArray_zeros(shape, 2);
-    shape[1] = 1;
-    struct NDArray *y = NDArray_zeros(shape, 2);
-
-    int index[2];
+    int shape[] = {n};
+    struct NDArray *v = NDArray_zeros(shape, 1);
+    struct NDArray *y = NDArray_zeros(shape, 1);
     for (int i = 0; i < n; i++)
     {
-        index[0] = i;
-        index[1] = 0;
-        NDArray_set(y, index, temps[i]);
-
-        for (int j = 0; j <= k; j++)
-        {
-            index[1] = j;
-            NDArray_set(X, index, powf(volts[i], j));
-        }
+        v->data[i] = volts[i];
+        y->data[i] = temps[i];
     }
 
+    struct NDArray *X = NDArray_vander(v, k + 1);
     NDArray_print(X);
     NDArray_print(y);
-
-    struct NDArray *Xt = NDArray_copy(X);
-    NDArray_swapAxes(Xt, 0, 1);
-
-    struct NDArray *prod1 = NDArray_matmul(Xt, X);
     NDArray_free(X);
 
-    struct NDArray *inv = NDArray_inv(prod1);
-    NDArray_free(prod1);
-
-    struct NDArray *prod2 = NDArray_matmul(inv, Xt);
-    NDArray_free(inv);
-    NDArray_free(Xt);
-
-    struct NDArray *a = NDArray_matmul(prod2, y);
-    NDArray_free(prod2);
+    struct NDArray *a = NDArray_polyfit(v, y, k);
+    NDArray_free(v);
     NDArray_free(y);
     return a;
 }
 
-float getTemp(struct NDArray *a, float x)
+// x and y are owned by the caller and reused between calls, so evaluating the polynomial
+// doesn't allocate. They can hold any number of readings, converted in one pass
+float getTemp(struct NDArray *a, struct NDArray *x, struct NDArray *y, float volts)
 {
-    int shape[2];
-    shape[0] = 1;
-    shape[1] = a->shape[0];
-    struct NDArray *X = NDArray_zeros(shape, 2);
-
-    int index[2];
-    index[0] = 0;
-    for (int j = 0; j < a->shape[0]; j++)
-    {
-        index[1] = j;
-        NDArray_set(X, index, powf(x, j));
-    }
-
-    struct NDArray *y = NDArray_matmul(X, a);
-    float output = y->data[0];
-
-    NDArray_free(X);
-    NDArray_free(y);
-
-    return output;
+    x->data[0] = volts;
+    NDArray_polyval_out(a, x, y);
+    return y->data[0];
 }
 
 int main()
@@ -85,11 +49,17 @@ int main()
     struct NDArray *a;
 
     a = createA(temps, volts, n, k);
+
+    int shape[] = {1};
+    struct NDArray *x = NDArray_zeros(shape, 1);
+    struct NDArray *y = NDArray_zeros(shape, 1);
     for (int i = 0; i < 2; i++)
     {
         // Testing
-        output = getTemp(a, testVal);
+        output = getTemp(a, x, y, testVal);
         printf("%4.4f\n", output);
     }
+    NDArray_free(x);
+    NDArray_free(y);
     NDArray_free(a);
-}
\ No newline at end of file
+}
@@ -1,6 +1,17 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "ndarray.h"
 #include <stdbool.h>
 
@@ -76,365 +87,2031 @@ void printFloatArray(float *row, int length)
     printf("%.2f]", row[length - 1]);
 }
 
-void NDArray_decRefCount(struct NDArray *array)
+// Counters behind NDArray_getStats. They are shared by all threads and updated with relaxed
+// atomics, since a snapshot only has to be consistent with itself eventually
+static struct
 {
-    --*array->refCount;
-    if (*array->refCount == 0)
-    {
-        free(array->data);
-        free(array->refCount);
-    }
-}
+    _Atomic uint64_t calls[NDARRAY_STAT_OPS];
+    _Atomic uint64_t nanoseconds[NDARRAY_STAT_OPS];
+    _Atomic uint64_t bytes[NDARRAY_STAT_OPS];
+    _Atomic uint64_t allocations;
+    _Atomic uint64_t bytesAllocated;
+    _Atomic uint64_t liveBytes;
+    _Atomic uint64_t peakLiveBytes;
+} stats;
+
+// Whether ops are timed: -1 until the NDARRAY_STATS environment variable has been read
+static atomic_int statsTiming = -1;
 
-struct NDArray *NDArray_create(int *shape, int ndim, NDARRAY_TYPE *data)
+static _Atomic(NDArrayTrace) traceCallback;
+static void *_Atomic traceContext;
+
+void NDArray_setStatsTiming(int enabled)
 {
-    int dataCount = shapeSize(shape, ndim);
+    atomic_store_explicit(&statsTiming, enabled != 0, memory_order_relaxed);
+}
 
-    struct NDArray *output = (struct NDArray *)malloc(sizeof(struct NDArray));
-    output->data = data;
-    output->refCount = (int *)malloc(sizeof(int));
-    *output->refCount = 1;
+void NDArray_setTrace(NDArrayTrace trace, void *context)
+{
+    atomic_store_explicit(&traceContext, context, memory_order_relaxed);
+    atomic_store_explicit(&traceCallback, trace, memory_order_release);
+}
 
-    output->steps = (int *)malloc(sizeof(int) * ndim);
-    output->shape = (int *)malloc(sizeof(int) * ndim);
-    memcpy(output->shape, shape, sizeof(int) * ndim);
-    int prod = 1;
-    for (int i = ndim - 1; i >= 0; i--)
+void NDArray_getStats(struct NDArrayStats *snapshot)
+{
+    for (int op = 0; op < NDARRAY_STAT_OPS; op++)
     {
-        output->steps[i] = prod;
-        prod *= shape[i];
+        snapshot->calls[op] = atomic_load_explicit(&stats.calls[op], memory_order_relaxed);
+        snapshot->nanoseconds[op] = atomic_load_explicit(&stats.nanoseconds[op], memory_order_relaxed);
+        snapshot->bytes[op] = atomic_load_explicit(&stats.bytes[op], memory_order_relaxed);
     }
-    output->steps[ndim - 1] = 1;
+    snapshot->allocations = atomic_load_explicit(&stats.allocations, memory_order_relaxed);
+    snapshot->bytesAllocated = atomic_load_explicit(&stats.bytesAllocated, memory_order_relaxed);
+    snapshot->liveBytes = atomic_load_explicit(&stats.liveBytes, memory_order_relaxed);
+    snapshot->peakLiveBytes = atomic_load_explicit(&stats.peakLiveBytes, memory_order_relaxed);
+}
 
-    output->ndim = ndim;
-    output->dataCount = dataCount;
+void NDArray_resetStats(void)
+{
+    for (int op = 0; op < NDARRAY_STAT_OPS; op++)
+    {
+        atomic_store_explicit(&stats.calls[op], 0, memory_order_relaxed);
+        atomic_store_explicit(&stats.nanoseconds[op], 0, memory_order_relaxed);
+        atomic_store_explicit(&stats.bytes[op], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&stats.allocations, 0, memory_order_relaxed);
+    atomic_store_explicit(&stats.bytesAllocated, 0, memory_order_relaxed);
+    // Memory that is still live carries over, and the peak starts again from it
+    atomic_store_explicit(&stats.peakLiveBytes, atomic_load_explicit(&stats.liveBytes, memory_order_relaxed),
+                          memory_order_relaxed);
+}
 
-    return output;
+static uint64_t statsNow(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
 }
 
-struct NDArray *NDArray_zeros(int *shape, int ndim)
+// Start timing an op, returning 0 when timing is off
+static uint64_t statsBegin(void)
 {
-    int dataCount = shapeSize(shape, ndim);
-    NDARRAY_TYPE *data = (NDARRAY_TYPE *)calloc(dataCount, sizeof(NDARRAY_TYPE));
+    int timing = atomic_load_explicit(&statsTiming, memory_order_relaxed);
+    if (timing < 0)
+    {
+        const char *env = getenv("NDARRAY_STATS");
+        timing = env != 0 && atoi(env) > 0;
+        atomic_store_explicit(&statsTiming, timing, memory_order_relaxed);
+    }
+    if (!timing && atomic_load_explicit(&traceCallback, memory_order_relaxed) == 0)
+    {
+        return 0;
+    }
+    return statsNow();
+}
 
-    return NDArray_create(shape, ndim, data);
+// Count a call to op that copied bytes, and report it to the trace callback if it was timed
+static void statsEnd(enum NDArrayStatOp op, uint64_t start, size_t bytes)
+{
+    // Locked adds are a large part of a small op's time, so the byte count is only touched
+    // by ops that copy
+    atomic_fetch_add_explicit(&stats.calls[op], 1, memory_order_relaxed);
+    if (bytes != 0)
+    {
+        atomic_fetch_add_explicit(&stats.bytes[op], bytes, memory_order_relaxed);
+    }
+    if (start == 0)
+    {
+        return;
+    }
+    uint64_t elapsed = statsNow() - start;
+    atomic_fetch_add_explicit(&stats.nanoseconds[op], elapsed, memory_order_relaxed);
+    NDArrayTrace trace = atomic_load_explicit(&traceCallback, memory_order_acquire);
+    if (trace != 0)
+    {
+        trace(op, elapsed, bytes, atomic_load_explicit(&traceContext, memory_order_relaxed));
+    }
 }
 
-struct NDArray *NDArray_ones(int *shape, int ndim)
+static void statsAllocate(size_t size)
 {
-    int dataCount = shapeSize(shape, ndim);
-    NDARRAY_TYPE *data = (NDARRAY_TYPE *)malloc(dataCount * sizeof(NDARRAY_TYPE));
-    for (int i = 0; i < dataCount; i++)
+    atomic_fetch_add_explicit(&stats.allocations, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&stats.bytesAllocated, size, memory_order_relaxed);
+    uint64_t live = atomic_fetch_add_explicit(&stats.liveBytes, size, memory_order_relaxed) + size;
+    uint64_t peak = atomic_load_explicit(&stats.peakLiveBytes, memory_order_relaxed);
+    while (live > peak && !atomic_compare_exchange_weak_explicit(&stats.peakLiveBytes, &peak, live,
+                                                                 memory_order_relaxed, memory_order_relaxed))
     {
-        data[i] = 1;
     }
+}
+
+// Every block the library allocates starts with this header, so that it can be released
+// through the allocator that provided it along with the size it was allocated with
+struct AllocationHeader
+{
+    const struct NDArrayAllocator *allocator;
+    size_t size;
+};
+
+// Keeps the memory after the header aligned for any element type
+#define ALLOCATION_HEADER_SIZE ((sizeof(struct AllocationHeader) + 15) & ~(size_t)15)
 
-    return NDArray_create(shape, ndim, data);
+static void *systemAllocate(void *context, size_t size)
+{
+    return malloc(size);
 }
 
-struct NDArray *NDArray_single(NDARRAY_TYPE value, int ndim)
+static void systemRelease(void *context, void *pointer, size_t size)
 {
-    NDARRAY_TYPE *data = (NDARRAY_TYPE *)malloc(sizeof(NDARRAY_TYPE));
-    *data = value;
+    free(pointer);
+}
 
-    int shape[ndim];
-    for (int i = 0; i < ndim; i++)
-    {
-        shape[i] = 1;
-    }
+static const struct NDArrayAllocator systemAllocator = {systemAllocate, systemRelease, 0};
 
-    return NDArray_create(shape, ndim, data);
+static _Thread_local const struct NDArrayAllocator *currentAllocator = &systemAllocator;
+
+void NDArray_setAllocator(const struct NDArrayAllocator *allocator)
+{
+    currentAllocator = allocator != 0 ? allocator : &systemAllocator;
 }
 
-struct NDArray *NDArray_eye(int size)
+const struct NDArrayAllocator *NDArray_getAllocator(void)
 {
-    int shape[] = {size, size};
-    struct NDArray *output = NDArray_zeros(shape, 2);
+    return currentAllocator;
+}
 
-    for (int i = 0; i < size; i++)
+// Arena blocks stay live until NDArray_arenaReset, whether or not they were freed
+static const struct NDArrayAllocator arenaAllocator;
+static _Thread_local uint64_t arenaLiveBytes;
+
+static void *ndMalloc(size_t size)
+{
+    const struct NDArrayAllocator *allocator = currentAllocator;
+    char *block = (char *)allocator->allocate(allocator->context, ALLOCATION_HEADER_SIZE + size);
+    if (block == 0)
     {
-        output->data[i * size + i] = 1;
+        return 0;
     }
-
-    return output;
+    struct AllocationHeader *header = (struct AllocationHeader *)block;
+    header->allocator = allocator;
+    header->size = ALLOCATION_HEADER_SIZE + size;
+    statsAllocate(header->size);
+    if (allocator == &arenaAllocator)
+    {
+        arenaLiveBytes += header->size;
+    }
+    return block + ALLOCATION_HEADER_SIZE;
 }
 
-// Assumes index is valid. Sets all to zero if array is finished.
-// Otherwise, return step
-int NDArray_incIndex(struct NDArray *array, int *index)
+static void ndFree(void *pointer)
 {
-    int step = 0;
-    for (int i = array->ndim - 1; i >= 0; i--)
+    if (pointer != 0)
     {
-        index[i]++;
-        if (index[i] == array->shape[i])
-        {
-            index[i] = 0;
-            step -= (array->shape[i] - 1) * array->steps[i];
-        }
-        else
+        struct AllocationHeader *header = (struct AllocationHeader *)((char *)pointer - ALLOCATION_HEADER_SIZE);
+        if (header->allocator != &arenaAllocator)
         {
-            return step + array->steps[i];
+            atomic_fetch_sub_explicit(&stats.liveBytes, header->size, memory_order_relaxed);
         }
+        header->allocator->release(header->allocator->context, header, header->size);
     }
-    // This is really just a flag. I think the step to loop should really be this - 1
-    return -array->dataCount;
 }
 
-int NDArray_reshape(struct NDArray *array, int *newShape, int newNDim)
+// Pool allocator: per thread free lists for blocks of 32, 64, 128 and 256 bytes (which covers
+// array headers, shapes, steps and reference counts) carved out of slabs aligned to their size,
+// so a block finds its slab by masking its address. A block released on another thread goes
+// back to its slab, and the owner takes those over when its own list runs dry. A slab counts
+// its blocks in use plus one for its owning thread, and whichever of the last release and the
+// owner's exit drops that to 0 frees it. Bigger blocks go straight to malloc
+#define POOL_CLASSES 4
+#define POOL_MIN_BLOCK 32
+#define POOL_SLAB_SIZE 65536
+
+struct PoolBlock
 {
-    // Copy the shape, to avoid modifying the original
-    int tempNewShape[newNDim];
-    memcpy(tempNewShape, newShape, newNDim * sizeof(int));
-    newShape = tempNewShape;
+    struct PoolBlock *next;
+};
 
-    // Calculate the value of an undefined index
-    int undefIndex = -1;
-    int prod = 1;
-    bool identical = array->ndim == newNDim;
-    for (int i = 0; i < newNDim; i++)
+struct PoolSlab
+{
+    // The owner's next slab of the same class
+    struct PoolSlab *next;
+    // Id of the owning thread, or 0 once it has exited
+    _Atomic uint64_t owner;
+    _Atomic(struct PoolBlock *) remote;
+    atomic_size_t users;
+};
+
+#define POOL_SLAB_HEADER_SIZE ((sizeof(struct PoolSlab) + 15) & ~(size_t)15)
+
+static _Thread_local struct PoolBlock *poolFreeLists[POOL_CLASSES];
+static _Thread_local struct PoolSlab *poolSlabs[POOL_CLASSES];
+// Nonzero once the thread owns a slab. Ids are never reused, unlike thread local addresses
+static _Thread_local uint64_t poolThread;
+static _Atomic uint64_t poolThreadCount;
+static pthread_key_t poolExitKey;
+static pthread_once_t poolExitOnce = PTHREAD_ONCE_INIT;
+
+static int poolClass(size_t size)
+{
+    for (int c = 0; c < POOL_CLASSES; c++)
     {
-        if (newShape[i] == -1)
+        if (size <= (size_t)POOL_MIN_BLOCK << c)
         {
-            if (undefIndex != -1)
-            {
-                return 2;
-            }
-            else
-            {
-                undefIndex = i;
-            }
+            return c;
         }
-        else
+    }
+    return -1;
+}
+
+static struct PoolSlab *poolSlabOf(void *block)
+{
+    return (struct PoolSlab *)((uintptr_t)block & ~(uintptr_t)(POOL_SLAB_SIZE - 1));
+}
+
+// Drop the exiting thread's hold on its slabs. Its free lists go with it
+static void poolThreadExit(void *unused)
+{
+    for (int c = 0; c < POOL_CLASSES; c++)
+    {
+        while (poolSlabs[c] != 0)
         {
-            // Check if the
-            if (identical)
+            struct PoolSlab *slab = poolSlabs[c];
+            poolSlabs[c] = slab->next;
+            atomic_store_explicit(&slab->owner, 0, memory_order_release);
+            if (atomic_fetch_sub_explicit(&slab->users, 1, memory_order_acq_rel) == 1)
             {
-                identical = array->shape[i] == newShape[i];
+                free(slab);
             }
-            prod *= newShape[i];
         }
+        poolFreeLists[c] = 0;
     }
+}
 
-    if (undefIndex != -1)
+static void poolExitKeyCreate(void)
+{
+    pthread_key_create(&poolExitKey, poolThreadExit);
+}
+
+static int poolNewSlab(int c)
+{
+    if (poolThread == 0)
     {
-        newShape[undefIndex] = array->dataCount / prod;
+        pthread_once(&poolExitOnce, poolExitKeyCreate);
+        if (pthread_setspecific(poolExitKey, poolSlabs) != 0)
+        {
+            return 1;
+        }
+        poolThread = atomic_fetch_add_explicit(&poolThreadCount, 1, memory_order_relaxed) + 1;
     }
-
-    // Check if the new shape is actually valid
-    if (shapeSize(newShape, newNDim) != array->dataCount)
+    struct PoolSlab *slab = (struct PoolSlab *)aligned_alloc(POOL_SLAB_SIZE, POOL_SLAB_SIZE);
+    if (slab == 0)
     {
         return 1;
     }
+    slab->next = poolSlabs[c];
+    atomic_init(&slab->owner, poolThread);
+    atomic_init(&slab->remote, 0);
+    atomic_init(&slab->users, 1);
+    poolSlabs[c] = slab;
 
-    // Only shortcut out after checking that the new shape is valid. It probably has to be anyway
-    if (identical)
+    size_t blockSize = (size_t)POOL_MIN_BLOCK << c;
+    for (size_t offset = POOL_SLAB_HEADER_SIZE; offset + blockSize <= POOL_SLAB_SIZE; offset += blockSize)
     {
-        return 0;
+        struct PoolBlock *block = (struct PoolBlock *)((char *)slab + offset);
+        block->next = poolFreeLists[c];
+        poolFreeLists[c] = block;
     }
+    return 0;
+}
 
-    int indOld = array->ndim - 1;
-    int indNew = newNDim - 1;
-    int newSteps[newNDim];
-    int oldShape[array->ndim];
-    memcpy(oldShape, array->shape, array->ndim * sizeof(int));
-    int oldSteps[array->ndim];
-    memcpy(oldSteps, array->steps, array->ndim * sizeof(int));
-    if (newShape[indNew] == 1)
+static void *poolAllocate(void *context, size_t size)
+{
+    int c = poolClass(size);
+    if (c < 0)
     {
-        newSteps[indNew] = 1;
-        indNew--;
+        return malloc(size);
     }
-    while (indNew >= 0)
+
+    if (poolFreeLists[c] == 0)
     {
-        if (oldShape[indOld] % newShape[indNew] == 0)
-        {
-            newSteps[indNew] = oldSteps[indOld];
-            oldSteps[indOld] *= newShape[indNew];
-            oldShape[indOld] /= newShape[indNew];
-            indNew--;
-        }
-        else if (oldShape[indOld] == 1 || oldSteps[indOld - 1] == oldShape[indOld] * oldSteps[indOld])
-        {
-            oldShape[indOld - 1] *= oldShape[indOld];
-            indOld--;
-        }
-        else
+        // Take back the blocks other threads released
+        for (struct PoolSlab *slab = poolSlabs[c]; slab != 0; slab = slab->next)
         {
-            DEBUG_PRINT("Making contiguous!\n");
-            NDArray_makeContiguous(array);
-            newSteps[newNDim - 1] = 1;
-            for (int i = newNDim - 1; i > 0; i--)
+            struct PoolBlock *block = atomic_exchange_explicit(&slab->remote, 0, memory_order_acquire);
+            while (block != 0)
             {
-                newSteps[i - 1] = newShape[i] * newSteps[i];
+                struct PoolBlock *next = block->next;
+                block->next = poolFreeLists[c];
+                poolFreeLists[c] = block;
+                block = next;
             }
-            break;
         }
     }
-
-    // Set new shape and steps
-    array->shape = (int *)realloc(array->shape, sizeof(int) * newNDim);
-    memcpy(array->shape, newShape, sizeof(int) * newNDim);
-
-    array->steps = (int *)realloc(array->steps, sizeof(int) * newNDim);
-    memcpy(array->steps, newSteps, sizeof(int) * newNDim);
-
-    array->ndim = newNDim;
-    return 0;
-}
-
-int NDArray_expandDims(struct NDArray *array, int axis)
-{
-    axis = validateAxis(axis, array->ndim + 1);
-    if (axis < 0)
+    if (poolFreeLists[c] == 0 && poolNewSlab(c))
     {
-        return 1;
+        return 0;
     }
 
-    int newShape[array->ndim + 1];
-    for (int i = 0; i < array->ndim; i++)
-    {
-        newShape[i + (i >= axis)] = array->shape[i];
-    }
-    newShape[axis] = 1;
-    int errorCode = NDArray_reshape(array, newShape, array->ndim + 1);
-    if (errorCode > 0)
-    {
-        // Offset errorCode past internal errors
-        return errorCode + 1;
-    }
-    return 0;
+    struct PoolBlock *block = poolFreeLists[c];
+    poolFreeLists[c] = block->next;
+    atomic_fetch_add_explicit(&poolSlabOf(block)->users, 1, memory_order_relaxed);
+    return block;
 }
 
-int NDArray_squeeze(struct NDArray *array, int axis)
+static void poolRelease(void *context, void *pointer, size_t size)
 {
-    axis = validateAxis(axis, array->ndim);
-    if (axis < 0)
+    int c = poolClass(size);
+    if (c < 0)
     {
-        return 1;
+        free(pointer);
+        return;
     }
-    if (array->shape[axis] != 1)
+    struct PoolBlock *block = (struct PoolBlock *)pointer;
+    struct PoolSlab *slab = poolSlabOf(block);
+    if (poolThread != 0 && atomic_load_explicit(&slab->owner, memory_order_relaxed) == poolThread)
     {
-        return 2;
+        block->next = poolFreeLists[c];
+        poolFreeLists[c] = block;
+        atomic_fetch_sub_explicit(&slab->users, 1, memory_order_relaxed);
+        return;
     }
 
-    int newShape[array->ndim - 1];
-    for (int i = 0; i < array->ndim - 1; i++)
+    struct PoolBlock *head = atomic_load_explicit(&slab->remote, memory_order_relaxed);
+    do
     {
-        newShape[i] = array->shape[i + (i >= axis)];
-    }
-    int errorCode = NDArray_reshape(array, newShape, array->ndim - 1);
-    if (errorCode > 0)
+        block->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&slab->remote, &head, block, memory_order_release,
+                                                    memory_order_relaxed));
+    if (atomic_fetch_sub_explicit(&slab->users, 1, memory_order_acq_rel) == 1)
     {
-        // Offset errorCode past internal errors
-        return errorCode + 2;
+        free(slab);
     }
-    return 0;
 }
 
-int NDArray_transpose(struct NDArray *array, int *newOrder)
-{
-    int *tempSteps = (int *)malloc(sizeof(int) * array->ndim);
-    int *tempShape = (int *)malloc(sizeof(int) * array->ndim);
+static const struct NDArrayAllocator poolAllocator = {poolAllocate, poolRelease, 0};
 
-    for (int i = 0; i < array->ndim; i++)
-    {
-        tempSteps[i] = array->steps[newOrder[i]];
-        tempShape[i] = array->shape[newOrder[i]];
-    }
-    free(array->steps);
-    free(array->shape);
-    array->steps = tempSteps;
-    array->shape = tempShape;
-    return 0;
+const struct NDArrayAllocator *NDArray_poolAllocator(void)
+{
+    return &poolAllocator;
 }
 
-int NDArray_swapAxes(struct NDArray *array, int axis1, int axis2)
+// Arena allocator: per thread bump allocation out of chunks, where releasing is a no-op
+// and NDArray_arenaReset frees everything at once
+#define ARENA_CHUNK_SIZE (1 << 20)
+
+struct ArenaChunk
 {
-    axis1 = validateAxis(axis1, array->ndim);
-    axis2 = validateAxis(axis2, array->ndim);
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+};
 
-    if (axis1 < 0 || axis2 < 0)
-    {
-        return 1;
-    }
+#define ARENA_CHUNK_HEADER_SIZE ((sizeof(struct ArenaChunk) + 15) & ~(size_t)15)
 
-    int newOrder[array->ndim];
-    for (int i = 0; i < array->ndim; i++)
-    {
-        newOrder[i] = i;
-    }
-    newOrder[axis1] = axis2;
-    newOrder[axis2] = axis1;
+static _Thread_local struct ArenaChunk *arenaChunks;
 
-    int errorCode = NDArray_transpose(array, newOrder);
-    if (errorCode != 0)
+static struct ArenaChunk *arenaNewChunk(size_t size)
+{
+    struct ArenaChunk *chunk = (struct ArenaChunk *)malloc(ARENA_CHUNK_HEADER_SIZE + size);
+    if (chunk != 0)
     {
-        return errorCode + 1;
+        chunk->next = arenaChunks;
+        chunk->size = size;
+        chunk->used = 0;
+        arenaChunks = chunk;
     }
-    return 0;
+    return chunk;
 }
 
-NDARRAY_TYPE *NDArray_getPointer(struct NDArray *array, int *index)
+static void *arenaAllocate(void *context, size_t size)
 {
-    NDARRAY_TYPE *addr = array->data;
-    for (int i = 0; i < array->ndim; i++)
+    size = (size + 15) & ~(size_t)15;
+    struct ArenaChunk *chunk = arenaChunks;
+    if (chunk == 0 || chunk->used + size > chunk->size)
     {
-        addr += index[i] * array->steps[i];
+        chunk = arenaNewChunk(size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE);
+        if (chunk == 0)
+        {
+            return 0;
+        }
     }
-    return addr;
+    void *pointer = (char *)chunk + ARENA_CHUNK_HEADER_SIZE + chunk->used;
+    chunk->used += size;
+    return pointer;
 }
 
-int compare(const void *a, const void *b)
+static void arenaRelease(void *context, void *pointer, size_t size)
 {
-    return (*(int *)b - *(int *)a);
 }
 
-int NDArray_makeContiguous(struct NDArray *array)
-{
-    NDARRAY_TYPE *newData = (NDARRAY_TYPE *)malloc(array->dataCount * sizeof(NDARRAY_TYPE));
-    int index[array->ndim];
-    memset(index, 0, array->ndim * sizeof(int));
-
-    int nextStep;
-    NDARRAY_TYPE *outPointer = newData;
-    do
-    {
-        *outPointer = NDArray_get(array, index);
-        outPointer++;
-    } while (NDArray_incIndex(array, index) != -array->dataCount);
-
-    NDArray_decRefCount(array);
-    array->data = newData;
-    array->refCount = (int *)malloc(sizeof(int));
-    *array->refCount = 1;
+static const struct NDArrayAllocator arenaAllocator = {arenaAllocate, arenaRelease, 0};
 
-    qsort(array->steps, array->ndim, sizeof(int), compare);
-    return 0;
+const struct NDArrayAllocator *NDArray_arenaAllocator(void)
+{
+    return &arenaAllocator;
 }
 
-// Assumes pointer is in array. Currently, this won't work with steps of 0
-void NDArray_getIndex(struct NDArray *array, NDARRAY_TYPE *pointer, int *index)
+void NDArray_arenaReset(void)
 {
-    int offset = pointer - array->data;
-    int prevStep = array->dataCount;
-    for (int i = 0; i < array->ndim; i++)
+    atomic_fetch_sub_explicit(&stats.liveBytes, arenaLiveBytes, memory_order_relaxed);
+    arenaLiveBytes = 0;
+    if (arenaChunks == 0)
     {
-        // Get the largest step that is smaller than the previous step
-        int step = 0;
-        int stepIndex = 0;
-        for (int j = 0; j < array->ndim; j++)
-        {
-            if (array->steps[j] < prevStep && array->steps[j] > step)
-            {
-                step = array->steps[j];
-                stepIndex = j;
-            }
-        }
-        prevStep = step;
+        return;
+    }
+    if (arenaChunks->next == 0)
+    {
+        arenaChunks->used = 0;
+        return;
+    }
 
-        index[stepIndex] = offset / step;
-        offset = offset % step;
+    // The frame needed several chunks, so replace them with one big enough for all of it
+    size_t total = 0;
+    while (arenaChunks != 0)
+    {
+        struct ArenaChunk *next = arenaChunks->next;
+        total += arenaChunks->size;
+        free(arenaChunks);
+        arenaChunks = next;
+    }
+    arenaNewChunk(total);
+}
+
+// The dtype of NDARRAY_TYPE, which the library's own results and linear algebra use
+#define NATIVE_DTYPE _Generic((NDARRAY_TYPE)0, float: NDARRAY_FLOAT32, double: NDARRAY_FLOAT64, \
+                              int32_t: NDARRAY_INT32, int64_t: NDARRAY_INT64)
+#define NDARRAY_DTYPES 4
+
+static const size_t dtypeSizes[NDARRAY_DTYPES] = {
+    [NDARRAY_FLOAT32] = sizeof(float),
+    [NDARRAY_FLOAT64] = sizeof(double),
+    [NDARRAY_INT32] = sizeof(int32_t),
+    [NDARRAY_INT64] = sizeof(int64_t),
+};
+
+size_t NDArray_itemSize(enum NDArrayDType dtype)
+{
+    return dtypeSizes[dtype];
+}
+
+enum NDArrayDType NDArray_promoteTypes(enum NDArrayDType a, enum NDArrayDType b)
+{
+    static const enum NDArrayDType promotions[NDARRAY_DTYPES][NDARRAY_DTYPES] = {
+        [NDARRAY_FLOAT32] = {NDARRAY_FLOAT32, NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_FLOAT64},
+        [NDARRAY_FLOAT64] = {NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_FLOAT64},
+        [NDARRAY_INT32] = {NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_INT32, NDARRAY_INT64},
+        [NDARRAY_INT64] = {NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_INT64, NDARRAY_INT64},
+    };
+    return promotions[a][b];
+}
+
+// Element index of data, holding dtype, converted to NDARRAY_TYPE
+static inline NDARRAY_TYPE loadElement(const void *data, ptrdiff_t index, enum NDArrayDType dtype)
+{
+    switch (dtype)
+    {
+    case NDARRAY_FLOAT32:
+        return (NDARRAY_TYPE)((const float *)data)[index];
+    case NDARRAY_FLOAT64:
+        return (NDARRAY_TYPE)((const double *)data)[index];
+    case NDARRAY_INT32:
+        return (NDARRAY_TYPE)((const int32_t *)data)[index];
+    default:
+        return (NDARRAY_TYPE)((const int64_t *)data)[index];
+    }
+}
+
+static inline void storeElement(void *data, ptrdiff_t index, enum NDArrayDType dtype, NDARRAY_TYPE value)
+{
+    switch (dtype)
+    {
+    case NDARRAY_FLOAT32:
+        ((float *)data)[index] = (float)value;
+        break;
+    case NDARRAY_FLOAT64:
+        ((double *)data)[index] = (double)value;
+        break;
+    case NDARRAY_INT32:
+        ((int32_t *)data)[index] = (int32_t)value;
+        break;
+    default:
+        ((int64_t *)data)[index] = (int64_t)value;
+        break;
+    }
+}
+
+// Round a size up so that whatever follows it in a block stays aligned
+#define ALIGN_BLOCK(size) (((size) + 15) & ~(size_t)15)
+
+// Reference counted storage for array data. It is released along with the block it lives
+// in once the last array using its data, or living in its block, is freed. The count is
+// atomic so that views of the same data can be made and freed on different threads
+struct NDArrayBuffer
+{
+    atomic_int refCount;
+    void *block;
+    // Frees data the library didn't allocate itself, such as a file mapping, or 0
+    void (*release)(void *data, void *context);
+    void *releaseData;
+    void *releaseContext;
+};
+
+#define BUFFER_HEADER_SIZE ALIGN_BLOCK(sizeof(struct NDArrayBuffer))
+#define ARRAY_HEADER_SIZE ALIGN_BLOCK(sizeof(struct NDArray))
+
+static void bufferIncRefCount(struct NDArrayBuffer *buffer)
+{
+    // Whoever makes the new reference already holds one, so nothing needs ordering here
+    atomic_fetch_add_explicit(&buffer->refCount, 1, memory_order_relaxed);
+}
+
+static void bufferDecRefCount(struct NDArrayBuffer *buffer)
+{
+    // Every thread's writes through its reference have to be visible before the buffer goes
+    if (atomic_fetch_sub_explicit(&buffer->refCount, 1, memory_order_release) == 1)
+    {
+        atomic_thread_fence(memory_order_acquire);
+        if (buffer->release != 0)
+        {
+            buffer->release(buffer->releaseData, buffer->releaseContext);
+        }
+        ndFree(buffer->block);
+    }
+}
+
+// A stand-alone buffer with room for size bytes of data straight after it, or 0 if it can't
+// be allocated
+static struct NDArrayBuffer *bufferAllocate(size_t size)
+{
+    struct NDArrayBuffer *buffer = (struct NDArrayBuffer *)ndMalloc(BUFFER_HEADER_SIZE + size);
+    if (buffer == 0)
+    {
+        return 0;
+    }
+    atomic_init(&buffer->refCount, 1);
+    buffer->block = buffer;
+    buffer->release = 0;
+    return buffer;
+}
+
+static NDARRAY_TYPE *bufferData(struct NDArrayBuffer *buffer)
+{
+    return (NDARRAY_TYPE *)((char *)buffer + BUFFER_HEADER_SIZE);
+}
+
+// Point shape and steps at storage for ndim dimensions: the inline arrays when they fit,
+// otherwise a single heap block holding both. The previous values are not kept. Returns
+// nonzero, leaving array as it was, if the heap block can't be allocated
+static int setNDim(struct NDArray *array, int ndim)
+{
+    int *shape = array->inlineShape;
+    int *steps = array->inlineSteps;
+    if (ndim > NDARRAY_INLINE_DIMS)
+    {
+        shape = (int *)ndMalloc(sizeof(int) * 2 * ndim);
+        if (shape == 0)
+        {
+            return 1;
+        }
+        steps = shape + ndim;
+    }
+    if (array->shape != array->inlineShape)
+    {
+        ndFree(array->shape);
+    }
+    array->shape = shape;
+    array->steps = steps;
+    array->ndim = ndim;
+    return 0;
+}
+
+// Allocate an array with row-major steps and room for dataCount uninitialised elements of
+// dtype. The header, its buffer and the data share a single block
+static struct NDArray *arrayAllocate(int *shape, int ndim, int dataCount, enum NDArrayDType dtype)
+{
+    char *block = (char *)ndMalloc(ARRAY_HEADER_SIZE + BUFFER_HEADER_SIZE + dtypeSizes[dtype] * dataCount);
+    if (block == 0)
+    {
+        return 0;
+    }
+    struct NDArray *output = (struct NDArray *)block;
+    struct NDArrayBuffer *buffer = (struct NDArrayBuffer *)(block + ARRAY_HEADER_SIZE);
+
+    // One reference for the data and one for the header living in the block
+    atomic_init(&buffer->refCount, 2);
+    buffer->block = block;
+    buffer->release = 0;
+    output->buffer = buffer;
+    output->home = buffer;
+    output->data = bufferData(buffer);
+
+    output->shape = output->inlineShape;
+    if (setNDim(output, ndim))
+    {
+        ndFree(block);
+        return 0;
+    }
+    memcpy(output->shape, shape, sizeof(int) * ndim);
+    int prod = 1;
+    for (int i = ndim - 1; i >= 0; i--)
+    {
+        output->steps[i] = prod;
+        prod *= shape[i];
+    }
+    output->dataCount = dataCount;
+    output->dtype = dtype;
+
+    return output;
+}
+
+// A new header sharing array's data, with the given shape and steps, or 0 if it can't be
+// allocated
+static struct NDArray *arrayView(struct NDArray *array, int *shape, int *steps, int ndim)
+{
+    struct NDArray *output = (struct NDArray *)ndMalloc(sizeof(struct NDArray));
+    if (output == 0)
+    {
+        return 0;
+    }
+    output->shape = output->inlineShape;
+    if (setNDim(output, ndim))
+    {
+        ndFree(output);
+        return 0;
+    }
+    memcpy(output->shape, shape, sizeof(int) * ndim);
+    memcpy(output->steps, steps, sizeof(int) * ndim);
+
+    output->data = array->data;
+    output->buffer = array->buffer;
+    bufferIncRefCount(output->buffer);
+    output->home = 0;
+    output->dataCount = array->dataCount;
+    output->dtype = array->dtype;
+    return output;
+}
+
+// Elements from the lowest to the highest address that shape and steps reach from element
+// zero, or 0 if the shape is empty. low is set to the lowest one's offset from element zero
+static int64_t stepSpan(int *shape, int *steps, int ndim, int64_t *low)
+{
+    int64_t high = 0;
+    *low = 0;
+    for (int i = 0; i < ndim; i++)
+    {
+        if (shape[i] == 0)
+        {
+            *low = 0;
+            return 0;
+        }
+        int64_t reach = (int64_t)(shape[i] - 1) * steps[i];
+        if (reach < 0)
+        {
+            *low += reach;
+        }
+        else
+        {
+            high += reach;
+        }
+    }
+    return high - *low + 1;
+}
+
+struct NDArray *NDArray_slice(struct NDArray *array, struct NDArraySlice *slices, int nslices)
+{
+    if (nslices < 0 || nslices > array->ndim)
+    {
+        return 0;
+    }
+    for (int i = 0; i < nslices; i++)
+    {
+        if (slices[i].step == 0)
+        {
+            return 0;
+        }
+    }
+
+    struct NDArray *output = arrayView(array, array->shape, array->steps, array->ndim);
+    if (output == 0)
+    {
+        return 0;
+    }
+    char *data = (char *)array->data;
+    for (int i = 0; i < nslices; i++)
+    {
+        // Clamp start and stop to the axis the way Python does, where a negative step
+        // runs from start down to just past stop
+        int length = array->shape[i];
+        int step = slices[i].step;
+        int bounds[2] = {slices[i].start, slices[i].stop};
+        for (int j = 0; j < 2; j++)
+        {
+            if (bounds[j] < 0)
+            {
+                bounds[j] += length;
+                if (bounds[j] < 0)
+                {
+                    bounds[j] = step < 0 ? -1 : 0;
+                }
+            }
+            else if (bounds[j] >= length)
+            {
+                bounds[j] = step < 0 ? length - 1 : length;
+            }
+        }
+        int start = bounds[0], stop = bounds[1];
+        int count = 0;
+        if (step > 0 && start < stop)
+        {
+            count = (stop - start - 1) / step + 1;
+        }
+        else if (step < 0 && stop < start)
+        {
+            count = (start - stop - 1) / -step + 1;
+        }
+
+        if (count > 0)
+        {
+            data += (ptrdiff_t)start * array->steps[i] * (ptrdiff_t)dtypeSizes[array->dtype];
+        }
+        output->shape[i] = count;
+        output->steps[i] = array->steps[i] * step;
+    }
+    output->data = (NDARRAY_TYPE *)data;
+    return output;
+}
+
+struct NDArray *NDArray_create(int *shape, int ndim)
+{
+    return arrayAllocate(shape, ndim, shapeSize(shape, ndim), NATIVE_DTYPE);
+}
+
+struct NDArray *NDArray_zerosDType(int *shape, int ndim, enum NDArrayDType dtype)
+{
+    if ((unsigned)dtype >= NDARRAY_DTYPES)
+    {
+        return 0;
+    }
+    struct NDArray *output = arrayAllocate(shape, ndim, shapeSize(shape, ndim), dtype);
+    if (output != 0)
+    {
+        memset(output->data, 0, output->dataCount * dtypeSizes[dtype]);
+    }
+    return output;
+}
+
+struct NDArray *NDArray_fromBuffer(void *data, int *shape, int *steps, int ndim, enum NDArrayDType dtype,
+                                   void (*deleter)(void *data, void *context), void *context)
+{
+    if (data == 0 || ndim < 0 || (unsigned)dtype >= NDARRAY_DTYPES)
+    {
+        return 0;
+    }
+    int64_t count = 1;
+    for (int i = 0; i < ndim && count <= INT_MAX; i++)
+    {
+        if (shape[i] < 0)
+        {
+            return 0;
+        }
+        count *= shape[i];
+    }
+    // dataCount spans every element the steps can reach
+    int64_t low;
+    int64_t span = steps != 0 ? stepSpan(shape, steps, ndim, &low) : count;
+    if (count > INT_MAX || span > INT_MAX)
+    {
+        return 0;
+    }
+
+    // The buffer has no data of its own, and hands the caller's back through deleter
+    struct NDArrayBuffer *buffer = bufferAllocate(0);
+    struct NDArray *output = buffer != 0 ? (struct NDArray *)ndMalloc(sizeof(struct NDArray)) : 0;
+    if (output != 0)
+    {
+        output->shape = output->inlineShape;
+    }
+    if (output == 0 || setNDim(output, ndim))
+    {
+        // Freed directly rather than released, since the caller keeps data
+        ndFree(output);
+        ndFree(buffer);
+        return 0;
+    }
+    buffer->release = deleter;
+    buffer->releaseData = data;
+    buffer->releaseContext = context;
+    memcpy(output->shape, shape, sizeof(int) * ndim);
+    int prod = 1;
+    for (int i = ndim - 1; i >= 0; i--)
+    {
+        output->steps[i] = steps != 0 ? steps[i] : prod;
+        prod *= shape[i];
+    }
+    output->data = (NDARRAY_TYPE *)data;
+    output->buffer = buffer;
+    output->home = 0;
+    output->dataCount = (int)span;
+    output->dtype = dtype;
+    return output;
+}
+
+struct NDArray *NDArray_zeros(int *shape, int ndim)
+{
+    return NDArray_zerosDType(shape, ndim, NATIVE_DTYPE);
+}
+
+struct NDArray *NDArray_ones(int *shape, int ndim)
+{
+    struct NDArray *output = NDArray_create(shape, ndim);
+    for (int i = 0; output != 0 && i < output->dataCount; i++)
+    {
+        output->data[i] = 1;
+    }
+    return output;
+}
+
+struct NDArray *NDArray_single(NDARRAY_TYPE value, int ndim)
+{
+    int shape[ndim > 0 ? ndim : 1];
+    for (int i = 0; i < ndim; i++)
+    {
+        shape[i] = 1;
+    }
+
+    struct NDArray *output = NDArray_create(shape, ndim);
+    if (output != 0)
+    {
+        *output->data = value;
+    }
+    return output;
+}
+
+struct NDArray *NDArray_eye(int size)
+{
+    int shape[] = {size, size};
+    struct NDArray *output = NDArray_zeros(shape, 2);
+
+    for (int i = 0; output != 0 && i < size; i++)
+    {
+        output->data[i * size + i] = 1;
+    }
+
+    return output;
+}
+
+// Assumes index is valid. Sets all to zero if array is finished.
+// Otherwise, return step
+int NDArray_incIndex(struct NDArray *array, int *index)
+{
+    int step = 0;
+    for (int i = array->ndim - 1; i >= 0; i--)
+    {
+        index[i]++;
+        if (index[i] == array->shape[i])
+        {
+            index[i] = 0;
+            step -= (array->shape[i] - 1) * array->steps[i];
+        }
+        else
+        {
+            return step + array->steps[i];
+        }
+    }
+    // This is really just a flag. I think the step to loop should really be this - 1
+    return -array->dataCount;
+}
+
+// Maximum dimensions and operands handled by NDArrayIter
+#define ITER_MAXDIM 32
+#define ITER_MAXOP 16
+
+// Iterate in the C order of the given shape rather than the order that best fits memory
+#define ITER_KEEP_ORDER 1
+
+// Iterates several broadcast-compatible arrays at once. Dimensions are reordered so that
+// the smallest steps are innermost, and neighbouring dimensions that are contiguous in
+// every operand are merged. Each outer step then exposes a run of innerSize elements
+// that the caller walks with constant byte steps, so the per element cost is a pointer bump
+struct NDArrayIter
+{
+    int nop;
+    int ndim;
+    int size;
+    int shape[ITER_MAXDIM];
+    int index[ITER_MAXDIM];
+    // Byte steps of each operand along each (reordered) dimension
+    ptrdiff_t steps[ITER_MAXOP][ITER_MAXDIM];
+    // Start of the current inner run for each operand
+    char *data[ITER_MAXOP];
+    int innerSize;
+    ptrdiff_t innerSteps[ITER_MAXOP];
+};
+
+// Whether dimension a should be iterated inside dimension b
+static bool iterIsInner(struct NDArrayIter *it, int a, int b)
+{
+    for (int op = 0; op < it->nop; op++)
+    {
+        ptrdiff_t stepA = it->steps[op][a] < 0 ? -it->steps[op][a] : it->steps[op][a];
+        ptrdiff_t stepB = it->steps[op][b] < 0 ? -it->steps[op][b] : it->steps[op][b];
+        if (stepA != 0 && stepB != 0 && stepA != stepB)
+        {
+            return stepA < stepB;
+        }
+    }
+    return false;
+}
+
+// Set up an iterator over shape for the operands in ops, which must all have ndim dimensions
+// and be equal to shape or 1 in each. Size 1 dimensions are broadcast with a step of 0, which
+// also lets an output accumulate a reduction. Returns nonzero if the operands don't fit
+static int iterInit(struct NDArrayIter *it, int nop, struct NDArray **ops, int *shape, int ndim, int flags)
+{
+    if (nop > ITER_MAXOP)
+    {
+        return 1;
+    }
+
+    it->nop = nop;
+    it->size = shapeSize(shape, ndim);
+    for (int op = 0; op < nop; op++)
+    {
+        if (ops[op]->ndim != ndim)
+        {
+            return 1;
+        }
+        it->data[op] = (char *)ops[op]->data;
+        for (int i = 0; i < ndim; i++)
+        {
+            if (ops[op]->shape[i] != shape[i] && ops[op]->shape[i] != 1)
+            {
+                return 1;
+            }
+        }
+    }
+
+    // Only dimensions longer than 1 are iterated, and an empty shape needs just one of its empty
+    // ones. Any shape with fewer than 2^31 elements then fits in ITER_MAXDIM, whatever its rank
+    int axes[ITER_MAXDIM];
+    int iterShape[ITER_MAXDIM];
+    int count = 0;
+    for (int i = 0; i < ndim; i++)
+    {
+        if (shape[i] == 1 || (it->size == 0 && (shape[i] != 0 || count > 0)))
+        {
+            continue;
+        }
+        if (count == ITER_MAXDIM)
+        {
+            return 1;
+        }
+        axes[count] = i;
+        iterShape[count++] = shape[i];
+    }
+    for (int op = 0; op < nop; op++)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            int axis = axes[i];
+            it->steps[op][i] = ops[op]->shape[axis] == 1 ? 0 : (ptrdiff_t)ops[op]->steps[axis] * dtypeSizes[ops[op]->dtype];
+        }
+    }
+    shape = iterShape;
+    ndim = count;
+
+    // Sort the dimensions, outermost first, with a stable insertion sort
+    int order[ndim > 0 ? ndim : 1];
+    for (int i = 0; i < ndim; i++)
+    {
+        order[i] = i;
+    }
+    if (!(flags & ITER_KEEP_ORDER))
+    {
+        for (int i = 1; i < ndim; i++)
+        {
+            int axis = order[i];
+            int j = i;
+            while (j > 0 && iterIsInner(it, order[j - 1], axis))
+            {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = axis;
+        }
+    }
+
+    // Drop size 1 dimensions and merge the rest where every operand is contiguous across them
+    ptrdiff_t steps[ITER_MAXOP][ITER_MAXDIM];
+    int newNDim = 0;
+    for (int i = 0; i < ndim; i++)
+    {
+        int axis = order[i];
+        if (shape[axis] == 1)
+        {
+            continue;
+        }
+        bool merge = newNDim > 0;
+        for (int op = 0; op < nop && merge; op++)
+        {
+            merge = steps[op][newNDim - 1] == it->steps[op][axis] * shape[axis];
+        }
+        if (merge)
+        {
+            it->shape[newNDim - 1] *= shape[axis];
+            for (int op = 0; op < nop; op++)
+            {
+                steps[op][newNDim - 1] = it->steps[op][axis];
+            }
+        }
+        else
+        {
+            it->shape[newNDim] = shape[axis];
+            for (int op = 0; op < nop; op++)
+            {
+                steps[op][newNDim] = it->steps[op][axis];
+            }
+            newNDim++;
+        }
+    }
+    if (newNDim == 0)
+    {
+        it->shape[0] = 1;
+        for (int op = 0; op < nop; op++)
+        {
+            steps[op][0] = 0;
+        }
+        newNDim = 1;
+    }
+
+    it->ndim = newNDim;
+    memset(it->index, 0, newNDim * sizeof(int));
+    for (int op = 0; op < nop; op++)
+    {
+        memcpy(it->steps[op], steps[op], newNDim * sizeof(ptrdiff_t));
+        it->innerSteps[op] = steps[op][newNDim - 1];
+    }
+    it->innerSize = it->shape[newNDim - 1];
+    return 0;
+}
+
+// Move every operand to the start of the next inner run. Returns false once all are done
+static bool iterNext(struct NDArrayIter *it)
+{
+    for (int i = it->ndim - 2; i >= 0; i--)
+    {
+        if (++it->index[i] < it->shape[i])
+        {
+            for (int op = 0; op < it->nop; op++)
+            {
+                it->data[op] += it->steps[op][i];
+            }
+            return true;
+        }
+        it->index[i] = 0;
+        for (int op = 0; op < it->nop; op++)
+        {
+            it->data[op] -= it->steps[op][i] * (it->shape[i] - 1);
+        }
+    }
+    return false;
+}
+
+// Slots for scratchBuffer. Each caller that can be active at the same time as another
+// gets its own slot, e.g. LU holds SCRATCH_LINALG while its trailing updates use GEMM's
+#define SCRATCH_GEMM_A 0
+#define SCRATCH_GEMM_B 1
+#define SCRATCH_LINALG 2
+#define SCRATCH_EXPR 3
+#define SCRATCH_REDUCE 4
+#define SCRATCH_SLOTS 5
+
+// A per thread buffer of at least size bytes that only ever grows, so that once a loop
+// has warmed up its kernels stop allocating. The contents don't survive a call that grows it.
+// Gives 0 if it can't grow, keeping no buffer so the next call tries again
+static _Thread_local void *scratchBuffers[SCRATCH_SLOTS];
+static _Thread_local size_t scratchSizes[SCRATCH_SLOTS];
+
+static void *scratchBuffer(int slot, size_t size)
+{
+    if (scratchBuffers[slot] == 0 || scratchSizes[slot] < size)
+    {
+        free(scratchBuffers[slot]);
+        scratchBuffers[slot] = malloc(size > 0 ? size : 1);
+        scratchSizes[slot] = scratchBuffers[slot] != 0 ? size : 0;
+    }
+    return scratchBuffers[slot];
+}
+
+// Free the calling thread's scratch buffers, for threads that are about to exit
+static void scratchRelease(void)
+{
+    for (int slot = 0; slot < SCRATCH_SLOTS; slot++)
+    {
+        free(scratchBuffers[slot]);
+        scratchBuffers[slot] = 0;
+        scratchSizes[slot] = 0;
+    }
+}
+
+// Thread pool. A parallel loop splits its range into chunks and gives each thread a
+// contiguous share of them. Threads take chunks from the front of their own share, then
+// steal from the back of the others' once it runs out. Chunk boundaries only depend on the
+// range, grain and thread count, and chunks never write to the same elements, so results
+// don't depend on which thread ran what
+#define THREAD_MAX 256
+// Chunks per thread, which gives stealing something to even out
+#define THREAD_CHUNKS 4
+// Elements below which an element-wise loop or sum isn't worth splitting
+#define PARALLEL_GRAIN 32768
+// Multiply-adds below which matmul isn't worth splitting
+#define PARALLEL_GEMM_GRAIN (1 << 18)
+
+// Body of a parallel loop, called for a subrange [begin, end)
+typedef void (*ParallelTask)(void *context, int begin, int end);
+
+struct ThreadPool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_cond_t done;
+    // Held for the whole of a parallel loop. Loops started while it's taken run serially
+    pthread_mutex_t busy;
+    // Requested thread count, or 0 for the default
+    int threadCount;
+    int workerCount;
+    pthread_t workers[THREAD_MAX];
+    // Bumped for each loop handed to the workers
+    unsigned generation;
+    unsigned startGeneration;
+    bool stop;
+    // Workers yet to finish the current loop
+    int active;
+
+    ParallelTask task;
+    void *context;
+    int count;
+    int chunkCount;
+    // Chunks left in each thread's share, packed as begin << 32 | end
+    _Atomic uint64_t queues[THREAD_MAX];
+};
+
+static struct ThreadPool threadPool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Set on workers and while a thread runs a parallel loop, so nested loops stay serial
+static _Thread_local bool inParallel;
+
+static int threadPoolSize(void)
+{
+    if (threadPool.threadCount == 0)
+    {
+        const char *env = getenv("NDARRAY_NUM_THREADS");
+        int count = env != 0 ? atoi(env) : 0;
+        if (count <= 0)
+        {
+            count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        }
+        threadPool.threadCount = count < 1 ? 1 : count > THREAD_MAX ? THREAD_MAX : count;
+    }
+    return threadPool.threadCount;
+}
+
+// Take a chunk from the front of a share, or from the back when stealing. Returns -1 if it's empty
+static int threadPoolTake(_Atomic uint64_t *queue, bool steal)
+{
+    uint64_t value = atomic_load_explicit(queue, memory_order_relaxed);
+    for (;;)
+    {
+        uint32_t begin = (uint32_t)(value >> 32);
+        uint32_t end = (uint32_t)value;
+        if (begin >= end)
+        {
+            return -1;
+        }
+        uint64_t next = steal ? (uint64_t)begin << 32 | (end - 1) : (uint64_t)(begin + 1) << 32 | end;
+        if (atomic_compare_exchange_weak_explicit(queue, &value, next, memory_order_relaxed, memory_order_relaxed))
+        {
+            return steal ? (int)end - 1 : (int)begin;
+        }
+    }
+}
+
+// Run chunks of the current loop until there are none left anywhere
+static void threadPoolRun(int self)
+{
+    struct ThreadPool *pool = &threadPool;
+    int threads = pool->workerCount + 1;
+    for (int i = 0; i < threads; i++)
+    {
+        _Atomic uint64_t *queue = &pool->queues[(self + i) % threads];
+        int chunk;
+        while ((chunk = threadPoolTake(queue, i > 0)) >= 0)
+        {
+            int begin = (int)((int64_t)pool->count * chunk / pool->chunkCount);
+            int end = (int)((int64_t)pool->count * (chunk + 1) / pool->chunkCount);
+            pool->task(pool->context, begin, end);
+        }
+    }
+}
+
+static void *threadPoolWorker(void *argument)
+{
+    struct ThreadPool *pool = &threadPool;
+    int self = (int)(intptr_t)argument;
+    inParallel = true;
+
+    pthread_mutex_lock(&pool->lock);
+    unsigned seen = pool->startGeneration;
+    for (;;)
+    {
+        while (pool->generation == seen && !pool->stop)
+        {
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        }
+        if (pool->stop)
+        {
+            break;
+        }
+        seen = pool->generation;
+        pthread_mutex_unlock(&pool->lock);
+
+        threadPoolRun(self);
+
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->active == 0)
+        {
+            pthread_cond_signal(&pool->done);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+    scratchRelease();
+    return 0;
+}
+
+// Call task over [0, count), split between threads in chunks of at least grain. Runs
+// serially if count is within one grain, the pool has one thread, or it's already in use
+static void parallelFor(int count, int grain, ParallelTask task, void *context)
+{
+    struct ThreadPool *pool = &threadPool;
+    if (count <= 0)
+    {
+        return;
+    }
+    grain = grain < 1 ? 1 : grain;
+    if (count <= grain || inParallel || pthread_mutex_trylock(&pool->busy) != 0)
+    {
+        task(context, 0, count);
+        return;
+    }
+
+    int threads = threadPoolSize();
+    int chunkCount = (count + grain - 1) / grain;
+    if (chunkCount > threads * THREAD_CHUNKS)
+    {
+        chunkCount = threads * THREAD_CHUNKS;
+    }
+    if (threads == 1)
+    {
+        pthread_mutex_unlock(&pool->busy);
+        task(context, 0, count);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    // Workers are started on first use, and again after the thread count changes
+    pool->startGeneration = pool->generation;
+    while (pool->workerCount < threads - 1)
+    {
+        if (pthread_create(&pool->workers[pool->workerCount], 0, threadPoolWorker,
+                           (void *)(intptr_t)(pool->workerCount + 1)) != 0)
+        {
+            break;
+        }
+        pool->workerCount++;
+    }
+
+    pool->task = task;
+    pool->context = context;
+    pool->count = count;
+    pool->chunkCount = chunkCount;
+    int running = pool->workerCount + 1;
+    for (int i = 0; i < running; i++)
+    {
+        uint64_t begin = (uint64_t)chunkCount * i / running;
+        uint64_t end = (uint64_t)chunkCount * (i + 1) / running;
+        atomic_store_explicit(&pool->queues[i], begin << 32 | end, memory_order_relaxed);
+    }
+    pool->active = pool->workerCount;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    inParallel = true;
+    threadPoolRun(0);
+    inParallel = false;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->active > 0)
+    {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    pthread_mutex_unlock(&pool->busy);
+}
+
+void NDArray_setNumThreads(int count)
+{
+    struct ThreadPool *pool = &threadPool;
+    pthread_mutex_lock(&pool->busy);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workerCount; i++)
+    {
+        pthread_join(pool->workers[i], 0);
+    }
+    pool->workerCount = 0;
+    pool->stop = false;
+
+    pool->threadCount = count <= 0 ? 0 : count > THREAD_MAX ? THREAD_MAX : count;
+    pthread_mutex_unlock(&pool->busy);
+}
+
+int NDArray_getNumThreads(void)
+{
+    pthread_mutex_lock(&threadPool.busy);
+    int count = threadPoolSize();
+    pthread_mutex_unlock(&threadPool.busy);
+    return count;
+}
+
+// Kernel for one inner run of an iterator: pointers to the output and inputs,
+// their byte steps, and the number of elements in the run
+typedef void (*ElementwiseKernel)(char **data, ptrdiff_t *steps, int count);
+
+// The dimension of it to split between threads, the longest one (outermost on ties) where
+// operand reduceOp doesn't have a step of 0, so that threads never accumulate into the same
+// element. Pass -1 if nothing is reduced into. Returns -1 if no dimension qualifies
+static int iterSplitAxis(struct NDArrayIter *it, int reduceOp)
+{
+    int axis = -1;
+    for (int i = 0; i < it->ndim; i++)
+    {
+        if (reduceOp >= 0 && it->steps[reduceOp][i] == 0)
+        {
+            continue;
+        }
+        if (axis < 0 || it->shape[i] > it->shape[axis])
+        {
+            axis = i;
+        }
+    }
+    return axis;
+}
+
+// Narrow dimension axis of an iterator that hasn't been advanced yet to [begin, end)
+static void iterRestrict(struct NDArrayIter *it, int axis, int begin, int end)
+{
+    for (int op = 0; op < it->nop; op++)
+    {
+        it->data[op] += begin * it->steps[op][axis];
+    }
+    it->size = it->size / it->shape[axis] * (end - begin);
+    it->shape[axis] = end - begin;
+    if (axis == it->ndim - 1)
+    {
+        it->innerSize = end - begin;
+    }
+}
+
+struct IterTask
+{
+    struct NDArrayIter *it;
+    int axis;
+    ElementwiseKernel kernel;
+};
+
+static void iterTask(void *context, int begin, int end)
+{
+    struct IterTask *task = (struct IterTask *)context;
+    struct NDArrayIter it = *task->it;
+    iterRestrict(&it, task->axis, begin, end);
+    do
+    {
+        task->kernel(it.data, it.innerSteps, it.innerSize);
+    } while (iterNext(&it));
+}
+
+// Run kernel over every inner run of a fresh iterator, splitting it between threads. Each
+// element is visited in the same order as a serial loop, so results don't depend on threads
+static void iterParallel(struct NDArrayIter *it, ElementwiseKernel kernel, int reduceOp)
+{
+    if (it->size == 0)
+    {
+        return;
+    }
+    struct IterTask task = {it, iterSplitAxis(it, reduceOp), kernel};
+    if (task.axis < 0)
+    {
+        do
+        {
+            kernel(it->data, it->innerSteps, it->innerSize);
+        } while (iterNext(it));
+        return;
+    }
+    int inner = it->size / it->shape[task.axis];
+    parallelFor(it->shape[task.axis], (PARALLEL_GRAIN + inner - 1) / inner, iterTask, &task);
+}
+
+// Conversion kernels, with the output first as for any other kernel. castKernels[to][from]
+// converts from one dtype to another, and castKernels[dtype][dtype] is a plain copy
+#define CAST_KERNEL(NAME, TO, FROM)                            \
+    static void NAME(char **data, ptrdiff_t *steps, int count) \
+    {                                                          \
+        char *out = data[0], *in = data[1];                    \
+        for (int i = 0; i < count; i++)                        \
+        {                                                      \
+            *(TO *)out = (TO) * (const FROM *)in;              \
+            out += steps[0];                                   \
+            in += steps[1];                                    \
+        }                                                      \
+    }
+
+#define DEFINE_CAST_KERNELS(NAME, TO)      \
+    CAST_KERNEL(NAME##Float32, TO, float)  \
+    CAST_KERNEL(NAME##Float64, TO, double) \
+    CAST_KERNEL(NAME##Int32, TO, int32_t)  \
+    CAST_KERNEL(NAME##Int64, TO, int64_t)  \
+    static const ElementwiseKernel NAME##s[] = {NAME##Float32, NAME##Float64, NAME##Int32, NAME##Int64};
+
+DEFINE_CAST_KERNELS(castToFloat32, float)
+DEFINE_CAST_KERNELS(castToFloat64, double)
+DEFINE_CAST_KERNELS(castToInt32, int32_t)
+DEFINE_CAST_KERNELS(castToInt64, int64_t)
+
+static const ElementwiseKernel *const castKernels[NDARRAY_DTYPES] = {
+    castToFloat32s, castToFloat64s, castToInt32s, castToInt64s};
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define NDARRAY_X86_SIMD
+#include <immintrin.h>
+#endif
+
+// Side of the square tiles a transposing copy moves at a time, in elements. Both sides of a
+// tile stay in L1, and its rows touch few enough pages to stay in the TLB
+#define COPY_TILE 16
+
+// Transpose a square block of block x block elements: row r of out gets column r of in, where
+// rows of out and in are outRow and inRow bytes apart and the elements in a row are adjacent
+typedef void (*TransposeKernel)(char *out, ptrdiff_t outRow, const char *in, ptrdiff_t inRow);
+
+#ifdef NDARRAY_X86_SIMD
+// The kernels only move bits, so the float forms serve the integer dtypes of the same size too
+__attribute__((target("sse2"))) static void transpose4x4Float32(char *out, ptrdiff_t outRow, const char *in,
+                                                                 ptrdiff_t inRow)
+{
+    __m128 r0 = _mm_loadu_ps((const float *)in);
+    __m128 r1 = _mm_loadu_ps((const float *)(in + inRow));
+    __m128 r2 = _mm_loadu_ps((const float *)(in + 2 * inRow));
+    __m128 r3 = _mm_loadu_ps((const float *)(in + 3 * inRow));
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps((float *)out, r0);
+    _mm_storeu_ps((float *)(out + outRow), r1);
+    _mm_storeu_ps((float *)(out + 2 * outRow), r2);
+    _mm_storeu_ps((float *)(out + 3 * outRow), r3);
+}
+
+__attribute__((target("avx2"))) static void transpose8x8Float32(char *out, ptrdiff_t outRow, const char *in,
+                                                                 ptrdiff_t inRow)
+{
+    __m256 r0 = _mm256_loadu_ps((const float *)in);
+    __m256 r1 = _mm256_loadu_ps((const float *)(in + inRow));
+    __m256 r2 = _mm256_loadu_ps((const float *)(in + 2 * inRow));
+    __m256 r3 = _mm256_loadu_ps((const float *)(in + 3 * inRow));
+    __m256 r4 = _mm256_loadu_ps((const float *)(in + 4 * inRow));
+    __m256 r5 = _mm256_loadu_ps((const float *)(in + 5 * inRow));
+    __m256 r6 = _mm256_loadu_ps((const float *)(in + 6 * inRow));
+    __m256 r7 = _mm256_loadu_ps((const float *)(in + 7 * inRow));
+    // Interleave pairs of rows, then pairs of pairs, then swap the 128-bit halves
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    __m256 t4 = _mm256_unpacklo_ps(r4, r5);
+    __m256 t5 = _mm256_unpackhi_ps(r4, r5);
+    __m256 t6 = _mm256_unpacklo_ps(r6, r7);
+    __m256 t7 = _mm256_unpackhi_ps(r6, r7);
+    r0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    r1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    r2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    r3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    r4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+    r5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+    r6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+    r7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm256_storeu_ps((float *)out, _mm256_permute2f128_ps(r0, r4, 0x20));
+    _mm256_storeu_ps((float *)(out + outRow), _mm256_permute2f128_ps(r1, r5, 0x20));
+    _mm256_storeu_ps((float *)(out + 2 * outRow), _mm256_permute2f128_ps(r2, r6, 0x20));
+    _mm256_storeu_ps((float *)(out + 3 * outRow), _mm256_permute2f128_ps(r3, r7, 0x20));
+    _mm256_storeu_ps((float *)(out + 4 * outRow), _mm256_permute2f128_ps(r0, r4, 0x31));
+    _mm256_storeu_ps((float *)(out + 5 * outRow), _mm256_permute2f128_ps(r1, r5, 0x31));
+    _mm256_storeu_ps((float *)(out + 6 * outRow), _mm256_permute2f128_ps(r2, r6, 0x31));
+    _mm256_storeu_ps((float *)(out + 7 * outRow), _mm256_permute2f128_ps(r3, r7, 0x31));
+}
+
+__attribute__((target("sse2"))) static void transpose2x2Float64(char *out, ptrdiff_t outRow, const char *in,
+                                                                 ptrdiff_t inRow)
+{
+    __m128d r0 = _mm_loadu_pd((const double *)in);
+    __m128d r1 = _mm_loadu_pd((const double *)(in + inRow));
+    _mm_storeu_pd((double *)out, _mm_unpacklo_pd(r0, r1));
+    _mm_storeu_pd((double *)(out + outRow), _mm_unpackhi_pd(r0, r1));
+}
+
+__attribute__((target("avx2"))) static void transpose4x4Float64(char *out, ptrdiff_t outRow, const char *in,
+                                                                 ptrdiff_t inRow)
+{
+    __m256d r0 = _mm256_loadu_pd((const double *)in);
+    __m256d r1 = _mm256_loadu_pd((const double *)(in + inRow));
+    __m256d r2 = _mm256_loadu_pd((const double *)(in + 2 * inRow));
+    __m256d r3 = _mm256_loadu_pd((const double *)(in + 3 * inRow));
+    __m256d t0 = _mm256_unpacklo_pd(r0, r1);
+    __m256d t1 = _mm256_unpackhi_pd(r0, r1);
+    __m256d t2 = _mm256_unpacklo_pd(r2, r3);
+    __m256d t3 = _mm256_unpackhi_pd(r2, r3);
+    _mm256_storeu_pd((double *)out, _mm256_permute2f128_pd(t0, t2, 0x20));
+    _mm256_storeu_pd((double *)(out + outRow), _mm256_permute2f128_pd(t1, t3, 0x20));
+    _mm256_storeu_pd((double *)(out + 2 * outRow), _mm256_permute2f128_pd(t0, t2, 0x31));
+    _mm256_storeu_pd((double *)(out + 3 * outRow), _mm256_permute2f128_pd(t1, t3, 0x31));
+}
+#endif
+
+// A plane to copy transposed: rows x cols elements of size bytes, where out is contiguous
+// along the cols and in along the rows
+struct TransposeCopy
+{
+    char *out;
+    const char *in;
+    ptrdiff_t outRow;
+    ptrdiff_t inRow;
+    int rows;
+    int cols;
+    int size;
+    int block;
+    TransposeKernel kernel;
+};
+
+// Element by element transpose of part of a tile, for the edges the kernels don't cover
+static void transposeScalar(struct TransposeCopy *copy, char *out, const char *in, int rows, int cols)
+{
+    for (int r = 0; r < rows; r++)
+    {
+        char *outRow = out + r * copy->outRow;
+        const char *inColumn = in + r * copy->size;
+        if (copy->size == 4)
+        {
+            for (int c = 0; c < cols; c++)
+            {
+                ((uint32_t *)outRow)[c] = *(const uint32_t *)(inColumn + c * copy->inRow);
+            }
+        }
+        else
+        {
+            for (int c = 0; c < cols; c++)
+            {
+                ((uint64_t *)outRow)[c] = *(const uint64_t *)(inColumn + c * copy->inRow);
+            }
+        }
+    }
+}
+
+// Copy the tile rows [begin, end) of a plane, a COPY_TILE square at a time
+static void transposeTask(void *context, int begin, int end)
+{
+    struct TransposeCopy *copy = (struct TransposeCopy *)context;
+    int block = copy->block;
+    for (int r0 = begin * COPY_TILE; r0 < copy->rows && r0 < end * COPY_TILE; r0 += COPY_TILE)
+    {
+        int rows = copy->rows - r0 < COPY_TILE ? copy->rows - r0 : COPY_TILE;
+        for (int c0 = 0; c0 < copy->cols; c0 += COPY_TILE)
+        {
+            int cols = copy->cols - c0 < COPY_TILE ? copy->cols - c0 : COPY_TILE;
+            char *out = copy->out + r0 * copy->outRow + c0 * copy->size;
+            const char *in = copy->in + c0 * copy->inRow + r0 * copy->size;
+            // The kernels cover the largest multiple of the block in each direction
+            int blockRows = copy->kernel != 0 ? rows - rows % block : 0;
+            int blockCols = copy->kernel != 0 ? cols - cols % block : 0;
+            for (int r = 0; r < blockRows; r += block)
+            {
+                for (int c = 0; c < blockCols; c += block)
+                {
+                    copy->kernel(out + r * copy->outRow + c * copy->size, copy->outRow,
+                                 in + c * copy->inRow + r * copy->size, copy->inRow);
+                }
+            }
+            transposeScalar(copy, out + blockCols * copy->size, in + blockCols * copy->inRow, blockRows,
+                            cols - blockCols);
+            transposeScalar(copy, out + blockRows * copy->outRow, in + blockRows * copy->size, rows - blockRows, cols);
+        }
+    }
+}
+
+// Copy a run where both sides are contiguous
+static void contiguousCopyKernel(char **data, ptrdiff_t *steps, int count)
+{
+    memcpy(data[0], data[1], count * steps[0]);
+}
+
+// Copy in to out, which have the same shape and dtype. When out's inner axis is a strided
+// one of in and in is contiguous along another, as after a transpose, the plane of those two
+// axes is copied in tiles, so both sides move whole cache lines instead of missing on every
+// element of in. Returns nonzero if the arrays have too many dimensions to iterate
+static int copyArray(struct NDArray *out, struct NDArray *in)
+{
+    struct NDArrayIter it;
+    struct NDArray *ops[] = {out, in};
+    if (iterInit(&it, 2, ops, in->shape, in->ndim, 0))
+    {
+        return 1;
+    }
+    if (it.size == 0)
+    {
+        return 0;
+    }
+
+    ptrdiff_t size = dtypeSizes[in->dtype];
+    int inner = it.ndim - 1;
+    int axis = -1;
+    if (it.innerSteps[0] == size && it.innerSteps[1] != size)
+    {
+        for (int i = inner - 1; i >= 0 && axis < 0; i--)
+        {
+            axis = it.steps[1][i] == size ? i : -1;
+        }
+    }
+    if (axis < 0)
+    {
+        bool contiguous = it.innerSteps[0] == size && it.innerSteps[1] == size;
+        iterParallel(&it, contiguous ? contiguousCopyKernel : castKernels[in->dtype][in->dtype], -1);
+        return 0;
+    }
+
+    // Move the tiled axis just outside the inner one, so the rest can be iterated around them
+    for (int i = axis; i < inner - 1; i++)
+    {
+        int shape = it.shape[i];
+        it.shape[i] = it.shape[i + 1];
+        it.shape[i + 1] = shape;
+        for (int op = 0; op < 2; op++)
+        {
+            ptrdiff_t step = it.steps[op][i];
+            it.steps[op][i] = it.steps[op][i + 1];
+            it.steps[op][i + 1] = step;
+        }
+    }
+
+    struct TransposeCopy copy = {0};
+    copy.outRow = it.steps[0][inner - 1];
+    copy.inRow = it.steps[1][inner];
+    copy.rows = it.shape[inner - 1];
+    copy.cols = it.shape[inner];
+    copy.size = (int)size;
+#ifdef NDARRAY_X86_SIMD
+    bool avx = NDArray_isa() >= NDARRAY_ISA_AVX2;
+    if (NDArray_isa() >= NDARRAY_ISA_SSE)
+    {
+        copy.block = size == 4 ? (avx ? 8 : 4) : (avx ? 4 : 2);
+        copy.kernel = size == 4 ? (avx ? transpose8x8Float32 : transpose4x4Float32)
+                                : (avx ? transpose4x4Float64 : transpose2x2Float64);
+    }
+#endif
+
+    // The outer iterator steps over every axis but the two of the plane
+    struct NDArrayIter outer = it;
+    outer.ndim = inner;
+    int tileRows = (copy.rows + COPY_TILE - 1) / COPY_TILE;
+    int tileSize = COPY_TILE * copy.cols;
+    do
+    {
+        copy.out = outer.data[0];
+        copy.in = outer.data[1];
+        parallelFor(tileRows, (PARALLEL_GRAIN + tileSize - 1) / tileSize, transposeTask, &copy);
+    } while (iterNext(&outer));
+    return 0;
+}
+
+static int makeContiguous(struct NDArray *array)
+{
+    int ndim = array->ndim;
+    int dataCount = shapeSize(array->shape, ndim);
+    struct NDArrayBuffer *buffer = bufferAllocate(dataCount * dtypeSizes[array->dtype]);
+    if (buffer == 0)
+    {
+        return 1;
+    }
+
+    // Describe the new buffer with a temporary header to copy into it
+    int steps[ndim > 0 ? ndim : 1];
+    int prod = 1;
+    for (int i = ndim - 1; i >= 0; i--)
+    {
+        steps[i] = prod;
+        prod *= array->shape[i];
+    }
+    struct NDArray output = *array;
+    output.data = bufferData(buffer);
+    output.steps = steps;
+    if (copyArray(&output, array))
+    {
+        bufferDecRefCount(buffer);
+        return 1;
+    }
+
+    // Take over the new buffer and its row-major steps. If this header lives in the
+    // old buffer's block, that block stays around until the header is freed
+    bufferDecRefCount(array->buffer);
+    array->buffer = buffer;
+    array->data = output.data;
+    array->dataCount = dataCount;
+    memcpy(array->steps, steps, ndim * sizeof(int));
+    return 0;
+}
+
+int NDArray_reshape(struct NDArray *array, int *newShape, int newNDim)
+{
+    // Copy the shape, to avoid modifying the original
+    int tempNewShape[newNDim > 0 ? newNDim : 1];
+    memcpy(tempNewShape, newShape, newNDim * sizeof(int));
+    newShape = tempNewShape;
+
+    // Calculate the value of an undefined index
+    int undefIndex = -1;
+    int prod = 1;
+    bool identical = array->ndim == newNDim;
+    for (int i = 0; i < newNDim; i++)
+    {
+        if (newShape[i] == -1)
+        {
+            if (undefIndex != -1)
+            {
+                return 2;
+            }
+            else
+            {
+                undefIndex = i;
+            }
+        }
+        else
+        {
+            // Check if the
+            if (identical)
+            {
+                identical = array->shape[i] == newShape[i];
+            }
+            prod *= newShape[i];
+        }
+    }
+
+    if (undefIndex != -1)
+    {
+        newShape[undefIndex] = shapeSize(array->shape, array->ndim) / prod;
+    }
+
+    // Check if the new shape is actually valid
+    if (shapeSize(newShape, newNDim) != shapeSize(array->shape, array->ndim))
+    {
+        return 1;
+    }
+
+    // Only shortcut out after checking that the new shape is valid. It probably has to be anyway
+    if (identical)
+    {
+        return 0;
+    }
+
+    int indOld = array->ndim - 1;
+    int indNew = newNDim - 1;
+    int newSteps[newNDim > 0 ? newNDim : 1];
+    int oldShape[array->ndim > 0 ? array->ndim : 1];
+    memcpy(oldShape, array->shape, array->ndim * sizeof(int));
+    int oldSteps[array->ndim > 0 ? array->ndim : 1];
+    memcpy(oldSteps, array->steps, array->ndim * sizeof(int));
+    // A 0-d result has no axes to step along
+    if (indNew >= 0 && newShape[indNew] == 1)
+    {
+        newSteps[indNew] = 1;
+        indNew--;
+    }
+    while (indNew >= 0)
+    {
+        if (oldShape[indOld] % newShape[indNew] == 0)
+        {
+            newSteps[indNew] = oldSteps[indOld];
+            oldSteps[indOld] *= newShape[indNew];
+            oldShape[indOld] /= newShape[indNew];
+            indNew--;
+        }
+        else if (oldShape[indOld] == 1 || oldSteps[indOld - 1] == oldShape[indOld] * oldSteps[indOld])
+        {
+            // The merged dimension steps like the inner one, unless that was just padding
+            if (oldShape[indOld] != 1)
+            {
+                oldSteps[indOld - 1] = oldSteps[indOld];
+            }
+            oldShape[indOld - 1] *= oldShape[indOld];
+            indOld--;
+        }
+        else
+        {
+            DEBUG_PRINT("Making contiguous!\n");
+            uint64_t start = statsBegin();
+            if (makeContiguous(array))
+            {
+                return 1;
+            }
+            statsEnd(NDARRAY_STAT_IMPLICIT_COPY, start, (size_t)array->dataCount * dtypeSizes[array->dtype]);
+            newSteps[newNDim - 1] = 1;
+            for (int i = newNDim - 1; i > 0; i--)
+            {
+                newSteps[i - 1] = newShape[i] * newSteps[i];
+            }
+            break;
+        }
+    }
+
+    // Set new shape and steps
+    if (setNDim(array, newNDim))
+    {
+        return 1;
+    }
+    memcpy(array->shape, newShape, sizeof(int) * newNDim);
+    memcpy(array->steps, newSteps, sizeof(int) * newNDim);
+    return 0;
+}
+
+int NDArray_expandDims(struct NDArray *array, int axis)
+{
+    axis = validateAxis(axis, array->ndim + 1);
+    if (axis < 0)
+    {
+        return 1;
+    }
+
+    int newShape[array->ndim + 1];
+    for (int i = 0; i < array->ndim; i++)
+    {
+        newShape[i + (i >= axis)] = array->shape[i];
+    }
+    newShape[axis] = 1;
+    int errorCode = NDArray_reshape(array, newShape, array->ndim + 1);
+    if (errorCode > 0)
+    {
+        // Offset errorCode past internal errors
+        return errorCode + 1;
+    }
+    return 0;
+}
+
+int NDArray_squeeze(struct NDArray *array, int axis)
+{
+    axis = validateAxis(axis, array->ndim);
+    if (axis < 0)
+    {
+        return 1;
+    }
+    if (array->shape[axis] != 1)
+    {
+        return 2;
+    }
+
+    int newShape[array->ndim > 1 ? array->ndim - 1 : 1];
+    for (int i = 0; i < array->ndim - 1; i++)
+    {
+        newShape[i] = array->shape[i + (i >= axis)];
+    }
+    int errorCode = NDArray_reshape(array, newShape, array->ndim - 1);
+    if (errorCode > 0)
+    {
+        // Offset errorCode past internal errors
+        return errorCode + 2;
+    }
+    return 0;
+}
+
+int NDArray_transpose(struct NDArray *array, int *newOrder)
+{
+    int tempSteps[array->ndim > 0 ? array->ndim : 1];
+    int tempShape[array->ndim > 0 ? array->ndim : 1];
+
+    for (int i = 0; i < array->ndim; i++)
+    {
+        tempSteps[i] = array->steps[newOrder[i]];
+        tempShape[i] = array->shape[newOrder[i]];
+    }
+    memcpy(array->steps, tempSteps, sizeof(int) * array->ndim);
+    memcpy(array->shape, tempShape, sizeof(int) * array->ndim);
+    return 0;
+}
+
+int NDArray_swapAxes(struct NDArray *array, int axis1, int axis2)
+{
+    axis1 = validateAxis(axis1, array->ndim);
+    axis2 = validateAxis(axis2, array->ndim);
+
+    if (axis1 < 0 || axis2 < 0)
+    {
+        return 1;
+    }
+
+    int newOrder[array->ndim > 0 ? array->ndim : 1];
+    for (int i = 0; i < array->ndim; i++)
+    {
+        newOrder[i] = i;
+    }
+    newOrder[axis1] = axis2;
+    newOrder[axis2] = axis1;
+
+    int errorCode = NDArray_transpose(array, newOrder);
+    if (errorCode != 0)
+    {
+        return errorCode + 1;
+    }
+    return 0;
+}
+
+void *NDArray_getPointer(struct NDArray *array, int *index)
+{
+    char *addr = (char *)array->data;
+    for (int i = 0; i < array->ndim; i++)
+    {
+        addr += (ptrdiff_t)index[i] * array->steps[i] * dtypeSizes[array->dtype];
+    }
+    return addr;
+}
+
+int NDArray_makeContiguous(struct NDArray *array)
+{
+    uint64_t start = statsBegin();
+    int status = makeContiguous(array);
+    statsEnd(NDARRAY_STAT_MAKE_CONTIGUOUS, start, (size_t)array->dataCount * dtypeSizes[array->dtype]);
+    return status;
+}
+
+struct NDArray *NDArray_ascontiguous(struct NDArray *array)
+{
+    uint64_t start = statsBegin();
+    int dataCount = shapeSize(array->shape, array->ndim);
+    struct NDArray *output = arrayAllocate(array->shape, array->ndim, dataCount, array->dtype);
+    if (output != 0 && copyArray(output, array))
+    {
+        NDArray_free(output);
+        output = 0;
+    }
+    statsEnd(NDARRAY_STAT_MAKE_CONTIGUOUS, start, output != 0 ? (size_t)dataCount * dtypeSizes[array->dtype] : 0);
+    return output;
+}
+
+// Assumes pointer is in array and that no two indices share an element, so dimensions that
+// are broadcast with a step of 0 get index 0
+void NDArray_getIndex(struct NDArray *array, NDARRAY_TYPE *pointer, int *index)
+{
+    int ndim = array->ndim;
+    ptrdiff_t offset = ((char *)pointer - (char *)array->data) / (ptrdiff_t)dtypeSizes[array->dtype];
+    // Count negative steps from the far end, which makes every step positive
+    for (int i = 0; i < ndim; i++)
+    {
+        index[i] = -1;
+        if (array->steps[i] < 0)
+        {
+            offset -= (ptrdiff_t)(array->shape[i] - 1) * array->steps[i];
+        }
+    }
+
+    // Peel off the dimensions from the largest step down
+    for (int n = 0; n < ndim; n++)
+    {
+        int axis = -1;
+        for (int i = 0; i < ndim; i++)
+        {
+            if (index[i] < 0 && (axis < 0 || abs(array->steps[i]) > abs(array->steps[axis])))
+            {
+                axis = i;
+            }
+        }
+        int step = abs(array->steps[axis]);
+        index[axis] = step == 0 || array->shape[axis] == 1 ? 0 : (int)(offset / step);
+        offset -= (ptrdiff_t)index[axis] * step;
+        if (array->steps[axis] < 0)
+        {
+            index[axis] = array->shape[axis] - 1 - index[axis];
+        }
     }
 }
 
@@ -446,484 +2123,5761 @@ void NDArray_getIndex(struct NDArray *array, NDARRAY_TYPE *pointer, int *index)
 //         return 0;
 //     }
 
-//     int index[array->ndim];
-//     NDArray_getIndex(array, pointer, index);
+//     int index[array->ndim];
+//     NDArray_getIndex(array, pointer, index);
+
+//     int nextStep = NDArray_incIndex(array, index);
+
+//     if (nextStep == 0)
+//     {
+//         printf("I didn't think this should ever happen");
+//         return 0;
+//     }
+//     else
+//     {
+//         return pointer + nextStep;
+//     }
+// }
+
+NDARRAY_TYPE NDArray_get(struct NDArray *array, int *index)
+{
+    return loadElement(NDArray_getPointer(array, index), 0, array->dtype);
+}
+
+void NDArray_set(struct NDArray *array, int *index, NDARRAY_TYPE value)
+{
+    storeElement(NDArray_getPointer(array, index), 0, array->dtype, value);
+}
+
+void NDArray_free(struct NDArray *array)
+{
+    if (array != 0)
+    {
+        if (array->shape != array->inlineShape)
+        {
+            ndFree(array->shape);
+        }
+        struct NDArrayBuffer *home = array->home;
+        bufferDecRefCount(array->buffer);
+        if (home != 0)
+        {
+            bufferDecRefCount(home);
+        }
+        else
+        {
+            ndFree(array);
+        }
+    }
+}
+
+static void printElement(const char *pointer, enum NDArrayDType dtype)
+{
+    switch (dtype)
+    {
+    case NDARRAY_FLOAT32:
+        printf(NDARRAY_TYPE_FORMAT, *(const float *)pointer);
+        break;
+    case NDARRAY_FLOAT64:
+        printf(NDARRAY_TYPE_FORMAT, *(const double *)pointer);
+        break;
+    case NDARRAY_INT32:
+        printf("%d", (int)*(const int32_t *)pointer);
+        break;
+    default:
+        printf("%lld", (long long)*(const int64_t *)pointer);
+        break;
+    }
+}
+
+void printSubArray(struct NDArray *array, int indent, char *pointer)
+{
+    ptrdiff_t step = (ptrdiff_t)array->steps[indent] * dtypeSizes[array->dtype];
+    for (int i = 0; i < indent; i++)
+    {
+        printf("   ");
+    }
+    printf("[");
+
+    // If this is the deepest layer in the array
+    if (indent == array->ndim - 1)
+    {
+        for (int i = 0; i < array->shape[indent] - 1; i++)
+        {
+            printElement(pointer, array->dtype);
+            printf(", ");
+            pointer += step;
+        }
+        printElement(pointer, array->dtype);
+    }
+    else
+    {
+        printf("\n");
+        for (int i = 0; i < array->shape[indent]; i++)
+        {
+            printSubArray(array, indent + 1, pointer);
+            pointer += step;
+        }
+
+        for (int i = 0; i < indent; i++)
+        {
+            printf("   ");
+        }
+    }
+
+    printf("]\n");
+}
+
+void NDArray_print(struct NDArray *array)
+{
+    int ndim = array->ndim;
+    printf("Shape: ");
+    printIntArray(array->shape, ndim);
+    printf("\nSteps: ");
+    printIntArray(array->steps, ndim);
+    printf("\n");
+
+    if (ndim == 0)
+    {
+        printElement((char *)array->data, array->dtype);
+        printf("\n");
+        return;
+    }
+    printSubArray(array, 0, (char *)array->data);
+}
+
+// Shape is assumed to have the size of array->ndim
+struct NDArray *NDArray_broadcastTo(struct NDArray *array, int *shape)
+{
+    // Check for incompatible shapes
+    for (int i = 0; i < array->ndim; i++)
+    {
+        if (array->shape[i] != shape[i] && array->shape[i] != 1)
+        {
+            DEBUG_PRINT("Incompatible shapes\n");
+            return 0;
+        }
+    }
+
+    // Convert all steps that are different to 0
+    int steps[array->ndim > 0 ? array->ndim : 1];
+    for (int i = 0; i < array->ndim; i++)
+    {
+        steps[i] = array->shape[i] != shape[i] ? 0 : array->steps[i];
+    }
+
+    return arrayView(array, shape, steps, array->ndim);
+}
+
+struct NDArrayPair NDArray_broadcast(struct NDArray *a, struct NDArray *b)
+{
+    struct NDArrayPair arrayPair = {0, 0};
+    if (a->ndim != b->ndim)
+    {
+        return arrayPair;
+    }
+
+    int newShape[a->ndim > 0 ? a->ndim : 1];
+    for (int i = 0; i < a->ndim; i++)
+    {
+        if (a->shape[i] == b->shape[i] || b->shape[i] == 1)
+        {
+            newShape[i] = a->shape[i];
+        }
+        else if (a->shape[i] == 1)
+        {
+            newShape[i] = b->shape[i];
+        }
+        else
+        {
+            return arrayPair;
+        }
+    }
+
+    arrayPair.a = NDArray_broadcastTo(a, newShape);
+    arrayPair.b = NDArray_broadcastTo(b, newShape);
+
+    return arrayPair;
+}
+
+// Broadcast the first ndim dimensions of a and b into shape.
+// Returns nonzero if they are incompatible
+static int broadcastShape(struct NDArray *a, struct NDArray *b, int ndim, int *shape)
+{
+    for (int i = 0; i < ndim; i++)
+    {
+        if (a->shape[i] == b->shape[i] || b->shape[i] == 1)
+        {
+            shape[i] = a->shape[i];
+        }
+        else if (a->shape[i] == 1)
+        {
+            shape[i] = b->shape[i];
+        }
+        else
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Nonzero unless out has exactly the given shape and no broadcast (step 0) dimensions,
+// which would have several output elements written through the same address. An empty out
+// has no elements to share, and its steps outside the empty axis are 0 anyway
+static int checkOutput(struct NDArray *out, int *shape, int ndim)
+{
+    if (out->ndim != ndim)
+    {
+        return 1;
+    }
+    bool empty = shapeSize(shape, ndim) == 0;
+    for (int i = 0; i < ndim; i++)
+    {
+        if (out->shape[i] != shape[i] || (shape[i] > 1 && out->steps[i] == 0 && !empty))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Set every element of array to value. Returns nonzero if it can't be iterated
+static int fillArray(struct NDArray *array, NDARRAY_TYPE value)
+{
+    // Copy the converted value in from a broadcast scalar
+    int64_t element;
+    storeElement(&element, 0, array->dtype, value);
+    int shape[array->ndim > 0 ? array->ndim : 1];
+    int steps[array->ndim > 0 ? array->ndim : 1];
+    for (int i = 0; i < array->ndim; i++)
+    {
+        shape[i] = 1;
+        steps[i] = 0;
+    }
+    struct NDArray scalar = *array;
+    scalar.shape = shape;
+    scalar.steps = steps;
+    scalar.data = (NDARRAY_TYPE *)&element;
+
+    struct NDArrayIter it;
+    struct NDArray *ops[] = {array, &scalar};
+    if (iterInit(&it, 2, ops, array->shape, array->ndim, 0))
+    {
+        return 1;
+    }
+    if (it.size > 0)
+    {
+        ElementwiseKernel copy = castKernels[array->dtype][array->dtype];
+        do
+        {
+            copy(it.data, it.innerSteps, it.innerSize);
+        } while (iterNext(&it));
+    }
+    return 0;
+}
+
+static int astypeOut(struct NDArray *array, struct NDArray *out)
+{
+    if (checkOutput(out, array->shape, array->ndim))
+    {
+        return 2;
+    }
+    if (out->dtype == array->dtype)
+    {
+        return copyArray(out, array);
+    }
+    struct NDArrayIter it;
+    struct NDArray *ops[] = {out, array};
+    if (iterInit(&it, 2, ops, array->shape, array->ndim, 0))
+    {
+        return 1;
+    }
+    iterParallel(&it, castKernels[out->dtype][array->dtype], -1);
+    return 0;
+}
+
+int NDArray_astype_out(struct NDArray *array, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = astypeOut(array, out);
+    statsEnd(NDARRAY_STAT_ASTYPE, start, status == 0 ? (size_t)shapeSize(out->shape, out->ndim) * dtypeSizes[out->dtype] : 0);
+    return status;
+}
+
+struct NDArray *NDArray_astype(struct NDArray *array, enum NDArrayDType dtype)
+{
+    if ((unsigned)dtype >= NDARRAY_DTYPES)
+    {
+        return 0;
+    }
+    struct NDArray *output = arrayAllocate(array->shape, array->ndim, shapeSize(array->shape, array->ndim), dtype);
+    if (output != 0 && NDArray_astype_out(array, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+static int isaLevel = -1;
+
+int NDArray_isa(void)
+{
+    if (isaLevel < 0)
+    {
+        int level = NDARRAY_ISA_SCALAR;
+#ifdef NDARRAY_X86_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            level = NDARRAY_ISA_AVX512;
+        }
+        else if (__builtin_cpu_supports("avx2"))
+        {
+            level = NDARRAY_ISA_AVX2;
+        }
+        else if (__builtin_cpu_supports("sse2"))
+        {
+            level = NDARRAY_ISA_SSE;
+        }
+#endif
+#ifdef NDARRAY_FORCE_ISA
+        // Never pick kernels the CPU can't run
+        if (NDARRAY_FORCE_ISA < level)
+        {
+            level = NDARRAY_FORCE_ISA;
+        }
+#endif
+        isaLevel = level;
+    }
+    return isaLevel;
+}
+
+// Portable kernel for a binary op with arbitrary steps
+#define SCALAR_BINARY_KERNEL(NAME, T, OP)                      \
+    static void NAME(char **data, ptrdiff_t *steps, int count) \
+    {                                                          \
+        char *out = data[0], *a = data[1], *b = data[2];       \
+        for (int i = 0; i < count; i++)                        \
+        {                                                      \
+            T x = *(T *)a, y = *(T *)b;                        \
+            *(T *)out = OP(x, y);                              \
+            out += steps[0];                                   \
+            a += steps[1];                                     \
+            b += steps[2];                                     \
+        }                                                      \
+    }
+
+// Vector types for the SIMD kernels: vec holds the elements and ivec the same number of
+// integer lanes, the type comparisons of vecs produce
+#define SIMD_TYPES(T, VEC_BYTES)                                                      \
+    typedef T vec __attribute__((vector_size(VEC_BYTES)));                            \
+    typedef __typeof__(__builtin_choose_expr(sizeof(T) == 8, (int64_t)0, (int32_t)0)) \
+        ivecLane;                                                                     \
+    typedef ivecLane ivec __attribute__((vector_size(VEC_BYTES), unused));
+
+// Vectorised kernel for a binary op, VEC_BYTES wide and compiled for TARGET, where VEC_OP is
+// OP on vecs. The output has to be contiguous for the vector loops, and each input has to be
+// contiguous, a broadcast scalar (step 0), or have a constant step while the other input is
+// contiguous. Anything else, and the tail of every run, goes through the scalar loop
+#define SIMD_BINARY_KERNEL(NAME, T, OP, VEC_OP, VEC_BYTES, TARGET)                             \
+    __attribute__((target(TARGET))) static void NAME(char **data, ptrdiff_t *steps, int count) \
+    {                                                                                          \
+        SIMD_TYPES(T, VEC_BYTES)                                                               \
+        const int lanes = VEC_BYTES / sizeof(T);                                               \
+        const ptrdiff_t size = sizeof(T);                                                      \
+        char *out = data[0], *a = data[1], *b = data[2];                                       \
+        ptrdiff_t stepA = steps[1], stepB = steps[2];                                          \
+        int i = 0;                                                                             \
+        if (steps[0] == size && stepA == size && stepB == size)                                \
+        {                                                                                      \
+            for (; i + lanes <= count; i += lanes)                                             \
+            {                                                                                  \
+                vec x, y;                                                                      \
+                memcpy(&x, a + i * size, sizeof(vec));                                         \
+                memcpy(&y, b + i * size, sizeof(vec));                                         \
+                x = VEC_OP(x, y);                                                              \
+                memcpy(out + i * size, &x, sizeof(vec));                                       \
+            }                                                                                  \
+        }                                                                                      \
+        else if (steps[0] == size && stepA == size && stepB == 0)                              \
+        {                                                                                      \
+            vec y = (vec){0} + *(T *)b;                                                        \
+            for (; i + lanes <= count; i += lanes)                                             \
+            {                                                                                  \
+                vec x;                                                                         \
+                memcpy(&x, a + i * size, sizeof(vec));                                         \
+                x = VEC_OP(x, y);                                                              \
+                memcpy(out + i * size, &x, sizeof(vec));                                       \
+            }                                                                                  \
+        }                                                                                      \
+        else if (steps[0] == size && stepA == 0 && stepB == size)                              \
+        {                                                                                      \
+            vec x = (vec){0} + *(T *)a;                                                        \
+            for (; i + lanes <= count; i += lanes)                                             \
+            {                                                                                  \
+                vec y;                                                                         \
+                memcpy(&y, b + i * size, sizeof(vec));                                         \
+                y = VEC_OP(x, y);                                                              \
+                memcpy(out + i * size, &y, sizeof(vec));                                       \
+            }                                                                                  \
+        }                                                                                      \
+        else if (steps[0] == size && (stepA == size || stepB == size))                         \
+        {                                                                                      \
+            for (; i + lanes <= count; i += lanes)                                             \
+            {                                                                                  \
+                T xs[VEC_BYTES / sizeof(T)];                                                   \
+                T ys[VEC_BYTES / sizeof(T)];                                                   \
+                for (int l = 0; l < lanes; l++)                                                \
+                {                                                                              \
+                    xs[l] = *(T *)(a + (i + l) * stepA);                                       \
+                    ys[l] = *(T *)(b + (i + l) * stepB);                                       \
+                }                                                                              \
+                vec x, y;                                                                      \
+                memcpy(&x, xs, sizeof(vec));                                                   \
+                memcpy(&y, ys, sizeof(vec));                                                   \
+                x = VEC_OP(x, y);                                                              \
+                memcpy(out + i * size, &x, sizeof(vec));                                       \
+            }                                                                                  \
+        }                                                                                      \
+        for (; i < count; i++)                                                                 \
+        {                                                                                      \
+            T x = *(T *)(a + i * stepA);                                                       \
+            T y = *(T *)(b + i * stepB);                                                       \
+            *(T *)(out + i * steps[0]) = OP(x, y);                                             \
+        }                                                                                      \
+    }
+
+// Portable kernel for a unary op with arbitrary steps
+#define SCALAR_UNARY_KERNEL(NAME, T, OP)                       \
+    static void NAME(char **data, ptrdiff_t *steps, int count) \
+    {                                                          \
+        char *out = data[0], *a = data[1];                     \
+        for (int i = 0; i < count; i++)                        \
+        {                                                      \
+            T x = *(T *)a;                                     \
+            *(T *)out = OP(x);                                 \
+            out += steps[0];                                   \
+            a += steps[1];                                     \
+        }                                                      \
+    }
+
+// Vectorised kernel for a unary op, used when the input and output are both contiguous
+#define SIMD_UNARY_KERNEL(NAME, T, OP, VEC_OP, VEC_BYTES, TARGET)                              \
+    __attribute__((target(TARGET))) static void NAME(char **data, ptrdiff_t *steps, int count) \
+    {                                                                                          \
+        SIMD_TYPES(T, VEC_BYTES)                                                               \
+        const int lanes = VEC_BYTES / sizeof(T);                                               \
+        const ptrdiff_t size = sizeof(T);                                                      \
+        char *out = data[0], *a = data[1];                                                     \
+        int i = 0;                                                                             \
+        if (steps[0] == size && steps[1] == size)                                              \
+        {                                                                                      \
+            for (; i + lanes <= count; i += lanes)                                             \
+            {                                                                                  \
+                vec x;                                                                         \
+                memcpy(&x, a + i * size, sizeof(vec));                                         \
+                x = VEC_OP(x);                                                                 \
+                memcpy(out + i * size, &x, sizeof(vec));                                       \
+            }                                                                                  \
+        }                                                                                      \
+        for (; i < count; i++)                                                                 \
+        {                                                                                      \
+            T x = *(T *)(a + i * steps[1]);                                                    \
+            *(T *)(out + i * steps[0]) = OP(x);                                                \
+        }                                                                                      \
+    }
+
+// Define the scalar kernel and, on x86, the SSE, AVX2 and AVX-512 kernels of an op on T,
+// along with a table of them indexed by NDArray_isa()
+#ifdef NDARRAY_X86_SIMD
+#define DEFINE_TYPED_BINARY_KERNELS(NAME, T, OP, VEC_OP)           \
+    SCALAR_BINARY_KERNEL(NAME##Scalar, T, OP)                      \
+    SIMD_BINARY_KERNEL(NAME##SSE, T, OP, VEC_OP, 16, "sse2")       \
+    SIMD_BINARY_KERNEL(NAME##AVX2, T, OP, VEC_OP, 32, "avx2")      \
+    SIMD_BINARY_KERNEL(NAME##AVX512, T, OP, VEC_OP, 64, "avx512f") \
+    static const ElementwiseKernel NAME##s[] = {NAME##Scalar, NAME##SSE, NAME##AVX2, NAME##AVX512};
+#define DEFINE_TYPED_UNARY_KERNELS(NAME, T, OP, VEC_OP)           \
+    SCALAR_UNARY_KERNEL(NAME##Scalar, T, OP)                      \
+    SIMD_UNARY_KERNEL(NAME##SSE, T, OP, VEC_OP, 16, "sse2")       \
+    SIMD_UNARY_KERNEL(NAME##AVX2, T, OP, VEC_OP, 32, "avx2")      \
+    SIMD_UNARY_KERNEL(NAME##AVX512, T, OP, VEC_OP, 64, "avx512f") \
+    static const ElementwiseKernel NAME##s[] = {NAME##Scalar, NAME##SSE, NAME##AVX2, NAME##AVX512};
+#else
+#define DEFINE_TYPED_BINARY_KERNELS(NAME, T, OP, VEC_OP) \
+    SCALAR_BINARY_KERNEL(NAME##Scalar, T, OP)            \
+    static const ElementwiseKernel NAME##s[] = {NAME##Scalar, NAME##Scalar, NAME##Scalar, NAME##Scalar};
+#define DEFINE_TYPED_UNARY_KERNELS(NAME, T, OP, VEC_OP) \
+    SCALAR_UNARY_KERNEL(NAME##Scalar, T, OP)            \
+    static const ElementwiseKernel NAME##s[] = {NAME##Scalar, NAME##Scalar, NAME##Scalar, NAME##Scalar};
+#endif
+
+// Ops that go through libm have no vector form, so every entry of their table is the scalar kernel
+#define DEFINE_TYPED_SCALAR_BINARY_KERNELS(NAME, T, OP) \
+    SCALAR_BINARY_KERNEL(NAME##Scalar, T, OP)           \
+    static const ElementwiseKernel NAME##s[] = {NAME##Scalar, NAME##Scalar, NAME##Scalar, NAME##Scalar};
+#define DEFINE_TYPED_SCALAR_UNARY_KERNELS(NAME, T, OP) \
+    SCALAR_UNARY_KERNEL(NAME##Scalar, T, OP)           \
+    static const ElementwiseKernel NAME##s[] = {NAME##Scalar, NAME##Scalar, NAME##Scalar, NAME##Scalar};
+
+// Kernel tables of an op for every dtype, indexed by enum NDArrayDType. The FLOAT variants
+// leave the integer entries empty, for ops that compute integers in float64 instead
+#define DEFINE_BINARY_KERNELS(NAME, OP, VEC_OP)                    \
+    DEFINE_TYPED_BINARY_KERNELS(NAME##Float32, float, OP, VEC_OP)  \
+    DEFINE_TYPED_BINARY_KERNELS(NAME##Float64, double, OP, VEC_OP) \
+    DEFINE_TYPED_BINARY_KERNELS(NAME##Int32, int32_t, OP, VEC_OP)  \
+    DEFINE_TYPED_BINARY_KERNELS(NAME##Int64, int64_t, OP, VEC_OP)  \
+    static const ElementwiseKernel *const NAME##s[] = {NAME##Float32s, NAME##Float64s, NAME##Int32s, NAME##Int64s};
+#define DEFINE_UNARY_KERNELS(NAME, OP, VEC_OP)                    \
+    DEFINE_TYPED_UNARY_KERNELS(NAME##Float32, float, OP, VEC_OP)  \
+    DEFINE_TYPED_UNARY_KERNELS(NAME##Float64, double, OP, VEC_OP) \
+    DEFINE_TYPED_UNARY_KERNELS(NAME##Int32, int32_t, OP, VEC_OP)  \
+    DEFINE_TYPED_UNARY_KERNELS(NAME##Int64, int64_t, OP, VEC_OP)  \
+    static const ElementwiseKernel *const NAME##s[] = {NAME##Float32s, NAME##Float64s, NAME##Int32s, NAME##Int64s};
+#define DEFINE_FLOAT_BINARY_KERNELS(NAME, OP, VEC_OP)              \
+    DEFINE_TYPED_BINARY_KERNELS(NAME##Float32, float, OP, VEC_OP)  \
+    DEFINE_TYPED_BINARY_KERNELS(NAME##Float64, double, OP, VEC_OP) \
+    static const ElementwiseKernel *const NAME##s[] = {NAME##Float32s, NAME##Float64s, 0, 0};
+#define DEFINE_FLOAT_SCALAR_BINARY_KERNELS(NAME, OP)              \
+    DEFINE_TYPED_SCALAR_BINARY_KERNELS(NAME##Float32, float, OP)  \
+    DEFINE_TYPED_SCALAR_BINARY_KERNELS(NAME##Float64, double, OP) \
+    static const ElementwiseKernel *const NAME##s[] = {NAME##Float32s, NAME##Float64s, 0, 0};
+#define DEFINE_FLOAT_SCALAR_UNARY_KERNELS(NAME, OP)              \
+    DEFINE_TYPED_SCALAR_UNARY_KERNELS(NAME##Float32, float, OP)  \
+    DEFINE_TYPED_SCALAR_UNARY_KERNELS(NAME##Float64, double, OP) \
+    static const ElementwiseKernel *const NAME##s[] = {NAME##Float32s, NAME##Float64s, 0, 0};
+
+// Lanes of x where mask is set and of y elsewhere, for the vector forms of ops
+#define VEC_SELECT(mask, x, y) ((vec)(((mask) & (ivec)(x)) | (~(mask) & (ivec)(y))))
+// 1 in lanes where mask is set and 0 elsewhere
+#define VEC_BOOL(mask) ((vec)((mask) & (ivec)((vec){0} + 1)))
+
+#define ADD_OP(x, y) ((x) + (y))
+#define SUBTRACT_OP(x, y) ((x) - (y))
+#define MULTIPLY_OP(x, y) ((x) * (y))
+#define DIVIDE_OP(x, y) ((x) / (y))
+#define POWER_OP(x, y) _Generic((x), float: powf, default: pow)(x, y)
+#define MINIMUM_OP(x, y) ((x) < (y) ? (x) : (y))
+#define MINIMUM_VEC_OP(x, y) VEC_SELECT((x) < (y), x, y)
+#define MAXIMUM_OP(x, y) ((x) > (y) ? (x) : (y))
+#define MAXIMUM_VEC_OP(x, y) VEC_SELECT((x) > (y), x, y)
+#define EQUAL_OP(x, y) ((x) == (y))
+#define EQUAL_VEC_OP(x, y) VEC_BOOL((x) == (y))
+#define NOT_EQUAL_OP(x, y) ((x) != (y))
+#define NOT_EQUAL_VEC_OP(x, y) VEC_BOOL((x) != (y))
+#define LESS_OP(x, y) ((x) < (y))
+#define LESS_VEC_OP(x, y) VEC_BOOL((x) < (y))
+#define LESS_EQUAL_OP(x, y) ((x) <= (y))
+#define LESS_EQUAL_VEC_OP(x, y) VEC_BOOL((x) <= (y))
+#define GREATER_OP(x, y) ((x) > (y))
+#define GREATER_VEC_OP(x, y) VEC_BOOL((x) > (y))
+#define GREATER_EQUAL_OP(x, y) ((x) >= (y))
+#define GREATER_EQUAL_VEC_OP(x, y) VEC_BOOL((x) >= (y))
+#define EXP_OP(x) _Generic((x), float: expf, default: exp)(x)
+#define LOG_OP(x) _Generic((x), float: logf, default: log)(x)
+#define SQRT_OP(x) _Generic((x), float: sqrtf, default: sqrt)(x)
+#define ABS_OP(x) _Generic((x), float: fabsf, double: fabs, int32_t: abs, int64_t: llabs)(x)
+// Clear the sign bit of floats, and negate negative integers
+#define ABS_VEC_OP(x)                                                         \
+    _Generic((x)[0], float: ABS_FLOAT_VEC_OP(x), double: ABS_FLOAT_VEC_OP(x), \
+             default: VEC_SELECT((x) < (vec){0}, -(x), x))
+#define ABS_FLOAT_VEC_OP(x) ((vec)((ivec)(x) & ~(ivec)(-(vec){0})))
+
+DEFINE_BINARY_KERNELS(addKernel, ADD_OP, ADD_OP)
+DEFINE_BINARY_KERNELS(subtractKernel, SUBTRACT_OP, SUBTRACT_OP)
+DEFINE_BINARY_KERNELS(multiplyKernel, MULTIPLY_OP, MULTIPLY_OP)
+DEFINE_FLOAT_BINARY_KERNELS(divideKernel, DIVIDE_OP, DIVIDE_OP)
+DEFINE_FLOAT_SCALAR_BINARY_KERNELS(powerKernel, POWER_OP)
+DEFINE_BINARY_KERNELS(minimumKernel, MINIMUM_OP, MINIMUM_VEC_OP)
+DEFINE_BINARY_KERNELS(maximumKernel, MAXIMUM_OP, MAXIMUM_VEC_OP)
+DEFINE_BINARY_KERNELS(equalKernel, EQUAL_OP, EQUAL_VEC_OP)
+DEFINE_BINARY_KERNELS(notEqualKernel, NOT_EQUAL_OP, NOT_EQUAL_VEC_OP)
+DEFINE_BINARY_KERNELS(lessKernel, LESS_OP, LESS_VEC_OP)
+DEFINE_BINARY_KERNELS(lessEqualKernel, LESS_EQUAL_OP, LESS_EQUAL_VEC_OP)
+DEFINE_BINARY_KERNELS(greaterKernel, GREATER_OP, GREATER_VEC_OP)
+DEFINE_BINARY_KERNELS(greaterEqualKernel, GREATER_EQUAL_OP, GREATER_EQUAL_VEC_OP)
+DEFINE_FLOAT_SCALAR_UNARY_KERNELS(expKernel, EXP_OP)
+DEFINE_FLOAT_SCALAR_UNARY_KERNELS(logKernel, LOG_OP)
+DEFINE_FLOAT_SCALAR_UNARY_KERNELS(sqrtKernel, SQRT_OP)
+DEFINE_UNARY_KERNELS(absKernel, ABS_OP, ABS_VEC_OP)
+
+// Registry of element-wise ops. Every op runs through ufuncOut, so they all share the
+// broadcasting, dimension merging and threading, and only differ in their kernels
+struct Ufunc
+{
+    // Number of inputs, 1 or 2
+    int nin;
+    // Kernels indexed by dtype, then by NDArray_isa(). Dtypes without kernels compute in float64
+    const ElementwiseKernel *const *kernels;
+};
+
+static const struct Ufunc ufuncs[] = {
+    [NDARRAY_ADD] = {2, addKernels},
+    [NDARRAY_SUBTRACT] = {2, subtractKernels},
+    [NDARRAY_MULTIPLY] = {2, multiplyKernels},
+    [NDARRAY_DIVIDE] = {2, divideKernels},
+    [NDARRAY_POWER] = {2, powerKernels},
+    [NDARRAY_MINIMUM] = {2, minimumKernels},
+    [NDARRAY_MAXIMUM] = {2, maximumKernels},
+    [NDARRAY_EQUAL] = {2, equalKernels},
+    [NDARRAY_NOT_EQUAL] = {2, notEqualKernels},
+    [NDARRAY_LESS] = {2, lessKernels},
+    [NDARRAY_LESS_EQUAL] = {2, lessEqualKernels},
+    [NDARRAY_GREATER] = {2, greaterKernels},
+    [NDARRAY_GREATER_EQUAL] = {2, greaterEqualKernels},
+    [NDARRAY_EXP] = {1, expKernels},
+    [NDARRAY_LOG] = {1, logKernels},
+    [NDARRAY_SQRT] = {1, sqrtKernels},
+    [NDARRAY_ABS] = {1, absKernels},
+};
+
+// The registry entry for op if it takes nin inputs, otherwise 0
+static const struct Ufunc *ufuncGet(enum NDArrayUfunc op, int nin)
+{
+    if ((unsigned)op >= sizeof(ufuncs) / sizeof(*ufuncs) || ufuncs[op].nin != nin)
+    {
+        return 0;
+    }
+    return &ufuncs[op];
+}
+
+// Shape of the result of an element-wise op on the inputs in ops. Returns nonzero if
+// they don't broadcast together
+static int ufuncShape(int nin, struct NDArray **ops, int *shape)
+{
+    if (nin == 1)
+    {
+        memcpy(shape, ops[0]->shape, sizeof(int) * ops[0]->ndim);
+        return 0;
+    }
+    if (ops[0]->ndim != ops[1]->ndim)
+    {
+        return 1;
+    }
+    return broadcastShape(ops[0], ops[1], ops[0]->ndim, shape);
+}
+
+// The dtype an op on a and b computes in
+static enum NDArrayDType ufuncType(const struct Ufunc *ufunc, struct NDArray *a, struct NDArray *b)
+{
+    enum NDArrayDType dtype = ufunc->nin == 2 ? NDArray_promoteTypes(a->dtype, b->dtype) : a->dtype;
+    return ufunc->kernels[dtype] != 0 ? dtype : NDARRAY_FLOAT64;
+}
+
+// Elements converted at a time for kernels whose operands don't all have the kernel's dtype
+#define CAST_BLOCK 256
+
+struct CastTask
+{
+    struct NDArrayIter *it;
+    int axis;
+    ElementwiseKernel kernel;
+    enum NDArrayDType dtype;
+    enum NDArrayDType types[3];
+};
+
+// Run a kernel on up to two inputs and an output, converting the operands that don't have
+// its dtype through per block buffers: inputs on the way in and the output on the way out
+static void castTask(void *context, int begin, int end)
+{
+    struct CastTask *task = (struct CastTask *)context;
+    struct NDArrayIter it = *task->it;
+    if (task->axis >= 0)
+    {
+        iterRestrict(&it, task->axis, begin, end);
+    }
+
+    ptrdiff_t size = dtypeSizes[task->dtype];
+    int64_t buffers[3][CAST_BLOCK];
+    do
+    {
+        for (int offset = 0; offset < it.innerSize; offset += CAST_BLOCK)
+        {
+            int count = it.innerSize - offset < CAST_BLOCK ? it.innerSize - offset : CAST_BLOCK;
+            char *data[3];
+            ptrdiff_t steps[3];
+            for (int op = 0; op < it.nop; op++)
+            {
+                data[op] = it.data[op] + offset * it.innerSteps[op];
+                steps[op] = it.innerSteps[op];
+                if (task->types[op] != task->dtype)
+                {
+                    char *cast[] = {(char *)buffers[op], data[op]};
+                    ptrdiff_t castSteps[] = {size, steps[op]};
+                    if (op > 0)
+                    {
+                        castKernels[task->dtype][task->types[op]](cast, castSteps, count);
+                    }
+                    data[op] = cast[0];
+                    steps[op] = size;
+                }
+            }
+            task->kernel(data, steps, count);
+            if (task->types[0] != task->dtype)
+            {
+                char *cast[] = {it.data[0] + offset * it.innerSteps[0], (char *)buffers[0]};
+                ptrdiff_t castSteps[] = {it.innerSteps[0], size};
+                castKernels[task->types[0]][task->dtype](cast, castSteps, count);
+            }
+        }
+    } while (iterNext(&it));
+}
+
+// Apply an element-wise op to the broadcast of its inputs (b is ignored for unary ops),
+// writing into out, using whichever of its kernels suits the CPU and the dtype the inputs
+// promote to. The kernel gets the output and the inputs for each inner run
+static int ufuncCompute(const struct Ufunc *ufunc, struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    struct NDArray *ops[] = {out, a, b};
+    int shape[a->ndim > 0 ? a->ndim : 1];
+    if (ufuncShape(ufunc->nin, ops + 1, shape))
+    {
+        return 1;
+    }
+    if (checkOutput(out, shape, a->ndim))
+    {
+        return 2;
+    }
+
+    struct NDArrayIter it;
+    if (iterInit(&it, ufunc->nin + 1, ops, shape, a->ndim, 0))
+    {
+        return 1;
+    }
+    enum NDArrayDType dtype = ufuncType(ufunc, a, b);
+    ElementwiseKernel kernel = ufunc->kernels[dtype][NDArray_isa()];
+    bool converts = false;
+    for (int op = 0; op <= ufunc->nin; op++)
+    {
+        converts |= ops[op]->dtype != dtype;
+    }
+    if (!converts)
+    {
+        iterParallel(&it, kernel, -1);
+        return 0;
+    }
+
+    struct CastTask task = {&it, iterSplitAxis(&it, -1), kernel, dtype, {out->dtype, a->dtype, ufunc->nin == 2 ? b->dtype : dtype}};
+    if (it.size == 0)
+    {
+        return 0;
+    }
+    if (task.axis < 0)
+    {
+        castTask(&task, 0, 0);
+    }
+    else
+    {
+        int inner = it.size / it.shape[task.axis];
+        parallelFor(it.shape[task.axis], (PARALLEL_GRAIN + inner - 1) / inner, castTask, &task);
+    }
+    return 0;
+}
+
+static int ufuncOut(const struct Ufunc *ufunc, struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = ufuncCompute(ufunc, a, b, out);
+    statsEnd(NDARRAY_STAT_ELEMENTWISE, start, 0);
+    return status;
+}
+
+static struct NDArray *ufuncNew(const struct Ufunc *ufunc, struct NDArray *a, struct NDArray *b)
+{
+    struct NDArray *ops[] = {a, b};
+    int shape[a->ndim > 0 ? a->ndim : 1];
+    if (ufuncShape(ufunc->nin, ops, shape))
+    {
+        return 0;
+    }
+
+    struct NDArray *result = arrayAllocate(shape, a->ndim, shapeSize(shape, a->ndim), ufuncType(ufunc, a, b));
+    if (result != 0 && ufuncOut(ufunc, a, b, result))
+    {
+        NDArray_free(result);
+        return 0;
+    }
+    return result;
+}
+
+struct NDArray *NDArray_binary(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *b)
+{
+    const struct Ufunc *ufunc = ufuncGet(op, 2);
+    return ufunc != 0 ? ufuncNew(ufunc, a, b) : 0;
+}
+
+int NDArray_binary_out(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    const struct Ufunc *ufunc = ufuncGet(op, 2);
+    return ufunc != 0 ? ufuncOut(ufunc, a, b, out) : 1;
+}
+
+struct NDArray *NDArray_unary(enum NDArrayUfunc op, struct NDArray *a)
+{
+    const struct Ufunc *ufunc = ufuncGet(op, 1);
+    return ufunc != 0 ? ufuncNew(ufunc, a, 0) : 0;
+}
+
+int NDArray_unary_out(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *out)
+{
+    const struct Ufunc *ufunc = ufuncGet(op, 1);
+    return ufunc != 0 ? ufuncOut(ufunc, a, 0, out) : 1;
+}
+
+struct NDArray *NDArray_multiply(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_MULTIPLY, a, b);
+}
+
+int NDArray_multiply_out(struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    return NDArray_binary_out(NDARRAY_MULTIPLY, a, b, out);
+}
+
+int NDArray_multiply_inplace(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary_out(NDARRAY_MULTIPLY, a, b, a);
+}
+
+struct NDArray *NDArray_add(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_ADD, a, b);
+}
+
+int NDArray_add_out(struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    return NDArray_binary_out(NDARRAY_ADD, a, b, out);
+}
+
+int NDArray_add_inplace(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary_out(NDARRAY_ADD, a, b, a);
+}
+
+struct NDArray *NDArray_subtract(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_SUBTRACT, a, b);
+}
+
+struct NDArray *NDArray_divide(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_DIVIDE, a, b);
+}
+
+struct NDArray *NDArray_power(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_POWER, a, b);
+}
+
+struct NDArray *NDArray_minimum(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_MINIMUM, a, b);
+}
+
+struct NDArray *NDArray_maximum(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_MAXIMUM, a, b);
+}
+
+struct NDArray *NDArray_equal(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_EQUAL, a, b);
+}
+
+struct NDArray *NDArray_notEqual(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_NOT_EQUAL, a, b);
+}
+
+struct NDArray *NDArray_less(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_LESS, a, b);
+}
+
+struct NDArray *NDArray_lessEqual(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_LESS_EQUAL, a, b);
+}
+
+struct NDArray *NDArray_greater(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_GREATER, a, b);
+}
+
+struct NDArray *NDArray_greaterEqual(struct NDArray *a, struct NDArray *b)
+{
+    return NDArray_binary(NDARRAY_GREATER_EQUAL, a, b);
+}
+
+struct NDArray *NDArray_exp(struct NDArray *a)
+{
+    return NDArray_unary(NDARRAY_EXP, a);
+}
+
+struct NDArray *NDArray_log(struct NDArray *a)
+{
+    return NDArray_unary(NDARRAY_LOG, a);
+}
+
+struct NDArray *NDArray_sqrt(struct NDArray *a)
+{
+    return NDArray_unary(NDARRAY_SQRT, a);
+}
+
+struct NDArray *NDArray_abs(struct NDArray *a)
+{
+    return NDArray_unary(NDARRAY_ABS, a);
+}
+
+// Reductions. The input, out viewed with the reduced axes put back with a step of 0, and
+// for sums a compensation array shaped like out, are iterated together. The iterator orders
+// the dimensions by the input's steps, so the innermost loop runs along the contiguous axis
+// whether or not that axis is reduced. Runs that reduce into a single element are summed
+// pairwise, and every addition into out is compensated (Kahan), so float sums of millions
+// of elements keep close to full precision. argmin and argmax instead walk the input in C
+// order with the reduced axes last, so that ties go to the first occurrence
+
+// Runs up to this long are summed directly, with 8 partial sums
+#define PAIRWISE_BLOCK 128
+
+// Reduce one run of the input (operand 0) into out (operand 1), using operand 2 as the
+// compensation for sums or the best value so far for argmin and argmax. position is how
+// far into its output element's reduced elements an arg reduction is, and positions are
+// stored as indexType
+typedef void (*ReduceRun)(enum NDArrayReduce op, char **data, ptrdiff_t *steps, int count, int *position,
+                          int reducedSize, enum NDArrayDType indexType);
+
+static void storeIndex(char *out, enum NDArrayDType indexType, int64_t index)
+{
+    switch (indexType)
+    {
+    case NDARRAY_FLOAT32:
+        *(float *)out = (float)index;
+        break;
+    case NDARRAY_FLOAT64:
+        *(double *)out = (double)index;
+        break;
+    case NDARRAY_INT32:
+        *(int32_t *)out = (int32_t)index;
+        break;
+    default:
+        *(int64_t *)out = index;
+        break;
+    }
+}
+
+// Pairwise sums, compensated (Kahan) adds and the run reducer for inputs, outputs and
+// compensations of type T
+#define DEFINE_REDUCE_KERNELS(SUFFIX, T)                                                           \
+    static T pairwiseSum##SUFFIX(const char *in, ptrdiff_t step, int count)                        \
+    {                                                                                              \
+        if (count > PAIRWISE_BLOCK)                                                                \
+        {                                                                                          \
+            int half = count / 2 / 8 * 8;                                                          \
+            T low = pairwiseSum##SUFFIX(in, step, half);                                           \
+            return low + pairwiseSum##SUFFIX(in + half * step, step, count - half);                \
+        }                                                                                          \
+                                                                                                   \
+        T partial[8] = {0};                                                                        \
+        int i = 0;                                                                                 \
+        for (; i + 8 <= count; i += 8)                                                             \
+        {                                                                                          \
+            for (int j = 0; j < 8; j++)                                                            \
+            {                                                                                      \
+                partial[j] += *(const T *)(in + (i + j) * step);                                   \
+            }                                                                                      \
+        }                                                                                          \
+        T total = ((partial[0] + partial[1]) + (partial[2] + partial[3])) +                        \
+                  ((partial[4] + partial[5]) + (partial[6] + partial[7]));                         \
+        for (; i < count; i++)                                                                     \
+        {                                                                                          \
+            total += *(const T *)(in + i * step);                                                  \
+        }                                                                                          \
+        return total;                                                                              \
+    }                                                                                              \
+                                                                                                   \
+    static inline void kahanAdd##SUFFIX(T *sum, T *compensation, T value)                          \
+    {                                                                                              \
+        T y = value - *compensation;                                                               \
+        T t = *sum + y;                                                                            \
+        *compensation = (t - *sum) - y;                                                            \
+        *sum = t;                                                                                  \
+    }                                                                                              \
+                                                                                                   \
+    static void reduceRun##SUFFIX(enum NDArrayReduce op, char **data, ptrdiff_t *steps, int count, \
+                                  int *position, int reducedSize, enum NDArrayDType indexType)     \
+    {                                                                                              \
+        char *in = data[0], *out = data[1], *extra = data[2];                                      \
+        switch (op)                                                                                \
+        {                                                                                          \
+        case NDARRAY_SUM:                                                                          \
+        case NDARRAY_MEAN:                                                                         \
+            if (steps[1] == 0)                                                                     \
+            {                                                                                      \
+                kahanAdd##SUFFIX((T *)out, (T *)extra, pairwiseSum##SUFFIX(in, steps[0], count));  \
+                return;                                                                            \
+            }                                                                                      \
+            if (steps[0] == sizeof(T) && steps[1] == sizeof(T) && steps[2] == sizeof(T))           \
+            {                                                                                      \
+                /* Separate loop so the compiler can vectorize it */                               \
+                const T *restrict x = (const T *)in;                                               \
+                T *restrict sum = (T *)out;                                                        \
+                T *restrict compensation = (T *)extra;                                             \
+                for (int i = 0; i < count; i++)                                                    \
+                {                                                                                  \
+                    kahanAdd##SUFFIX(&sum[i], &compensation[i], x[i]);                             \
+                }                                                                                  \
+                return;                                                                            \
+            }                                                                                      \
+            for (int i = 0; i < count; i++)                                                        \
+            {                                                                                      \
+                T *sum = (T *)(out + i * steps[1]);                                                \
+                kahanAdd##SUFFIX(sum, (T *)(extra + i * steps[2]), *(T *)(in + i * steps[0]));     \
+            }                                                                                      \
+            return;                                                                                \
+        case NDARRAY_PROD:                                                                         \
+            for (int i = 0; i < count; i++)                                                        \
+            {                                                                                      \
+                *(T *)(out + i * steps[1]) *= *(T *)(in + i * steps[0]);                           \
+            }                                                                                      \
+            return;                                                                                \
+        case NDARRAY_MIN:                                                                          \
+        case NDARRAY_MAX:                                                                          \
+            for (int i = 0; i < count; i++)                                                        \
+            {                                                                                      \
+                T x = *(T *)(in + i * steps[0]);                                                   \
+                T *best = (T *)(out + i * steps[1]);                                               \
+                if (op == NDARRAY_MIN ? x < *best : x > *best)                                     \
+                {                                                                                  \
+                    *best = x;                                                                     \
+                }                                                                                  \
+            }                                                                                      \
+            return;                                                                                \
+        case NDARRAY_ARGMIN:                                                                       \
+        case NDARRAY_ARGMAX:                                                                       \
+            for (int i = 0; i < count; i++)                                                        \
+            {                                                                                      \
+                T x = *(T *)(in + i * steps[0]);                                                   \
+                T *best = (T *)(extra + i * steps[2]);                                             \
+                if (*position == 0 || (op == NDARRAY_ARGMIN ? x < *best : x > *best))              \
+                {                                                                                  \
+                    *best = x;                                                                     \
+                    storeIndex(out + i * steps[1], indexType, *position);                          \
+                }                                                                                  \
+                if (++*position == reducedSize)                                                    \
+                {                                                                                  \
+                    *position = 0;                                                                 \
+                }                                                                                  \
+            }                                                                                      \
+            return;                                                                                \
+        }                                                                                          \
+    }
+
+DEFINE_REDUCE_KERNELS(Float32, float)
+DEFINE_REDUCE_KERNELS(Float64, double)
+
+struct ReduceTask
+{
+    struct NDArrayIter *it;
+    int axis;
+    enum NDArrayReduce op;
+    // Number of input elements reduced into each output element
+    int reducedSize;
+    ReduceRun run;
+    // The input's dtype, and the one run works in
+    enum NDArrayDType inputType;
+    enum NDArrayDType dtype;
+    enum NDArrayDType indexType;
+};
+
+static void reduceTask(void *context, int begin, int end)
+{
+    struct ReduceTask *task = (struct ReduceTask *)context;
+    struct NDArrayIter it = *task->it;
+    if (task->axis >= 0)
+    {
+        iterRestrict(&it, task->axis, begin, end);
+    }
+
+    // Chunks start on a new output element, since they're split along a kept axis
+    int position = 0;
+    int64_t buffer[CAST_BLOCK];
+    ptrdiff_t size = dtypeSizes[task->dtype];
+    do
+    {
+        if (task->inputType == task->dtype)
+        {
+            task->run(task->op, it.data, it.innerSteps, it.innerSize, &position, task->reducedSize, task->indexType);
+            continue;
+        }
+
+        // Convert the input a block at a time
+        for (int offset = 0; offset < it.innerSize; offset += CAST_BLOCK)
+        {
+            int count = it.innerSize - offset < CAST_BLOCK ? it.innerSize - offset : CAST_BLOCK;
+            char *data[3];
+            for (int op = 0; op < 3; op++)
+            {
+                data[op] = it.data[op] + offset * it.innerSteps[op];
+            }
+            char *cast[] = {(char *)buffer, data[0]};
+            ptrdiff_t castSteps[] = {size, it.innerSteps[0]};
+            castKernels[task->dtype][task->inputType](cast, castSteps, count);
+            data[0] = (char *)buffer;
+            ptrdiff_t steps[] = {size, it.innerSteps[1], it.innerSteps[2]};
+            task->run(task->op, data, steps, count, &position, task->reducedSize, task->indexType);
+        }
+    } while (iterNext(&it));
+}
+
+// Mark the reduced axes and work out the output shape. Returns the output's ndim, or -1 if
+// an axis is out of range or repeated
+static int reduceShape(struct NDArray *array, int *axes, int naxes, int keepdims, bool *reduced, int *shape)
+{
+    int ndim = array->ndim;
+    for (int i = 0; i < ndim; i++)
+    {
+        reduced[i] = axes == 0;
+    }
+    for (int i = 0; axes != 0 && i < naxes; i++)
+    {
+        int axis = validateAxis(axes[i], ndim);
+        if (axis < 0 || axis >= ndim || reduced[axis])
+        {
+            return -1;
+        }
+        reduced[axis] = true;
+    }
+
+    int outNDim = 0;
+    for (int i = 0; i < ndim; i++)
+    {
+        if (!reduced[i] || keepdims)
+        {
+            shape[outNDim++] = reduced[i] ? 1 : array->shape[i];
+        }
+    }
+    return outNDim;
+}
+
+static int reduceOut(enum NDArrayReduce op, struct NDArray *array, int *axes, int naxes, int keepdims, struct NDArray *out)
+{
+    int ndim = array->ndim;
+    if ((unsigned)op > NDARRAY_ARGMAX)
+    {
+        return 1;
+    }
+
+    bool reduced[ndim > 0 ? ndim : 1];
+    int outShape[ndim > 0 ? ndim : 1];
+    int outNDim = reduceShape(array, axes, naxes, keepdims, reduced, outShape);
+    if (outNDim < 0)
+    {
+        return 1;
+    }
+    // Arg reductions compare in the input's dtype, or float64 for integers. The others
+    // accumulate in out, so it has to hold floats
+    bool arg = op == NDARRAY_ARGMIN || op == NDARRAY_ARGMAX;
+    enum NDArrayDType dtype = arg ? (array->dtype == NDARRAY_FLOAT32 ? NDARRAY_FLOAT32 : NDARRAY_FLOAT64) : out->dtype;
+    if (checkOutput(out, outShape, outNDim) || (dtype != NDARRAY_FLOAT32 && dtype != NDARRAY_FLOAT64))
+    {
+        return 2;
+    }
+    int reducedSize = 1;
+    for (int i = 0; i < ndim; i++)
+    {
+        reducedSize *= reduced[i] ? array->shape[i] : 1;
+    }
+    if (reducedSize == 0 && op != NDARRAY_SUM && op != NDARRAY_MEAN && op != NDARRAY_PROD)
+    {
+        return 1;
+    }
+
+    int viewShape[ndim > 0 ? ndim : 1];
+    int viewSteps[ndim > 0 ? ndim : 1];
+    int extraSteps[ndim > 0 ? ndim : 1];
+    int outCount = 1;
+    for (int i = ndim - 1, j = outNDim - 1; i >= 0; i--)
+    {
+        viewShape[i] = reduced[i] ? 1 : array->shape[i];
+        viewSteps[i] = reduced[i] ? 0 : out->steps[j];
+        extraSteps[i] = reduced[i] ? 0 : outCount;
+        outCount *= viewShape[i];
+        j -= !reduced[i] || keepdims;
+    }
+    struct NDArray view = *out;
+    view.shape = viewShape;
+    view.steps = viewSteps;
+    view.ndim = ndim;
+
+    // Compensations, or best values for arg reductions, laid out contiguously like out
+    struct NDArray extra = view;
+    extra.steps = extraSteps;
+    extra.dtype = dtype;
+    extra.data = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_REDUCE, dtypeSizes[dtype] * outCount);
+    if (extra.data == 0)
+    {
+        return 1;
+    }
+    memset(extra.data, 0, dtypeSizes[dtype] * outCount);
+
+    NDARRAY_TYPE init[] = {[NDARRAY_SUM] = 0, [NDARRAY_MEAN] = 0, [NDARRAY_PROD] = 1,
+                           [NDARRAY_MIN] = INFINITY, [NDARRAY_MAX] = -INFINITY};
+    if (!arg && fillArray(out, init[op]))
+    {
+        return 1;
+    }
+
+    struct NDArray input = *array;
+    int inputShape[ndim > 0 ? ndim : 1];
+    int inputSteps[ndim > 0 ? ndim : 1];
+    int flags = 0;
+    if (arg)
+    {
+        // Move the reduced axes last, keeping C order otherwise
+        int order[ndim > 0 ? ndim : 1];
+        int count = 0;
+        for (int pass = 0; pass < 2; pass++)
+        {
+            for (int i = 0; i < ndim; i++)
+            {
+                if (reduced[i] == (pass == 1))
+                {
+                    order[count++] = i;
+                }
+            }
+        }
+        int *permuted[] = {viewShape, viewSteps, extraSteps};
+        for (int k = 0; k < 3; k++)
+        {
+            int copy[ndim > 0 ? ndim : 1];
+            memcpy(copy, permuted[k], sizeof(int) * ndim);
+            for (int i = 0; i < ndim; i++)
+            {
+                permuted[k][i] = copy[order[i]];
+            }
+        }
+        for (int i = 0; i < ndim; i++)
+        {
+            inputShape[i] = array->shape[order[i]];
+            inputSteps[i] = array->steps[order[i]];
+        }
+        input.shape = inputShape;
+        input.steps = inputSteps;
+        flags = ITER_KEEP_ORDER;
+    }
+
+    struct NDArray *ops[] = {&input, &view, &extra};
+    struct NDArrayIter it;
+    if (iterInit(&it, 3, ops, input.shape, ndim, flags))
+    {
+        return 1;
+    }
+    // Never split along a reduced axis, so the result doesn't depend on the thread count
+    struct ReduceTask task = {&it, iterSplitAxis(&it, 1), op, reducedSize,
+                              dtype == NDARRAY_FLOAT32 ? reduceRunFloat32 : reduceRunFloat64,
+                              array->dtype, dtype, out->dtype};
+    if (it.size > 0)
+    {
+        if (task.axis < 0)
+        {
+            reduceTask(&task, 0, 0);
+        }
+        else
+        {
+            int inner = it.size / it.shape[task.axis];
+            parallelFor(it.shape[task.axis], (PARALLEL_GRAIN + inner - 1) / inner, reduceTask, &task);
+        }
+    }
+
+    if (op == NDARRAY_MEAN)
+    {
+        // Divide by the count through a broadcast scalar view, which doesn't allocate
+        float count32 = reducedSize;
+        double count64 = reducedSize;
+        int scalarShape[outNDim > 0 ? outNDim : 1];
+        int scalarSteps[outNDim > 0 ? outNDim : 1];
+        for (int i = 0; i < outNDim; i++)
+        {
+            scalarShape[i] = 1;
+            scalarSteps[i] = 0;
+        }
+        struct NDArray scalar = *out;
+        scalar.shape = scalarShape;
+        scalar.steps = scalarSteps;
+        scalar.data = (NDARRAY_TYPE *)(dtype == NDARRAY_FLOAT32 ? (void *)&count32 : (void *)&count64);
+        ufuncOut(&ufuncs[NDARRAY_DIVIDE], out, &scalar, out);
+    }
+    return 0;
+}
+
+int NDArray_reduce_out(enum NDArrayReduce op, struct NDArray *array, int *axes, int naxes, int keepdims, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = reduceOut(op, array, axes, naxes, keepdims, out);
+    statsEnd(NDARRAY_STAT_REDUCE, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_reduce(enum NDArrayReduce op, struct NDArray *array, int *axes, int naxes, int keepdims)
+{
+    int ndim = array->ndim;
+    bool reduced[ndim > 0 ? ndim : 1];
+    int shape[ndim > 0 ? ndim : 1];
+    int outNDim = reduceShape(array, axes, naxes, keepdims, reduced, shape);
+    if (outNDim < 0)
+    {
+        return 0;
+    }
+
+    // Indices for arg reductions, and floats to accumulate in for the rest
+    enum NDArrayDType dtype = array->dtype == NDARRAY_FLOAT32 ? NDARRAY_FLOAT32 : NDARRAY_FLOAT64;
+    if (op == NDARRAY_ARGMIN || op == NDARRAY_ARGMAX)
+    {
+        dtype = NDARRAY_INT64;
+    }
+    struct NDArray *output = arrayAllocate(shape, outNDim, shapeSize(shape, outNDim), dtype);
+    if (output != 0 && NDArray_reduce_out(op, array, axes, naxes, keepdims, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+int NDArray_sum_out(struct NDArray *array, int axis, struct NDArray *out)
+{
+    return NDArray_reduce_out(NDARRAY_SUM, array, &axis, 1, 0, out);
+}
+
+struct NDArray *NDArray_sum(struct NDArray *array, int axis)
+{
+    return NDArray_reduce(NDARRAY_SUM, array, &axis, 1, 0);
+}
+
+// Lazy expressions. Nodes only record their op, inputs and shape. Evaluation walks the
+// iteration space once, in blocks of EXPR_BLOCK elements of each inner run: every op node
+// computes its block into a per thread buffer, reading array leaves in place, and the root
+// writes straight into the output (or is summed into it, pairwise and compensated as in
+// NDArray_sum). Shared nodes are computed once per block, and only the leaves and the output
+// ever touch main memory
+#define EXPR_BLOCK 256
+#define EXPR_MAXNODES 64
+// Node ops besides the ufuncs
+#define EXPR_ARRAY -1
+#define EXPR_SUM -2
+
+struct NDArrayExpr
+{
+    int refCount;
+    // An enum NDArrayUfunc, EXPR_ARRAY or EXPR_SUM
+    int op;
+    struct NDArrayExpr *inputs[2];
+    struct NDArray *array;
+    // Axis of an EXPR_SUM
+    int axis;
+    int ndim;
+    int shape[ITER_MAXDIM];
+};
+
+static struct NDArrayExpr *exprNew(int op, struct NDArrayExpr *a, struct NDArrayExpr *b, int ndim, int *shape)
+{
+    struct NDArrayExpr *expr = (struct NDArrayExpr *)ndMalloc(sizeof(struct NDArrayExpr));
+    if (expr == 0)
+    {
+        NDArray_exprFree(a);
+        NDArray_exprFree(b);
+        return 0;
+    }
+    expr->refCount = 1;
+    expr->op = op;
+    expr->inputs[0] = a;
+    expr->inputs[1] = b;
+    expr->array = 0;
+    expr->axis = 0;
+    expr->ndim = ndim;
+    memcpy(expr->shape, shape, sizeof(int) * ndim);
+    return expr;
+}
+
+void NDArray_exprFree(struct NDArrayExpr *expr)
+{
+    if (expr != 0 && --expr->refCount == 0)
+    {
+        NDArray_exprFree(expr->inputs[0]);
+        NDArray_exprFree(expr->inputs[1]);
+        ndFree(expr);
+    }
+}
+
+struct NDArrayExpr *NDArray_exprRetain(struct NDArrayExpr *expr)
+{
+    if (expr != 0)
+    {
+        expr->refCount++;
+    }
+    return expr;
+}
+
+struct NDArrayExpr *NDArray_exprArray(struct NDArray *array)
+{
+    if (array->ndim > ITER_MAXDIM)
+    {
+        return 0;
+    }
+    struct NDArrayExpr *expr = exprNew(EXPR_ARRAY, 0, 0, array->ndim, array->shape);
+    if (expr != 0)
+    {
+        expr->array = array;
+    }
+    return expr;
+}
+
+struct NDArrayExpr *NDArray_exprBinary(enum NDArrayUfunc op, struct NDArrayExpr *a, struct NDArrayExpr *b)
+{
+    bool valid = a != 0 && b != 0 && ufuncGet(op, 2) != 0 && a->op != EXPR_SUM && b->op != EXPR_SUM && a->ndim == b->ndim;
+    int shape[ITER_MAXDIM];
+    for (int i = 0; valid && i < a->ndim; i++)
+    {
+        valid = a->shape[i] == b->shape[i] || a->shape[i] == 1 || b->shape[i] == 1;
+        shape[i] = a->shape[i] == 1 ? b->shape[i] : a->shape[i];
+    }
+    if (!valid)
+    {
+        NDArray_exprFree(a);
+        NDArray_exprFree(b);
+        return 0;
+    }
+    return exprNew(op, a, b, a->ndim, shape);
+}
+
+struct NDArrayExpr *NDArray_exprUnary(enum NDArrayUfunc op, struct NDArrayExpr *a)
+{
+    if (a == 0 || ufuncGet(op, 1) == 0 || a->op == EXPR_SUM)
+    {
+        NDArray_exprFree(a);
+        return 0;
+    }
+    return exprNew(op, a, 0, a->ndim, a->shape);
+}
+
+struct NDArrayExpr *NDArray_exprSum(struct NDArrayExpr *a, int axis)
+{
+    if (a == 0 || a->op == EXPR_SUM)
+    {
+        NDArray_exprFree(a);
+        return 0;
+    }
+    axis = validateAxis(axis, a->ndim);
+    if (axis < 0 || axis >= a->ndim)
+    {
+        NDArray_exprFree(a);
+        return 0;
+    }
+
+    int shape[ITER_MAXDIM];
+    for (int i = 0; i < a->ndim - 1; i++)
+    {
+        shape[i] = a->shape[i + (i >= axis)];
+    }
+    struct NDArrayExpr *expr = exprNew(EXPR_SUM, a, 0, a->ndim - 1, shape);
+    if (expr != 0)
+    {
+        expr->axis = axis;
+    }
+    return expr;
+}
+
+// An element-wise graph flattened for evaluation. Inputs always come before the nodes
+// using them, and the root is last. A sum's compensations are the iterator operand after
+// the leaves
+struct ExprPlan
+{
+    int nodeCount;
+    struct NDArrayExpr *nodes[EXPR_MAXNODES];
+    // For each node, the indices of its inputs, or for a leaf its iterator operand
+    int inputs[EXPR_MAXNODES][2];
+    int operand[EXPR_MAXNODES];
+    const ElementwiseKernel *kernels[EXPR_MAXNODES];
+    int leafCount;
+    struct NDArray *leaves[ITER_MAXOP - 1];
+    bool sum;
+    ReduceRun sumRun;
+    struct NDArrayIter it;
+};
+
+// Add expr and everything below it to the plan, returning its index or -1 if it's too big
+static int exprPlanAdd(struct ExprPlan *plan, struct NDArrayExpr *expr)
+{
+    for (int i = 0; i < plan->nodeCount; i++)
+    {
+        if (plan->nodes[i] == expr)
+        {
+            return i;
+        }
+    }
+
+    int inputs[2] = {-1, -1};
+    for (int i = 0; i < 2 && expr->inputs[i] != 0; i++)
+    {
+        inputs[i] = exprPlanAdd(plan, expr->inputs[i]);
+        if (inputs[i] < 0)
+        {
+            return -1;
+        }
+    }
+    if (plan->nodeCount == EXPR_MAXNODES)
+    {
+        return -1;
+    }
+
+    int node = plan->nodeCount++;
+    plan->nodes[node] = expr;
+    plan->inputs[node][0] = inputs[0];
+    plan->inputs[node][1] = inputs[1];
+    plan->operand[node] = -1;
+    plan->kernels[node] = 0;
+    if (expr->op == EXPR_ARRAY)
+    {
+        // Operand 0 is the output
+        int leaf = 0;
+        while (leaf < plan->leafCount && plan->leaves[leaf] != expr->array)
+        {
+            leaf++;
+        }
+        if (leaf == plan->leafCount)
+        {
+            if (leaf == ITER_MAXOP - 1 - plan->sum)
+            {
+                return -1;
+            }
+            plan->leaves[plan->leafCount++] = expr->array;
+        }
+        plan->operand[node] = leaf + 1;
+    }
+    else
+    {
+        plan->kernels[node] = ufuncs[expr->op].kernels[NATIVE_DTYPE];
+    }
+    return node;
+}
+
+// Copy a run, for expressions that are just an array
+static void copyKernel(char **data, ptrdiff_t *steps, int count)
+{
+    char *out = data[0], *in = data[1];
+    for (int i = 0; i < count; i++)
+    {
+        *(NDARRAY_TYPE *)out = *(NDARRAY_TYPE *)in;
+        out += steps[0];
+        in += steps[1];
+    }
+}
+
+struct ExprTask
+{
+    struct ExprPlan *plan;
+    int axis;
+    // Set if a thread couldn't get its block buffers
+    atomic_int failed;
+};
+
+static void exprTask(void *context, int begin, int end)
+{
+    struct ExprTask *task = (struct ExprTask *)context;
+    struct ExprPlan *plan = task->plan;
+    struct NDArrayIter it = plan->it;
+    if (task->axis >= 0)
+    {
+        iterRestrict(&it, task->axis, begin, end);
+    }
+
+    const ptrdiff_t size = sizeof(NDARRAY_TYPE);
+    int isa = NDArray_isa();
+    int root = plan->nodeCount - 1;
+    char *buffers = (char *)scratchBuffer(SCRATCH_EXPR, size * EXPR_BLOCK * plan->nodeCount);
+    if (buffers == 0)
+    {
+        atomic_store_explicit(&task->failed, 1, memory_order_relaxed);
+        return;
+    }
+    char *pointers[EXPR_MAXNODES];
+    ptrdiff_t steps[EXPR_MAXNODES];
+
+    do
+    {
+        for (int offset = 0; offset < it.innerSize; offset += EXPR_BLOCK)
+        {
+            int count = it.innerSize - offset < EXPR_BLOCK ? it.innerSize - offset : EXPR_BLOCK;
+            char *out = it.data[0] + offset * it.innerSteps[0];
+            for (int node = 0; node <= root; node++)
+            {
+                int operand = plan->operand[node];
+                if (operand >= 0)
+                {
+                    pointers[node] = it.data[operand] + offset * it.innerSteps[operand];
+                    steps[node] = it.innerSteps[operand];
+                    enum NDArrayDType dtype = plan->leaves[operand - 1]->dtype;
+                    if (dtype != NATIVE_DTYPE)
+                    {
+                        // Convert leaves of other dtypes into the node's buffer
+                        char *cast[] = {buffers + node * size * EXPR_BLOCK, pointers[node]};
+                        ptrdiff_t castSteps[] = {size, steps[node]};
+                        castKernels[NATIVE_DTYPE][dtype](cast, castSteps, count);
+                        pointers[node] = cast[0];
+                        steps[node] = size;
+                    }
+                    continue;
+                }
+
+                // The root of a plain element-wise expression writes to the output directly
+                bool direct = node == root && !plan->sum;
+                pointers[node] = direct ? out : buffers + node * size * EXPR_BLOCK;
+                steps[node] = direct ? it.innerSteps[0] : size;
+                int a = plan->inputs[node][0];
+                int b = plan->inputs[node][1];
+                char *data[] = {pointers[node], pointers[a], b >= 0 ? pointers[b] : 0};
+                ptrdiff_t kernelSteps[] = {steps[node], steps[a], b >= 0 ? steps[b] : 0};
+                plan->kernels[node][isa](data, kernelSteps, count);
+            }
+
+            if (plan->sum)
+            {
+                int extra = plan->leafCount + 1;
+                char *data[] = {pointers[root], out, it.data[extra] + offset * it.innerSteps[extra]};
+                ptrdiff_t kernelSteps[] = {steps[root], it.innerSteps[0], it.innerSteps[extra]};
+                plan->sumRun(NDARRAY_SUM, data, kernelSteps, count, 0, 0, NATIVE_DTYPE);
+            }
+            else if (plan->operand[root] >= 0)
+            {
+                char *data[] = {out, pointers[root]};
+                ptrdiff_t kernelSteps[] = {it.innerSteps[0], steps[root]};
+                copyKernel(data, kernelSteps, count);
+            }
+        }
+    } while (iterNext(&it));
+}
+
+static int exprEvalOut(struct NDArrayExpr *expr, struct NDArray *out)
+{
+    if (expr == 0)
+    {
+        return 1;
+    }
+    if (checkOutput(out, expr->shape, expr->ndim) || out->dtype != NATIVE_DTYPE)
+    {
+        return 2;
+    }
+
+    struct ExprPlan *plan = (struct ExprPlan *)ndMalloc(sizeof(struct ExprPlan));
+    if (plan == 0)
+    {
+        return 1;
+    }
+    plan->nodeCount = 0;
+    plan->leafCount = 0;
+    plan->sum = expr->op == EXPR_SUM;
+    struct NDArrayExpr *root = plan->sum ? expr->inputs[0] : expr;
+    if (exprPlanAdd(plan, root) < 0)
+    {
+        ndFree(plan);
+        return 1;
+    }
+
+    // As in NDArray_sum_out, a sum views out with the summed axis put back with a step of 0
+    int ndim = root->ndim;
+    int viewShape[ndim > 0 ? ndim : 1];
+    int viewSteps[ndim > 0 ? ndim : 1];
+    for (int i = 0; i < ndim; i++)
+    {
+        int axis = plan->sum ? expr->axis : ndim;
+        viewShape[i] = i == axis ? 1 : out->shape[i - (i > axis)];
+        viewSteps[i] = i == axis ? 0 : out->steps[i - (i > axis)];
+    }
+    struct NDArray view = *out;
+    view.shape = viewShape;
+    view.steps = viewSteps;
+    view.ndim = ndim;
+    struct NDArray *ops[ITER_MAXOP];
+    ops[0] = &view;
+    memcpy(ops + 1, plan->leaves, sizeof(struct NDArray *) * plan->leafCount);
+
+    // Compensations for a sum, laid out contiguously like out
+    int extraSteps[ndim > 0 ? ndim : 1];
+    struct NDArray extra = view;
+    if (plan->sum)
+    {
+        int outCount = 1;
+        for (int i = ndim - 1; i >= 0; i--)
+        {
+            extraSteps[i] = i == expr->axis ? 0 : outCount;
+            outCount *= viewShape[i];
+        }
+        extra.steps = extraSteps;
+        extra.data = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_REDUCE, sizeof(NDARRAY_TYPE) * outCount);
+        if (extra.data == 0 || fillArray(out, 0))
+        {
+            ndFree(plan);
+            return 1;
+        }
+        memset(extra.data, 0, sizeof(NDARRAY_TYPE) * outCount);
+        ops[plan->leafCount + 1] = &extra;
+        plan->sumRun = NATIVE_DTYPE == NDARRAY_FLOAT32 ? reduceRunFloat32 : reduceRunFloat64;
+    }
+    if (iterInit(&plan->it, plan->leafCount + 1 + plan->sum, ops, root->shape, ndim, 0))
+    {
+        ndFree(plan);
+        return 1;
+    }
+
+    int status = 0;
+    if (plan->it.size > 0)
+    {
+        struct ExprTask task = {plan, iterSplitAxis(&plan->it, plan->sum ? 0 : -1), 0};
+        if (task.axis < 0)
+        {
+            exprTask(&task, 0, 0);
+        }
+        else
+        {
+            int inner = plan->it.size / plan->it.shape[task.axis];
+            parallelFor(plan->it.shape[task.axis], (PARALLEL_GRAIN + inner - 1) / inner, exprTask, &task);
+        }
+        status = atomic_load(&task.failed);
+    }
+    ndFree(plan);
+    return status;
+}
+
+int NDArray_exprEval_out(struct NDArrayExpr *expr, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = exprEvalOut(expr, out);
+    statsEnd(NDARRAY_STAT_EXPR, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_exprEval(struct NDArrayExpr *expr)
+{
+    if (expr == 0)
+    {
+        return 0;
+    }
+    struct NDArray *output = NDArray_create(expr->shape, expr->ndim);
+    if (output != 0 && NDArray_exprEval_out(expr, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+struct NDArray *NDArray_copy(struct NDArray *array)
+{
+    return arrayView(array, array->shape, array->steps, array->ndim);
+}
+
+struct NDArray *NDArray_clone(struct NDArray *array)
+{
+    // Copy only the memory the steps reach, so that clones of slices stay small
+    int64_t low;
+    int span = (int)stepSpan(array->shape, array->steps, array->ndim, &low);
+    size_t itemSize = dtypeSizes[array->dtype];
+    struct NDArray *output = arrayAllocate(array->shape, array->ndim, span, array->dtype);
+    if (output == 0)
+    {
+        return 0;
+    }
+    memcpy(output->data, (char *)array->data + low * (ptrdiff_t)itemSize, itemSize * span);
+    output->data = (NDARRAY_TYPE *)((char *)output->data - low * (ptrdiff_t)itemSize);
+    memcpy(output->steps, array->steps, sizeof(int) * array->ndim);
+    return output;
+}
+
+// Blocking parameters for the GEMM kernel. MR x NR is the register tile held in
+// accumulators by the micro-kernel, KC x NR panels of B are streamed from L1,
+// MC x KC blocks of A are kept in L2 and KC x NC blocks of B in L3.
+#define GEMM_MR 6
+#define GEMM_NR (64 / (int)sizeof(NDARRAY_TYPE))
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 2048
+
+// Pack an mc x kc block of A, holding dtype, into MR-row micro-panels of NDARRAY_TYPE, zero
+// padding the last one
+static void gemmPackA(int mc, int kc, const void *a, enum NDArrayDType dtype, int rsA, int csA, NDARRAY_TYPE *packed)
+{
+    for (int i = 0; i < mc; i += GEMM_MR)
+    {
+        int mr = mc - i < GEMM_MR ? mc - i : GEMM_MR;
+        for (int p = 0; p < kc; p++)
+        {
+            if (dtype == NATIVE_DTYPE)
+            {
+                const NDARRAY_TYPE *col = (const NDARRAY_TYPE *)a + i * rsA + p * csA;
+                for (int ii = 0; ii < mr; ii++)
+                {
+                    packed[ii] = col[ii * rsA];
+                }
+            }
+            else
+            {
+                for (int ii = 0; ii < mr; ii++)
+                {
+                    packed[ii] = loadElement(a, (ptrdiff_t)(i + ii) * rsA + (ptrdiff_t)p * csA, dtype);
+                }
+            }
+            for (int ii = mr; ii < GEMM_MR; ii++)
+            {
+                packed[ii] = 0;
+            }
+            packed += GEMM_MR;
+        }
+    }
+}
+
+// Pack a kc x nc block of B, holding dtype, into NR-column micro-panels of NDARRAY_TYPE, zero
+// padding the last one
+static void gemmPackB(int kc, int nc, const void *b, enum NDArrayDType dtype, int rsB, int csB, NDARRAY_TYPE *packed)
+{
+    for (int j = 0; j < nc; j += GEMM_NR)
+    {
+        int nr = nc - j < GEMM_NR ? nc - j : GEMM_NR;
+        for (int p = 0; p < kc; p++)
+        {
+            const NDARRAY_TYPE *row = (const NDARRAY_TYPE *)b + p * rsB + j * csB;
+            if (dtype != NATIVE_DTYPE)
+            {
+                for (int jj = 0; jj < nr; jj++)
+                {
+                    packed[jj] = loadElement(b, (ptrdiff_t)p * rsB + (ptrdiff_t)(j + jj) * csB, dtype);
+                }
+            }
+            else if (csB == 1)
+            {
+                memcpy(packed, row, nr * sizeof(NDARRAY_TYPE));
+            }
+            else
+            {
+                for (int jj = 0; jj < nr; jj++)
+                {
+                    packed[jj] = row[jj * csB];
+                }
+            }
+            for (int jj = nr; jj < GEMM_NR; jj++)
+            {
+                packed[jj] = 0;
+            }
+            packed += GEMM_NR;
+        }
+    }
+}
+
+#if defined(__GNUC__)
+typedef NDARRAY_TYPE gemmRow __attribute__((vector_size(GEMM_NR * sizeof(NDARRAY_TYPE))));
+#endif
+
+// Multiply an MR x kc micro-panel of A by a kc x NR micro-panel of B and store
+// alpha times the result in the top left mr x nr corner of C, adding to C if accumulate is set
+static void gemmMicroKernel(int kc, const NDARRAY_TYPE *a, const NDARRAY_TYPE *b, NDARRAY_TYPE alpha,
+                            bool accumulate, NDARRAY_TYPE *c, int rsC, int csC, int mr, int nr)
+{
+    NDARRAY_TYPE ab[GEMM_MR][GEMM_NR];
+#if defined(__GNUC__)
+    // Vector extensions keep the whole tile in registers for whatever SIMD width the target has
+    gemmRow acc[GEMM_MR] = {{0}};
+    for (int p = 0; p < kc; p++)
+    {
+        gemmRow row;
+        memcpy(&row, b, sizeof(row));
+        for (int i = 0; i < GEMM_MR; i++)
+        {
+            acc[i] += a[i] * row;
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+    memcpy(ab, acc, sizeof(ab));
+#else
+    memset(ab, 0, sizeof(ab));
+    for (int p = 0; p < kc; p++)
+    {
+        for (int i = 0; i < GEMM_MR; i++)
+        {
+            for (int j = 0; j < GEMM_NR; j++)
+            {
+                ab[i][j] += a[i] * b[j];
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+#endif
+
+    for (int i = 0; i < mr; i++)
+    {
+        NDARRAY_TYPE *cRow = c + i * rsC;
+        for (int j = 0; j < nr; j++)
+        {
+            if (accumulate)
+            {
+                cRow[j * csC] += alpha * ab[i][j];
+            }
+            else
+            {
+                cRow[j * csC] = alpha * ab[i][j];
+            }
+        }
+    }
+}
+
+// C = alpha * A * B, or C += alpha * A * B if accumulate is set. A is m x k, B is k x n
+// and C is m x n, all with arbitrary (row, column) steps. Nothing is copied beyond the
+// fixed size packing buffers, so any view can be passed in directly. A and B may hold any
+// dtype, and are converted to NDARRAY_TYPE as they're packed. Returns nonzero if the packing
+// buffers can't be allocated
+static int gemm(int m, int n, int k, NDARRAY_TYPE alpha,
+                 const void *a, enum NDArrayDType typeA, int rsA, int csA,
+                 const void *b, enum NDArrayDType typeB, int rsB, int csB,
+                 bool accumulate, NDARRAY_TYPE *c, int rsC, int csC)
+{
+    if (m == 0 || n == 0)
+    {
+        return 0;
+    }
+    if (k == 0)
+    {
+        if (!accumulate)
+        {
+            for (int i = 0; i < m; i++)
+            {
+                for (int j = 0; j < n; j++)
+                {
+                    c[i * rsC + j * csC] = 0;
+                }
+            }
+        }
+        return 0;
+    }
+
+    int kcMax = k < GEMM_KC ? k : GEMM_KC;
+    int mcMax = m < GEMM_MC ? m : GEMM_MC;
+    int ncMax = n < GEMM_NC ? n : GEMM_NC;
+    mcMax = (mcMax + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+    ncMax = (ncMax + GEMM_NR - 1) / GEMM_NR * GEMM_NR;
+    NDARRAY_TYPE *packedA = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_GEMM_A, sizeof(NDARRAY_TYPE) * mcMax * kcMax);
+    NDARRAY_TYPE *packedB = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_GEMM_B, sizeof(NDARRAY_TYPE) * kcMax * ncMax);
+    if (packedA == 0 || packedB == 0)
+    {
+        return 1;
+    }
+
+    for (int jc = 0; jc < n; jc += GEMM_NC)
+    {
+        int nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+        for (int pc = 0; pc < k; pc += GEMM_KC)
+        {
+            int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            const char *blockB = (const char *)b + ((ptrdiff_t)pc * rsB + (ptrdiff_t)jc * csB) * (ptrdiff_t)dtypeSizes[typeB];
+            gemmPackB(kc, nc, blockB, typeB, rsB, csB, packedB);
+            // Only the first block along k may overwrite C
+            bool acc = accumulate || pc > 0;
+
+            for (int ic = 0; ic < m; ic += GEMM_MC)
+            {
+                int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+                const char *blockA = (const char *)a + ((ptrdiff_t)ic * rsA + (ptrdiff_t)pc * csA) * (ptrdiff_t)dtypeSizes[typeA];
+                gemmPackA(mc, kc, blockA, typeA, rsA, csA, packedA);
+
+                for (int jr = 0; jr < nc; jr += GEMM_NR)
+                {
+                    int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                    for (int ir = 0; ir < mc; ir += GEMM_MR)
+                    {
+                        int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                        gemmMicroKernel(kc, packedA + ir * kc, packedB + jr * kc, alpha, acc,
+                                        c + (ic + ir) * rsC + (jc + jr) * csC, rsC, csC, mr, nr);
+                    }
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+// Pointer to the matrix at a batch index, where size 1 batch dimensions are broadcast
+static char *batchPointer(struct NDArray *array, int *index, int nbatch)
+{
+    char *pointer = (char *)array->data;
+    for (int i = 0; i < nbatch; i++)
+    {
+        if (array->shape[i] != 1)
+        {
+            pointer += (ptrdiff_t)index[i] * array->steps[i] * dtypeSizes[array->dtype];
+        }
+    }
+    return pointer;
+}
+
+static void incBatchIndex(int *index, int *shape, int nbatch)
+{
+    for (int i = nbatch - 1; i >= 0; i--)
+    {
+        if (++index[i] < shape[i])
+        {
+            return;
+        }
+        index[i] = 0;
+    }
+}
+
+// Set index to the position of the linear batch number batch in shape
+static void batchIndex(int batch, int *shape, int nbatch, int *index)
+{
+    for (int i = nbatch - 1; i >= 0; i--)
+    {
+        index[i] = batch % shape[i];
+        batch /= shape[i];
+    }
+}
+
+// Copy an m x n matrix holding dtype, with arbitrary steps, into a contiguous row-major
+// buffer of NDARRAY_TYPE
+static void copyMatrix(const void *src, enum NDArrayDType dtype, int rs, int cs, int m, int n, NDARRAY_TYPE *dst)
+{
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            ptrdiff_t index = (ptrdiff_t)i * rs + (ptrdiff_t)j * cs;
+            dst[i * n + j] = dtype == NATIVE_DTYPE ? ((const NDARRAY_TYPE *)src)[index] : loadElement(src, index, dtype);
+        }
+    }
+}
+
+// Copy a contiguous row-major m x n matrix out to one holding dtype, with arbitrary steps
+static void storeMatrix(const NDARRAY_TYPE *src, int m, int n, void *dst, enum NDArrayDType dtype, int rs, int cs)
+{
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            ptrdiff_t index = (ptrdiff_t)i * rs + (ptrdiff_t)j * cs;
+            if (dtype == NATIVE_DTYPE)
+            {
+                ((NDARRAY_TYPE *)dst)[index] = src[i * n + j];
+            }
+            else
+            {
+                storeElement(dst, index, dtype, src[i * n + j]);
+            }
+        }
+    }
+}
+
+// Matrices up to SMALL_MAX x SMALL_MAX are worked on in local arrays by the kernels below,
+// skipping the packing, blocking and scratch buffers of the general routines, which cost far
+// more than the arithmetic at these sizes. Each kernel takes its size as its first argument
+// and is always inlined into a dispatcher that passes a constant, so every size gets its own
+// fully unrolled copy
+#define SMALL_MAX 8
+
+#if defined(__GNUC__)
+#define SMALL_INLINE static inline __attribute__((always_inline))
+#else
+#define SMALL_INLINE static inline
+#endif
+
+// A switch over n from 1 to SMALL_MAX that expands CASE(N) for each constant size. CASE has to
+// end in a return or a break
+#define SMALL_SWITCH(n, CASE) \
+    switch (n)                \
+    {                         \
+    case 1:                   \
+        CASE(1);              \
+    case 2:                   \
+        CASE(2);              \
+    case 3:                   \
+        CASE(3);              \
+    case 4:                   \
+        CASE(4);              \
+    case 5:                   \
+        CASE(5);              \
+    case 6:                   \
+        CASE(6);              \
+    case 7:                   \
+        CASE(7);              \
+    default:                  \
+        CASE(8);              \
+    }
+
+// copyMatrix and storeMatrix, inlined into the kernels so that their sizes are constants
+SMALL_INLINE void smallLoad(const char *src, enum NDArrayDType dtype, int rs, int cs, int m, int n, NDARRAY_TYPE *dst)
+{
+    if (dtype != NATIVE_DTYPE)
+    {
+        copyMatrix(src, dtype, rs, cs, m, n, dst);
+        return;
+    }
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            dst[i * n + j] = ((const NDARRAY_TYPE *)src)[(ptrdiff_t)i * rs + (ptrdiff_t)j * cs];
+        }
+    }
+}
+
+SMALL_INLINE void smallStore(const NDARRAY_TYPE *src, int m, int n, char *dst, enum NDArrayDType dtype, int rs, int cs)
+{
+    if (dtype != NATIVE_DTYPE)
+    {
+        storeMatrix(src, m, n, dst, dtype, rs, cs);
+        return;
+    }
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            ((NDARRAY_TYPE *)dst)[(ptrdiff_t)i * rs + (ptrdiff_t)j * cs] = src[i * n + j];
+        }
+    }
+}
+
+// Gaussian elimination with partial pivoting of a contiguous n x n a, applying the same row
+// operations to a contiguous n x k x. Leaves the upper triangle in a and the reciprocals of
+// its diagonal in inverse. Returns the number of row swaps, or -1 if a is singular
+SMALL_INLINE int smallEliminateN(int n, int k, NDARRAY_TYPE *a, NDARRAY_TYPE *x, NDARRAY_TYPE *inverse)
+{
+    int swaps = 0;
+    for (int j = 0; j < n; j++)
+    {
+        int p = j;
+        NDARRAY_TYPE max = a[j * n + j] < 0 ? -a[j * n + j] : a[j * n + j];
+        for (int i = j + 1; i < n; i++)
+        {
+            NDARRAY_TYPE value = a[i * n + j] < 0 ? -a[i * n + j] : a[i * n + j];
+            if (value > max)
+            {
+                max = value;
+                p = i;
+            }
+        }
+        if (max == 0)
+        {
+            return -1;
+        }
+        if (p != j)
+        {
+            for (int c = j; c < n; c++)
+            {
+                NDARRAY_TYPE temp = a[j * n + c];
+                a[j * n + c] = a[p * n + c];
+                a[p * n + c] = temp;
+            }
+            for (int c = 0; c < k; c++)
+            {
+                NDARRAY_TYPE temp = x[j * k + c];
+                x[j * k + c] = x[p * k + c];
+                x[p * k + c] = temp;
+            }
+            swaps++;
+        }
+
+        inverse[j] = 1 / a[j * n + j];
+        for (int i = j + 1; i < n; i++)
+        {
+            NDARRAY_TYPE l = a[i * n + j] * inverse[j];
+            for (int c = j + 1; c < n; c++)
+            {
+                a[i * n + c] -= l * a[j * n + c];
+            }
+            for (int c = 0; c < k; c++)
+            {
+                x[i * k + c] -= l * x[j * k + c];
+            }
+        }
+    }
+    return swaps;
+}
+
+// Solve a * x = b for a contiguous n x n a and n x k b, overwriting a and replacing b with
+// x. Returns nonzero if a is singular
+SMALL_INLINE int smallSolveN(int n, int k, NDARRAY_TYPE *a, NDARRAY_TYPE *x)
+{
+    NDARRAY_TYPE inverse[SMALL_MAX];
+    if (smallEliminateN(n, k, a, x, inverse) < 0)
+    {
+        return 1;
+    }
+    for (int i = n - 1; i >= 0; i--)
+    {
+        for (int p = i + 1; p < n; p++)
+        {
+            for (int c = 0; c < k; c++)
+            {
+                x[i * k + c] -= a[i * n + p] * x[p * k + c];
+            }
+        }
+        for (int c = 0; c < k; c++)
+        {
+            x[i * k + c] *= inverse[i];
+        }
+    }
+    return 0;
+}
+
+// Inverses, with b the identity, and single right hand sides are unrolled in every dimension
+static int smallSolve(int n, int k, NDARRAY_TYPE *a, NDARRAY_TYPE *x)
+{
+#define SMALL_SOLVE(N) \
+    return k == (N) ? smallSolveN(N, N, a, x) : k == 1 ? smallSolveN(N, 1, a, x) : smallSolveN(N, k, a, x)
+    SMALL_SWITCH(n, SMALL_SOLVE)
+#undef SMALL_SOLVE
+}
+
+// Inverse and determinant by cofactors of a contiguous n x n matrix for n up to
+// SMALL_COFACTOR_MAX. The dependency chain is a few products and a single division, much
+// shorter than elimination's pivot by pivot one, which dominates at these sizes
+#define SMALL_COFACTOR_MAX 4
+
+SMALL_INLINE NDARRAY_TYPE smallCofactorDet(int n, const NDARRAY_TYPE *a)
+{
+    switch (n)
+    {
+    case 1:
+        return a[0];
+    case 2:
+        return a[0] * a[3] - a[1] * a[2];
+    case 3:
+        return a[0] * (a[4] * a[8] - a[5] * a[7]) - a[1] * (a[3] * a[8] - a[5] * a[6]) +
+               a[2] * (a[3] * a[7] - a[4] * a[6]);
+    default:
+    {
+        // Laplace expansion along the first two rows, by 2 x 2 minors
+        NDARRAY_TYPE s0 = a[0] * a[5] - a[4] * a[1], s1 = a[0] * a[6] - a[4] * a[2];
+        NDARRAY_TYPE s2 = a[0] * a[7] - a[4] * a[3], s3 = a[1] * a[6] - a[5] * a[2];
+        NDARRAY_TYPE s4 = a[1] * a[7] - a[5] * a[3], s5 = a[2] * a[7] - a[6] * a[3];
+        NDARRAY_TYPE c0 = a[8] * a[13] - a[12] * a[9], c1 = a[8] * a[14] - a[12] * a[10];
+        NDARRAY_TYPE c2 = a[8] * a[15] - a[12] * a[11], c3 = a[9] * a[14] - a[13] * a[10];
+        NDARRAY_TYPE c4 = a[9] * a[15] - a[13] * a[11], c5 = a[10] * a[15] - a[14] * a[11];
+        return s0 * c5 - s1 * c4 + s2 * c3 + s3 * c2 - s4 * c1 + s5 * c0;
+    }
+    }
+}
+
+// Returns nonzero if the determinant is 0
+SMALL_INLINE int smallCofactorInv(int n, const NDARRAY_TYPE *a, NDARRAY_TYPE *x)
+{
+    NDARRAY_TYPE det = smallCofactorDet(n, a);
+    if (det == 0)
+    {
+        return 1;
+    }
+    NDARRAY_TYPE scale = 1 / det;
+    switch (n)
+    {
+    case 1:
+        x[0] = scale;
+        break;
+    case 2:
+        x[0] = a[3] * scale;
+        x[1] = -a[1] * scale;
+        x[2] = -a[2] * scale;
+        x[3] = a[0] * scale;
+        break;
+    case 3:
+        x[0] = (a[4] * a[8] - a[5] * a[7]) * scale;
+        x[1] = (a[2] * a[7] - a[1] * a[8]) * scale;
+        x[2] = (a[1] * a[5] - a[2] * a[4]) * scale;
+        x[3] = (a[5] * a[6] - a[3] * a[8]) * scale;
+        x[4] = (a[0] * a[8] - a[2] * a[6]) * scale;
+        x[5] = (a[2] * a[3] - a[0] * a[5]) * scale;
+        x[6] = (a[3] * a[7] - a[4] * a[6]) * scale;
+        x[7] = (a[1] * a[6] - a[0] * a[7]) * scale;
+        x[8] = (a[0] * a[4] - a[1] * a[3]) * scale;
+        break;
+    default:
+    {
+        NDARRAY_TYPE s0 = a[0] * a[5] - a[4] * a[1], s1 = a[0] * a[6] - a[4] * a[2];
+        NDARRAY_TYPE s2 = a[0] * a[7] - a[4] * a[3], s3 = a[1] * a[6] - a[5] * a[2];
+        NDARRAY_TYPE s4 = a[1] * a[7] - a[5] * a[3], s5 = a[2] * a[7] - a[6] * a[3];
+        NDARRAY_TYPE c0 = a[8] * a[13] - a[12] * a[9], c1 = a[8] * a[14] - a[12] * a[10];
+        NDARRAY_TYPE c2 = a[8] * a[15] - a[12] * a[11], c3 = a[9] * a[14] - a[13] * a[10];
+        NDARRAY_TYPE c4 = a[9] * a[15] - a[13] * a[11], c5 = a[10] * a[15] - a[14] * a[11];
+        x[0] = (a[5] * c5 - a[6] * c4 + a[7] * c3) * scale;
+        x[1] = (-a[1] * c5 + a[2] * c4 - a[3] * c3) * scale;
+        x[2] = (a[13] * s5 - a[14] * s4 + a[15] * s3) * scale;
+        x[3] = (-a[9] * s5 + a[10] * s4 - a[11] * s3) * scale;
+        x[4] = (-a[4] * c5 + a[6] * c2 - a[7] * c1) * scale;
+        x[5] = (a[0] * c5 - a[2] * c2 + a[3] * c1) * scale;
+        x[6] = (-a[12] * s5 + a[14] * s2 - a[15] * s1) * scale;
+        x[7] = (a[8] * s5 - a[10] * s2 + a[11] * s1) * scale;
+        x[8] = (a[4] * c4 - a[5] * c2 + a[7] * c0) * scale;
+        x[9] = (-a[0] * c4 + a[1] * c2 - a[3] * c0) * scale;
+        x[10] = (a[12] * s4 - a[13] * s2 + a[15] * s0) * scale;
+        x[11] = (-a[8] * s4 + a[9] * s2 - a[11] * s0) * scale;
+        x[12] = (-a[4] * c3 + a[5] * c1 - a[6] * c0) * scale;
+        x[13] = (a[0] * c3 - a[1] * c1 + a[2] * c0) * scale;
+        x[14] = (-a[12] * s3 + a[13] * s1 - a[14] * s0) * scale;
+        x[15] = (a[8] * s3 - a[9] * s1 + a[10] * s0) * scale;
+        break;
+    }
+    }
+    return 0;
+}
+
+// Overwrites a
+static NDARRAY_TYPE smallDet(int n, NDARRAY_TYPE *a)
+{
+    NDARRAY_TYPE inverse[SMALL_MAX];
+    int swaps;
+#define SMALL_DET(N)                                  \
+    if ((N) <= SMALL_COFACTOR_MAX)                    \
+    {                                                 \
+        return smallCofactorDet(N, a);                \
+    }                                                 \
+    swaps = smallEliminateN(N, 0, a, 0, inverse);     \
+    break
+    SMALL_SWITCH(n, SMALL_DET)
+#undef SMALL_DET
+    if (swaps < 0)
+    {
+        return 0;
+    }
+    NDARRAY_TYPE det = swaps % 2 != 0 ? -1 : 1;
+    for (int i = 0; i < n; i++)
+    {
+        det *= a[i * n + i];
+    }
+    return det;
+}
+
+// Tiles of C that NDArray_matmul hands to threads, each one a separate GEMM. Tiles
+// don't change the order of any sums, so results are the same however C is split
+#define GEMM_TILE_M GEMM_MC
+#define GEMM_TILE_N 512
+
+struct MatmulTask
+{
+    struct NDArray *a;
+    struct NDArray *b;
+    struct NDArray *out;
+    int *shape;
+    int nbatch;
+    int m;
+    int n;
+    int k;
+    int tilesM;
+    int tilesN;
+    // Set if a thread couldn't get its packing buffers
+    atomic_int failed;
+};
+
+// Multiply tiles [begin, end), numbered by batch, then tile row, then tile column
+static void matmulTask(void *context, int begin, int end)
+{
+    struct MatmulTask *task = (struct MatmulTask *)context;
+    struct NDArray *a = task->a;
+    struct NDArray *b = task->b;
+    struct NDArray *out = task->out;
+    int ndim = a->ndim;
+    int tiles = task->tilesM * task->tilesN;
+    int index[ndim];
+
+    for (int t = begin; t < end; t++)
+    {
+        batchIndex(t / tiles, task->shape, task->nbatch, index);
+        int i = t % tiles / task->tilesN * GEMM_TILE_M;
+        int j = t % tiles % task->tilesN * GEMM_TILE_N;
+        int mc = task->m - i < GEMM_TILE_M ? task->m - i : GEMM_TILE_M;
+        int nc = task->n - j < GEMM_TILE_N ? task->n - j : GEMM_TILE_N;
+
+        int rsA = a->steps[ndim - 2], csA = a->steps[ndim - 1];
+        int rsB = b->steps[ndim - 2], csB = b->steps[ndim - 1];
+        int rsC = out->steps[ndim - 2], csC = out->steps[ndim - 1];
+        NDARRAY_TYPE *c = (NDARRAY_TYPE *)batchPointer(out, index, task->nbatch);
+        if (gemm(mc, nc, task->k, 1, batchPointer(a, index, task->nbatch) + (ptrdiff_t)i * rsA * dtypeSizes[a->dtype],
+                 a->dtype, rsA, csA, batchPointer(b, index, task->nbatch) + (ptrdiff_t)j * csB * dtypeSizes[b->dtype],
+                 b->dtype, rsB, csB, false, c + i * rsC + j * csC, rsC, csC))
+        {
+            atomic_store_explicit(&task->failed, 1, memory_order_relaxed);
+            return;
+        }
+    }
+}
+
+// Shape of the product of a and b, where leading dimensions are batch dimensions,
+// broadcast as in NDArray_multiply. Returns nonzero if they can't be multiplied
+static int matmulShape(struct NDArray *a, struct NDArray *b, int *shape)
+{
+    int ndim = a->ndim;
+    if (b->ndim != ndim || ndim < 2)
+    {
+        return 1;
+    }
+    if (b->shape[ndim - 2] != a->shape[ndim - 1])
+    {
+        return 1;
+    }
+    if (broadcastShape(a, b, ndim - 2, shape))
+    {
+        return 1;
+    }
+    shape[ndim - 2] = a->shape[ndim - 2];
+    shape[ndim - 1] = b->shape[ndim - 1];
+    return 0;
+}
+
+// Multiply batches [begin, end) of an m x k by k x n product that fits the small kernels
+SMALL_INLINE void smallMatmulN(int n, int m, int k, struct MatmulTask *task, int begin, int end)
+{
+    struct NDArray *a = task->a;
+    struct NDArray *b = task->b;
+    struct NDArray *out = task->out;
+    int ndim = a->ndim;
+    NDARRAY_TYPE left[SMALL_MAX * SMALL_MAX];
+    NDARRAY_TYPE right[SMALL_MAX * SMALL_MAX];
+    NDARRAY_TYPE product[SMALL_MAX * SMALL_MAX];
+    int index[ndim];
+
+    batchIndex(begin, task->shape, task->nbatch, index);
+    for (int batch = begin; batch < end; batch++)
+    {
+        smallLoad(batchPointer(a, index, task->nbatch), a->dtype, a->steps[ndim - 2], a->steps[ndim - 1], m, k, left);
+        smallLoad(batchPointer(b, index, task->nbatch), b->dtype, b->steps[ndim - 2], b->steps[ndim - 1], k, n, right);
+        for (int i = 0; i < m; i++)
+        {
+            NDARRAY_TYPE row[SMALL_MAX] = {0};
+            for (int p = 0; p < k; p++)
+            {
+                for (int j = 0; j < n; j++)
+                {
+                    row[j] += left[i * k + p] * right[p * n + j];
+                }
+            }
+            memcpy(product + i * n, row, sizeof(NDARRAY_TYPE) * n);
+        }
+        smallStore(product, m, n, batchPointer(out, index, task->nbatch), out->dtype, out->steps[ndim - 2],
+                   out->steps[ndim - 1]);
+        incBatchIndex(index, task->shape, task->nbatch);
+    }
+}
+
+// Square products, the common case, are unrolled in every dimension
+static void smallMatmulTask(void *context, int begin, int end)
+{
+    struct MatmulTask *task = (struct MatmulTask *)context;
+    int m = task->m, k = task->k;
+#define SMALL_MATMUL(N)                                  \
+    if (m == (N) && k == (N))                            \
+    {                                                    \
+        smallMatmulN(N, N, N, task, begin, end);         \
+    }                                                    \
+    else                                                 \
+    {                                                    \
+        smallMatmulN(N, m, k, task, begin, end);         \
+    }                                                    \
+    return
+    SMALL_SWITCH(task->n, SMALL_MATMUL)
+#undef SMALL_MATMUL
+}
+
+static int matmulOut(struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    int ndim = a->ndim;
+    int shape[ndim > 2 ? ndim : 2];
+    if (matmulShape(a, b, shape))
+    {
+        return 1;
+    }
+    if (checkOutput(out, shape, ndim) || out->dtype != NATIVE_DTYPE)
+    {
+        return 2;
+    }
+    if (shapeSize(shape, ndim) == 0)
+    {
+        return 0;
+    }
+
+    struct MatmulTask task;
+    task.a = a;
+    task.b = b;
+    task.out = out;
+    task.shape = shape;
+    task.nbatch = ndim - 2;
+    task.m = shape[ndim - 2];
+    task.n = shape[ndim - 1];
+    task.k = a->shape[ndim - 1];
+    task.tilesM = (task.m + GEMM_TILE_M - 1) / GEMM_TILE_M;
+    task.tilesN = (task.n + GEMM_TILE_N - 1) / GEMM_TILE_N;
+    atomic_init(&task.failed, 0);
+
+    // Small products skip the tiles and GEMM's packing, taking one task per matrix
+    if (task.m > 0 && task.n > 0 && task.m <= SMALL_MAX && task.n <= SMALL_MAX && task.k <= SMALL_MAX)
+    {
+        int64_t work = (int64_t)task.m * task.n * (task.k > 0 ? task.k : 1);
+        parallelFor(shapeSize(shape, ndim - 2), (int)(PARALLEL_GEMM_GRAIN / work), smallMatmulTask, &task);
+        return 0;
+    }
+
+    int tileM = task.m < GEMM_TILE_M ? task.m : GEMM_TILE_M;
+    int tileN = task.n < GEMM_TILE_N ? task.n : GEMM_TILE_N;
+    int64_t tileWork = (int64_t)tileM * tileN * (task.k > 0 ? task.k : 1);
+    int grain = tileWork >= PARALLEL_GEMM_GRAIN ? 1 : (int)(PARALLEL_GEMM_GRAIN / tileWork);
+    parallelFor(shapeSize(shape, ndim - 2) * task.tilesM * task.tilesN, grain, matmulTask, &task);
+    return atomic_load(&task.failed);
+}
+
+int NDArray_matmul_out(struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = matmulOut(a, b, out);
+    statsEnd(NDARRAY_STAT_MATMUL, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_matmul(struct NDArray *a, struct NDArray *b)
+{
+    int ndim = a->ndim;
+    int shape[ndim > 2 ? ndim : 2];
+    if (matmulShape(a, b, shape))
+    {
+        return 0;
+    }
+
+    // matmulOut writes every element, so the output is left uninitialised
+    struct NDArray *output = arrayAllocate(shape, ndim, shapeSize(shape, ndim), NATIVE_DTYPE);
+    if (output != 0 && NDArray_matmul_out(a, b, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+// Contractions name each axis with a letter, numbered 0-25 for A-Z and 26-51 for a-z
+#define EINSUM_LABELS 52
+#define EINSUM_MAX_OPERANDS 32
+// Up to this many operands every contraction order is tried, which takes 3^count steps. Past
+// it the cheapest pair is contracted first
+#define EINSUM_OPTIMAL_MAX 8
+
+// An operand or intermediate result of a contraction, with the label of each of its axes
+struct EinsumTerm
+{
+    struct NDArray *array;
+    int labels[EINSUM_LABELS];
+    uint64_t labelMask;
+    // The operands that went into it, one bit each
+    uint64_t operands;
+};
+
+// Label number of a subscript letter, or -1
+static int einsumLabel(char c)
+{
+    if (c >= 'A' && c <= 'Z')
+    {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 26;
+    }
+    return -1;
+}
+
+// Split subscripts into the labels of each operand, one after another, and of the output.
+// Without "->" the output has the labels used once, in alphabetical order. Returns the
+// output's ndim, or -1 if subscripts don't fit the operands
+static int einsumParse(const char *subscripts, int count, struct NDArray **operands, int *labels, int *output)
+{
+    int uses[EINSUM_LABELS] = {0};
+    int operand = 0;
+    int axis = 0;
+    const char *c = subscripts;
+    for (; *c != 0 && !(c[0] == '-' && c[1] == '>'); c++)
+    {
+        if (*c == ' ')
+        {
+            continue;
+        }
+        if (*c == ',')
+        {
+            if (operand >= count || axis != operands[operand]->ndim)
+            {
+                return -1;
+            }
+            operand++;
+            axis = 0;
+            continue;
+        }
+        int label = einsumLabel(*c);
+        if (label < 0 || operand >= count || axis >= operands[operand]->ndim)
+        {
+            return -1;
+        }
+        *labels++ = label;
+        uses[label]++;
+        axis++;
+    }
+    if (operand != count - 1 || axis != operands[operand]->ndim)
+    {
+        return -1;
+    }
+
+    int outNDim = 0;
+    if (*c == 0)
+    {
+        for (int label = 0; label < EINSUM_LABELS; label++)
+        {
+            if (uses[label] == 1)
+            {
+                output[outNDim++] = label;
+            }
+        }
+        return outNDim;
+    }
+    bool seen[EINSUM_LABELS] = {false};
+    for (c += 2; *c != 0; c++)
+    {
+        if (*c == ' ')
+        {
+            continue;
+        }
+        int label = einsumLabel(*c);
+        if (label < 0 || uses[label] == 0 || seen[label])
+        {
+            return -1;
+        }
+        seen[label] = true;
+        output[outNDim++] = label;
+    }
+    return outNDim;
+}
+
+// Size of each label, checking that the axes sharing one agree, and the output's shape
+static int contractShape(int count, struct NDArray **operands, const int *labels, const int *output, int outNDim,
+                         int *sizes, int *shape)
+{
+    for (int label = 0; label < EINSUM_LABELS; label++)
+    {
+        sizes[label] = -1;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        for (int axis = 0; axis < operands[i]->ndim; axis++, labels++)
+        {
+            if (sizes[*labels] >= 0 && sizes[*labels] != operands[i]->shape[axis])
+            {
+                return 1;
+            }
+            sizes[*labels] = operands[i]->shape[axis];
+        }
+    }
+    for (int i = 0; i < outNDim; i++)
+    {
+        shape[i] = sizes[output[i]];
+    }
+    return 0;
+}
+
+// Merge each run of counts[g] axes into one axis g, if their steps allow it. Size 1 axes
+// merge with anything
+static bool einsumMerge(const int *shape, const int *steps, const int *counts, int ngroups, int *groupShape,
+                        int *groupSteps)
+{
+    for (int g = 0, axis = 0; g < ngroups; axis += counts[g], g++)
+    {
+        bool first = true;
+        groupShape[g] = 1;
+        groupSteps[g] = 0;
+        for (int i = axis + counts[g] - 1; i >= axis; i--)
+        {
+            if (shape[i] == 1)
+            {
+                continue;
+            }
+            if (first)
+            {
+                groupSteps[g] = steps[i];
+                first = false;
+            }
+            else if (steps[i] != groupSteps[g] * groupShape[g])
+            {
+                return false;
+            }
+            groupShape[g] *= shape[i];
+        }
+    }
+    return true;
+}
+
+// A view of array with its axes taken in the order of axes, then merged into ngroups axes of
+// counts[g] axes each. Copies the data when a group can't be merged in place, or gives 0
+// instead if copy is false
+static struct NDArray *einsumGroup(struct NDArray *array, const int *axes, const int *counts, int ngroups, bool copy)
+{
+    int ndim = array->ndim;
+    int shape[ndim > 0 ? ndim : 1];
+    int steps[ndim > 0 ? ndim : 1];
+    for (int i = 0; i < ndim; i++)
+    {
+        shape[i] = array->shape[axes[i]];
+        steps[i] = array->steps[axes[i]];
+    }
+    int groupShape[ngroups];
+    int groupSteps[ngroups];
+    if (einsumMerge(shape, steps, counts, ngroups, groupShape, groupSteps))
+    {
+        return arrayView(array, groupShape, groupSteps, ngroups);
+    }
+    if (!copy)
+    {
+        return 0;
+    }
+
+    struct NDArray *permuted = arrayView(array, shape, steps, ndim);
+    if (permuted == 0 || makeContiguous(permuted))
+    {
+        NDArray_free(permuted);
+        return 0;
+    }
+    einsumMerge(permuted->shape, permuted->steps, counts, ngroups, groupShape, groupSteps);
+    struct NDArray *group = arrayView(permuted, groupShape, groupSteps, ngroups);
+    NDArray_free(permuted);
+    return group;
+}
+
+// Turn operand into a term: repeated labels become a diagonal view, then labels that aren't
+// shared with another operand or the output are summed out. Returns nonzero if an allocation
+// fails, leaving whatever array the term has for the caller to free
+static int einsumPrepare(struct NDArray *operand, const int *labels, uint64_t shared, int index,
+                          struct EinsumTerm *term)
+{
+    int axisOf[EINSUM_LABELS];
+    int shape[EINSUM_LABELS];
+    int steps[EINSUM_LABELS];
+    int ndim = 0;
+    for (int label = 0; label < EINSUM_LABELS; label++)
+    {
+        axisOf[label] = -1;
+    }
+    for (int axis = 0; axis < operand->ndim; axis++)
+    {
+        int label = labels[axis];
+        if (axisOf[label] >= 0)
+        {
+            steps[axisOf[label]] += operand->steps[axis];
+            continue;
+        }
+        axisOf[label] = ndim;
+        term->labels[ndim] = label;
+        shape[ndim] = operand->shape[axis];
+        steps[ndim] = operand->steps[axis];
+        ndim++;
+    }
+    term->array = arrayView(operand, shape, steps, ndim);
+    term->operands = (uint64_t)1 << index;
+    if (term->array == 0)
+    {
+        return 1;
+    }
+
+    int axes[EINSUM_LABELS];
+    int naxes = 0;
+    int kept = 0;
+    term->labelMask = 0;
+    for (int axis = 0; axis < ndim; axis++)
+    {
+        int label = term->labels[axis];
+        if (shared & ((uint64_t)1 << label))
+        {
+            shape[kept] = shape[axis];
+            term->labels[kept++] = label;
+            term->labelMask |= (uint64_t)1 << label;
+        }
+        else
+        {
+            axes[naxes++] = axis;
+        }
+    }
+    if (naxes > 0)
+    {
+        struct NDArray *sum = NDArray_zeros(shape, kept);
+        if (sum == 0 || NDArray_reduce_out(NDARRAY_SUM, term->array, axes, naxes, 0, sum))
+        {
+            NDArray_free(sum);
+            return 1;
+        }
+        NDArray_free(term->array);
+        term->array = sum;
+    }
+    return 0;
+}
+
+// Elements in an array with the labels in mask
+static double einsumSize(uint64_t mask, const int *sizes)
+{
+    double size = 1;
+    for (int label = 0; label < EINSUM_LABELS; label++)
+    {
+        if (mask & ((uint64_t)1 << label))
+        {
+            size *= sizes[label];
+        }
+    }
+    return size;
+}
+
+// Labels left on the result of contracting the operands in set: those still needed by the
+// operands outside it or by the output
+static uint64_t einsumKeep(const struct EinsumTerm *terms, int count, uint64_t set, uint64_t outputMask)
+{
+    uint64_t inside = 0;
+    uint64_t outside = outputMask;
+    for (int i = 0; i < count; i++)
+    {
+        if (set & ((uint64_t)1 << i))
+        {
+            inside |= terms[i].labelMask;
+        }
+        else
+        {
+            outside |= terms[i].labelMask;
+        }
+    }
+    return inside & outside;
+}
+
+// Record the pairs that contract set as split divides it, children first. Returns the term
+// holding the result
+static int einsumEmit(int set, const int *split, int count, int *steps, int *nsteps)
+{
+    if ((set & (set - 1)) == 0)
+    {
+        int index = 0;
+        while (!(set & (1 << index)))
+        {
+            index++;
+        }
+        return index;
+    }
+    int left = einsumEmit(split[set], split, count, steps, nsteps);
+    int right = einsumEmit(set ^ split[set], split, count, steps, nsteps);
+    steps[2 * *nsteps] = left;
+    steps[2 * *nsteps + 1] = right;
+    return count + (*nsteps)++;
+}
+
+// The order to contract the terms in, as count - 1 pairs of term numbers in steps. The result
+// of pair s becomes term count + s. The cost of a pair is its multiply-adds, the product of
+// the sizes of every label either side has left
+static void einsumOrder(const struct EinsumTerm *terms, int count, uint64_t outputMask, const int *sizes, int *steps)
+{
+    if (count <= EINSUM_OPTIMAL_MAX)
+    {
+        // Cheapest way to contract each subset, built up from smaller subsets
+        int full = (1 << count) - 1;
+        uint64_t keep[1 << EINSUM_OPTIMAL_MAX];
+        double cost[1 << EINSUM_OPTIMAL_MAX];
+        int split[1 << EINSUM_OPTIMAL_MAX];
+        for (int set = 1; set <= full; set++)
+        {
+            keep[set] = einsumKeep(terms, count, set, outputMask);
+            cost[set] = 0;
+            if ((set & (set - 1)) == 0)
+            {
+                continue;
+            }
+            // Splits that keep the lowest operand on the left, so each is tried once
+            int low = set & -set;
+            cost[set] = INFINITY;
+            for (int left = (set - 1) & set; left > 0; left = (left - 1) & set)
+            {
+                int right = set ^ left;
+                if (!(left & low))
+                {
+                    continue;
+                }
+                double total = cost[left] + cost[right] + einsumSize(keep[left] | keep[right], sizes);
+                if (total < cost[set])
+                {
+                    cost[set] = total;
+                    split[set] = left;
+                }
+            }
+        }
+        int nsteps = 0;
+        einsumEmit(full, split, count, steps, &nsteps);
+        return;
+    }
+
+    int active[EINSUM_MAX_OPERANDS];
+    uint64_t sets[EINSUM_MAX_OPERANDS];
+    uint64_t keep[EINSUM_MAX_OPERANDS];
+    for (int i = 0; i < count; i++)
+    {
+        active[i] = i;
+        sets[i] = (uint64_t)1 << i;
+        keep[i] = einsumKeep(terms, count, sets[i], outputMask);
+    }
+    for (int step = 0, n = count; n > 1; step++, n--)
+    {
+        int bestLeft = 0;
+        int bestRight = 1;
+        double best = INFINITY;
+        for (int left = 0; left < n; left++)
+        {
+            for (int right = left + 1; right < n; right++)
+            {
+                double cost = einsumSize(keep[left] | keep[right], sizes);
+                if (cost < best)
+                {
+                    best = cost;
+                    bestLeft = left;
+                    bestRight = right;
+                }
+            }
+        }
+        steps[2 * step] = active[bestLeft];
+        steps[2 * step + 1] = active[bestRight];
+        active[bestLeft] = count + step;
+        sets[bestLeft] |= sets[bestRight];
+        keep[bestLeft] = einsumKeep(terms, count, sets[bestLeft], outputMask);
+        active[bestRight] = active[n - 1];
+        sets[bestRight] = sets[n - 1];
+        keep[bestRight] = keep[n - 1];
+    }
+}
+
+// Sort labels by their rank, keeping the order of equal ones
+static void einsumSortLabels(int *labels, int n, const int *rank)
+{
+    for (int i = 1; i < n; i++)
+    {
+        int label = labels[i];
+        int j = i;
+        for (; j > 0 && rank[labels[j - 1]] > rank[label]; j--)
+        {
+            labels[j] = labels[j - 1];
+        }
+        labels[j] = label;
+    }
+}
+
+// Split the labels of a pair into batch labels, shared and kept, those only a has and those
+// only b has, in that order in labels with their counts in counts. Labels shared and not kept
+// go in contracted
+static int einsumClassify(const struct EinsumTerm *a, const struct EinsumTerm *b, uint64_t keep, const int *rank,
+                          int *labels, int *counts, int *contracted)
+{
+    int batch[EINSUM_LABELS];
+    int left[EINSUM_LABELS];
+    int right[EINSUM_LABELS];
+    int ncontracted = 0;
+    counts[0] = counts[1] = counts[2] = 0;
+    for (int axis = 0; axis < a->array->ndim; axis++)
+    {
+        int label = a->labels[axis];
+        if (!(b->labelMask & ((uint64_t)1 << label)))
+        {
+            left[counts[1]++] = label;
+        }
+        else if (keep & ((uint64_t)1 << label))
+        {
+            batch[counts[0]++] = label;
+        }
+        else
+        {
+            contracted[ncontracted++] = label;
+        }
+    }
+    for (int axis = 0; axis < b->array->ndim; axis++)
+    {
+        int label = b->labels[axis];
+        if (!(a->labelMask & ((uint64_t)1 << label)))
+        {
+            right[counts[2]++] = label;
+        }
+    }
+    einsumSortLabels(batch, counts[0], rank);
+    einsumSortLabels(left, counts[1], rank);
+    einsumSortLabels(right, counts[2], rank);
+    memcpy(labels, batch, counts[0] * sizeof(int));
+    memcpy(labels + counts[0], left, counts[1] * sizeof(int));
+    memcpy(labels + counts[0] + counts[1], right, counts[2] * sizeof(int));
+    return ncontracted;
+}
+
+// Axes of term in the order of labels
+static void einsumAxes(const struct EinsumTerm *term, const int *labels, int n, int *axes)
+{
+    for (int i = 0; i < n; i++)
+    {
+        axes[i] = 0;
+        while (term->labels[axes[i]] != labels[i])
+        {
+            axes[i]++;
+        }
+    }
+}
+
+// Contract a pair of terms into result, keeping the labels in keep, as one batched matmul of a
+// (batch, left, contracted) view of a and a (batch, contracted, right) view of b. Without
+// contracted labels it's an element-wise product instead. The result is written straight into
+// out when out is native and its labels, given by output, come out in the same order. Returns
+// nonzero, with no result array, if an allocation fails
+static int einsumPair(const struct EinsumTerm *a, const struct EinsumTerm *b, uint64_t keep, const int *rank,
+                       const int *sizes, struct NDArray *out, const int *output, int outNDim,
+                       struct EinsumTerm *result)
+{
+    int counts[3];
+    int contracted[EINSUM_LABELS];
+    int ncontracted = einsumClassify(a, b, keep, rank, result->labels, counts, contracted);
+    int ndim = counts[0] + counts[1] + counts[2];
+    bool direct = out != 0 && out->dtype == NATIVE_DTYPE && ndim == outNDim;
+    if (direct && memcmp(result->labels, output, ndim * sizeof(int)) != 0)
+    {
+        // Swapping the pair swaps the left and right labels, which may match out instead
+        einsumClassify(b, a, keep, rank, result->labels, counts, contracted);
+        direct = memcmp(result->labels, output, ndim * sizeof(int)) == 0;
+        if (direct)
+        {
+            const struct EinsumTerm *swap = a;
+            a = b;
+            b = swap;
+        }
+        else
+        {
+            einsumClassify(a, b, keep, rank, result->labels, counts, contracted);
+        }
+    }
+
+    int order[EINSUM_LABELS];
+    int axes[EINSUM_LABELS];
+    memcpy(order, result->labels, (counts[0] + counts[1]) * sizeof(int));
+    memcpy(order + counts[0] + counts[1], contracted, ncontracted * sizeof(int));
+    einsumAxes(a, order, a->array->ndim, axes);
+    int countsA[] = {counts[0], counts[1], ncontracted};
+    struct NDArray *left = einsumGroup(a->array, axes, countsA, 3, true);
+
+    memcpy(order + counts[0], contracted, ncontracted * sizeof(int));
+    memcpy(order + counts[0] + ncontracted, result->labels + counts[0] + counts[1], counts[2] * sizeof(int));
+    einsumAxes(b, order, b->array->ndim, axes);
+    int countsB[] = {counts[0], ncontracted, counts[2]};
+    struct NDArray *right = einsumGroup(b->array, axes, countsB, 3, true);
+
+    int shape[EINSUM_LABELS];
+    result->labelMask = 0;
+    for (int i = 0; i < ndim; i++)
+    {
+        axes[i] = i;
+        shape[i] = sizes[result->labels[i]];
+        result->labelMask |= (uint64_t)1 << result->labels[i];
+    }
+    result->operands = a->operands | b->operands;
+    struct NDArray *product = direct ? einsumGroup(out, axes, counts, 3, false) : 0;
+    result->array = product != 0 ? out : NDArray_zeros(shape, ndim);
+    if (product == 0 && result->array != 0)
+    {
+        product = einsumGroup(result->array, axes, counts, 3, true);
+    }
+
+    int status = 1;
+    if (left == 0 || right == 0 || product == 0)
+    {
+        // Reported below
+    }
+    else if (left->shape[2] == 0)
+    {
+        status = fillArray(product, 0);
+    }
+    else if (ncontracted == 0)
+    {
+        status = NDArray_multiply_out(left, right, product);
+    }
+    else
+    {
+        status = NDArray_matmul_out(left, right, product);
+    }
+    NDArray_free(left);
+    NDArray_free(right);
+    NDArray_free(product);
+    if (status != 0)
+    {
+        if (result->array != out)
+        {
+            NDArray_free(result->array);
+        }
+        result->array = 0;
+    }
+    return status != 0;
+}
+
+// Free the arrays of the first count terms, after a failed contraction
+static void einsumFree(struct EinsumTerm *terms, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        NDArray_free(terms[i].array);
+    }
+}
+
+static int contractOut(int count, struct NDArray **operands, const int *labels, const int *output, int outNDim,
+                       struct NDArray *out)
+{
+    int sizes[EINSUM_LABELS];
+    int shape[EINSUM_LABELS];
+    if (count < 1 || count > EINSUM_MAX_OPERANDS ||
+        contractShape(count, operands, labels, output, outNDim, sizes, shape))
+    {
+        return 1;
+    }
+    if (checkOutput(out, shape, outNDim))
+    {
+        return 2;
+    }
+
+    // Labels in the output rank by their position there, ahead of the rest
+    int rank[EINSUM_LABELS];
+    uint64_t outputMask = 0;
+    for (int label = 0; label < EINSUM_LABELS; label++)
+    {
+        rank[label] = EINSUM_LABELS;
+    }
+    for (int i = 0; i < outNDim; i++)
+    {
+        rank[output[i]] = i;
+        outputMask |= (uint64_t)1 << output[i];
+    }
+
+    // Labels in the output or in more than one operand are the only ones that can't be summed
+    // out of an operand up front
+    uint64_t seen = 0;
+    uint64_t shared = outputMask;
+    const int *operandLabels = labels;
+    for (int i = 0; i < count; i++)
+    {
+        uint64_t mask = 0;
+        for (int axis = 0; axis < operands[i]->ndim; axis++)
+        {
+            mask |= (uint64_t)1 << operandLabels[axis];
+        }
+        shared |= seen & mask;
+        seen |= mask;
+        operandLabels += operands[i]->ndim;
+    }
+
+    struct EinsumTerm terms[2 * EINSUM_MAX_OPERANDS];
+    for (int i = 0; i < count; i++)
+    {
+        if (einsumPrepare(operands[i], labels, shared, i, &terms[i]))
+        {
+            einsumFree(terms, i + 1);
+            return 1;
+        }
+        labels += operands[i]->ndim;
+    }
+    int steps[2 * EINSUM_MAX_OPERANDS];
+    einsumOrder(terms, count, outputMask, sizes, steps);
+    for (int step = 0; step < count - 1; step++)
+    {
+        struct EinsumTerm *a = &terms[steps[2 * step]];
+        struct EinsumTerm *b = &terms[steps[2 * step + 1]];
+        bool last = step == count - 2;
+        uint64_t keep = last ? outputMask : einsumKeep(terms, count, a->operands | b->operands, outputMask);
+        int failed = einsumPair(a, b, keep, rank, sizes, last ? out : 0, output, outNDim, &terms[count + step]);
+        NDArray_free(a->array);
+        NDArray_free(b->array);
+        a->array = 0;
+        b->array = 0;
+        if (failed)
+        {
+            einsumFree(terms, count + step + 1);
+            return 1;
+        }
+    }
+
+    // Unless the last pair went straight into out, copy the result over in the output's order
+    struct NDArray *result = terms[count > 1 ? 2 * count - 2 : 0].array;
+    if (result != out)
+    {
+        int steps[EINSUM_LABELS];
+        int axes[EINSUM_LABELS];
+        einsumAxes(&terms[count > 1 ? 2 * count - 2 : 0], output, outNDim, axes);
+        for (int i = 0; i < outNDim; i++)
+        {
+            steps[i] = result->steps[axes[i]];
+        }
+        struct NDArray *view = arrayView(result, shape, steps, outNDim);
+        int status = view != 0 ? NDArray_astype_out(view, out) : 1;
+        NDArray_free(view);
+        NDArray_free(result);
+        return status != 0;
+    }
+    return 0;
+}
+
+// Shape of the result of einsum, returning its ndim, or -1 if the arguments are invalid
+static int einsumShape(const char *subscripts, int count, struct NDArray **operands, int *labels, int *output,
+                       int *shape)
+{
+    int sizes[EINSUM_LABELS];
+    int outNDim = einsumParse(subscripts, count, operands, labels, output);
+    if (outNDim < 0 || contractShape(count, operands, labels, output, outNDim, sizes, shape))
+    {
+        return -1;
+    }
+    return outNDim;
+}
+
+// Total axes of the operands, for sizing the label array
+static int operandAxes(int count, struct NDArray **operands)
+{
+    int total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        total += operands[i]->ndim;
+    }
+    return total > 0 ? total : 1;
+}
+
+int NDArray_einsum_out(const char *subscripts, int count, struct NDArray **operands, struct NDArray *out)
+{
+    if (count < 1 || count > EINSUM_MAX_OPERANDS)
+    {
+        return 1;
+    }
+    uint64_t start = statsBegin();
+    int labels[operandAxes(count, operands)];
+    int output[EINSUM_LABELS];
+    int outNDim = einsumParse(subscripts, count, operands, labels, output);
+    int status = outNDim < 0 ? 1 : contractOut(count, operands, labels, output, outNDim, out);
+    statsEnd(NDARRAY_STAT_EINSUM, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_einsum(const char *subscripts, int count, struct NDArray **operands)
+{
+    if (count < 1 || count > EINSUM_MAX_OPERANDS)
+    {
+        return 0;
+    }
+    int labels[operandAxes(count, operands)];
+    int output[EINSUM_LABELS];
+    int shape[EINSUM_LABELS];
+    int outNDim = einsumShape(subscripts, count, operands, labels, output, shape);
+    if (outNDim < 0)
+    {
+        return 0;
+    }
+
+    struct NDArray *result = NDArray_zeros(shape, outNDim);
+    if (result != 0 && NDArray_einsum_out(subscripts, count, operands, result))
+    {
+        NDArray_free(result);
+        return 0;
+    }
+    return result;
+}
+
+// Labels for tensordot: paired axes share one, and the output has a's free axes, then b's.
+// Returns the output's ndim, or -1 if the axes are invalid
+static int tensordotLabels(struct NDArray *a, struct NDArray *b, int *axesA, int *axesB, int naxes, int *labels,
+                           int *output)
+{
+    if (naxes < 0 || naxes > a->ndim || naxes > b->ndim || a->ndim + b->ndim - naxes > EINSUM_LABELS)
+    {
+        return -1;
+    }
+    bool paired[a->ndim > 0 ? a->ndim : 1];
+    for (int axis = 0; axis < a->ndim; axis++)
+    {
+        labels[axis] = axis;
+        paired[axis] = false;
+    }
+    int *labelsB = labels + a->ndim;
+    for (int axis = 0; axis < b->ndim; axis++)
+    {
+        labelsB[axis] = -1;
+    }
+    for (int i = 0; i < naxes; i++)
+    {
+        int axisA = validateAxis(axesA[i], a->ndim);
+        int axisB = validateAxis(axesB[i], b->ndim);
+        if (axisA < 0 || axisB < 0 || paired[axisA] || labelsB[axisB] >= 0)
+        {
+            return -1;
+        }
+        paired[axisA] = true;
+        labelsB[axisB] = axisA;
+    }
+
+    int outNDim = 0;
+    for (int axis = 0; axis < a->ndim; axis++)
+    {
+        if (!paired[axis])
+        {
+            output[outNDim++] = axis;
+        }
+    }
+    for (int axis = 0, next = a->ndim; axis < b->ndim; axis++)
+    {
+        if (labelsB[axis] < 0)
+        {
+            labelsB[axis] = next++;
+            output[outNDim++] = labelsB[axis];
+        }
+    }
+    return outNDim;
+}
+
+int NDArray_tensordot_out(struct NDArray *a, struct NDArray *b, int *axesA, int *axesB, int naxes, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    struct NDArray *operands[] = {a, b};
+    int labels[operandAxes(2, operands)];
+    int output[EINSUM_LABELS];
+    int outNDim = tensordotLabels(a, b, axesA, axesB, naxes, labels, output);
+    int status = outNDim < 0 ? 1 : contractOut(2, operands, labels, output, outNDim, out);
+    statsEnd(NDARRAY_STAT_EINSUM, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_tensordot(struct NDArray *a, struct NDArray *b, int *axesA, int *axesB, int naxes)
+{
+    struct NDArray *operands[] = {a, b};
+    int labels[operandAxes(2, operands)];
+    int output[EINSUM_LABELS];
+    int sizes[EINSUM_LABELS];
+    int shape[EINSUM_LABELS];
+    int outNDim = tensordotLabels(a, b, axesA, axesB, naxes, labels, output);
+    if (outNDim < 0 || contractShape(2, operands, labels, output, outNDim, sizes, shape))
+    {
+        return 0;
+    }
+
+    struct NDArray *result = NDArray_zeros(shape, outNDim);
+    if (result != 0 && NDArray_tensordot_out(a, b, axesA, axesB, naxes, result))
+    {
+        NDArray_free(result);
+        return 0;
+    }
+    return result;
+}
+
+// Columns per panel in the blocked LU factorization. Panels are factored with
+// rank-1 updates and the trailing matrix is updated with a single GEMM per panel
+#define LU_BLOCK 32
+
+// In place LU factorization with partial pivoting of a contiguous n x n matrix, such
+// that P * A = L * U. L has an implicit unit diagonal. Row i was swapped with row
+// pivots[i] at step i. Returns 1 if a zero pivot was found, and -1 if the trailing updates
+// couldn't get their scratch buffers
+static int luFactor(NDARRAY_TYPE *a, int n, int *pivots)
+{
+    int singular = 0;
+    for (int j0 = 0; j0 < n; j0 += LU_BLOCK)
+    {
+        int jb = n - j0 < LU_BLOCK ? n - j0 : LU_BLOCK;
+
+        // Factor the panel a[j0:, j0:j0 + jb], swapping whole rows
+        for (int j = j0; j < j0 + jb; j++)
+        {
+            int p = j;
+            NDARRAY_TYPE max = a[j * n + j] < 0 ? -a[j * n + j] : a[j * n + j];
+            for (int i = j + 1; i < n; i++)
+            {
+                NDARRAY_TYPE value = a[i * n + j] < 0 ? -a[i * n + j] : a[i * n + j];
+                if (value > max)
+                {
+                    max = value;
+                    p = i;
+                }
+            }
+            pivots[j] = p;
+            if (p != j)
+            {
+                for (int jj = 0; jj < n; jj++)
+                {
+                    NDARRAY_TYPE temp = a[j * n + jj];
+                    a[j * n + jj] = a[p * n + jj];
+                    a[p * n + jj] = temp;
+                }
+            }
+            if (max == 0)
+            {
+                singular = 1;
+                continue;
+            }
+
+            NDARRAY_TYPE x = 1 / a[j * n + j];
+            for (int i = j + 1; i < n; i++)
+            {
+                NDARRAY_TYPE l = a[i * n + j] *= x;
+                for (int jj = j + 1; jj < j0 + jb; jj++)
+                {
+                    a[i * n + jj] -= l * a[j * n + jj];
+                }
+            }
+        }
+
+        int rest = n - j0 - jb;
+        if (rest == 0)
+        {
+            break;
+        }
+
+        // U12 = L11^-1 * A12
+        for (int i = j0 + 1; i < j0 + jb; i++)
+        {
+            for (int p = j0; p < i; p++)
+            {
+                NDARRAY_TYPE l = a[i * n + p];
+                for (int jj = j0 + jb; jj < n; jj++)
+                {
+                    a[i * n + jj] -= l * a[p * n + jj];
+                }
+            }
+        }
+
+        // A22 -= L21 * U12
+        if (gemm(rest, rest, jb, -1, a + (j0 + jb) * n + j0, NATIVE_DTYPE, n, 1, a + j0 * n + j0 + jb, NATIVE_DTYPE,
+                 n, 1, true, a + (j0 + jb) * n + j0 + jb, n, 1))
+        {
+            return -1;
+        }
+    }
+    return singular;
+}
+
+// Overwrite the contiguous n x k matrix x with A^-1 * x, given the factors from luFactor
+static void luSolveInPlace(const NDARRAY_TYPE *lu, const int *pivots, int n, NDARRAY_TYPE *x, int k)
+{
+    for (int i = 0; i < n; i++)
+    {
+        if (pivots[i] != i)
+        {
+            for (int j = 0; j < k; j++)
+            {
+                NDARRAY_TYPE temp = x[i * k + j];
+                x[i * k + j] = x[pivots[i] * k + j];
+                x[pivots[i] * k + j] = temp;
+            }
+        }
+    }
+
+    // Forward substitution with the unit lower triangle
+    for (int i = 1; i < n; i++)
+    {
+        for (int p = 0; p < i; p++)
+        {
+            NDARRAY_TYPE l = lu[i * n + p];
+            for (int j = 0; j < k; j++)
+            {
+                x[i * k + j] -= l * x[p * k + j];
+            }
+        }
+    }
+
+    // Back substitution with the upper triangle
+    for (int i = n - 1; i >= 0; i--)
+    {
+        for (int p = i + 1; p < n; p++)
+        {
+            NDARRAY_TYPE u = lu[i * n + p];
+            for (int j = 0; j < k; j++)
+            {
+                x[i * k + j] -= u * x[p * k + j];
+            }
+        }
+        NDARRAY_TYPE d = 1 / lu[i * n + i];
+        for (int j = 0; j < k; j++)
+        {
+            x[i * k + j] *= d;
+        }
+    }
+}
+
+static struct NDArrayLU *luNew(struct NDArray *array)
+{
+    int ndim = array->ndim;
+    if (ndim < 2)
+    {
+        return 0;
+    }
+    int n = array->shape[ndim - 1];
+    if (array->shape[ndim - 2] != n)
+    {
+        return 0;
+    }
+
+    struct NDArrayLU *output = (struct NDArrayLU *)ndMalloc(sizeof(struct NDArrayLU));
+    if (output == 0)
+    {
+        return 0;
+    }
+    output->lu = NDArray_zeros(array->shape, ndim);
+    int batchCount = shapeSize(array->shape, ndim - 2);
+    output->pivots = (int *)ndMalloc(sizeof(int) * (batchCount * n > 0 ? batchCount * n : 1));
+    output->singular = 0;
+    if (output->lu == 0 || output->pivots == 0)
+    {
+        NDArray_luFree(output);
+        return 0;
+    }
+
+    int index[ndim];
+    memset(index, 0, ndim * sizeof(int));
+    for (int batch = 0; batch < batchCount; batch++)
+    {
+        NDARRAY_TYPE *lu = output->lu->data + batch * n * n;
+        copyMatrix(batchPointer(array, index, ndim - 2), array->dtype, array->steps[ndim - 2], array->steps[ndim - 1], n, n, lu);
+        int status = luFactor(lu, n, output->pivots + batch * n);
+        if (status < 0)
+        {
+            NDArray_luFree(output);
+            return 0;
+        }
+        output->singular |= status;
+        incBatchIndex(index, array->shape, ndim - 2);
+    }
+
+    return output;
+}
+
+struct NDArrayLU *NDArray_lu(struct NDArray *array)
+{
+    uint64_t start = statsBegin();
+    struct NDArrayLU *lu = luNew(array);
+    statsEnd(NDARRAY_STAT_LU, start, 0);
+    return lu;
+}
+
+// Shape of the solution of a * x = b, for (..., n, n) a and (..., n, k) b with
+// broadcast batch dimensions. Returns nonzero if they don't fit
+static int solveShape(struct NDArray *a, struct NDArray *b, int *shape)
+{
+    int ndim = a->ndim;
+    if (b->ndim != ndim || ndim < 2)
+    {
+        return 1;
+    }
+    int n = a->shape[ndim - 1];
+    if (a->shape[ndim - 2] != n || b->shape[ndim - 2] != n)
+    {
+        return 1;
+    }
+    if (broadcastShape(a, b, ndim - 2, shape))
+    {
+        return 1;
+    }
+    shape[ndim - 2] = n;
+    shape[ndim - 1] = b->shape[ndim - 1];
+    return 0;
+}
+
+static int luSolveOut(struct NDArrayLU *lu, struct NDArray *b, struct NDArray *out)
+{
+    int ndim = lu->lu->ndim;
+    int shape[ndim];
+    if (solveShape(lu->lu, b, shape))
+    {
+        return 1;
+    }
+    if (checkOutput(out, shape, ndim))
+    {
+        return 2;
+    }
+    if (lu->singular)
+    {
+        return 3;
+    }
+
+    int n = shape[ndim - 2];
+    int k = shape[ndim - 1];
+    int batchCount = shapeSize(shape, ndim - 2);
+    NDARRAY_TYPE *x = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_LINALG, sizeof(NDARRAY_TYPE) * n * k);
+    if (x == 0)
+    {
+        return 1;
+    }
+
+    int index[ndim];
+    memset(index, 0, ndim * sizeof(int));
+    for (int batch = 0; batch < batchCount; batch++)
+    {
+        // Factors are contiguous, so the batch offset doubles as the pivot offset
+        NDARRAY_TYPE *factor = (NDARRAY_TYPE *)batchPointer(lu->lu, index, ndim - 2);
+        copyMatrix(batchPointer(b, index, ndim - 2), b->dtype, b->steps[ndim - 2], b->steps[ndim - 1], n, k, x);
+        luSolveInPlace(factor, lu->pivots + (factor - lu->lu->data) / (n > 0 ? n : 1), n, x, k);
+        storeMatrix(x, n, k, batchPointer(out, index, ndim - 2), out->dtype, out->steps[ndim - 2], out->steps[ndim - 1]);
+        incBatchIndex(index, shape, ndim - 2);
+    }
+    return 0;
+}
+
+int NDArray_luSolve_out(struct NDArrayLU *lu, struct NDArray *b, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = luSolveOut(lu, b, out);
+    statsEnd(NDARRAY_STAT_LU_SOLVE, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_luSolve(struct NDArrayLU *lu, struct NDArray *b)
+{
+    int ndim = lu->lu->ndim;
+    int shape[ndim];
+    if (lu->singular || solveShape(lu->lu, b, shape))
+    {
+        return 0;
+    }
+
+    struct NDArray *output = NDArray_zeros(shape, ndim);
+    if (output != 0 && NDArray_luSolve_out(lu, b, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+void NDArray_luFree(struct NDArrayLU *lu)
+{
+    if (lu != 0)
+    {
+        NDArray_free(lu->lu);
+        ndFree(lu->pivots);
+        ndFree(lu);
+    }
+}
+
+static int solveOut(struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    int ndim = a->ndim;
+    int shape[ndim > 2 ? ndim : 2];
+    if (solveShape(a, b, shape))
+    {
+        return 1;
+    }
+    if (checkOutput(out, shape, ndim))
+    {
+        return 2;
+    }
+
+    int n = shape[ndim - 2];
+    int k = shape[ndim - 1];
+    int batchCount = shapeSize(shape, ndim - 2);
+    int small = n > 0 && n <= SMALL_MAX && k <= SMALL_MAX;
+    NDARRAY_TYPE local[2 * SMALL_MAX * SMALL_MAX];
+    NDARRAY_TYPE *lu = small ? local
+                             : (NDARRAY_TYPE *)scratchBuffer(SCRATCH_LINALG, sizeof(NDARRAY_TYPE) * n * (n + k) + sizeof(int) * n);
+    if (lu == 0)
+    {
+        return 1;
+    }
+    NDARRAY_TYPE *x = lu + n * n;
+    int *pivots = (int *)(x + n * k);
+
+    int index[ndim];
+    memset(index, 0, ndim * sizeof(int));
+    for (int batch = 0; batch < batchCount; batch++)
+    {
+        copyMatrix(batchPointer(a, index, ndim - 2), a->dtype, a->steps[ndim - 2], a->steps[ndim - 1], n, n, lu);
+        copyMatrix(batchPointer(b, index, ndim - 2), b->dtype, b->steps[ndim - 2], b->steps[ndim - 1], n, k, x);
+        int status = small ? smallSolve(n, k, lu, x) : luFactor(lu, n, pivots);
+        if (status != 0)
+        {
+            return status < 0 ? 1 : 3;
+        }
+        if (!small)
+        {
+            luSolveInPlace(lu, pivots, n, x, k);
+        }
+        storeMatrix(x, n, k, batchPointer(out, index, ndim - 2), out->dtype, out->steps[ndim - 2], out->steps[ndim - 1]);
+        incBatchIndex(index, shape, ndim - 2);
+    }
+    return 0;
+}
+
+int NDArray_solve_out(struct NDArray *a, struct NDArray *b, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = solveOut(a, b, out);
+    statsEnd(NDARRAY_STAT_SOLVE, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_solve(struct NDArray *a, struct NDArray *b)
+{
+    int ndim = a->ndim;
+    int shape[ndim > 2 ? ndim : 2];
+    if (solveShape(a, b, shape))
+    {
+        return 0;
+    }
+
+    struct NDArray *output = NDArray_zeros(shape, ndim);
+    if (output != 0 && NDArray_solve_out(a, b, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+static int detOut(struct NDArray *array, struct NDArray *out)
+{
+    int ndim = array->ndim;
+    if (ndim < 2 || array->shape[ndim - 1] != array->shape[ndim - 2])
+    {
+        return 1;
+    }
+    if (checkOutput(out, array->shape, ndim - 2))
+    {
+        return 2;
+    }
+
+    int n = array->shape[ndim - 1];
+    int batchCount = shapeSize(array->shape, ndim - 2);
+    NDARRAY_TYPE local[SMALL_MAX * SMALL_MAX];
+    NDARRAY_TYPE *lu = local;
+    int *pivots = 0;
+    if (n > SMALL_MAX)
+    {
+        lu = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_LINALG, sizeof(NDARRAY_TYPE) * n * n + sizeof(int) * n);
+        if (lu == 0)
+        {
+            return 1;
+        }
+        pivots = (int *)(lu + n * n);
+    }
+
+    int index[ndim];
+    memset(index, 0, ndim * sizeof(int));
+    for (int batch = 0; batch < batchCount; batch++)
+    {
+        // A singular matrix just has a zero pivot, so its determinant comes out as 0
+        NDARRAY_TYPE det = 1;
+        copyMatrix(batchPointer(array, index, ndim - 2), array->dtype, array->steps[ndim - 2], array->steps[ndim - 1], n, n, lu);
+        if (n > SMALL_MAX)
+        {
+            // The product of U's diagonal, negated for each row swap
+            if (luFactor(lu, n, pivots) < 0)
+            {
+                return 1;
+            }
+            for (int i = 0; i < n; i++)
+            {
+                det *= pivots[i] != i ? -lu[i * n + i] : lu[i * n + i];
+            }
+        }
+        else if (n > 0)
+        {
+            det = smallDet(n, lu);
+        }
+
+        char *target = batchPointer(out, index, ndim - 2);
+        if (out->dtype == NATIVE_DTYPE)
+        {
+            *(NDARRAY_TYPE *)target = det;
+        }
+        else
+        {
+            storeElement(target, 0, out->dtype, det);
+        }
+        incBatchIndex(index, array->shape, ndim - 2);
+    }
+    return 0;
+}
+
+int NDArray_det_out(struct NDArray *array, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = detOut(array, out);
+    statsEnd(NDARRAY_STAT_DET, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_det(struct NDArray *array)
+{
+    int ndim = array->ndim;
+    if (ndim < 2 || array->shape[ndim - 1] != array->shape[ndim - 2])
+    {
+        return 0;
+    }
+
+    struct NDArray *output = NDArray_zeros(array->shape, ndim - 2);
+    if (output != 0 && NDArray_det_out(array, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+// In place Cholesky factorization A = L * L^T of a contiguous, symmetric n x n matrix.
+// Only the lower triangle is read and written. Returns nonzero if A is not positive definite
+static int choleskyFactor(NDARRAY_TYPE *a, int n)
+{
+    for (int j = 0; j < n; j++)
+    {
+        NDARRAY_TYPE d = a[j * n + j];
+        for (int p = 0; p < j; p++)
+        {
+            d -= a[j * n + p] * a[j * n + p];
+        }
+        if (!(d > 0))
+        {
+            return 1;
+        }
+        d = sqrt(d);
+        a[j * n + j] = d;
+
+        for (int i = j + 1; i < n; i++)
+        {
+            NDARRAY_TYPE value = a[i * n + j];
+            for (int p = 0; p < j; p++)
+            {
+                value -= a[i * n + p] * a[j * n + p];
+            }
+            a[i * n + j] = value / d;
+        }
+    }
+    return 0;
+}
+
+// Overwrite the contiguous n x k matrix x with A^-1 * x, given the factor from choleskyFactor
+static void choleskySolveInPlace(const NDARRAY_TYPE *l, int n, NDARRAY_TYPE *x, int k)
+{
+    for (int i = 0; i < n; i++)
+    {
+        for (int p = 0; p < i; p++)
+        {
+            NDARRAY_TYPE value = l[i * n + p];
+            for (int j = 0; j < k; j++)
+            {
+                x[i * k + j] -= value * x[p * k + j];
+            }
+        }
+        NDARRAY_TYPE d = 1 / l[i * n + i];
+        for (int j = 0; j < k; j++)
+        {
+            x[i * k + j] *= d;
+        }
+    }
+
+    for (int i = n - 1; i >= 0; i--)
+    {
+        for (int p = i + 1; p < n; p++)
+        {
+            NDARRAY_TYPE value = l[p * n + i];
+            for (int j = 0; j < k; j++)
+            {
+                x[i * k + j] -= value * x[p * k + j];
+            }
+        }
+        NDARRAY_TYPE d = 1 / l[i * n + i];
+        for (int j = 0; j < k; j++)
+        {
+            x[i * k + j] *= d;
+        }
+    }
+}
+
+// Least squares solution of X * out = y by Householder QR, where X is n x p and y is n x k
+// with arbitrary steps, and out is a contiguous p x k matrix. The work buffer needs room for
+// (n + 1) * (p + k) values. Returns nonzero if X does not have full column rank
+static int lstsqQR(int n, int p, int k, const void *x, enum NDArrayDType typeX, int rsX, int csX,
+                   const void *y, enum NDArrayDType typeY, int rsY, int csY, NDARRAY_TYPE *out, NDARRAY_TYPE *work)
+{
+    // Work on the transposes, so that each column being reflected is contiguous
+    NDARRAY_TYPE *xt = work;
+    NDARRAY_TYPE *yt = xt + p * n;
+    NDARRAY_TYPE *rDiag = yt + k * n;
+    copyMatrix(x, typeX, csX, rsX, p, n, xt);
+    copyMatrix(y, typeY, csY, rsY, k, n, yt);
+
+    for (int j = 0; j < p; j++)
+    {
+        // Build the reflector v = x - alpha * e1 in place of column j
+        NDARRAY_TYPE *v = xt + j * n + j;
+        int length = n - j;
+        NDARRAY_TYPE norm = 0;
+        for (int i = 0; i < length; i++)
+        {
+            norm += v[i] * v[i];
+        }
+        norm = sqrt(norm);
+        if (norm == 0)
+        {
+            return 1;
+        }
+        NDARRAY_TYPE alpha = v[0] > 0 ? -norm : norm;
+        rDiag[j] = alpha;
+        // v^T v = 2 * norm * (norm + |x0|), as alpha has the opposite sign to x0
+        NDARRAY_TYPE scale = 1 / (norm * (norm + (v[0] < 0 ? -v[0] : v[0])));
+        v[0] -= alpha;
+
+        // Apply H = I - 2 v v^T / (v^T v) to the remaining columns of X and to y
+        for (int c = 0; c < p + k; c++)
+        {
+            if (c < p && c <= j)
+            {
+                continue;
+            }
+            NDARRAY_TYPE *column = c < p ? xt + c * n + j : yt + (c - p) * n + j;
+            NDARRAY_TYPE dot = 0;
+            for (int i = 0; i < length; i++)
+            {
+                dot += v[i] * column[i];
+            }
+            dot *= scale;
+            for (int i = 0; i < length; i++)
+            {
+                column[i] -= dot * v[i];
+            }
+        }
+    }
+
+    // Back substitution with R, whose strict upper triangle is now in xt
+    for (int i = p - 1; i >= 0; i--)
+    {
+        for (int c = 0; c < k; c++)
+        {
+            NDARRAY_TYPE value = yt[c * n + i];
+            for (int q = i + 1; q < p; q++)
+            {
+                value -= xt[q * n + i] * out[q * k + c];
+            }
+            out[i * k + c] = value / rDiag[i];
+        }
+    }
+    return 0;
+}
+
+// Shape of the least squares solution for (..., n, p) x and (..., n, k) y, with
+// broadcast batch dimensions. Returns nonzero if they don't fit
+static int lstsqShape(struct NDArray *x, struct NDArray *y, int *shape)
+{
+    int ndim = x->ndim;
+    if (ndim < 2 || y->ndim != ndim)
+    {
+        return 1;
+    }
+    int n = x->shape[ndim - 2];
+    int p = x->shape[ndim - 1];
+    if (y->shape[ndim - 2] != n || n < p)
+    {
+        return 1;
+    }
+    if (broadcastShape(x, y, ndim - 2, shape))
+    {
+        return 1;
+    }
+    shape[ndim - 2] = p;
+    shape[ndim - 1] = y->shape[ndim - 1];
+    return 0;
+}
+
+static int lstsqOut(struct NDArray *x, struct NDArray *y, enum NDArrayLstsqMode mode, struct NDArray *out)
+{
+    int ndim = x->ndim;
+    int shape[ndim > 2 ? ndim : 2];
+    if (lstsqShape(x, y, shape))
+    {
+        return 1;
+    }
+    if (checkOutput(out, shape, ndim))
+    {
+        return 2;
+    }
+
+    int n = x->shape[ndim - 2];
+    int p = shape[ndim - 2];
+    int k = shape[ndim - 1];
+    int batchCount = shapeSize(shape, ndim - 2);
+
+    // Scratch for one batch at a time, sized for the QR fallback
+    NDARRAY_TYPE *gram = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_LINALG, sizeof(NDARRAY_TYPE) * (p * p + p * k + (n + 1) * (p + k)));
+    if (gram == 0)
+    {
+        return 1;
+    }
+    NDARRAY_TYPE *solution = gram + p * p;
+    NDARRAY_TYPE *work = solution + p * k;
+
+    int rsX = x->steps[ndim - 2], csX = x->steps[ndim - 1];
+    int rsY = y->steps[ndim - 2], csY = y->steps[ndim - 1];
+    int index[ndim];
+    memset(index, 0, ndim * sizeof(int));
+    for (int batch = 0; batch < batchCount; batch++)
+    {
+        char *xData = batchPointer(x, index, ndim - 2);
+        char *yData = batchPointer(y, index, ndim - 2);
+
+        int failed = 1;
+        if (mode == NDARRAY_LSTSQ_CHOLESKY)
+        {
+            // Normal equations X^T X a = X^T y, reading X^T straight from X's steps
+            if (gemm(p, p, n, 1, xData, x->dtype, csX, rsX, xData, x->dtype, rsX, csX, false, gram, p, 1) ||
+                gemm(p, k, n, 1, xData, x->dtype, csX, rsX, yData, y->dtype, rsY, csY, false, solution, k, 1))
+            {
+                return 1;
+            }
+            failed = choleskyFactor(gram, p);
+            if (!failed)
+            {
+                choleskySolveInPlace(gram, p, solution, k);
+            }
+        }
+        // An indefinite Gram matrix means X is (numerically) rank deficient, so QR gets a go
+        if (failed && lstsqQR(n, p, k, xData, x->dtype, rsX, csX, yData, y->dtype, rsY, csY, solution, work))
+        {
+            return 3;
+        }
+
+        storeMatrix(solution, p, k, batchPointer(out, index, ndim - 2), out->dtype, out->steps[ndim - 2], out->steps[ndim - 1]);
+        incBatchIndex(index, shape, ndim - 2);
+    }
+    return 0;
+}
+
+int NDArray_lstsq_out(struct NDArray *x, struct NDArray *y, enum NDArrayLstsqMode mode, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = lstsqOut(x, y, mode, out);
+    statsEnd(NDARRAY_STAT_LSTSQ, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_lstsq(struct NDArray *x, struct NDArray *y, enum NDArrayLstsqMode mode)
+{
+    int ndim = x->ndim;
+    int shape[ndim > 2 ? ndim : 2];
+    if (lstsqShape(x, y, shape))
+    {
+        return 0;
+    }
+
+    struct NDArray *output = NDArray_zeros(shape, ndim);
+    if (output != 0 && NDArray_lstsq_out(x, y, mode, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+// Horner's scheme over a run of x, with the output first as for element-wise kernels. Each
+// step depends on the last, so the vector loop keeps four vectors in flight to hide the latency
+typedef void (*PolyvalKernel)(const void *coefficients, int count, char **data, ptrdiff_t *steps, int n);
+
+#define SCALAR_POLYVAL_KERNEL(NAME, T)                                                           \
+    static void NAME(const void *coefficients, int count, char **data, ptrdiff_t *steps, int n) \
+    {                                                                                            \
+        const T *c = (const T *)coefficients;                                                    \
+        char *out = data[0], *x = data[1];                                                       \
+        for (int i = 0; i < n; i++)                                                              \
+        {                                                                                        \
+            T value = *(T *)x, sum = c[count - 1];                                               \
+            for (int j = count - 2; j >= 0; j--)                                                 \
+            {                                                                                    \
+                sum = sum * value + c[j];                                                        \
+            }                                                                                    \
+            *(T *)out = sum;                                                                     \
+            out += steps[0];                                                                     \
+            x += steps[1];                                                                       \
+        }                                                                                        \
+    }
+
+#define SIMD_POLYVAL_KERNEL(NAME, T, VEC_BYTES, TARGET)                                                       \
+    __attribute__((target(TARGET))) static void NAME(const void *coefficients, int count, char **data,        \
+                                                     ptrdiff_t *steps, int n)                                 \
+    {                                                                                                         \
+        SIMD_TYPES(T, VEC_BYTES)                                                                              \
+        const T *c = (const T *)coefficients;                                                                 \
+        const int lanes = VEC_BYTES / sizeof(T);                                                              \
+        const ptrdiff_t size = sizeof(T);                                                                     \
+        char *out = data[0], *x = data[1];                                                                    \
+        int i = 0;                                                                                            \
+        if (steps[0] == size && steps[1] == size)                                                             \
+        {                                                                                                     \
+            for (; i + 4 * lanes <= n; i += 4 * lanes)                                                        \
+            {                                                                                                 \
+                vec v0, v1, v2, v3;                                                                           \
+                memcpy(&v0, x + i * size, sizeof(vec));                                                       \
+                memcpy(&v1, x + (i + lanes) * size, sizeof(vec));                                             \
+                memcpy(&v2, x + (i + 2 * lanes) * size, sizeof(vec));                                         \
+                memcpy(&v3, x + (i + 3 * lanes) * size, sizeof(vec));                                         \
+                vec sum0 = (vec){0} + c[count - 1], sum1 = sum0, sum2 = sum0, sum3 = sum0;                    \
+                for (int j = count - 2; j >= 0; j--)                                                          \
+                {                                                                                             \
+                    sum0 = sum0 * v0 + c[j];                                                                  \
+                    sum1 = sum1 * v1 + c[j];                                                                  \
+                    sum2 = sum2 * v2 + c[j];                                                                  \
+                    sum3 = sum3 * v3 + c[j];                                                                  \
+                }                                                                                             \
+                memcpy(out + i * size, &sum0, sizeof(vec));                                                   \
+                memcpy(out + (i + lanes) * size, &sum1, sizeof(vec));                                         \
+                memcpy(out + (i + 2 * lanes) * size, &sum2, sizeof(vec));                                     \
+                memcpy(out + (i + 3 * lanes) * size, &sum3, sizeof(vec));                                     \
+            }                                                                                                 \
+            for (; i + lanes <= n; i += lanes)                                                                \
+            {                                                                                                 \
+                vec v, sum = (vec){0} + c[count - 1];                                                         \
+                memcpy(&v, x + i * size, sizeof(vec));                                                        \
+                for (int j = count - 2; j >= 0; j--)                                                          \
+                {                                                                                             \
+                    sum = sum * v + c[j];                                                                     \
+                }                                                                                             \
+                memcpy(out + i * size, &sum, sizeof(vec));                                                    \
+            }                                                                                                 \
+        }                                                                                                     \
+        for (; i < n; i++)                                                                                    \
+        {                                                                                                     \
+            T value = *(T *)(x + i * steps[1]), sum = c[count - 1];                                           \
+            for (int j = count - 2; j >= 0; j--)                                                              \
+            {                                                                                                 \
+                sum = sum * value + c[j];                                                                     \
+            }                                                                                                 \
+            *(T *)(out + i * steps[0]) = sum;                                                                 \
+        }                                                                                                     \
+    }
+
+#ifdef NDARRAY_X86_SIMD
+#define DEFINE_POLYVAL_KERNELS(NAME, T)                  \
+    SCALAR_POLYVAL_KERNEL(NAME##Scalar, T)               \
+    SIMD_POLYVAL_KERNEL(NAME##SSE, T, 16, "sse2")        \
+    SIMD_POLYVAL_KERNEL(NAME##AVX2, T, 32, "avx2")       \
+    SIMD_POLYVAL_KERNEL(NAME##AVX512, T, 64, "avx512f")  \
+    static const PolyvalKernel NAME##s[] = {NAME##Scalar, NAME##SSE, NAME##AVX2, NAME##AVX512};
+#else
+#define DEFINE_POLYVAL_KERNELS(NAME, T) \
+    SCALAR_POLYVAL_KERNEL(NAME##Scalar, T) \
+    static const PolyvalKernel NAME##s[] = {NAME##Scalar, NAME##Scalar, NAME##Scalar, NAME##Scalar};
+#endif
+
+DEFINE_POLYVAL_KERNELS(polyvalFloat32, float)
+DEFINE_POLYVAL_KERNELS(polyvalFloat64, double)
+
+// Indexed by the float dtype polynomials are evaluated in
+static const PolyvalKernel *const polyvalKernels[] = {
+    [NDARRAY_FLOAT32] = polyvalFloat32s, [NDARRAY_FLOAT64] = polyvalFloat64s};
+
+struct PolyvalTask
+{
+    struct NDArrayIter *it;
+    int axis;
+    PolyvalKernel kernel;
+    const void *coefficients;
+    int count;
+    enum NDArrayDType dtype;
+    enum NDArrayDType types[2];
+};
+
+// Evaluate over part of the iterator, converting x and the output through per block buffers
+// when they don't have the dtype the polynomial is evaluated in
+static void polyvalTask(void *context, int begin, int end)
+{
+    struct PolyvalTask *task = (struct PolyvalTask *)context;
+    struct NDArrayIter it = *task->it;
+    if (task->axis >= 0)
+    {
+        iterRestrict(&it, task->axis, begin, end);
+    }
+
+    ptrdiff_t size = dtypeSizes[task->dtype];
+    int64_t buffers[2][CAST_BLOCK];
+    do
+    {
+        for (int offset = 0; offset < it.innerSize; offset += CAST_BLOCK)
+        {
+            int count = it.innerSize - offset < CAST_BLOCK ? it.innerSize - offset : CAST_BLOCK;
+            char *data[2];
+            ptrdiff_t steps[2];
+            for (int op = 0; op < 2; op++)
+            {
+                data[op] = it.data[op] + offset * it.innerSteps[op];
+                steps[op] = it.innerSteps[op];
+                if (task->types[op] != task->dtype)
+                {
+                    char *cast[] = {(char *)buffers[op], data[op]};
+                    ptrdiff_t castSteps[] = {size, steps[op]};
+                    if (op > 0)
+                    {
+                        castKernels[task->dtype][task->types[op]](cast, castSteps, count);
+                    }
+                    data[op] = cast[0];
+                    steps[op] = size;
+                }
+            }
+            task->kernel(task->coefficients, task->count, data, steps, count);
+            if (task->types[0] != task->dtype)
+            {
+                char *cast[] = {it.data[0] + offset * it.innerSteps[0], (char *)buffers[0]};
+                ptrdiff_t castSteps[] = {it.innerSteps[0], size};
+                castKernels[task->types[0]][task->dtype](cast, castSteps, count);
+            }
+        }
+    } while (iterNext(&it));
+}
+
+// Polynomials are evaluated in the promoted float type of their coefficients and x
+static enum NDArrayDType polyvalType(struct NDArray *coefficients, struct NDArray *x)
+{
+    enum NDArrayDType dtype = NDArray_promoteTypes(coefficients->dtype, x->dtype);
+    return dtype == NDARRAY_FLOAT32 ? NDARRAY_FLOAT32 : NDARRAY_FLOAT64;
+}
+
+static int polyvalOut(struct NDArray *coefficients, struct NDArray *x, struct NDArray *out)
+{
+    if (coefficients->ndim != 1)
+    {
+        return 1;
+    }
+    if (checkOutput(out, x->shape, x->ndim))
+    {
+        return 2;
+    }
+    int count = coefficients->shape[0];
+    if (count == 0)
+    {
+        return fillArray(out, 0);
+    }
+
+    // The kernels want the coefficients contiguous and in their own dtype, which they
+    // usually already are
+    enum NDArrayDType dtype = polyvalType(coefficients, x);
+    struct NDArray *converted = 0;
+    const void *c = coefficients->data;
+    if (coefficients->dtype != dtype || coefficients->steps[0] != 1)
+    {
+        converted = NDArray_astype(coefficients, dtype);
+        if (converted == 0)
+        {
+            return 1;
+        }
+        c = converted->data;
+    }
+
+    struct NDArrayIter it;
+    struct NDArray *ops[] = {out, x};
+    if (iterInit(&it, 2, ops, x->shape, x->ndim, 0))
+    {
+        NDArray_free(converted);
+        return 1;
+    }
+    struct PolyvalTask task = {&it, iterSplitAxis(&it, -1), polyvalKernels[dtype][NDArray_isa()], c, count, dtype,
+                               {out->dtype, x->dtype}};
+    if (it.size > 0 && task.axis < 0)
+    {
+        polyvalTask(&task, 0, 0);
+    }
+    else if (it.size > 0)
+    {
+        // Every element costs a multiply and an add per coefficient
+        int inner = it.size / it.shape[task.axis] * count;
+        parallelFor(it.shape[task.axis], (PARALLEL_GRAIN + inner - 1) / inner, polyvalTask, &task);
+    }
+    NDArray_free(converted);
+    return 0;
+}
+
+int NDArray_polyval_out(struct NDArray *coefficients, struct NDArray *x, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = polyvalOut(coefficients, x, out);
+    statsEnd(NDARRAY_STAT_ELEMENTWISE, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_polyval(struct NDArray *coefficients, struct NDArray *x)
+{
+    struct NDArray *output = arrayAllocate(x->shape, x->ndim, shapeSize(x->shape, x->ndim), polyvalType(coefficients, x));
+    if (output != 0 && NDArray_polyval_out(coefficients, x, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+struct NDArray *NDArray_vander(struct NDArray *x, int columns)
+{
+    if (x->ndim != 1 || columns < 0)
+    {
+        return 0;
+    }
+    int n = x->shape[0];
+    enum NDArrayDType dtype = x->dtype == NDARRAY_FLOAT32 ? NDARRAY_FLOAT32 : NDARRAY_FLOAT64;
+    int shape[] = {n, columns};
+    struct NDArray *output = arrayAllocate(shape, 2, n * columns, dtype);
+    if (output == 0)
+    {
+        return 0;
+    }
+
+    // Each row is a running product, kept in double so float32 rows round once per element
+    for (int i = 0; i < n && columns > 0; i++)
+    {
+        char *row = (char *)output->data + (ptrdiff_t)i * columns * dtypeSizes[dtype];
+        double value, power = 1;
+        char *cast[] = {(char *)&value, (char *)x->data + (ptrdiff_t)i * x->steps[0] * dtypeSizes[x->dtype]};
+        ptrdiff_t castSteps[] = {0, 0};
+        castKernels[NDARRAY_FLOAT64][x->dtype](cast, castSteps, 1);
+        for (int j = 0; j < columns; j++)
+        {
+            if (dtype == NDARRAY_FLOAT32)
+            {
+                ((float *)row)[j] = (float)power;
+            }
+            else
+            {
+                ((double *)row)[j] = power;
+            }
+            power *= value;
+        }
+    }
+    return output;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Number of distinct values in 1-D x, or -1 if there is no memory to count them
+static int distinctCount(struct NDArray *x)
+{
+    int n = x->shape[0];
+    double *values = (double *)ndMalloc(sizeof(double) * (n > 0 ? n : 1));
+    if (values == 0)
+    {
+        return -1;
+    }
+    char *cast[] = {(char *)values, (char *)x->data};
+    ptrdiff_t castSteps[] = {sizeof(double), (ptrdiff_t)x->steps[0] * dtypeSizes[x->dtype]};
+    castKernels[NDARRAY_FLOAT64][x->dtype](cast, castSteps, n);
+    qsort(values, n, sizeof(double), compareDoubles);
+    int count = n > 0;
+    for (int i = 1; i < n; i++)
+    {
+        count += values[i] != values[i - 1];
+    }
+    ndFree(values);
+    return count;
+}
+
+struct NDArray *NDArray_polyfit(struct NDArray *x, struct NDArray *y, int degree)
+{
+    if (x->ndim != 1 || y->ndim != 1 || x->shape[0] != y->shape[0] || degree < 0)
+    {
+        return 0;
+    }
+    // Rounding hides repeated points from QR's rank check, so they are counted up front
+    if (distinctCount(x) <= degree)
+    {
+        return 0;
+    }
+    struct NDArray *vander = NDArray_vander(x, degree + 1);
+    int shape[] = {y->shape[0], 1};
+    int steps[] = {y->steps[0], 1};
+    struct NDArray *column = arrayView(y, shape, steps, 2);
+    if (vander == 0 || column == 0)
+    {
+        NDArray_free(vander);
+        NDArray_free(column);
+        return 0;
+    }
+
+    // Householder QR keeps the fit accurate in single precision, where the normal equations of
+    // even a cubic are badly conditioned
+    struct NDArray *output = NDArray_lstsq(vander, column, NDARRAY_LSTSQ_QR);
+    NDArray_free(vander);
+    NDArray_free(column);
+    if (output != 0)
+    {
+        int coefficients[] = {degree + 1};
+        NDArray_reshape(output, coefficients, 1);
+    }
+    return output;
+}
+
+struct NDArrayRLS
+{
+    int features;
+    int targets;
+    NDARRAY_TYPE regularization;
+    NDARRAY_TYPE forgetting;
+    // What the regularization weighs now, as it's forgotten along with the samples
+    NDARRAY_TYPE priorWeight;
+    // Upper triangular R, with R^T R the weighted X^T X plus the regularization, beside Z, with
+    // R^T Z = X^T Y. Row i holds p values of R then k of Z
+    NDARRAY_TYPE *factor;
+    // The last windowSize samples, x then y in each row, as a ring starting at the oldest
+    NDARRAY_TYPE *samples;
+    int windowSize;
+    int windowCount;
+    int windowStart;
+    // Samples taken out since the factor was last rebuilt
+    int downdates;
+    // The sample being added, and the one being rotated in or out
+    NDARRAY_TYPE *incoming;
+    NDARRAY_TYPE *row;
+};
+
+// Least share of a diagonal entry's square a downdate may leave. Taking out an ordinary sample
+// leaves most of it, so only samples that dominate the window fall below this
+#define RLS_MIN_DOWNDATE 0.01
+
+// Add row, scaled by weight, to the factor with Givens rotations, zeroing it one entry at a time
+static void rlsRotateIn(struct NDArrayRLS *rls, const NDARRAY_TYPE *sample, NDARRAY_TYPE weight)
+{
+    int p = rls->features, width = rls->features + rls->targets;
+    NDARRAY_TYPE *row = rls->row;
+    for (int j = 0; j < width; j++)
+    {
+        row[j] = weight * sample[j];
+    }
+    for (int i = 0; i < p; i++)
+    {
+        NDARRAY_TYPE *r = rls->factor + i * width;
+        NDARRAY_TYPE rho = sqrt(r[i] * r[i] + row[i] * row[i]);
+        if (rho == 0)
+        {
+            continue;
+        }
+        NDARRAY_TYPE c = r[i] / rho, s = row[i] / rho;
+        r[i] = rho;
+        for (int j = i + 1; j < width; j++)
+        {
+            NDARRAY_TYPE value = r[j];
+            r[j] = c * value + s * row[j];
+            row[j] = c * row[j] - s * value;
+        }
+    }
+}
+
+// Remove row, scaled by weight, from the factor with hyperbolic rotations. Taking out most of
+// what a diagonal entry holds cancels away its digits, and the error would stay in the factor
+// for good, so this returns nonzero, leaving the factor part way through, if a rotation would
+// leave less than RLS_MIN_DOWNDATE
+static int rlsRotateOut(struct NDArrayRLS *rls, const NDARRAY_TYPE *sample, NDARRAY_TYPE weight)
+{
+    int p = rls->features, width = rls->features + rls->targets;
+    NDARRAY_TYPE *row = rls->row;
+    for (int j = 0; j < width; j++)
+    {
+        row[j] = weight * sample[j];
+    }
+    for (int i = 0; i < p; i++)
+    {
+        NDARRAY_TYPE *r = rls->factor + i * width;
+        if (row[i] == 0)
+        {
+            continue;
+        }
+        NDARRAY_TYPE rho2 = (r[i] - row[i]) * (r[i] + row[i]);
+        if (!(rho2 > r[i] * r[i] * RLS_MIN_DOWNDATE))
+        {
+            return 1;
+        }
+        NDARRAY_TYPE rho = sqrt(rho2);
+        NDARRAY_TYPE c = rho / r[i], s = row[i] / r[i];
+        r[i] = rho;
+        for (int j = i + 1; j < width; j++)
+        {
+            r[j] = (r[j] - s * row[j]) / c;
+            row[j] = c * row[j] - s * r[j];
+        }
+    }
+    return 0;
+}
+
+// Start the factor over from the regularization and the samples in the window
+static void rlsRebuild(struct NDArrayRLS *rls)
+{
+    rls->downdates = 0;
+    int p = rls->features, width = rls->features + rls->targets;
+    memset(rls->factor, 0, sizeof(NDARRAY_TYPE) * p * width);
+    NDARRAY_TYPE diagonal = sqrt(rls->priorWeight * rls->regularization);
+    for (int i = 0; i < p; i++)
+    {
+        rls->factor[i * width + i] = diagonal;
+    }
+    for (int age = rls->windowCount - 1; age >= 0; age--)
+    {
+        int slot = (rls->windowStart + rls->windowCount - 1 - age) % rls->windowSize;
+        rlsRotateIn(rls, rls->samples + slot * width, pow(rls->forgetting, 0.5 * age));
+    }
+}
+
+struct NDArrayRLS *NDArray_rlsNew(int features, int targets, NDARRAY_TYPE regularization, NDARRAY_TYPE forgetting, int window)
+{
+    if (features <= 0 || targets <= 0 || !(regularization >= 0) || !(forgetting > 0 && forgetting <= 1) || window < 0)
+    {
+        return 0;
+    }
+    int width = features + targets;
+    size_t values = (size_t)features * width + (size_t)window * width + 2 * width;
+    struct NDArrayRLS *rls = (struct NDArrayRLS *)ndMalloc(ALIGN_BLOCK(sizeof(struct NDArrayRLS)) + sizeof(NDARRAY_TYPE) * values);
+    if (rls == 0)
+    {
+        return 0;
+    }
+    rls->features = features;
+    rls->targets = targets;
+    rls->regularization = regularization;
+    rls->forgetting = forgetting;
+    rls->priorWeight = 1;
+    rls->factor = (NDARRAY_TYPE *)((char *)rls + ALIGN_BLOCK(sizeof(struct NDArrayRLS)));
+    rls->samples = rls->factor + features * width;
+    rls->incoming = rls->samples + window * width;
+    rls->row = rls->incoming + width;
+    rls->windowSize = window;
+    rls->windowCount = 0;
+    rls->windowStart = 0;
+    rlsRebuild(rls);
+    return rls;
+}
+
+// Shape check for a batch of samples: x is (n, p) or a single (p) sample, and y is (n, k), or
+// (k) alongside a single sample, or (n) when there's one target. Gives n, or -1 if they don't fit
+static int rlsSamples(struct NDArrayRLS *rls, struct NDArray *x, struct NDArray *y, int *rsY, int *csY)
+{
+    int p = rls->features, k = rls->targets;
+    if (x->ndim == 1 && x->shape[0] == p && y->ndim == 1 && y->shape[0] == k)
+    {
+        *rsY = 0;
+        *csY = y->steps[0];
+        return 1;
+    }
+    if (x->ndim != 2 || x->shape[1] != p)
+    {
+        return -1;
+    }
+    int n = x->shape[0];
+    if (y->ndim == 2 && y->shape[0] == n && y->shape[1] == k)
+    {
+        *rsY = y->steps[0];
+        *csY = y->steps[1];
+        return n;
+    }
+    if (y->ndim == 1 && y->shape[0] == n && k == 1)
+    {
+        *rsY = y->steps[0];
+        *csY = 0;
+        return n;
+    }
+    return -1;
+}
+
+static int rlsUpdate(struct NDArrayRLS *rls, struct NDArray *x, struct NDArray *y)
+{
+    int rsY, csY;
+    int n = rlsSamples(rls, x, y, &rsY, &csY);
+    if (n < 0)
+    {
+        return 1;
+    }
+    int p = rls->features, k = rls->targets, width = p + k;
+    int rsX = x->ndim == 2 ? x->steps[0] : 0;
+    int csX = x->steps[x->ndim - 1];
+    NDARRAY_TYPE decay = sqrt(rls->forgetting);
+    // A sample leaving the window has been forgotten at each of the windowSize since it arrived
+    NDARRAY_TYPE leaving = pow(rls->forgetting, 0.5 * rls->windowSize);
+
+    for (int s = 0; s < n; s++)
+    {
+        if (rls->forgetting != 1)
+        {
+            for (int i = 0; i < p * width; i++)
+            {
+                rls->factor[i] *= decay;
+            }
+            rls->priorWeight *= rls->forgetting;
+        }
+
+        NDARRAY_TYPE *sample = rls->incoming;
+        for (int j = 0; j < p; j++)
+        {
+            sample[j] = loadElement(x->data, (ptrdiff_t)s * rsX + (ptrdiff_t)j * csX, x->dtype);
+        }
+        for (int j = 0; j < k; j++)
+        {
+            sample[p + j] = loadElement(y->data, (ptrdiff_t)s * rsY + (ptrdiff_t)j * csY, y->dtype);
+        }
+        rlsRotateIn(rls, sample, 1);
+
+        if (rls->windowSize == 0)
+        {
+            continue;
+        }
+        if (rls->windowCount < rls->windowSize)
+        {
+            int slot = (rls->windowStart + rls->windowCount++) % rls->windowSize;
+            memcpy(rls->samples + slot * width, sample, sizeof(NDARRAY_TYPE) * width);
+            continue;
+        }
+        // The newest sample takes the oldest one's slot once it has been taken out
+        NDARRAY_TYPE *oldest = rls->samples + rls->windowStart * width;
+        // Rounding still builds up over many downdates, so the factor is also rebuilt once a
+        // window's worth have gone by, which at most doubles the cost per sample
+        int failed = rlsRotateOut(rls, oldest, leaving);
+        memcpy(oldest, sample, sizeof(NDARRAY_TYPE) * width);
+        rls->windowStart = (rls->windowStart + 1) % rls->windowSize;
+        if (failed || ++rls->downdates == rls->windowSize)
+        {
+            rlsRebuild(rls);
+        }
+    }
+    return 0;
+}
+
+int NDArray_rlsUpdate(struct NDArrayRLS *rls, struct NDArray *x, struct NDArray *y)
+{
+    uint64_t start = statsBegin();
+    int status = rlsUpdate(rls, x, y);
+    statsEnd(NDARRAY_STAT_RLS, start, 0);
+    return status;
+}
 
-//     int nextStep = NDArray_incIndex(array, index);
+int NDArray_rlsSolve_out(struct NDArrayRLS *rls, struct NDArray *out)
+{
+    int p = rls->features, k = rls->targets, width = p + k;
+    int shape[] = {p, k};
+    if (checkOutput(out, shape, 2))
+    {
+        return 2;
+    }
 
-//     if (nextStep == 0)
-//     {
-//         printf("I didn't think this should ever happen");
-//         return 0;
-//     }
-//     else
-//     {
-//         return pointer + nextStep;
-//     }
-// }
+    // Back substitution with R, into scratch as out may have any dtype and steps
+    NDARRAY_TYPE *solution = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_LINALG, sizeof(NDARRAY_TYPE) * p * k);
+    if (solution == 0)
+    {
+        return 1;
+    }
+    for (int i = p - 1; i >= 0; i--)
+    {
+        const NDARRAY_TYPE *r = rls->factor + i * width;
+        if (r[i] == 0)
+        {
+            return 3;
+        }
+        for (int c = 0; c < k; c++)
+        {
+            NDARRAY_TYPE value = r[p + c];
+            for (int q = i + 1; q < p; q++)
+            {
+                value -= r[q] * solution[q * k + c];
+            }
+            solution[i * k + c] = value / r[i];
+        }
+    }
+    storeMatrix(solution, p, k, out->data, out->dtype, out->steps[0], out->steps[1]);
+    return 0;
+}
 
-NDARRAY_TYPE NDArray_get(struct NDArray *array, int *index)
+struct NDArray *NDArray_rlsSolve(struct NDArrayRLS *rls)
 {
-    return *NDArray_getPointer(array, index);
+    int shape[] = {rls->features, rls->targets};
+    struct NDArray *output = NDArray_zeros(shape, 2);
+    if (output != 0 && NDArray_rlsSolve_out(rls, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
 }
 
-void NDArray_set(struct NDArray *array, int *index, NDARRAY_TYPE value)
+void NDArray_rlsFree(struct NDArrayRLS *rls)
+{
+    ndFree(rls);
+}
+
+struct InvTask
+{
+    struct NDArray *array;
+    struct NDArray *out;
+    int n;
+    int batchCount;
+    // Set if any matrix turns out to be singular
+    atomic_int singular;
+    // Set if a thread couldn't get its scratch buffers
+    atomic_int failed;
+};
+
+// Invert matrices [begin, end) through an LU factorization each
+static void invTask(void *context, int begin, int end)
+{
+    struct InvTask *task = (struct InvTask *)context;
+    struct NDArray *array = task->array;
+    struct NDArray *out = task->out;
+    int ndim = array->ndim;
+    int n = task->n;
+    NDARRAY_TYPE *lu = (NDARRAY_TYPE *)scratchBuffer(SCRATCH_LINALG, sizeof(NDARRAY_TYPE) * 2 * n * n + sizeof(int) * n);
+    if (lu == 0)
+    {
+        atomic_store_explicit(&task->failed, 1, memory_order_relaxed);
+        return;
+    }
+    NDARRAY_TYPE *x = lu + n * n;
+    int *pivots = (int *)(x + n * n);
+
+    int index[ndim];
+    batchIndex(begin, array->shape, ndim - 2, index);
+    for (int batch = begin; batch < end; batch++)
+    {
+        copyMatrix(batchPointer(array, index, ndim - 2), array->dtype, array->steps[ndim - 2], array->steps[ndim - 1], n, n, lu);
+        int status = luFactor(lu, n, pivots);
+        if (status < 0)
+        {
+            atomic_store_explicit(&task->failed, 1, memory_order_relaxed);
+            return;
+        }
+        if (status > 0)
+        {
+            atomic_store_explicit(&task->singular, 1, memory_order_relaxed);
+        }
+        else
+        {
+            // Solve against the identity
+            memset(x, 0, sizeof(NDARRAY_TYPE) * n * n);
+            for (int i = 0; i < n; i++)
+            {
+                x[i * n + i] = 1;
+            }
+            luSolveInPlace(lu, pivots, n, x, n);
+            storeMatrix(x, n, n, batchPointer(out, index, ndim - 2), out->dtype, out->steps[ndim - 2], out->steps[ndim - 1]);
+        }
+        incBatchIndex(index, array->shape, ndim - 2);
+    }
+}
+
+// Invert matrices [begin, end) that fit the small kernels
+SMALL_INLINE void smallInvN(int n, struct InvTask *task, int begin, int end)
+{
+    struct NDArray *array = task->array;
+    struct NDArray *out = task->out;
+    int ndim = array->ndim;
+    NDARRAY_TYPE a[SMALL_MAX * SMALL_MAX];
+    NDARRAY_TYPE x[SMALL_MAX * SMALL_MAX];
+
+    int index[ndim];
+    batchIndex(begin, array->shape, ndim - 2, index);
+    for (int batch = begin; batch < end; batch++)
+    {
+        smallLoad(batchPointer(array, index, ndim - 2), array->dtype, array->steps[ndim - 2], array->steps[ndim - 1], n, n, a);
+        int singular;
+        if (n <= SMALL_COFACTOR_MAX)
+        {
+            singular = smallCofactorInv(n, a, x);
+        }
+        else
+        {
+            memset(x, 0, sizeof(NDARRAY_TYPE) * n * n);
+            for (int i = 0; i < n; i++)
+            {
+                x[i * n + i] = 1;
+            }
+            singular = smallSolveN(n, n, a, x);
+        }
+        if (singular)
+        {
+            atomic_store_explicit(&task->singular, 1, memory_order_relaxed);
+        }
+        else
+        {
+            smallStore(x, n, n, batchPointer(out, index, ndim - 2), out->dtype, out->steps[ndim - 2], out->steps[ndim - 1]);
+        }
+        incBatchIndex(index, array->shape, ndim - 2);
+    }
+}
+
+static void smallInvTask(void *context, int begin, int end)
+{
+    struct InvTask *task = (struct InvTask *)context;
+#define SMALL_INV(N)                         \
+    smallInvN(N, task, begin, end);          \
+    return
+    SMALL_SWITCH(task->n, SMALL_INV)
+#undef SMALL_INV
+}
+
+#if defined(__GNUC__)
+// Batches of matrices up to this size are inverted INV_LANES at a time, with element (i, j)
+// of every matrix in the group held in one vector, so that each step of the elimination is
+// a single SIMD op across the group
+#define INV_INTERLEAVE_MAX 8
+#if defined(__AVX__)
+#define INV_LANES (32 / (int)sizeof(NDARRAY_TYPE))
+#else
+#define INV_LANES (16 / (int)sizeof(NDARRAY_TYPE))
+#endif
+
+typedef NDARRAY_TYPE invVector __attribute__((vector_size(INV_LANES * sizeof(NDARRAY_TYPE))));
+typedef __typeof__(__builtin_choose_expr(sizeof(NDARRAY_TYPE) == 8, (int64_t)0, (int32_t)0)) invLane;
+typedef invLane invMask __attribute__((vector_size(INV_LANES * sizeof(NDARRAY_TYPE))));
+
+// Lanes of a where mask is set and of b elsewhere
+#define INV_SELECT(mask, a, b) ((invVector)(((mask) & (invMask)(a)) | (~(mask) & (invMask)(b))))
+
+// Gauss-Jordan elimination with partial pivoting chosen separately in each lane. a is
+// overwritten and x, which should start as the identity, ends up as the inverse. Returns
+// a bit mask of the lanes whose matrix is singular. Always inlined so that invInterleaved can
+// give each size its own fully unrolled copy
+static inline __attribute__((always_inline)) int invInterleavedN(int n, invVector *a, invVector *x)
+{
+    invMask singular = {0};
+    for (int j = 0; j < n; j++)
+    {
+        // Row of the largest magnitude in column j, at or below the diagonal
+        invVector max = INV_SELECT(a[j * n + j] < 0, -a[j * n + j], a[j * n + j]);
+        invMask pivot = (invMask){0} + j;
+        for (int i = j + 1; i < n; i++)
+        {
+            invVector value = INV_SELECT(a[i * n + j] < 0, -a[i * n + j], a[i * n + j]);
+            invMask bigger = value > max;
+            max = INV_SELECT(bigger, value, max);
+            pivot = (bigger & ((invMask){0} + i)) | (~bigger & pivot);
+        }
+        singular |= max == 0;
+
+        // Swap row j with the pivot row in the lanes that chose it. Well conditioned batches,
+        // such as Gram matrices, rarely pivot, so rows no lane chose are skipped
+        for (int i = j + 1; i < n; i++)
+        {
+            invMask swap = pivot == i;
+            invLane any = 0;
+            for (int lane = 0; lane < INV_LANES; lane++)
+            {
+                any |= swap[lane];
+            }
+            if (any == 0)
+            {
+                continue;
+            }
+            for (int c = j; c < n; c++)
+            {
+                invVector temp = a[j * n + c];
+                a[j * n + c] = INV_SELECT(swap, a[i * n + c], temp);
+                a[i * n + c] = INV_SELECT(swap, temp, a[i * n + c]);
+            }
+            for (int c = 0; c < n; c++)
+            {
+                invVector temp = x[j * n + c];
+                x[j * n + c] = INV_SELECT(swap, x[i * n + c], temp);
+                x[i * n + c] = INV_SELECT(swap, temp, x[i * n + c]);
+            }
+        }
+
+        // Scale the pivot row, then eliminate column j from every other row
+        invVector scale = 1 / a[j * n + j];
+        for (int c = j; c < n; c++)
+        {
+            a[j * n + c] *= scale;
+        }
+        for (int c = 0; c < n; c++)
+        {
+            x[j * n + c] *= scale;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (i == j)
+            {
+                continue;
+            }
+            invVector factor = a[i * n + j];
+            for (int c = j; c < n; c++)
+            {
+                a[i * n + c] -= factor * a[j * n + c];
+            }
+            for (int c = 0; c < n; c++)
+            {
+                x[i * n + c] -= factor * x[j * n + c];
+            }
+        }
+    }
+
+    int lanes = 0;
+    for (int lane = 0; lane < INV_LANES; lane++)
+    {
+        lanes |= singular[lane] != 0 ? 1 << lane : 0;
+    }
+    return lanes;
+}
+
+static int invInterleaved(int n, invVector *a, invVector *x)
+{
+    switch (n)
+    {
+    case 1:
+        return invInterleavedN(1, a, x);
+    case 2:
+        return invInterleavedN(2, a, x);
+    case 3:
+        return invInterleavedN(3, a, x);
+    case 4:
+        return invInterleavedN(4, a, x);
+    case 5:
+        return invInterleavedN(5, a, x);
+    case 6:
+        return invInterleavedN(6, a, x);
+    case 7:
+        return invInterleavedN(7, a, x);
+    default:
+        return invInterleavedN(8, a, x);
+    }
+}
+
+// Invert groups [begin, end) of INV_LANES consecutive matrices. The last group is padded
+// with identity matrices
+static void invInterleavedTask(void *context, int begin, int end)
+{
+    struct InvTask *task = (struct InvTask *)context;
+    struct NDArray *array = task->array;
+    struct NDArray *out = task->out;
+    int ndim = array->ndim;
+    int n = task->n;
+    int rs = array->steps[ndim - 2];
+    int cs = array->steps[ndim - 1];
+    int rsOut = out->steps[ndim - 2];
+    int csOut = out->steps[ndim - 1];
+    invVector a[INV_INTERLEAVE_MAX * INV_INTERLEAVE_MAX];
+    invVector x[INV_INTERLEAVE_MAX * INV_INTERLEAVE_MAX];
+    // Element (i, j) of lane l is at [(i * n + j) * INV_LANES + l]
+    NDARRAY_TYPE *aLanes = (NDARRAY_TYPE *)a;
+    NDARRAY_TYPE *xLanes = (NDARRAY_TYPE *)x;
+    int index[ndim];
+
+    for (int group = begin; group < end; group++)
+    {
+        int first = group * INV_LANES;
+        int lanes = task->batchCount - first < INV_LANES ? task->batchCount - first : INV_LANES;
+        for (int i = 0; i < n * n; i++)
+        {
+            x[i] = (invVector){0};
+        }
+
+        batchIndex(first, array->shape, ndim - 2, index);
+        for (int lane = 0; lane < INV_LANES; lane++)
+        {
+            const char *matrix = batchPointer(array, index, ndim - 2);
+            for (int i = 0; i < n; i++)
+            {
+                for (int j = 0; j < n; j++)
+                {
+                    ptrdiff_t element = (ptrdiff_t)i * rs + (ptrdiff_t)j * cs;
+                    NDARRAY_TYPE value = array->dtype == NATIVE_DTYPE ? ((const NDARRAY_TYPE *)matrix)[element]
+                                                                      : loadElement(matrix, element, array->dtype);
+                    aLanes[(i * n + j) * INV_LANES + lane] = lane < lanes ? value : i == j;
+                }
+                xLanes[(i * n + i) * INV_LANES + lane] = 1;
+            }
+            if (lane < lanes - 1)
+            {
+                incBatchIndex(index, array->shape, ndim - 2);
+            }
+        }
+
+        int singular = invInterleaved(n, a, x);
+
+        batchIndex(first, array->shape, ndim - 2, index);
+        for (int lane = 0; lane < lanes; lane++)
+        {
+            if (singular & 1 << lane)
+            {
+                atomic_store_explicit(&task->singular, 1, memory_order_relaxed);
+            }
+            else
+            {
+                char *matrix = batchPointer(out, index, ndim - 2);
+                for (int i = 0; i < n; i++)
+                {
+                    for (int j = 0; j < n; j++)
+                    {
+                        ptrdiff_t element = (ptrdiff_t)i * rsOut + (ptrdiff_t)j * csOut;
+                        NDARRAY_TYPE value = xLanes[(i * n + j) * INV_LANES + lane];
+                        if (out->dtype == NATIVE_DTYPE)
+                        {
+                            ((NDARRAY_TYPE *)matrix)[element] = value;
+                        }
+                        else
+                        {
+                            storeElement(matrix, element, out->dtype, value);
+                        }
+                    }
+                }
+            }
+            incBatchIndex(index, array->shape, ndim - 2);
+        }
+    }
+}
+#endif
+
+static int invOut(struct NDArray *array, struct NDArray *out)
+{
+    int ndim = array->ndim;
+    if (ndim < 2 || array->shape[ndim - 1] != array->shape[ndim - 2])
+    {
+        return 1;
+    }
+    if (checkOutput(out, array->shape, ndim))
+    {
+        return 2;
+    }
+
+    // Each matrix is copied out before its inverse is written, so out may be array itself.
+    // Matrices are independent, so the batch is split between threads
+    struct InvTask task;
+    task.array = array;
+    task.out = out;
+    task.n = array->shape[ndim - 1];
+    task.batchCount = shapeSize(array->shape, ndim - 2);
+    atomic_init(&task.singular, 0);
+    atomic_init(&task.failed, 0);
+    int64_t work = (int64_t)task.n * task.n * task.n + 1;
+
+#if defined(__GNUC__)
+    // Interleaving only pays once there are enough matrices to fill the lanes, and the
+    // cofactor kernels are quicker still
+    if (task.n > SMALL_COFACTOR_MAX && task.n <= INV_INTERLEAVE_MAX && task.batchCount >= INV_LANES)
+    {
+        int groups = (task.batchCount + INV_LANES - 1) / INV_LANES;
+        work *= INV_LANES;
+        parallelFor(groups, work >= PARALLEL_GEMM_GRAIN ? 1 : (int)(PARALLEL_GEMM_GRAIN / work), invInterleavedTask, &task);
+        return atomic_load(&task.singular) ? 3 : 0;
+    }
+#endif
+    int grain = work >= PARALLEL_GEMM_GRAIN ? 1 : (int)(PARALLEL_GEMM_GRAIN / work);
+    parallelFor(task.batchCount, grain, task.n > 0 && task.n <= SMALL_MAX ? smallInvTask : invTask, &task);
+    return atomic_load(&task.failed) ? 1 : atomic_load(&task.singular) ? 3 : 0;
+}
+
+int NDArray_inv_out(struct NDArray *array, struct NDArray *out)
+{
+    uint64_t start = statsBegin();
+    int status = invOut(array, out);
+    statsEnd(NDARRAY_STAT_INV, start, 0);
+    return status;
+}
+
+struct NDArray *NDArray_inv(struct NDArray *array)
+{
+    // This returns 0 if any matrix is singular
+    int ndim = array->ndim;
+    if (ndim < 2 || array->shape[ndim - 1] != array->shape[ndim - 2])
+    {
+        return 0;
+    }
+
+    struct NDArray *output = NDArray_zeros(array->shape, ndim);
+    if (output != 0 && NDArray_inv_out(array, output))
+    {
+        NDArray_free(output);
+        return 0;
+    }
+    return output;
+}
+
+// .npy files as numpy.save writes them: a magic string, a version, the length of a Python
+// dict literal describing the array, the dict padded with spaces so the data starts on a
+// 64 byte boundary, then the data
+#define NPY_MAGIC "\x93NUMPY"
+#define NPY_MAGIC_SIZE 6
+#define NPY_ALIGN 64
+#define NPY_MAX_DIMS 64
+// Room for the preamble of an array with ndim dimensions
+#define NPY_HEADER_CAPACITY(ndim) (2 * NPY_ALIGN + 24 * (size_t)(ndim))
+
+struct NpyHeader
+{
+    enum NDArrayDType dtype;
+    // The data is in the other byte order from this machine's
+    bool swap;
+    bool fortran;
+    int ndim;
+    int shape[NPY_MAX_DIMS];
+    int dataCount;
+};
+
+static bool littleEndian(void)
+{
+    const uint16_t one = 1;
+    return *(const uint8_t *)&one == 1;
+}
+
+static void putLittleEndian(unsigned char *bytes, uint64_t value, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        bytes[i] = (unsigned char)(value >> 8 * i);
+    }
+}
+
+static uint64_t getLittleEndian(const unsigned char *bytes, int count)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < count; i++)
+    {
+        value |= (uint64_t)bytes[i] << 8 * i;
+    }
+    return value;
+}
+
+static bool isRowMajor(struct NDArray *array)
+{
+    int expected = 1;
+    for (int i = array->ndim - 1; i >= 0; i--)
+    {
+        if (array->shape[i] == 0)
+        {
+            return true;
+        }
+        if (array->shape[i] != 1 && array->steps[i] != expected)
+        {
+            return false;
+        }
+        expected *= array->shape[i];
+    }
+    return true;
+}
+
+// Write the preamble for array, saved in C order, into header and return its length
+static size_t npyHeader(struct NDArray *array, char *header)
+{
+    static const char *const descrs[NDARRAY_DTYPES] = {"f4", "f8", "i4", "i8"};
+    size_t capacity = NPY_HEADER_CAPACITY(array->ndim);
+    char dict[capacity];
+    int length = snprintf(dict, capacity, "{'descr': '%c%s', 'fortran_order': False, 'shape': (",
+                          littleEndian() ? '<' : '>', descrs[array->dtype]);
+    for (int i = 0; i < array->ndim; i++)
+    {
+        // Python needs the trailing comma for a one element tuple
+        length += snprintf(dict + length, capacity - length, i > 0 ? ", %d" : array->ndim == 1 ? "%d," : "%d",
+                           array->shape[i]);
+    }
+    length += snprintf(dict + length, capacity - length, "), }");
+
+    // Version 1.0 stores the dict length in 2 bytes, and 2.0 in 4
+    size_t prefix = 10;
+    size_t total = (prefix + length + 1 + NPY_ALIGN - 1) / NPY_ALIGN * NPY_ALIGN;
+    if (total - prefix > 0xFFFF)
+    {
+        prefix = 12;
+        total = (prefix + length + 1 + NPY_ALIGN - 1) / NPY_ALIGN * NPY_ALIGN;
+    }
+    memcpy(header, NPY_MAGIC, NPY_MAGIC_SIZE);
+    header[6] = prefix == 10 ? 1 : 2;
+    header[7] = 0;
+    putLittleEndian((unsigned char *)header + 8, total - prefix, (int)prefix - 8);
+    memcpy(header + prefix, dict, length);
+    memset(header + prefix + length, ' ', total - prefix - length - 1);
+    header[total - 1] = '\n';
+    return total;
+}
+
+// Check the magic string and version at the start of a .npy file. Returns the length of the
+// dict that follows and sets prefix to where it starts, or returns 0 if this isn't .npy
+static size_t npyPrefix(const unsigned char *bytes, size_t size, size_t *prefix)
 {
-    *NDArray_getPointer(array, index) = value;
+    if (size < 10 || memcmp(bytes, NPY_MAGIC, NPY_MAGIC_SIZE) != 0)
+    {
+        return 0;
+    }
+    if (bytes[6] == 1)
+    {
+        *prefix = 10;
+        return getLittleEndian(bytes + 8, 2);
+    }
+    if ((bytes[6] == 2 || bytes[6] == 3) && size >= 12)
+    {
+        *prefix = 12;
+        return getLittleEndian(bytes + 8, 4);
+    }
+    return 0;
+}
+
+// Where the value of key starts in a header dict, or 0 if it isn't there
+static const char *npyValue(const char *dict, const char *key)
+{
+    size_t length = strlen(key);
+    for (const char *p = strstr(dict, key); p != 0; p = strstr(p + 1, key))
+    {
+        if (p == dict || (p[-1] != '\'' && p[-1] != '"') || p[length] != p[-1])
+        {
+            continue;
+        }
+        p += length + 1;
+        while (*p == ' ')
+        {
+            p++;
+        }
+        if (*p == ':')
+        {
+            p++;
+            while (*p == ' ')
+            {
+                p++;
+            }
+            return p;
+        }
+    }
+    return 0;
 }
 
-void NDArray_free(struct NDArray *array)
+// Fill in header from the dict of a .npy file. Returns 0 on success, or 1 if the dict is
+// malformed or describes something other than float32, float64, int32 or int64 elements
+static int npyParseHeader(const char *dict, struct NpyHeader *header)
 {
-    if (array != 0)
+    const char *descr = npyValue(dict, "descr");
+    const char *fortran = npyValue(dict, "fortran_order");
+    const char *shape = npyValue(dict, "shape");
+    if (descr == 0 || fortran == 0 || shape == 0 || strnlen(descr, 5) < 5 ||
+        (descr[0] != '\'' && descr[0] != '"') || descr[4] != descr[0])
     {
-        free(array->steps);
-        free(array->shape);
-        NDArray_decRefCount(array);
-        free(array);
+        return 1;
     }
-}
 
-void printSubArray(struct NDArray *array, int indent, int *index)
-{
-    for (int i = 0; i < indent; i++)
+    if (descr[1] == '<' || descr[1] == '>')
     {
-        printf("   ");
+        header->swap = (descr[1] == '<') != littleEndian();
     }
-    printf("[");
+    else if (descr[1] == '=' || descr[1] == '|')
+    {
+        header->swap = false;
+    }
+    else
+    {
+        return 1;
+    }
+    static const char *const descrs[NDARRAY_DTYPES] = {"f4", "f8", "i4", "i8"};
+    int dtype = 0;
+    while (dtype < NDARRAY_DTYPES && strncmp(descr + 2, descrs[dtype], 2) != 0)
+    {
+        dtype++;
+    }
+    if (dtype == NDARRAY_DTYPES)
+    {
+        return 1;
+    }
+    header->dtype = (enum NDArrayDType)dtype;
 
-    // If this is the deepest layer in the array
-    if (indent == array->ndim - 1)
+    if (strncmp(fortran, "True", 4) == 0 || strncmp(fortran, "False", 5) == 0)
     {
-        for (int i = 0; i < array->shape[indent] - 1; i++)
-        {
-            printf(NDARRAY_TYPE_FORMAT ", ", NDArray_get(array, index));
-            // printf("%d, ", (int)pointer / 4);
-            NDArray_incIndex(array, index);
-        }
-        printf(NDARRAY_TYPE_FORMAT, NDArray_get(array, index));
-        // printf("%d", (int)pointer / 4);
-        NDArray_incIndex(array, index);
+        header->fortran = fortran[0] == 'T';
     }
     else
     {
-        printf("\n");
-        for (int i = 0; i < array->shape[indent]; i++)
+        return 1;
+    }
+
+    if (*shape++ != '(')
+    {
+        return 1;
+    }
+    header->ndim = 0;
+    int64_t count = 1;
+    while (true)
+    {
+        while (*shape == ' ')
         {
-            printSubArray(array, indent + 1, index);
+            shape++;
         }
-
-        for (int i = 0; i < indent; i++)
+        if (*shape == ')')
         {
-            printf("   ");
+            break;
+        }
+        char *end;
+        long long size = strtoll(shape, &end, 10);
+        if (end == shape || size < 0 || size > INT_MAX || header->ndim == NPY_MAX_DIMS)
+        {
+            return 1;
+        }
+        // Python 2 wrote longs with a suffix
+        shape = *end == 'L' ? end + 1 : end;
+        header->shape[header->ndim++] = (int)size;
+        count *= size;
+        if (count > INT_MAX)
+        {
+            return 1;
+        }
+        while (*shape == ' ')
+        {
+            shape++;
+        }
+        if (*shape == ',')
+        {
+            shape++;
+        }
+        else if (*shape != ')')
+        {
+            return 1;
         }
     }
-
-    printf("]\n");
+    header->dataCount = (int)count;
+    return 0;
 }
 
-void NDArray_print(struct NDArray *array)
+// Steps of the data described by header, in C or Fortran order
+static void npySteps(struct NpyHeader *header, int *steps)
 {
-    int ndim = array->ndim;
-    printf("Shape: ");
-    printIntArray(array->shape, ndim);
-    printf("\nSteps: ");
-    printIntArray(array->steps, ndim);
-    printf("\n");
-
-    int index[array->ndim];
-    memset(index, 0, array->ndim * sizeof(int));
-    printSubArray(array, 0, index);
+    int prod = 1;
+    for (int i = 0; i < header->ndim; i++)
+    {
+        int axis = header->fortran ? i : header->ndim - 1 - i;
+        steps[axis] = prod;
+        prod *= header->shape[axis];
+    }
 }
 
-// Shape is assumed to have the size of array->ndim
-struct NDArray *NDArray_broadcastTo(struct NDArray *array, int *shape)
+static void byteSwap(char *data, size_t count, size_t itemSize)
 {
-    // Check for incompatible shapes
-    for (int i = 0; i < array->ndim; i++)
+    for (size_t i = 0; i < count; i++, data += itemSize)
     {
-        if (array->shape[i] != shape[i] && array->shape[i] != 1)
+        for (size_t j = 0; j < itemSize / 2; j++)
         {
-            DEBUG_PRINT("Incompatible shapes\n");
-            return 0;
+            char byte = data[j];
+            data[j] = data[itemSize - 1 - j];
+            data[itemSize - 1 - j] = byte;
         }
     }
+}
 
-    struct NDArray *result = (struct NDArray *)malloc(sizeof(struct NDArray));
-    result->data = array->data;
-    result->refCount = array->refCount;
-    ++*result->refCount;
-    result->ndim = array->ndim;
-
-    result->steps = (int *)malloc(sizeof(int) * array->ndim);
-    result->shape = (int *)malloc(sizeof(int) * array->ndim);
-    memcpy(result->shape, shape, sizeof(int) * array->ndim);
-    memcpy(result->steps, array->steps, sizeof(int) * array->ndim);
-
-    // Convert all steps that are different to 0
-    for (int i = 0; i < result->ndim; i++)
+// Read a .npy array from the current position of file
+static struct NDArray *npyRead(FILE *file)
+{
+    unsigned char bytes[12];
+    if (fread(bytes, 1, 10, file) != 10 || (bytes[6] >= 2 && fread(bytes + 10, 1, 2, file) != 2))
     {
-        if (array->shape[i] != result->shape[i])
-        {
-            result->steps[i] = 0;
-        }
+        return 0;
+    }
+    size_t prefix;
+    size_t length = npyPrefix(bytes, bytes[6] >= 2 ? 12 : 10, &prefix);
+    char *dict = length > 0 ? (char *)ndMalloc(length + 1) : 0;
+    if (dict == 0)
+    {
+        return 0;
+    }
+    struct NpyHeader header;
+    bool valid = fread(dict, 1, length, file) == length;
+    dict[length] = 0;
+    valid = valid && npyParseHeader(dict, &header) == 0;
+    ndFree(dict);
+    if (!valid)
+    {
+        return 0;
     }
 
-    result->ndim = array->ndim;
-    result->dataCount = array->dataCount;
-    return result;
+    struct NDArray *array = arrayAllocate(header.shape, header.ndim, header.dataCount, header.dtype);
+    size_t itemSize = dtypeSizes[header.dtype];
+    if (array == 0 || fread(array->data, itemSize, header.dataCount, file) != (size_t)header.dataCount)
+    {
+        NDArray_free(array);
+        return 0;
+    }
+    if (header.swap)
+    {
+        byteSwap((char *)array->data, header.dataCount, itemSize);
+    }
+    npySteps(&header, array->steps);
+    return array;
 }
 
-struct NDArrayPair NDArray_broadcast(struct NDArray *a, struct NDArray *b)
+int NDArray_save(const char *path, struct NDArray *array)
 {
-    struct NDArrayPair arrayPair = {0, 0};
-    if (a->ndim != b->ndim)
+    struct NDArray *contiguous = isRowMajor(array) ? array : NDArray_astype(array, array->dtype);
+    if (contiguous == 0)
     {
-        return arrayPair;
+        return 1;
     }
-
-    int newShape[a->ndim];
-    for (int i = 0; i < a->ndim; i++)
+    FILE *file = fopen(path, "wb");
+    if (file == 0)
     {
-        if (a->shape[i] == b->shape[i] || b->shape[i] == 1)
-        {
-            newShape[i] = a->shape[i];
-        }
-        else if (a->shape[i] == 1)
-        {
-            newShape[i] = b->shape[i];
-        }
-        else
+        if (contiguous != array)
         {
-            return arrayPair;
+            NDArray_free(contiguous);
         }
+        return 1;
     }
+    char header[NPY_HEADER_CAPACITY(array->ndim)];
+    size_t headerLength = npyHeader(array, header);
+    size_t count = shapeSize(array->shape, array->ndim);
+    bool written = fwrite(header, 1, headerLength, file) == headerLength &&
+                   fwrite(contiguous->data, dtypeSizes[array->dtype], count, file) == count;
+    if (contiguous != array)
+    {
+        NDArray_free(contiguous);
+    }
+    return fclose(file) == 0 && written ? 0 : 1;
+}
 
-    arrayPair.a = NDArray_broadcastTo(a, newShape);
-    arrayPair.b = NDArray_broadcastTo(b, newShape);
-
-    return arrayPair;
+struct NDArray *NDArray_load(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == 0)
+    {
+        return 0;
+    }
+    struct NDArray *array = npyRead(file);
+    fclose(file);
+    return array;
 }
 
-struct NDArray *NDArray_sum(struct NDArray *array, int axis)
+struct FileMapping
 {
-    axis = validateAxis(axis, array->ndim);
+    void *address;
+    size_t size;
+};
+
+static void unmapFile(void *data, void *context)
+{
+    struct FileMapping *mapping = (struct FileMapping *)context;
+    munmap(mapping->address, mapping->size);
+    ndFree(mapping);
+}
 
-    if (axis < 0 || axis >= array->ndim)
+struct NDArray *NDArray_mmap(const char *path, enum NDArrayMapMode mode)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
     {
         return 0;
     }
-    if (array->ndim < 2)
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < 10)
     {
+        close(fd);
         return 0;
     }
-
-    // The new shape is a copy of the old, except the sum axis
-    int shape[array->ndim];
-    memcpy(shape, array->shape, array->ndim * sizeof(int));
-    shape[axis] = 1;
-
-    struct NDArray *result = NDArray_zeros(shape, array->ndim);
-
-    struct NDArray *bResult = NDArray_broadcastTo(result, array->shape);
-
-    // Step through all elements in the input array and add them to the
-    // corresponding output element (which is repeated along the axis).
-    // Part of this is similar to nextPointer, but it's more efficient
-    // to implement it here
-    int index[array->ndim];
-    memset(index, 0, array->ndim * sizeof(int));
-    int nextStep;
-    NDARRAY_TYPE *pointer = array->data;
-    do
+    size_t size = (size_t)status.st_size;
+    // Private pages are copied on the first write, so the file itself never changes
+    void *mapping = mode == NDARRAY_MAP_COPY ? mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)
+                                             : mmap(0, size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
     {
-        *NDArray_getPointer(bResult, index) += NDArray_get(array, index);
-
-        nextStep = NDArray_incIndex(array, index);
-    } while (nextStep != -array->dataCount);
-    NDArray_free(bResult);
+        return 0;
+    }
 
-    // The new shape is a copy of the old, excluding the sum axis
-    int outShape[array->ndim - 1];
-    for (int i = 0; i < array->ndim - 1; i++)
+    // The data is used where it lies, so it has to be in this machine's byte order and aligned
+    size_t prefix;
+    size_t length = npyPrefix((const unsigned char *)mapping, size, &prefix);
+    char *dict = length > 0 && prefix + length <= size ? (char *)ndMalloc(length + 1) : 0;
+    struct NpyHeader header;
+    bool valid = dict != 0;
+    if (valid)
     {
-        outShape[i] = array->shape[i + (i >= axis)];
+        memcpy(dict, (char *)mapping + prefix, length);
+        dict[length] = 0;
+        valid = npyParseHeader(dict, &header) == 0 && !header.swap &&
+                (prefix + length) % dtypeSizes[header.dtype] == 0 &&
+                (size - prefix - length) / dtypeSizes[header.dtype] >= (size_t)header.dataCount;
+        ndFree(dict);
+    }
+    if (!valid)
+    {
+        munmap(mapping, size);
+        return 0;
     }
 
-    NDArray_reshape(result, outShape, array->ndim - 1);
-    return result;
-}
-
-struct NDArray *NDArray_multiply(struct NDArray *a, struct NDArray *b)
-{
-    struct NDArrayPair pair = NDArray_broadcast(a, b);
-    if (pair.a == 0)
+    int steps[NPY_MAX_DIMS];
+    npySteps(&header, steps);
+    struct FileMapping *context = (struct FileMapping *)ndMalloc(sizeof(struct FileMapping));
+    if (context == 0)
     {
+        munmap(mapping, size);
         return 0;
     }
+    context->address = mapping;
+    context->size = size;
+    struct NDArray *array = NDArray_fromBuffer((char *)mapping + prefix + length, header.shape, steps, header.ndim,
+                                               header.dtype, unmapFile, context);
+    if (array == 0)
+    {
+        unmapFile(0, context);
+    }
+    return array;
+}
 
-    int index[pair.a->ndim];
-    memset(index, 0, pair.a->ndim * sizeof(int));
+// .npz archives are zip files holding one .npy file per array. Entries are stored without
+// compression, so each one is a .npy file at some offset in the archive
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_SIZE 22
+#define ZIP64_LOCATOR_SIZE 20
+#define ZIP64_END_SIZE 56
+// MS-DOS date of 1980-01-01, the earliest a zip file can hold
+#define ZIP_DATE 0x21
 
-    struct NDArray *result = NDArray_zeros(pair.a->shape, pair.a->ndim);
+struct ZipEntry
+{
+    uint32_t crc;
+    uint32_t size;
+    uint32_t offset;
+};
 
-    NDARRAY_TYPE *pointer = result->data;
-    do
+static void crcTable(uint32_t *table)
+{
+    for (uint32_t i = 0; i < 256; i++)
     {
-        *pointer = NDArray_get(pair.a, index) * NDArray_get(pair.b, index);
-        pointer++;
-    } while (NDArray_incIndex(pair.a, index) != -pair.a->dataCount);
-
-    NDArray_free(pair.a);
-    NDArray_free(pair.b);
-    return result;
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 1 ? 0xEDB88320 ^ (crc >> 1) : crc >> 1;
+        }
+        table[i] = crc;
+    }
 }
 
-struct NDArray *NDArray_add(struct NDArray *a, struct NDArray *b)
+static uint32_t crcUpdate(const uint32_t *table, uint32_t crc, const void *data, size_t size)
 {
-    struct NDArrayPair pair = NDArray_broadcast(a, b);
-    if (pair.a == 0)
+    const unsigned char *bytes = (const unsigned char *)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
     {
-        return 0;
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
     }
-
-    int index[pair.a->ndim];
-    memset(index, 0, pair.a->ndim * sizeof(int));
-
-    struct NDArray *result = NDArray_zeros(pair.a->shape, pair.a->ndim);
-
-    NDARRAY_TYPE *pointer = result->data;
-    do
-    {
-        *pointer = NDArray_get(pair.a, index) + NDArray_get(pair.b, index);
-        pointer++;
-    } while (NDArray_incIndex(pair.a, index) != -pair.a->dataCount);
-
-    NDArray_free(pair.a);
-    NDArray_free(pair.b);
-    return result;
+    return ~crc;
 }
 
-struct NDArray *NDArray_copy(struct NDArray *array)
+// Write array to file as a stored zip entry called name and record it in entry
+static bool zipWriteArray(FILE *file, const uint32_t *table, const char *name, struct NDArray *array,
+                          struct ZipEntry *entry)
 {
-    struct NDArray *output = (struct NDArray *)malloc(sizeof(struct NDArray));
-    output->data = array->data;
-    output->refCount = array->refCount;
-    ++*output->refCount;
-    output->ndim = array->ndim;
-    output->dataCount = array->dataCount;
-
-    output->steps = (int *)malloc(sizeof(int) * array->ndim);
-    output->shape = (int *)malloc(sizeof(int) * array->ndim);
-    memcpy(output->shape, array->shape, sizeof(int) * array->ndim);
-    memcpy(output->steps, array->steps, sizeof(int) * array->ndim);
+    size_t nameLength = strlen(name);
+    off_t offset = ftello(file);
+    struct NDArray *contiguous = isRowMajor(array) ? array : NDArray_astype(array, array->dtype);
+    if (contiguous == 0)
+    {
+        return false;
+    }
+    char header[NPY_HEADER_CAPACITY(array->ndim)];
+    size_t headerLength = npyHeader(array, header);
+    size_t dataLength = dtypeSizes[array->dtype] * shapeSize(array->shape, array->ndim);
+    bool written = offset >= 0 && offset <= 0xFFFFFFFF && headerLength + dataLength <= 0xFFFFFFFF &&
+                   nameLength <= 0xFFFF;
+    if (written)
+    {
+        entry->crc = crcUpdate(table, crcUpdate(table, 0, header, headerLength), contiguous->data, dataLength);
+        entry->size = (uint32_t)(headerLength + dataLength);
+        entry->offset = (uint32_t)offset;
 
-    return output;
+        unsigned char local[ZIP_LOCAL_HEADER_SIZE] = {'P', 'K', 3, 4, 20};
+        putLittleEndian(local + 12, ZIP_DATE, 2);
+        putLittleEndian(local + 14, entry->crc, 4);
+        putLittleEndian(local + 18, entry->size, 4);
+        putLittleEndian(local + 22, entry->size, 4);
+        putLittleEndian(local + 26, nameLength, 2);
+        written = fwrite(local, 1, sizeof(local), file) == sizeof(local) &&
+                  fwrite(name, 1, nameLength, file) == nameLength &&
+                  fwrite(header, 1, headerLength, file) == headerLength &&
+                  fwrite(contiguous->data, 1, dataLength, file) == dataLength;
+    }
+    if (contiguous != array)
+    {
+        NDArray_free(contiguous);
+    }
+    return written;
 }
 
-struct NDArray *NDArray_clone(struct NDArray *array)
+int NDArray_savez(const char *path, int count, const char **names, struct NDArray **arrays)
 {
-    struct NDArray *output = (struct NDArray *)malloc(sizeof(struct NDArray));
-
-    output->ndim = array->ndim;
-    output->dataCount = array->dataCount;
+    if (count < 0 || count > 0xFFFF)
+    {
+        return 1;
+    }
+    FILE *file = fopen(path, "wb");
+    if (file == 0)
+    {
+        return 1;
+    }
+    uint32_t table[256];
+    crcTable(table);
+    struct ZipEntry *entries = (struct ZipEntry *)ndMalloc(sizeof(struct ZipEntry) * (count + 1));
+    bool written = entries != 0;
 
-    output->data = (NDARRAY_TYPE *)malloc(sizeof(NDARRAY_TYPE) * array->dataCount);
-    memcpy(output->data, array->data, sizeof(NDARRAY_TYPE) * array->dataCount);
+    // numpy.load strips the .npy that numpy.savez adds to each name
+    for (int i = 0; i < count && written; i++)
+    {
+        char name[strlen(names[i]) + 5];
+        sprintf(name, "%s.npy", names[i]);
+        written = zipWriteArray(file, table, name, arrays[i], &entries[i]);
+    }
 
-    output->refCount = (int *)malloc(sizeof(int));
-    *output->refCount = 1;
+    off_t directory = ftello(file);
+    written = written && directory >= 0 && directory <= 0xFFFFFFFF;
+    for (int i = 0; i < count && written; i++)
+    {
+        size_t nameLength = strlen(names[i]) + 4;
+        unsigned char central[ZIP_CENTRAL_HEADER_SIZE] = {'P', 'K', 1, 2, 20, 0, 20};
+        putLittleEndian(central + 14, ZIP_DATE, 2);
+        putLittleEndian(central + 16, entries[i].crc, 4);
+        putLittleEndian(central + 20, entries[i].size, 4);
+        putLittleEndian(central + 24, entries[i].size, 4);
+        putLittleEndian(central + 28, nameLength, 2);
+        putLittleEndian(central + 42, entries[i].offset, 4);
+        written = fwrite(central, 1, sizeof(central), file) == sizeof(central) &&
+                  fwrite(names[i], 1, nameLength - 4, file) == nameLength - 4 && fwrite(".npy", 1, 4, file) == 4;
+    }
 
-    output->steps = (int *)malloc(sizeof(int) * array->ndim);
-    output->shape = (int *)malloc(sizeof(int) * array->ndim);
-    memcpy(output->shape, array->shape, sizeof(int) * array->ndim);
-    memcpy(output->steps, array->steps, sizeof(int) * array->ndim);
+    off_t end = ftello(file);
+    written = written && end >= 0 && end <= 0xFFFFFFFF;
+    if (written)
+    {
+        unsigned char record[ZIP_END_SIZE] = {'P', 'K', 5, 6};
+        putLittleEndian(record + 8, count, 2);
+        putLittleEndian(record + 10, count, 2);
+        putLittleEndian(record + 12, end - directory, 4);
+        putLittleEndian(record + 16, directory, 4);
+        written = fwrite(record, 1, sizeof(record), file) == sizeof(record);
+    }
+    ndFree(entries);
+    return fclose(file) == 0 && written ? 0 : 1;
+}
 
-    return output;
+static bool readAt(FILE *file, off_t offset, void *data, size_t size)
+{
+    return fseeko(file, offset, SEEK_SET) == 0 && fread(data, 1, size, file) == size;
 }
 
-struct NDArray *NDArray_matmul(struct NDArray *a, struct NDArray *b)
+// Find the central directory of a zip file from the record at its end, which zip64 archives
+// extend with a second record when the directory is too big or too far in for 32 bits
+static bool zipDirectory(FILE *file, uint64_t *count, uint64_t *size, uint64_t *offset)
 {
-    // TODO: Implement this
-    if (a->ndim != b->ndim)
+    if (fseeko(file, 0, SEEK_END) != 0)
     {
-        return 0;
+        return false;
     }
-    int ndim = a->ndim;
-    if (ndim < 2)
+    off_t fileSize = ftello(file);
+    // The end record is followed by a comment of at most 64 KiB
+    size_t tailSize = ZIP64_LOCATOR_SIZE + ZIP_END_SIZE + 0xFFFF;
+    tailSize = fileSize < (off_t)tailSize ? (size_t)fileSize : tailSize;
+    unsigned char *tail = (unsigned char *)ndMalloc(tailSize);
+    if (tail == 0 || !readAt(file, fileSize - tailSize, tail, tailSize))
     {
-        return 0;
+        ndFree(tail);
+        return false;
     }
 
-    a = NDArray_copy(a);
-    b = NDArray_copy(b);
-
-    int errorCode = 0;
-    errorCode |= NDArray_expandDims(a, -3);
-    errorCode |= NDArray_expandDims(b, -3);
-
-    struct NDArray *output = 0;
-
-    if (errorCode == 0)
-    {
-        errorCode |= NDArray_swapAxes(a, -1, -3);
-        errorCode |= NDArray_swapAxes(b, -2, -3);
-    }
-    if (errorCode == 0)
+    bool found = false;
+    for (size_t i = tailSize >= ZIP_END_SIZE ? tailSize - ZIP_END_SIZE + 1 : 0; i-- > 0;)
     {
-        struct NDArray *prod = NDArray_multiply(a, b);
-        if (prod == 0)
+        unsigned char *record = tail + i;
+        if (memcmp(record, "PK\5\6", 4) != 0)
         {
-            errorCode |= 1;
+            continue;
         }
-
-        if (errorCode == 0)
+        *count = getLittleEndian(record + 10, 2);
+        *size = getLittleEndian(record + 12, 4);
+        *offset = getLittleEndian(record + 16, 4);
+        found = true;
+        if (*count == 0xFFFF || *size == 0xFFFFFFFF || *offset == 0xFFFFFFFF)
         {
-            output = NDArray_sum(prod, -3);
-            if (output == 0)
+            unsigned char *locator = record - ZIP64_LOCATOR_SIZE;
+            unsigned char end[ZIP64_END_SIZE];
+            found = i >= ZIP64_LOCATOR_SIZE && memcmp(locator, "PK\6\7", 4) == 0 &&
+                    readAt(file, (off_t)getLittleEndian(locator + 8, 8), end, sizeof(end)) &&
+                    memcmp(end, "PK\6\6", 4) == 0;
+            if (found)
             {
-                errorCode |= 1;
+                *count = getLittleEndian(end + 32, 8);
+                *size = getLittleEndian(end + 40, 8);
+                *offset = getLittleEndian(end + 48, 8);
             }
         }
-        NDArray_free(prod);
+        break;
     }
-
-    NDArray_free(a);
-    NDArray_free(b);
-    return output;
+    ndFree(tail);
+    return found && *offset + *size <= (uint64_t)fileSize;
 }
 
-struct NDArray *NDArray_inv(struct NDArray *array)
+// Offset of the data of the stored entry called name, or name.npy, in a zip file, or -1
+static off_t zipFind(FILE *file, const char *name)
 {
-    // This is a naive implementation of Gaussian elimination. Better performance may be
-    // obtained from https://sites.engineering.ucsb.edu/~hpscicom/projects/gauss/introge.pdf
-    // This doesn't actually check if a matrix is invertable
-    if (array->ndim < 2)
+    uint64_t count, size, offset;
+    if (!zipDirectory(file, &count, &size, &offset))
     {
-        return 0;
+        return -1;
     }
-    if (array->shape[array->ndim - 1] != array->shape[array->ndim - 2])
+    unsigned char *directory = (unsigned char *)ndMalloc(size);
+    if (directory == 0 || !readAt(file, (off_t)offset, directory, size))
     {
-        return 0;
+        ndFree(directory);
+        return -1;
     }
 
-    struct NDArray *input = NDArray_clone(array);
-
-    int shape[3];
-    shape[0] = -1;
-    shape[1] = input->shape[input->ndim - 2];
-    shape[2] = input->shape[input->ndim - 1];
-    NDArray_reshape(input, shape, 3);
-
-    int n = input->shape[input->ndim - 1];
-
-    struct NDArray *output = NDArray_zeros(input->shape, input->ndim);
-
-    int index[3];
-    NDARRAY_TYPE x, temp1, temp2;
-    for (int b = 0; b < input->shape[0]; b++)
+    size_t length = strlen(name);
+    off_t data = -1;
+    unsigned char *entry = directory;
+    for (uint64_t i = 0; i < count; i++)
     {
-        index[0] = b;
-        // Convert zeros to identity
-        for (int i = 0; i < n; i++)
+        if (entry + ZIP_CENTRAL_HEADER_SIZE > directory + size || memcmp(entry, "PK\1\2", 4) != 0)
         {
-            index[1] = i;
-            index[2] = i;
-            NDArray_set(output, index, 1);
+            break;
         }
-
-        for (int i = 0; i < n; i++)
+        size_t nameLength = getLittleEndian(entry + 28, 2);
+        size_t extraLength = getLittleEndian(entry + 30, 2);
+        size_t commentLength = getLittleEndian(entry + 32, 2);
+        unsigned char *entryName = entry + ZIP_CENTRAL_HEADER_SIZE;
+        unsigned char *extra = entryName + nameLength;
+        unsigned char *next = extra + extraLength + commentLength;
+        if (next > directory + size)
         {
-            index[1] = i;
-            index[2] = i;
-            if (NDArray_get(input, index) == 0)
-            {
-                for (int ii = 0; ii < n; ii++)
-                {
-                    index[1] = i;
-                    index[2] = ii;
-                    temp1 = NDArray_get(input, index);
-                    index[1] = ii;
-                    index[2] = i;
-                    temp2 = NDArray_get(input, index);
-                    if (ii != i && temp1 != 0 && temp2 != 0)
-                    {
-                        for (int j = 0; j < n; j++)
-                        {
-                            index[2] = j;
-
-                            index[1] = i;
-                            temp1 = NDArray_get(input, index);
-                            index[1] = ii;
-                            temp2 = NDArray_get(input, index);
-                            NDArray_set(input, index, temp1);
-                            index[1] = i;
-                            NDArray_set(input, index, temp2);
-
-                            temp1 = NDArray_get(output, index);
-                            index[1] = ii;
-                            temp2 = NDArray_get(output, index);
-                            NDArray_set(output, index, temp1);
-                            index[1] = i;
-                            NDArray_set(output, index, temp2);
-                        }
-                        break;
-                    }
-                }
-            }
+            break;
         }
-
-        for (int i = 0; i < n; i++)
+        if (memcmp(entryName, name, length < nameLength ? length : nameLength) != 0 ||
+            (nameLength != length && (nameLength != length + 4 || memcmp(entryName + length, ".npy", 4) != 0)))
         {
-            for (int k = 0; k < i; k++)
-            {
-                index[1] = i;
-                index[2] = k;
-                x = NDArray_get(input, index);
-                for (int j = 0; j < n; j++)
-                {
-                    index[1] = k;
-                    index[2] = j;
-                    temp1 = NDArray_get(input, index);
-                    temp2 = NDArray_get(output, index);
-                    index[1] = i;
-                    *NDArray_getPointer(input, index) -= x * temp1;
-                    *NDArray_getPointer(output, index) -= x * temp2;
-                }
-            }
-
-            index[1] = i;
-            index[2] = i;
-            x = 1 / NDArray_get(input, index);
-            for (int j = 0; j < n; j++)
-            {
-                index[2] = j;
-                *NDArray_getPointer(input, index) *= x;
-                *NDArray_getPointer(output, index) *= x;
-            }
+            entry = next;
+            continue;
         }
 
-        for (int i = n - 1; i > 0; i--)
+        // Encrypted and compressed entries can't be read in place
+        if ((getLittleEndian(entry + 8, 2) & 1) != 0 || getLittleEndian(entry + 10, 2) != 0)
+        {
+            break;
+        }
+        uint64_t local = getLittleEndian(entry + 42, 4);
+        if (local == 0xFFFFFFFF)
         {
-            for (int ii = i - 1; ii >= 0; ii--)
+            // The zip64 extra field holds whichever of the sizes and offset didn't fit, in order
+            int skip = (getLittleEndian(entry + 24, 4) == 0xFFFFFFFF) + (getLittleEndian(entry + 20, 4) == 0xFFFFFFFF);
+            for (unsigned char *field = extra; field + 4 <= extra + extraLength;)
             {
-                index[1] = ii;
-                index[2] = i;
-                x = NDArray_get(input, index);
-                for (int j = 0; j < n; j++)
+                size_t fieldLength = getLittleEndian(field + 2, 2);
+                if (getLittleEndian(field, 2) == 1 && 8 * (skip + 1) <= (int)fieldLength)
                 {
-                    index[1] = i;
-                    index[2] = j;
-                    temp1 = NDArray_get(input, index);
-                    temp2 = NDArray_get(output, index);
-                    index[1] = ii;
-                    *NDArray_getPointer(input, index) -= x * temp1;
-                    *NDArray_getPointer(output, index) -= x * temp2;
+                    local = getLittleEndian(field + 4 + 8 * skip, 8);
+                    break;
                 }
+                field += 4 + fieldLength;
             }
         }
+        unsigned char header[ZIP_LOCAL_HEADER_SIZE];
+        if (readAt(file, (off_t)local, header, sizeof(header)) && memcmp(header, "PK\3\4", 4) == 0)
+        {
+            data = (off_t)(local + ZIP_LOCAL_HEADER_SIZE + getLittleEndian(header + 26, 2) + getLittleEndian(header + 28, 2));
+        }
+        break;
     }
+    ndFree(directory);
+    return data;
+}
 
-    NDArray_reshape(output, array->shape, array->ndim);
-    NDArray_free(input);
-    return output;
-}
\ No newline at end of file
+struct NDArray *NDArray_loadz(const char *path, const char *name)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == 0)
+    {
+        return 0;
+    }
+    off_t data = zipFind(file, name);
+    struct NDArray *array = data >= 0 && fseeko(file, data, SEEK_SET) == 0 ? npyRead(file) : 0;
+    fclose(file);
+    return array;
+}
@@ -1,6 +1,10 @@
 #ifndef NDARRAY_DEFINED
 #define NDARRAY_DEFINED
 
+#include <stddef.h>
+#include <stdint.h>
+#include <limits.h>
+
 #ifndef NDARRAY_TYPE
 #define NDARRAY_TYPE float
 #define NDARRAY_TYPE_FORMAT "%4.4f"
@@ -10,22 +14,232 @@
  extern "C" {
 #endif
 
+// Instruction sets the element-wise kernels can use, as returned by NDArray_isa. Build
+// ndarray.c with NDARRAY_FORCE_ISA defined to one of these to cap the kernels at that
+// level, e.g. -DNDARRAY_FORCE_ISA=NDARRAY_ISA_SCALAR when benchmarking
+#define NDARRAY_ISA_SCALAR 0
+#define NDARRAY_ISA_SSE 1
+#define NDARRAY_ISA_AVX2 2
+#define NDARRAY_ISA_AVX512 3
+
+// Ranks up to this keep their shape and steps inside struct NDArray itself
+#define NDARRAY_INLINE_DIMS 8
+
+struct NDArrayBuffer;
+
+// Element types an array can hold. Arrays made by the library without a dtype argument hold
+// NDARRAY_TYPE, and the linear algebra kernels compute in NDARRAY_TYPE whatever their inputs hold
+enum NDArrayDType
+{
+    NDARRAY_FLOAT32,
+    NDARRAY_FLOAT64,
+    NDARRAY_INT32,
+    NDARRAY_INT64
+};
+
+// Arrays can be shared between threads for reading. Any number of threads may read the same
+// header at once, for instance to take views of it or use it as an input, and views of the
+// same data can be freed on any thread since the data's reference count is atomic. Changing a
+// header (reshape, transpose, makeContiguous, free) while other threads use it is not safe,
+// and neither is writing to data that other threads read. Expressions are not thread safe
 struct NDArray
 {
     int *steps;
     int *shape;
     int ndim;
     int dataCount;
+    enum NDArrayDType dtype;
+    // Element zero, of type dtype, so cast it first when that isn't NDARRAY_TYPE. Views can
+    // start anywhere in the buffer, and negative steps walk back from here
     NDARRAY_TYPE *data;
-    int *refCount;
+    // Reference counted storage that data points into, shared with any views
+    struct NDArrayBuffer *buffer;
+    // The buffer whose block this header was allocated in, if any
+    struct NDArrayBuffer *home;
+    int inlineShape[NDARRAY_INLINE_DIMS];
+    int inlineSteps[NDARRAY_INLINE_DIMS];
+};
+
+// Memory provider for everything the library allocates. release gets the size that was
+// passed to allocate. Blocks are always released through the allocator that provided them,
+// so the allocator can be changed while arrays from the previous one are still alive
+struct NDArrayAllocator
+{
+    void *(*allocate)(void *context, size_t size);
+    void (*release)(void *context, void *pointer, size_t size);
+    void *context;
+};
+
+// One axis of NDArray_slice, as in Python's start:stop:step. Negative start and stop count
+// from the end, and both are clamped to the axis, so 0, INT_MAX, 1 takes all of it and
+// INT_MAX, INT_MIN, -1 all of it reversed
+struct NDArraySlice
+{
+    int start;
+    int stop;
+    int step;
 };
 
+#define NDARRAY_SLICE_ALL ((struct NDArraySlice){0, INT_MAX, 1})
+#define NDARRAY_SLICE_REVERSE ((struct NDArraySlice){INT_MAX, INT_MIN, -1})
+
 struct NDArrayPair
 {
     struct NDArray *a;
     struct NDArray *b;
 };
 
+// LU factorization with partial pivoting of a (..., n, n) array, reusable across solves
+struct NDArrayLU
+{
+    // Unit lower triangle L and upper triangle U of each matrix, packed together
+    struct NDArray *lu;
+    // Row i of each matrix was swapped with row pivots[i] during factorization
+    int *pivots;
+    // Nonzero if any of the matrices is singular
+    int singular;
+};
+
+// Algorithms for NDArray_lstsq
+enum NDArrayLstsqMode
+{
+    // Cholesky factorization of the normal equations. Fastest, but squares the condition number
+    NDARRAY_LSTSQ_CHOLESKY,
+    // Householder QR of X. Slower, but accurate for badly conditioned problems
+    NDARRAY_LSTSQ_QR
+};
+
+// Element-wise ops for NDArray_binary and NDArray_unary. Comparisons give 1 where they
+// hold and 0 elsewhere
+enum NDArrayUfunc
+{
+    NDARRAY_ADD,
+    NDARRAY_SUBTRACT,
+    NDARRAY_MULTIPLY,
+    NDARRAY_DIVIDE,
+    NDARRAY_POWER,
+    NDARRAY_MINIMUM,
+    NDARRAY_MAXIMUM,
+    NDARRAY_EQUAL,
+    NDARRAY_NOT_EQUAL,
+    NDARRAY_LESS,
+    NDARRAY_LESS_EQUAL,
+    NDARRAY_GREATER,
+    NDARRAY_GREATER_EQUAL,
+    // Unary
+    NDARRAY_EXP,
+    NDARRAY_LOG,
+    NDARRAY_SQRT,
+    NDARRAY_ABS
+};
+
+// Reductions for NDArray_reduce. The arg variants give the index of the first minimum or
+// maximum, counted in C order over the reduced axes
+enum NDArrayReduce
+{
+    NDARRAY_SUM,
+    NDARRAY_MEAN,
+    NDARRAY_PROD,
+    NDARRAY_MIN,
+    NDARRAY_MAX,
+    NDARRAY_ARGMIN,
+    NDARRAY_ARGMAX
+};
+
+// How NDArray_mmap maps a file
+enum NDArrayMapMode
+{
+    // Read-only pages shared with the file. Writing to the array crashes
+    NDARRAY_MAP_READ,
+    // Writable private pages, copied on the first write so the file itself never changes
+    NDARRAY_MAP_COPY
+};
+
+// Ops counted by NDArray_getStats. Ops that call other ops count those too, so an element-wise
+// divide inside a mean shows up under both
+enum NDArrayStatOp
+{
+    // Every binary and unary ufunc, including the _inplace variants
+    NDARRAY_STAT_ELEMENTWISE,
+    NDARRAY_STAT_REDUCE,
+    NDARRAY_STAT_EXPR,
+    NDARRAY_STAT_ASTYPE,
+    // Explicit calls to NDArray_makeContiguous and NDArray_ascontiguous
+    NDARRAY_STAT_MAKE_CONTIGUOUS,
+    // Copies NDArray_reshape makes because the new shape can't be a view of the old data
+    NDARRAY_STAT_IMPLICIT_COPY,
+    NDARRAY_STAT_MATMUL,
+    NDARRAY_STAT_INV,
+    NDARRAY_STAT_LU,
+    NDARRAY_STAT_LU_SOLVE,
+    NDARRAY_STAT_SOLVE,
+    NDARRAY_STAT_LSTSQ,
+    NDARRAY_STAT_RLS,
+    NDARRAY_STAT_DET,
+    // NDArray_einsum and NDArray_tensordot, which count their matmuls and products too
+    NDARRAY_STAT_EINSUM,
+    NDARRAY_STAT_OPS
+};
+
+// Totals across all threads since the last NDArray_resetStats
+struct NDArrayStats
+{
+    uint64_t calls[NDARRAY_STAT_OPS];
+    // Wall time in each op, which only counts while timing is on
+    uint64_t nanoseconds[NDARRAY_STAT_OPS];
+    // Bytes copied by astype and the contiguous copies
+    uint64_t bytes[NDARRAY_STAT_OPS];
+    // Blocks from the allocator, counting array headers and data but not external buffers
+    uint64_t allocations;
+    uint64_t bytesAllocated;
+    // Bytes held in the library's blocks now, and the most held at once. Arena blocks are held
+    // until NDArray_arenaReset, freed or not
+    uint64_t liveBytes;
+    uint64_t peakLiveBytes;
+};
+
+// Called after every op once set, on the thread that ran it, with the time it took and the
+// bytes it copied
+typedef void (*NDArrayTrace)(enum NDArrayStatOp op, uint64_t nanoseconds, size_t bytes, void *context);
+
+int NDArray_isa(void);
+
+// Threads used by element-wise ops, sums and matmul, including the calling thread. Passing 0
+// goes back to the default: the NDARRAY_NUM_THREADS environment variable if set, otherwise
+// the number of online processors. Results are the same for any thread count
+void NDArray_setNumThreads(int count);
+
+int NDArray_getNumThreads(void);
+
+// Use allocator for the calling thread's allocations from now on, or malloc if it is 0.
+// The per thread scratch buffers of the linear algebra kernels always use malloc
+void NDArray_setAllocator(const struct NDArrayAllocator *allocator);
+
+const struct NDArrayAllocator *NDArray_getAllocator(void);
+
+// Size class pool for small blocks (array headers, shapes and steps), falling back to malloc.
+// Its arrays can be freed on any thread, including after the thread that made them has exited
+const struct NDArrayAllocator *NDArray_poolAllocator(void);
+
+// Bump allocator for temporaries. Freeing is a no-op, and NDArray_arenaReset releases everything
+// the calling thread allocated from it at once. Arrays from the arena must not be used after that
+const struct NDArrayAllocator *NDArray_arenaAllocator(void);
+
+void NDArray_arenaReset(void);
+
+// Calls, copies and allocations are always counted. Timing ops costs two clock reads per call,
+// so it only happens while it is on, which it is from the start if the NDARRAY_STATS
+// environment variable is a positive number, or while a trace callback is set
+void NDArray_setStatsTiming(int enabled);
+
+void NDArray_getStats(struct NDArrayStats *stats);
+
+// Zero the counters. liveBytes carries over, and the peak starts again from it
+void NDArray_resetStats(void);
+
+// Pass 0 to stop tracing. Don't change it while other threads are running ops
+void NDArray_setTrace(NDArrayTrace trace, void *context);
+
 struct NDArray *NDArray_eye(int size);
 
 struct NDArray *NDArray_zeros(int *shape, int ndim);
@@ -34,6 +248,29 @@ struct NDArray *NDArray_ones(int *shape, int ndim);
 
 struct NDArray *NDArray_single(NDARRAY_TYPE value, int ndim);
 
+struct NDArray *NDArray_zerosDType(int *shape, int ndim, enum NDArrayDType dtype);
+
+// Wrap memory the library didn't allocate, such as a DMA buffer or another library's tensor,
+// without copying it. data points at element zero, and steps are in elements, or 0 for C
+// order. Once the last array using data is freed, deleter(data, context) is called on
+// whichever thread freed it, unless deleter is 0. Gives 0 for invalid input, in which case
+// the caller still owns data
+struct NDArray *NDArray_fromBuffer(void *data, int *shape, int *steps, int ndim, enum NDArrayDType dtype,
+                                   void (*deleter)(void *data, void *context), void *context);
+
+size_t NDArray_itemSize(enum NDArrayDType dtype);
+
+// The dtype element-wise ops on a and b compute in: the wider of the two, and float64 when
+// mixing integers with floats. Ops that have no integer form, such as divide, sqrt and exp,
+// compute integers in float64
+enum NDArrayDType NDArray_promoteTypes(enum NDArrayDType a, enum NDArrayDType b);
+
+// A contiguous copy of array converted to dtype
+struct NDArray *NDArray_astype(struct NDArray *array, enum NDArrayDType dtype);
+
+// A view of array sharing its data, sliced along the first nslices axes, or 0 if a step is 0
+struct NDArray *NDArray_slice(struct NDArray *array, struct NDArraySlice *slices, int nslices);
+
 int NDArray_reshape(struct NDArray *array, int *newShape, int newNDim);
 
 void NDArray_free(struct NDArray *array);
@@ -48,12 +285,36 @@ void NDArray_set(struct NDArray *array, int *index, NDARRAY_TYPE value);
 
 // NDARRAY_TYPE *NDArray_nextPointer(struct NDArray *array, NDARRAY_TYPE *pointer);
 
+// Give array its own row-major copy of the data, in place. Views sharing the old data
+// keep it. Transposed and permuted layouts are copied in cache-sized tiles
 int NDArray_makeContiguous(struct NDArray *array);
 
+// A new row-major array with a copy of array's elements, leaving array as it was
+struct NDArray *NDArray_ascontiguous(struct NDArray *array);
+
 void NDArray_print(struct NDArray *array);
 
 struct NDArray *NDArray_sum(struct NDArray *array, int axis);
 
+// Reduce over naxes axes, or over all of them if axes is NULL. keepdims leaves the reduced
+// axes in place with length 1; otherwise reducing every axis gives a 0-d array. Sums and
+// means are pairwise and compensated. min, max and the arg variants fail on empty axes
+struct NDArray *NDArray_reduce(enum NDArrayReduce op, struct NDArray *array, int *axes, int naxes, int keepdims);
+
+// The _out variants below write into a caller-owned out array instead of allocating one. They
+// return 0 on success, 1 if the inputs are invalid, 2 if out doesn't have the result's shape
+// (or broadcasts over a dimension), and 3 if a matrix is singular. Unless noted otherwise, out
+// may be one of the element-wise inputs but must not partially overlap any input
+int NDArray_sum_out(struct NDArray *array, int axis, struct NDArray *out);
+
+// Convert array to out's dtype, element by element
+int NDArray_astype_out(struct NDArray *array, struct NDArray *out);
+
+// out must not overlap array. Sums, means, products, minimums and maximums are accumulated
+// in out, so it must hold floats; NDArray_reduce makes them float64 for integer input, and
+// int64 for the arg variants
+int NDArray_reduce_out(enum NDArrayReduce op, struct NDArray *array, int *axes, int naxes, int keepdims, struct NDArray *out);
+
 void printIntArray(int *row, int length);
 
 void printFloatArray(float *row, int length);
@@ -68,12 +329,199 @@ int NDArray_squeeze(struct NDArray *array, int axis);
 
 struct NDArray *NDArray_multiply(struct NDArray *a, struct NDArray *b);
 
+int NDArray_multiply_out(struct NDArray *a, struct NDArray *b, struct NDArray *out);
+
+// a *= b, where b has to broadcast to a's shape
+int NDArray_multiply_inplace(struct NDArray *a, struct NDArray *b);
+
 struct NDArray *NDArray_add(struct NDArray *a, struct NDArray *b);
 
+int NDArray_add_out(struct NDArray *a, struct NDArray *b, struct NDArray *out);
+
+// a += b, where b has to broadcast to a's shape
+int NDArray_add_inplace(struct NDArray *a, struct NDArray *b);
+
+// Binary op on a and b broadcast together, or 0 if they don't broadcast or op is unary. The
+// result has the dtype of NDArray_promoteTypes. For the _out variants, inputs and out whose
+// dtype differs from that are converted in blocks as the op runs
+struct NDArray *NDArray_binary(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *b);
+
+int NDArray_binary_out(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *b, struct NDArray *out);
+
+// Unary op on a, or 0 if op is binary
+struct NDArray *NDArray_unary(enum NDArrayUfunc op, struct NDArray *a);
+
+int NDArray_unary_out(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *out);
+
+// Shorthands for NDArray_binary and NDArray_unary
+struct NDArray *NDArray_subtract(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_divide(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_power(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_minimum(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_maximum(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_equal(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_notEqual(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_less(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_lessEqual(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_greater(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_greaterEqual(struct NDArray *a, struct NDArray *b);
+
+struct NDArray *NDArray_exp(struct NDArray *a);
+
+struct NDArray *NDArray_log(struct NDArray *a);
+
+struct NDArray *NDArray_sqrt(struct NDArray *a);
+
+struct NDArray *NDArray_abs(struct NDArray *a);
+
+// Lazily evaluated element-wise expressions, with an optional sum as the last step. Building
+// one only records the ops, and evaluating it runs the whole graph in a single pass without
+// making any intermediate arrays. It computes in NDARRAY_TYPE, converting other arrays as it
+// reads them, and the output must hold NDARRAY_TYPE. Arrays in an expression must stay alive
+// until it's evaluated. Builders take over the references to their inputs, even when they
+// fail, so a chain can be written inline and only its result freed. They return 0 for invalid
+// input, or if given 0, so a chain only needs checking at the end
+struct NDArrayExpr;
+
+struct NDArrayExpr *NDArray_exprArray(struct NDArray *array);
+
+struct NDArrayExpr *NDArray_exprBinary(enum NDArrayUfunc op, struct NDArrayExpr *a, struct NDArrayExpr *b);
+
+struct NDArrayExpr *NDArray_exprUnary(enum NDArrayUfunc op, struct NDArrayExpr *a);
+
+// Sum over axis as in NDArray_sum. Nothing can be built on top of a sum
+struct NDArrayExpr *NDArray_exprSum(struct NDArrayExpr *a, int axis);
+
+struct NDArray *NDArray_exprEval(struct NDArrayExpr *expr);
+
+int NDArray_exprEval_out(struct NDArrayExpr *expr, struct NDArray *out);
+
+// Another reference to expr, for using a node more than once
+struct NDArrayExpr *NDArray_exprRetain(struct NDArrayExpr *expr);
+
+// Release a reference. Nodes live on while other expressions still use them
+void NDArray_exprFree(struct NDArrayExpr *expr);
+
 struct NDArray *NDArray_matmul(struct NDArray *a, struct NDArray *b);
 
+// out must not overlap a or b
+int NDArray_matmul_out(struct NDArray *a, struct NDArray *b, struct NDArray *out);
+
+// Einstein summation as numpy.einsum, without ellipses: "bij,bjk->bik" is a batched matmul,
+// "ii->i" a diagonal and "ij->" a sum. Labels are letters, and without "->" the output has the
+// ones used once, in alphabetical order. Operands are contracted a pair at a time, in the order
+// with the fewest multiply-adds, each pair as one batched matmul
+struct NDArray *NDArray_einsum(const char *subscripts, int count, struct NDArray **operands);
+
+// out must not overlap the operands
+int NDArray_einsum_out(const char *subscripts, int count, struct NDArray **operands, struct NDArray *out);
+
+// numpy.tensordot with the axes given as pairs: the products of a and b summed over axis
+// axesA[i] of a paired with axesB[i] of b. The result has a's other axes, then b's
+struct NDArray *NDArray_tensordot(struct NDArray *a, struct NDArray *b, int *axesA, int *axesB, int naxes);
+
+// out must not overlap a or b
+int NDArray_tensordot_out(struct NDArray *a, struct NDArray *b, int *axesA, int *axesB, int naxes, struct NDArray *out);
+
 struct NDArray *NDArray_inv(struct NDArray *array);
 
+// out may be array itself, to invert in place
+int NDArray_inv_out(struct NDArray *array, struct NDArray *out);
+
+struct NDArrayLU *NDArray_lu(struct NDArray *array);
+
+struct NDArray *NDArray_luSolve(struct NDArrayLU *lu, struct NDArray *b);
+
+int NDArray_luSolve_out(struct NDArrayLU *lu, struct NDArray *b, struct NDArray *out);
+
+void NDArray_luFree(struct NDArrayLU *lu);
+
+struct NDArray *NDArray_solve(struct NDArray *a, struct NDArray *b);
+
+int NDArray_solve_out(struct NDArray *a, struct NDArray *b, struct NDArray *out);
+
+// Determinant of each matrix of a (..., n, n) array, shaped like the batch dimensions, so a
+// single matrix gives a 0-d array. Singular matrices give 0
+struct NDArray *NDArray_det(struct NDArray *array);
+
+int NDArray_det_out(struct NDArray *array, struct NDArray *out);
+
+struct NDArray *NDArray_lstsq(struct NDArray *x, struct NDArray *y, enum NDArrayLstsqMode mode);
+
+int NDArray_lstsq_out(struct NDArray *x, struct NDArray *y, enum NDArrayLstsqMode mode, struct NDArray *out);
+
+// Polynomials are 1-D arrays of coefficients, lowest power first, as NDArray_lstsq gives them
+// for the columns of NDArray_vander
+
+// Powers 0 to columns - 1 of each element of 1-D x, one row per element. The result is
+// float32 for float32 x and float64 otherwise
+struct NDArray *NDArray_vander(struct NDArray *x, int columns);
+
+// Least squares fit of a polynomial of degree degree to the points (x, y), both 1-D. Gives 0
+// if there are too few distinct points to determine it
+struct NDArray *NDArray_polyfit(struct NDArray *x, struct NDArray *y, int degree);
+
+// The polynomial at every element of x, of any shape, by Horner's scheme. It is evaluated in
+// float32 if the coefficients and x promote to it, otherwise in float64
+struct NDArray *NDArray_polyval(struct NDArray *coefficients, struct NDArray *x);
+
+int NDArray_polyval_out(struct NDArray *coefficients, struct NDArray *x, struct NDArray *out);
+
+// Recursive least squares: the solution of NDArray_lstsq(X, Y) for p features and k targets,
+// kept up to date as rows of X and Y arrive without keeping them all. It holds the triangular
+// Cholesky factor of X^T X, so each sample costs O(p (p + k)) however many came before.
+// Older samples can fade out, their weight multiplied by forgetting at every new sample, and
+// with a window only the last window samples count, the oldest taken out as each new one
+// arrives. regularization is added to the diagonal of X^T X, which keeps the fit defined
+// before p samples have arrived, and fades out along with the samples
+struct NDArrayRLS;
+
+// Gives 0 for a forgetting factor outside (0, 1]. Pass 1 to keep old samples at full
+// weight, and a window of 0 to keep every sample
+struct NDArrayRLS *NDArray_rlsNew(int features, int targets, NDARRAY_TYPE regularization, NDARRAY_TYPE forgetting,
+                                  int window);
+
+// Add one sample, x of p and y of k, or a batch of rows, x (n, p) and y (n, k), or (n) for a
+// single target. Returns 1 if the shapes don't fit
+int NDArray_rlsUpdate(struct NDArrayRLS *rls, struct NDArray *x, struct NDArray *y);
+
+// The current p x k coefficients. Fails, with 3 from the _out form, while the samples so far
+// don't determine them
+struct NDArray *NDArray_rlsSolve(struct NDArrayRLS *rls);
+
+int NDArray_rlsSolve_out(struct NDArrayRLS *rls, struct NDArray *out);
+
+void NDArray_rlsFree(struct NDArrayRLS *rls);
+
+// Read and write numpy's .npy files. Loading gives 0 if the file can't be read or holds
+// anything but float32, float64, int32 or int64 elements, and saving returns 0 on success
+// and 1 if the file can't be written
+int NDArray_save(const char *path, struct NDArray *array);
+
+struct NDArray *NDArray_load(const char *path);
+
+// Save count arrays to an uncompressed .npz archive of at most 4 GiB, under the names
+// numpy.load will give them
+int NDArray_savez(const char *path, int count, const char **names, struct NDArray **arrays);
+
+// The array saved under name in an .npz archive written without compression
+struct NDArray *NDArray_loadz(const char *path, const char *name);
+
+// Map an .npy file into memory instead of reading it, so opening it is instant and pages are
+// only read in as they are used. The mapping goes away when the last array using it is freed.
+// Gives 0 if the data isn't in this machine's byte order
+struct NDArray *NDArray_mmap(const char *path, enum NDArrayMapMode mode);
+
 struct NDArray *NDArray_copy(struct NDArray *array);
 
 struct NDArray *NDArray_clone(struct NDArray *array);
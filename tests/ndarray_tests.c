@@ -0,0 +1,2922 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include "ndarray.h"
+
+// Checks results against reference values, worked out by hand or by brute-force loops in
+// double. Exits nonzero if any check fails
+
+static int failures = 0;
+static unsigned seed = 12345;
+
+#define CHECK(condition) check((condition) != 0, #condition, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+    if (!ok)
+    {
+        printf("line %d: %s failed\n", line, what);
+        failures++;
+    }
+}
+
+// Relative tolerance of NDARRAY_TYPE arithmetic, with some room for rounding over long sums
+static double tolerance(void)
+{
+    return sizeof(NDARRAY_TYPE) == sizeof(float) ? 1e-4 : 1e-10;
+}
+
+static int near(double actual, double expected, double scale)
+{
+    return fabs(actual - expected) <= tolerance() * (scale + fabs(expected));
+}
+
+// The tolerance for results held in dtype, which may be narrower than NDARRAY_TYPE
+static double dtypeTolerance(enum NDArrayDType dtype)
+{
+    return dtype == NDARRAY_FLOAT32 ? 1e-4 : tolerance();
+}
+
+// Element flat (in C order) of array, whatever its layout and dtype
+static double element(struct NDArray *array, long flat)
+{
+    int index[array->ndim > 0 ? array->ndim : 1];
+    for (int i = array->ndim - 1; i >= 0; i--)
+    {
+        index[i] = (int)(flat % array->shape[i]);
+        flat /= array->shape[i];
+    }
+    return NDArray_get(array, index);
+}
+
+static long elementCount(int *shape, int ndim)
+{
+    long count = 1;
+    for (int i = 0; i < ndim; i++)
+    {
+        count *= shape[i];
+    }
+    return count;
+}
+
+#define CHECK_ARRAY(actual, expected, shape, ndim) checkArray((actual), (expected), (shape), (ndim), #actual, __LINE__)
+
+// actual against expected, given in C order, with the tolerance scaled to the largest expected value
+static void checkArray(struct NDArray *actual, const double *expected, int *shape, int ndim, const char *what,
+                       int line)
+{
+    if (actual == 0 || actual->ndim != ndim)
+    {
+        printf("line %d: %s has the wrong rank\n", line, what);
+        failures++;
+        return;
+    }
+    for (int i = 0; i < ndim; i++)
+    {
+        if (actual->shape[i] != shape[i])
+        {
+            printf("line %d: %s has the wrong shape\n", line, what);
+            failures++;
+            return;
+        }
+    }
+    long count = elementCount(shape, ndim);
+    double scale = 1;
+    for (long i = 0; i < count; i++)
+    {
+        scale = fabs(expected[i]) > scale ? fabs(expected[i]) : scale;
+    }
+    for (long i = 0; i < count; i++)
+    {
+        if (fabs(element(actual, i) - expected[i]) > dtypeTolerance(actual->dtype) * (scale + fabs(expected[i])))
+        {
+            printf("line %d: %s[%ld] is %.10g, expected %.10g\n", line, what, i, element(actual, i), expected[i]);
+            failures++;
+            return;
+        }
+    }
+}
+
+static double randomValue(void)
+{
+    seed = seed * 1664525u + 1013904223u;
+    return (seed >> 8) * (2.0 / (1 << 24)) - 1;
+}
+
+// Uniform values in [-1, 1) from a fixed seed
+static struct NDArray *randomArray(int *shape, int ndim)
+{
+    struct NDArray *array = NDArray_zeros(shape, ndim);
+    for (int i = 0; i < array->dataCount; i++)
+    {
+        array->data[i] = (NDARRAY_TYPE)randomValue();
+    }
+    return array;
+}
+
+static struct NDArray *filled(int *shape, int ndim, double value)
+{
+    struct NDArray *array = NDArray_zeros(shape, ndim);
+    for (int i = 0; array != 0 && i < array->dataCount; i++)
+    {
+        array->data[i] = (NDARRAY_TYPE)value;
+    }
+    return array;
+}
+
+// Random values of dtype, in [-50, 50), and whole numbers for the integer dtypes
+static struct NDArray *randomTyped(int *shape, int ndim, enum NDArrayDType dtype)
+{
+    struct NDArray *array = NDArray_zerosDType(shape, ndim, dtype);
+    for (int i = 0; i < array->dataCount; i++)
+    {
+        double value = 50 * randomValue();
+        char *item = (char *)array->data + i * NDArray_itemSize(dtype);
+        switch (dtype)
+        {
+        case NDARRAY_FLOAT32:
+            *(float *)item = (float)value;
+            break;
+        case NDARRAY_FLOAT64:
+            *(double *)item = value;
+            break;
+        case NDARRAY_INT32:
+            *(int32_t *)item = (int32_t)floor(value);
+            break;
+        case NDARRAY_INT64:
+            *(int64_t *)item = (int64_t)floor(value);
+            break;
+        }
+    }
+    return array;
+}
+
+static void testBasics(void)
+{
+    int shape[] = {2, 3};
+    struct NDArray *array = NDArray_zeros(shape, 2);
+    for (int i = 0; i < 6; i++)
+    {
+        array->data[i] = i;
+    }
+
+    // Transposing only changes the steps, so the elements come out in the new order
+    CHECK(NDArray_swapAxes(array, 0, 1) == 0);
+    int transposed[] = {3, 2};
+    double transposedValues[] = {0, 3, 1, 4, 2, 5};
+    CHECK_ARRAY(array, transposedValues, transposed, 2);
+
+    // Reshaping a transposed array keeps its element order
+    int flat[] = {-1};
+    CHECK(NDArray_reshape(array, flat, 1) == 0);
+    int six[] = {6};
+    CHECK_ARRAY(array, transposedValues, six, 1);
+
+    int rows[] = {2, 3};
+    CHECK(NDArray_reshape(array, rows, 2) == 0);
+    struct NDArray *sum = NDArray_sum(array, 1);
+    int two[] = {2};
+    double sums[] = {4, 11};
+    CHECK_ARRAY(sum, sums, two, 1);
+
+    // (2, 3) * (2, 1) broadcasts the sums along each row
+    int column[] = {2, 1};
+    CHECK(NDArray_reshape(sum, column, 2) == 0);
+    struct NDArray *product = NDArray_multiply(array, sum);
+    double products[] = {0, 12, 4, 44, 22, 55};
+    CHECK_ARRAY(product, products, rows, 2);
+
+    struct NDArray *bad = NDArray_zeros(six, 1);
+    CHECK(NDArray_multiply(array, bad) == 0);
+    NDArray_free(bad);
+    NDArray_free(product);
+    NDArray_free(sum);
+    NDArray_free(array);
+
+    // [[0, 1, 1], [1, 0, 7], [1, 1, 0]] has determinant 8, so its inverse is the adjugate / 8
+    struct NDArray *matrix = NDArray_ones((int[]){3, 3}, 2);
+    for (int i = 0; i < 3; i++)
+    {
+        matrix->data[i * 3 + i] = 0;
+    }
+    matrix->data[1 * 3 + 2] = 7;
+    struct NDArray *inverse = NDArray_inv(matrix);
+    double inverseValues[] = {-7 / 8.0, 1 / 8.0, 7 / 8.0, 7 / 8.0, -1 / 8.0, 1 / 8.0, 1 / 8.0, 1 / 8.0, -1 / 8.0};
+    CHECK_ARRAY(inverse, inverseValues, ((int[]){3, 3}), 2);
+    NDArray_free(inverse);
+    NDArray_free(matrix);
+}
+
+// a @ b by the triple loop in double, with the batch dimensions broadcast. shape is set to
+// the product's shape
+static double *naiveMatmul(struct NDArray *a, struct NDArray *b, int *shape)
+{
+    int ndim = a->ndim;
+    for (int i = 0; i < ndim - 2; i++)
+    {
+        shape[i] = a->shape[i] > b->shape[i] ? a->shape[i] : b->shape[i];
+    }
+    int m = a->shape[ndim - 2], k = a->shape[ndim - 1], n = b->shape[ndim - 1];
+    shape[ndim - 2] = m;
+    shape[ndim - 1] = n;
+    long batches = elementCount(shape, ndim - 2);
+    double *product = malloc(sizeof(double) * (batches * m * n > 0 ? batches * m * n : 1));
+    int indexA[ndim], indexB[ndim];
+    for (long batch = 0; batch < batches; batch++)
+    {
+        long rest = batch;
+        for (int i = ndim - 3; i >= 0; i--)
+        {
+            int index = (int)(rest % shape[i]);
+            rest /= shape[i];
+            indexA[i] = a->shape[i] == 1 ? 0 : index;
+            indexB[i] = b->shape[i] == 1 ? 0 : index;
+        }
+        for (int i = 0; i < m; i++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                double sum = 0;
+                for (int p = 0; p < k; p++)
+                {
+                    indexA[ndim - 2] = i;
+                    indexA[ndim - 1] = p;
+                    indexB[ndim - 2] = p;
+                    indexB[ndim - 1] = j;
+                    sum += (double)NDArray_get(a, indexA) * NDArray_get(b, indexB);
+                }
+                product[(batch * m + i) * n + j] = sum;
+            }
+        }
+    }
+    return product;
+}
+
+static void checkMatmul(struct NDArray *a, struct NDArray *b, int line)
+{
+    int shape[a->ndim];
+    double *expected = naiveMatmul(a, b, shape);
+    struct NDArray *product = NDArray_matmul(a, b);
+    checkArray(product, expected, shape, a->ndim, "NDArray_matmul(a, b)", line);
+    NDArray_free(product);
+    free(expected);
+}
+
+static void testMatmul(void)
+{
+    // Sizes off the multiples of the register block (6 x 16 or 6 x 8) and of the 256 deep k block
+    int sizes[][3] = {{1, 1, 1}, {3, 5, 2}, {7, 17, 9}, {13, 257, 19}, {65, 300, 70}, {6, 256, 16}};
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        int shapeA[] = {sizes[i][0], sizes[i][1]};
+        int shapeB[] = {sizes[i][1], sizes[i][2]};
+        struct NDArray *a = randomArray(shapeA, 2);
+        struct NDArray *b = randomArray(shapeB, 2);
+        checkMatmul(a, b, __LINE__);
+
+        // The same product from transposed copies, read through their steps
+        int transposedA[] = {sizes[i][1], sizes[i][0]};
+        int transposedB[] = {sizes[i][2], sizes[i][1]};
+        struct NDArray *at = randomArray(transposedA, 2);
+        struct NDArray *bt = randomArray(transposedB, 2);
+        NDArray_swapAxes(at, 0, 1);
+        NDArray_swapAxes(bt, 0, 1);
+        checkMatmul(at, bt, __LINE__);
+        checkMatmul(a, bt, __LINE__);
+        NDArray_free(a);
+        NDArray_free(b);
+        NDArray_free(at);
+        NDArray_free(bt);
+    }
+
+    // Batch dimensions broadcast against each other, and a strided slice of every other row
+    int shapeA[] = {3, 1, 10, 20};
+    int shapeB[] = {1, 4, 20, 11};
+    struct NDArray *a = randomArray(shapeA, 4);
+    struct NDArray *b = randomArray(shapeB, 4);
+    checkMatmul(a, b, __LINE__);
+    struct NDArraySlice everyOther[] = {NDARRAY_SLICE_ALL, NDARRAY_SLICE_ALL, {0, INT_MAX, 2}};
+    struct NDArray *rows = NDArray_slice(a, everyOther, 3);
+    checkMatmul(rows, b, __LINE__);
+    NDArray_free(rows);
+
+    // Empty products: no rows, and an empty inner dimension giving zeros
+    int emptyRows[] = {0, 20};
+    int emptyInner[] = {5, 0};
+    int inner[] = {0, 3};
+    struct NDArray *none = NDArray_zeros(emptyRows, 2);
+    struct NDArray *left = NDArray_zeros(emptyInner, 2);
+    struct NDArray *right = NDArray_zeros(inner, 2);
+    struct NDArray *matrix = randomArray(shapeB + 2, 2);
+    checkMatmul(none, matrix, __LINE__);
+    checkMatmul(left, right, __LINE__);
+
+    int wrongShape[] = {3, 3};
+    struct NDArray *wrong = NDArray_zeros(wrongShape, 2);
+    CHECK(NDArray_matmul(matrix, wrong) == 0);
+    CHECK(NDArray_matmul_out(left, right, wrong) == 2);
+    NDArray_free(wrong);
+    NDArray_free(matrix);
+    NDArray_free(none);
+    NDArray_free(left);
+    NDArray_free(right);
+    NDArray_free(a);
+    NDArray_free(b);
+}
+
+static double maxAbs(struct NDArray *array)
+{
+    double largest = 0;
+    long count = elementCount(array->shape, array->ndim);
+    for (long i = 0; i < count; i++)
+    {
+        largest = fabs(element(array, i)) > largest ? fabs(element(array, i)) : largest;
+    }
+    return largest;
+}
+
+// x solves a x = b, with b broadcast to x's batches, if the residual is as small as a backward
+// stable solve leaves it
+static void checkSolution(struct NDArray *a, struct NDArray *x, struct NDArray *b, int line)
+{
+    if (x == 0)
+    {
+        printf("line %d: no solution\n", line);
+        failures++;
+        return;
+    }
+    int ndim = x->ndim;
+    int shape[ndim];
+    double *product = naiveMatmul(a, x, shape);
+    struct NDArray *expected = NDArray_broadcastTo(b, shape);
+    int n = a->shape[ndim - 1];
+    double bound = tolerance() * n * (maxAbs(a) * maxAbs(x) + maxAbs(b));
+    long count = elementCount(shape, ndim);
+    for (long i = 0; i < count; i++)
+    {
+        if (fabs(product[i] - element(expected, i)) > bound)
+        {
+            printf("line %d: residual %.3g at %ld is over %.3g\n", line, product[i] - element(expected, i), i, bound);
+            failures++;
+            break;
+        }
+    }
+    NDArray_free(expected);
+    free(product);
+}
+
+static void testSolve(void)
+{
+    // A zero leading entry, which only works with row swaps. The solution is (1, 2, 3)
+    double values[] = {0, 2, 1, 1, 1, 1, 2, 1, 0};
+    int square[] = {3, 3};
+    int column[] = {3, 1};
+    struct NDArray *a = NDArray_zeros(square, 2);
+    for (int i = 0; i < 9; i++)
+    {
+        a->data[i] = (NDARRAY_TYPE)values[i];
+    }
+    struct NDArray *b = NDArray_zeros(column, 2);
+    b->data[0] = 7;
+    b->data[1] = 6;
+    b->data[2] = 4;
+    struct NDArray *x = NDArray_solve(a, b);
+    double solution[] = {1, 2, 3};
+    CHECK_ARRAY(x, solution, column, 2);
+    NDArray_free(x);
+
+    // The factors reproduce the matrix once the recorded row swaps are applied to it
+    struct NDArrayLU *lu = NDArray_lu(a);
+    CHECK(lu != 0 && !lu->singular && lu->pivots[0] != 0);
+    for (int step = 0; step < 3; step++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            double swap = values[step * 3 + j];
+            values[step * 3 + j] = values[lu->pivots[step] * 3 + j];
+            values[lu->pivots[step] * 3 + j] = swap;
+        }
+    }
+    double reconstructed[9];
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            double sum = 0;
+            for (int p = 0; p <= (i < j ? i : j); p++)
+            {
+                double lower = p == i ? 1 : lu->lu->data[i * 3 + p];
+                sum += lower * lu->lu->data[p * 3 + j];
+            }
+            reconstructed[i * 3 + j] = sum;
+        }
+    }
+    for (int i = 0; i < 9; i++)
+    {
+        CHECK(near(reconstructed[i], values[i], 1));
+    }
+    x = NDArray_luSolve(lu, b);
+    CHECK_ARRAY(x, solution, column, 2);
+    NDArray_free(x);
+    NDArray_luFree(lu);
+    NDArray_free(a);
+    NDArray_free(b);
+
+    // Sizes either side of the 32 column panels of the blocked factorization
+    int sizes[] = {1, 5, 31, 32, 33, 65, 100};
+    for (int i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++)
+    {
+        int n = sizes[i];
+        int shapeA[] = {n, n};
+        int shapeB[] = {n, 3};
+        a = randomArray(shapeA, 2);
+        b = randomArray(shapeB, 2);
+        x = NDArray_solve(a, b);
+        checkSolution(a, x, b, __LINE__);
+        NDArray_free(x);
+        lu = NDArray_lu(a);
+        x = NDArray_luSolve(lu, b);
+        checkSolution(a, x, b, __LINE__);
+        NDArray_free(x);
+        NDArray_luFree(lu);
+
+        // A transposed matrix, read through its steps
+        NDArray_swapAxes(a, 0, 1);
+        x = NDArray_solve(a, b);
+        checkSolution(a, x, b, __LINE__);
+        NDArray_free(x);
+        NDArray_free(a);
+        NDArray_free(b);
+    }
+
+    // Right-hand sides broadcast against the batches of matrices
+    int shapeA[] = {2, 1, 40, 40};
+    int shapeB[] = {1, 3, 40, 2};
+    a = randomArray(shapeA, 4);
+    b = randomArray(shapeB, 4);
+    x = NDArray_solve(a, b);
+    int solved[] = {2, 3, 40, 2};
+    CHECK(x != 0 && x->shape[0] == 2 && x->shape[1] == 3);
+    checkSolution(a, x, b, __LINE__);
+    struct NDArray *out = NDArray_zeros(solved, 4);
+    CHECK(NDArray_solve_out(a, b, out) == 0);
+    checkSolution(a, out, b, __LINE__);
+    NDArray_free(out);
+    NDArray_free(x);
+    NDArray_free(a);
+    NDArray_free(b);
+
+    // Singular matrices, small and large enough to take the blocked path, give status 3
+    int sizesSingular[] = {2, 3, 40};
+    for (int i = 0; i < 3; i++)
+    {
+        int n = sizesSingular[i];
+        int shape[] = {n, n};
+        int rhs[] = {n, 1};
+        a = randomArray(shape, 2);
+        // A zero column stays exactly zero through elimination, where a dependent row may not
+        for (int j = 0; j < n; j++)
+        {
+            a->data[j * n + n / 2] = 0;
+        }
+        b = randomArray(rhs, 2);
+        out = NDArray_zeros(rhs, 2);
+        CHECK(NDArray_solve_out(a, b, out) == 3);
+        CHECK(NDArray_solve(a, b) == 0);
+        lu = NDArray_lu(a);
+        CHECK(lu->singular);
+        CHECK(NDArray_luSolve_out(lu, b, out) == 3);
+        NDArray_luFree(lu);
+        NDArray_free(out);
+        NDArray_free(a);
+        NDArray_free(b);
+    }
+}
+
+// 0-d arrays, which full reductions and single-matrix determinants give, through the iterator
+// and the ufuncs
+static void testZeroDim(void)
+{
+    struct NDArray *a = NDArray_single(2, 0);
+    struct NDArray *b = NDArray_single(3, 0);
+    struct NDArray *sum = NDArray_add(a, b);
+    CHECK(sum != 0 && sum->ndim == 0);
+    CHECK_ARRAY(sum, ((double[]){5}), 0, 0);
+    struct NDArray *exponential = NDArray_exp(a);
+    CHECK_ARRAY(exponential, ((double[]){exp(2)}), 0, 0);
+    CHECK(NDArray_multiply_inplace(a, b) == 0);
+    CHECK_ARRAY(a, ((double[]){6}), 0, 0);
+
+    // Squeezing the last axis away leaves a 0-d array
+    int one[] = {1};
+    struct NDArray *vector = NDArray_ones(one, 1);
+    CHECK(NDArray_squeeze(vector, 0) == 0 && vector->ndim == 0);
+    CHECK_ARRAY(vector, ((double[]){1}), 0, 0);
+    CHECK(NDArray_reshape(vector, one, 1) == 0 && vector->ndim == 1);
+
+    NDArray_free(vector);
+    NDArray_free(exponential);
+    NDArray_free(sum);
+    NDArray_free(a);
+    NDArray_free(b);
+}
+
+// More axes than the iterator holds, which only works because length 1 axes are left out of it
+static void testHighRank(void)
+{
+    int shape[40];
+    int broadcastShape[40];
+    for (int i = 0; i < 40; i++)
+    {
+        shape[i] = 1;
+    }
+    shape[5] = 2;
+    shape[20] = 3;
+    shape[39] = 4;
+    memcpy(broadcastShape, shape, sizeof(shape));
+    broadcastShape[20] = 1;
+    struct NDArray *a = NDArray_zeros(shape, 40);
+    struct NDArray *b = NDArray_zeros(broadcastShape, 40);
+    double values[24];
+    double sums[24];
+    double products[24];
+    for (int i = 0; i < 24; i++)
+    {
+        a->data[i] = (NDARRAY_TYPE)i;
+        values[i] = i;
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        b->data[i] = (NDARRAY_TYPE)(i + 1);
+    }
+    for (int i = 0; i < 24; i++)
+    {
+        // a is (2, 3, 4) and b (2, 1, 4) once the length 1 axes are dropped
+        int broadcastIndex = i / 12 * 4 + i % 4;
+        sums[i] = i + i;
+        products[i] = i * (broadcastIndex + 1.0);
+    }
+
+    struct NDArray *sum = NDArray_add(a, a);
+    CHECK_ARRAY(sum, sums, shape, 40);
+    struct NDArray *product = NDArray_multiply(a, b);
+    CHECK_ARRAY(product, products, shape, 40);
+    struct NDArray *total = NDArray_reduce(NDARRAY_SUM, a, 0, 0, 0);
+    CHECK_ARRAY(total, ((double[]){276}), 0, 0);
+    struct NDArray *maxima = NDArray_reduce(NDARRAY_ARGMAX, a, (int[]){20}, 1, 1);
+    int maximaShape[40];
+    memcpy(maximaShape, broadcastShape, sizeof(shape));
+    CHECK_ARRAY(maxima, ((double[]){2, 2, 2, 2, 2, 2, 2, 2}), maximaShape, 40);
+    struct NDArray *converted = NDArray_astype(a, NDARRAY_INT64);
+    CHECK_ARRAY(converted, values, shape, 40);
+
+    // A transposed copy goes through the blocked copy's iterator
+    struct NDArray *transposed = NDArray_copy(a);
+    CHECK(NDArray_swapAxes(transposed, 5, 39) == 0);
+    struct NDArray *contiguous = NDArray_ascontiguous(transposed);
+    int transposedShape[40];
+    memcpy(transposedShape, shape, sizeof(shape));
+    transposedShape[5] = 4;
+    transposedShape[39] = 2;
+    double transposedValues[24];
+    for (int i = 0; i < 24; i++)
+    {
+        // Element (k, j, i) of the (4, 3, 2) result is a's (i, j, k)
+        transposedValues[i] = i % 2 * 12 + i / 2 % 3 * 4 + i / 6;
+    }
+    CHECK_ARRAY(contiguous, transposedValues, transposedShape, 40);
+
+    // An empty high rank array has nothing to iterate
+    shape[30] = 0;
+    struct NDArray *empty = NDArray_zeros(shape, 40);
+    struct NDArray *emptySum = NDArray_add(empty, empty);
+    CHECK(emptySum != 0 && emptySum->ndim == 40 && emptySum->dataCount == 0);
+
+    NDArray_free(emptySum);
+    NDArray_free(empty);
+    NDArray_free(contiguous);
+    NDArray_free(transposed);
+    NDArray_free(converted);
+    NDArray_free(maxima);
+    NDArray_free(total);
+    NDArray_free(product);
+    NDArray_free(sum);
+    NDArray_free(b);
+    NDArray_free(a);
+}
+
+// op on x and y, or on x alone for unary ops, in double
+static double naiveUfunc(enum NDArrayUfunc op, double x, double y)
+{
+    switch (op)
+    {
+    case NDARRAY_ADD:
+        return x + y;
+    case NDARRAY_SUBTRACT:
+        return x - y;
+    case NDARRAY_MULTIPLY:
+        return x * y;
+    case NDARRAY_DIVIDE:
+        return x / y;
+    case NDARRAY_POWER:
+        return pow(x, y);
+    case NDARRAY_MINIMUM:
+        return x < y ? x : y;
+    case NDARRAY_MAXIMUM:
+        return x > y ? x : y;
+    case NDARRAY_EQUAL:
+        return x == y;
+    case NDARRAY_NOT_EQUAL:
+        return x != y;
+    case NDARRAY_LESS:
+        return x < y;
+    case NDARRAY_LESS_EQUAL:
+        return x <= y;
+    case NDARRAY_GREATER:
+        return x > y;
+    case NDARRAY_GREATER_EQUAL:
+        return x >= y;
+    case NDARRAY_EXP:
+        return exp(x);
+    case NDARRAY_LOG:
+        return log(x);
+    case NDARRAY_SQRT:
+        return sqrt(x);
+    case NDARRAY_ABS:
+        return fabs(x);
+    }
+    return 0;
+}
+
+// A binary op, or a unary one if b is 0, against naiveUfunc on every element of the broadcast
+static void checkUfunc(enum NDArrayUfunc op, struct NDArray *a, struct NDArray *b, int line)
+{
+    int ndim = a->ndim;
+    int shape[ndim > 0 ? ndim : 1];
+    for (int i = 0; i < ndim; i++)
+    {
+        shape[i] = b != 0 && b->shape[i] > a->shape[i] ? b->shape[i] : a->shape[i];
+    }
+    long count = elementCount(shape, ndim);
+    double *expected = (double *)malloc(sizeof(double) * (count > 0 ? count : 1));
+    for (long flat = 0; flat < count; flat++)
+    {
+        // Flat positions in a and b, with their length 1 axes broadcast
+        long flatA = 0, flatB = 0, rest = flat, scaleA = 1, scaleB = 1;
+        for (int i = ndim - 1; i >= 0; i--)
+        {
+            long index = rest % shape[i];
+            rest /= shape[i];
+            flatA += (a->shape[i] == 1 ? 0 : index) * scaleA;
+            scaleA *= a->shape[i];
+            if (b != 0)
+            {
+                flatB += (b->shape[i] == 1 ? 0 : index) * scaleB;
+                scaleB *= b->shape[i];
+            }
+        }
+        expected[flat] = naiveUfunc(op, element(a, flatA), b != 0 ? element(b, flatB) : 0);
+    }
+    struct NDArray *result = b != 0 ? NDArray_binary(op, a, b) : NDArray_unary(op, a);
+    checkArray(result, expected, shape, ndim, "element-wise result", line);
+    NDArray_free(result);
+    free(expected);
+}
+
+// The vector kernels against the reference for every dtype, at lengths either side of each
+// vector width, through each of their fast paths: contiguous inputs, a broadcast scalar on
+// either side, and an input with a constant step. The scalar-only build of this file checks
+// the portable kernels against the same reference
+static void testSimd(void)
+{
+    enum NDArrayUfunc ops[] = {NDARRAY_ADD, NDARRAY_SUBTRACT, NDARRAY_MULTIPLY, NDARRAY_DIVIDE,
+                               NDARRAY_MINIMUM, NDARRAY_MAXIMUM, NDARRAY_ABS};
+    enum NDArrayDType dtypes[] = {NDARRAY_FLOAT32, NDARRAY_FLOAT64, NDARRAY_INT32, NDARRAY_INT64};
+    for (int d = 0; d < 4; d++)
+    {
+        for (int n = 1; n <= 40; n++)
+        {
+            int length[] = {n};
+            int doubled[] = {2 * n};
+            int one[] = {1};
+            struct NDArray *a = randomTyped(length, 1, dtypes[d]);
+            struct NDArray *b = randomTyped(length, 1, dtypes[d]);
+            struct NDArray *scalar = randomTyped(one, 1, dtypes[d]);
+            struct NDArray *wide = randomTyped(doubled, 1, dtypes[d]);
+            struct NDArraySlice everyOther[] = {{1, INT_MAX, 2}};
+            struct NDArray *strided = NDArray_slice(wide, everyOther, 1);
+            for (int i = 0; i < 7; i++)
+            {
+                if (ops[i] == NDARRAY_ABS)
+                {
+                    checkUfunc(ops[i], a, 0, __LINE__);
+                    checkUfunc(ops[i], strided, 0, __LINE__);
+                    continue;
+                }
+                checkUfunc(ops[i], a, b, __LINE__);
+                checkUfunc(ops[i], a, scalar, __LINE__);
+                checkUfunc(ops[i], scalar, b, __LINE__);
+                checkUfunc(ops[i], strided, b, __LINE__);
+                checkUfunc(ops[i], a, strided, __LINE__);
+            }
+            NDArray_free(strided);
+            NDArray_free(wide);
+            NDArray_free(scalar);
+            NDArray_free(b);
+            NDArray_free(a);
+        }
+    }
+
+    // The _out form writing into a non-contiguous out takes the scalar loop
+    int length[] = {37};
+    struct NDArray *wide = NDArray_zeros((int[]){74}, 1);
+    struct NDArray *a = randomTyped(length, 1, wide->dtype);
+    struct NDArray *b = randomTyped(length, 1, wide->dtype);
+    struct NDArraySlice everyOther[] = {{0, INT_MAX, 2}};
+    struct NDArray *out = NDArray_slice(wide, everyOther, 1);
+    CHECK(NDArray_binary_out(NDARRAY_MULTIPLY, a, b, out) == 0);
+    double expected[37];
+    for (int i = 0; i < 37; i++)
+    {
+        expected[i] = element(a, i) * element(b, i);
+    }
+    CHECK_ARRAY(out, expected, length, 1);
+    NDArray_free(out);
+    NDArray_free(b);
+    NDArray_free(a);
+    NDArray_free(wide);
+}
+
+// Allocator that checks every release against the blocks it handed out
+struct CountingAllocator
+{
+    void *blocks[64];
+    size_t sizes[64];
+    int allocations;
+    int releases;
+    int mismatches;
+};
+
+static void *countingAllocate(void *context, size_t size)
+{
+    struct CountingAllocator *counts = (struct CountingAllocator *)context;
+    if (counts->allocations == 64)
+    {
+        return 0;
+    }
+    void *block = malloc(size);
+    counts->blocks[counts->allocations] = block;
+    counts->sizes[counts->allocations] = size;
+    counts->allocations++;
+    return block;
+}
+
+static void countingRelease(void *context, void *pointer, size_t size)
+{
+    struct CountingAllocator *counts = (struct CountingAllocator *)context;
+    int i = 0;
+    while (i < counts->allocations && counts->blocks[i] != pointer)
+    {
+        i++;
+    }
+    if (i == counts->allocations || counts->sizes[i] != size)
+    {
+        counts->mismatches++;
+    }
+    else
+    {
+        counts->blocks[i] = 0;
+    }
+    counts->releases++;
+    free(pointer);
+}
+
+static void *poolArrays(void *arrays)
+{
+    NDArray_setAllocator(NDArray_poolAllocator());
+    for (int i = 0; i < 100; i++)
+    {
+        ((struct NDArray **)arrays)[i] = filled((int[]){i % 5 + 1}, 1, i);
+    }
+    return 0;
+}
+
+static void *freeArrays(void *arrays)
+{
+    for (int i = 0; i < 100; i++)
+    {
+        NDArray_free(((struct NDArray **)arrays)[i]);
+    }
+    return 0;
+}
+
+static void testAllocators(void)
+{
+    CHECK(NDArray_getAllocator() != 0);
+    const struct NDArrayAllocator *system = NDArray_getAllocator();
+
+    // Every block goes back through the allocator that provided it, with its size, even after
+    // the thread has moved on to another allocator
+    struct CountingAllocator counts = {0};
+    struct NDArrayAllocator counting = {countingAllocate, countingRelease, &counts};
+    NDArray_setAllocator(&counting);
+    CHECK(NDArray_getAllocator() == &counting);
+    int shape[] = {3, 4};
+    struct NDArray *a = filled(shape, 2, 2);
+    struct NDArray *b = filled((int[]){4, 3}, 2, 2);
+    struct NDArray *c = NDArray_matmul(a, b);
+    NDArray_setAllocator(0);
+    CHECK(NDArray_getAllocator() == system);
+    double expected[9];
+    for (int i = 0; i < 9; i++)
+    {
+        expected[i] = 16;
+    }
+    CHECK_ARRAY(c, expected, ((int[]){3, 3}), 2);
+    CHECK(counts.allocations > 0);
+    NDArray_free(c);
+    NDArray_free(b);
+    NDArray_free(a);
+    CHECK(counts.releases == counts.allocations);
+    CHECK(counts.mismatches == 0);
+
+    // Allocation failures in the custom allocator come back as errors
+    counts.allocations = 64;
+    NDArray_setAllocator(&counting);
+    CHECK(NDArray_zeros(shape, 2) == 0);
+    NDArray_setAllocator(0);
+
+    // The pool reuses released blocks
+    NDArray_setAllocator(NDArray_poolAllocator());
+    CHECK(NDArray_getAllocator() == NDArray_poolAllocator());
+    struct NDArray *first = filled(shape, 2, 1);
+    void *data = first->data;
+    NDArray_free(first);
+    struct NDArray *second = filled(shape, 2, 3);
+    CHECK(second->data == data);
+    CHECK(element(second, 11) == 3);
+    NDArray_free(second);
+
+    // Blocks can be freed on a thread that didn't make them, including after that thread has
+    // exited, and a thread's blocks can outlive it
+    struct NDArray *arrays[100];
+    pthread_t thread;
+    CHECK(pthread_create(&thread, 0, poolArrays, arrays) == 0);
+    pthread_join(thread, 0);
+    for (int i = 0; i < 100; i++)
+    {
+        CHECK(arrays[i]->shape[0] == i % 5 + 1 && element(arrays[i], 0) == i);
+    }
+    freeArrays(arrays);
+    poolArrays(arrays);
+    CHECK(pthread_create(&thread, 0, freeArrays, arrays) == 0);
+    pthread_join(thread, 0);
+    // Big blocks fall through to malloc
+    struct NDArray *big = filled((int[]){1000}, 1, 5);
+    CHECK(element(big, 999) == 5);
+    NDArray_free(big);
+    NDArray_setAllocator(0);
+
+    // Freeing arena arrays is a no-op, and reset hands the same memory out again
+    NDArray_setAllocator(NDArray_arenaAllocator());
+    struct NDArray *x = filled(shape, 2, 4);
+    struct NDArray *y = filled(shape, 2, 5);
+    struct NDArray *sum = NDArray_add(x, y);
+    CHECK(element(sum, 0) == 9 && element(sum, 11) == 9);
+    NDArray_free(x);
+    CHECK(element(y, 0) == 5);
+    void *start = x;
+    NDArray_free(y);
+    NDArray_free(sum);
+    NDArray_arenaReset();
+    struct NDArray *z = filled(shape, 2, 6);
+    CHECK((void *)z == start);
+    CHECK(element(z, 0) == 6);
+    NDArray_free(z);
+    // More than a chunk's worth in one frame
+    for (int i = 0; i < 3; i++)
+    {
+        NDArray_free(NDArray_zeros((int[]){200000}, 1));
+    }
+    NDArray_arenaReset();
+    struct NDArray *large = filled((int[]){200000}, 1, 7);
+    CHECK(element(large, 199999) == 7);
+    NDArray_arenaReset();
+    NDArray_setAllocator(0);
+}
+
+#define THREADED_OPS 9
+
+// Results of each threaded op on inputs big enough to split
+static void threadedOps(struct NDArray **inputs, struct NDArray **results)
+{
+    struct NDArray *wide = inputs[0], *tall = inputs[1], *batch = inputs[2];
+    int all[] = {0, 1};
+    int rows[] = {0};
+    results[0] = NDArray_add(wide, wide);
+    results[1] = NDArray_unary(NDARRAY_EXP, wide);
+    results[2] = NDArray_reduce(NDARRAY_SUM, wide, all, 2, 0);
+    results[3] = NDArray_reduce(NDARRAY_SUM, wide, rows, 1, 0);
+    results[4] = NDArray_reduce(NDARRAY_ARGMAX, wide, all, 2, 0);
+    results[5] = NDArray_astype(wide, NDARRAY_FLOAT64);
+    results[6] = NDArray_ascontiguous(tall);
+    results[7] = NDArray_matmul(wide, tall);
+    results[8] = NDArray_inv(batch);
+}
+
+// Splitting work across threads mustn't change any bit of the results
+static void testThreads(void)
+{
+    int wideShape[] = {300, 400};
+    int batchShape[] = {5000, 3, 3};
+    struct NDArray *inputs[3];
+    inputs[0] = randomArray(wideShape, 2);
+    inputs[1] = randomArray(wideShape, 2);
+    CHECK(NDArray_transpose(inputs[1], (int[]){1, 0}) == 0);
+    inputs[2] = randomArray(batchShape, 3);
+    for (int i = 0; i < 5000; i++)
+    {
+        // Diagonally dominant, so well away from singular
+        for (int j = 0; j < 3; j++)
+        {
+            inputs[2]->data[i * 9 + j * 4] += 4;
+        }
+    }
+
+    struct NDArray *serial[THREADED_OPS], *parallel[THREADED_OPS];
+    NDArray_setNumThreads(1);
+    CHECK(NDArray_getNumThreads() == 1);
+    threadedOps(inputs, serial);
+    NDArray_setNumThreads(4);
+    CHECK(NDArray_getNumThreads() == 4);
+    threadedOps(inputs, parallel);
+    NDArray_setNumThreads(0);
+    CHECK(NDArray_getNumThreads() >= 1);
+
+    for (int i = 0; i < THREADED_OPS; i++)
+    {
+        struct NDArray *a = serial[i], *b = parallel[i];
+        bool same = a != 0 && b != 0 && a->ndim == b->ndim && a->dtype == b->dtype && a->dataCount == b->dataCount;
+        for (int j = 0; same && j < a->ndim; j++)
+        {
+            same = a->shape[j] == b->shape[j];
+        }
+        if (same)
+        {
+            same = memcmp(a->data, b->data, (size_t)a->dataCount * NDArray_itemSize(a->dtype)) == 0;
+        }
+        check(same, "results for 1 and 4 threads are the same", __LINE__);
+        NDArray_free(b);
+        NDArray_free(a);
+    }
+    for (int i = 0; i < 3; i++)
+    {
+        NDArray_free(inputs[i]);
+    }
+}
+
+// Random n x n matrices, made diagonally dominant so they are well conditioned
+static struct NDArray *randomMatrices(int count, int n)
+{
+    int shape[] = {count, n, n};
+    struct NDArray *batch = randomArray(shape, 3);
+    for (int b = 0; b < count; b++)
+    {
+        for (int i = 0; i < n; i++)
+        {
+            batch->data[(b * n + i) * n + i] += n;
+        }
+    }
+    return batch;
+}
+
+// Batches of up to 8 x 8 are inverted several matrices at a time, one per vector lane, with
+// the last group padded. Each inverse is checked on its own and against inverting its matrix
+// alone, which takes the one matrix at a time path
+static void testInverse(void)
+{
+    int counts[] = {1, 3, 4, 8, 13, 17};
+    for (int n = 1; n <= 9; n++)
+    {
+        struct NDArray *identity = NDArray_eye(n);
+        CHECK(NDArray_reshape(identity, (int[]){1, n, n}, 3) == 0);
+        for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+        {
+            struct NDArray *batch = randomMatrices(counts[c], n);
+            struct NDArray *inverse = NDArray_inv(batch);
+            checkSolution(batch, inverse, identity, __LINE__);
+            for (int b = 0; inverse != 0 && b < counts[c]; b += 5)
+            {
+                struct NDArraySlice one[] = {{b, b + 1, 1}};
+                struct NDArray *matrix = NDArray_slice(batch, one, 1);
+                struct NDArray *alone = NDArray_inv(matrix);
+                struct NDArray *part = NDArray_slice(inverse, one, 1);
+                long count = elementCount(part->shape, 3);
+                double *expected = malloc(sizeof(double) * count);
+                for (long i = 0; i < count; i++)
+                {
+                    expected[i] = element(alone, i);
+                }
+                CHECK_ARRAY(part, expected, ((int[]){1, n, n}), 3);
+                free(expected);
+                NDArray_free(part);
+                NDArray_free(alone);
+                NDArray_free(matrix);
+            }
+
+            // Transposed matrices, read through their steps, and inverting in place
+            CHECK(NDArray_swapAxes(batch, 1, 2) == 0);
+            struct NDArray *transposed = NDArray_inv(batch);
+            checkSolution(batch, transposed, identity, __LINE__);
+            struct NDArray *copy = NDArray_ascontiguous(batch);
+            CHECK(NDArray_inv_out(copy, copy) == 0);
+            checkSolution(batch, copy, identity, __LINE__);
+            NDArray_free(copy);
+            NDArray_free(transposed);
+            NDArray_free(inverse);
+            NDArray_free(batch);
+        }
+
+        // Permutation matrices, which need a row swap in every column, and whose inverse is
+        // their transpose. One lane in the group has the identity instead
+        struct NDArray *permutations = NDArray_zeros((int[]){13, n, n}, 3);
+        for (int b = 0; b < 13; b++)
+        {
+            for (int i = 0; i < n; i++)
+            {
+                int j = b == 6 ? i : (i + 1 + b) % n;
+                permutations->data[(b * n + i) * n + j] = 1;
+            }
+        }
+        struct NDArray *undone = NDArray_inv(permutations);
+        CHECK(NDArray_swapAxes(permutations, 1, 2) == 0);
+        double *expected = malloc(sizeof(double) * 13 * n * n);
+        for (long i = 0; i < 13 * n * n; i++)
+        {
+            expected[i] = element(permutations, i);
+        }
+        CHECK_ARRAY(undone, expected, ((int[]){13, n, n}), 3);
+        free(expected);
+        NDArray_free(undone);
+
+        // A singular matrix anywhere in the batch fails the whole call
+        struct NDArray *batch = randomMatrices(13, n);
+        for (int i = 0; i < n; i++)
+        {
+            batch->data[(9 * n + i) * n + (n > 1 ? 1 : 0)] = 0;
+            batch->data[(9 * n + i) * n] = 0;
+        }
+        struct NDArray *out = NDArray_zeros(batch->shape, 3);
+        CHECK(NDArray_inv_out(batch, out) == 3);
+        CHECK(NDArray_inv(batch) == 0);
+        CHECK(NDArray_inv_out(batch, identity) == 2);
+        NDArray_free(out);
+        NDArray_free(batch);
+        NDArray_free(permutations);
+        NDArray_free(identity);
+    }
+}
+
+// Every registered op on broadcast inputs of every dtype, mixed dtypes included, against
+// naiveUfunc, and the shorthands against the ops they stand for
+static void testUfuncs(void)
+{
+    enum NDArrayDType dtypes[] = {NDARRAY_FLOAT32, NDARRAY_FLOAT64, NDARRAY_INT32, NDARRAY_INT64};
+    int shapeA[] = {3, 1, 5};
+    int shapeB[] = {1, 4, 5};
+    for (int d = 0; d < 4; d++)
+    {
+        struct NDArray *a = randomTyped(shapeA, 3, dtypes[d]);
+        struct NDArray *b = randomTyped(shapeB, 3, dtypes[(d + 1) % 4]);
+        struct NDArray *same = randomTyped(shapeB, 3, dtypes[d]);
+        struct NDArray *magnitude = NDArray_unary(NDARRAY_ABS, a);
+        struct NDArray *small = randomTyped(shapeB, 3, dtypes[d]);
+        for (int op = NDARRAY_ADD; op <= NDARRAY_GREATER_EQUAL; op++)
+        {
+            if (op == NDARRAY_POWER)
+            {
+                continue;
+            }
+            checkUfunc(op, a, b, __LINE__);
+            checkUfunc(op, a, same, __LINE__);
+            // Ties for the comparisons and min and max
+            checkUfunc(op, a, a, __LINE__);
+        }
+        // Small exponents, so integer powers stay exact in float32
+        for (int i = 0; i < small->dataCount; i++)
+        {
+            int index[] = {0, i / 5, i % 5};
+            NDArray_set(small, index, (NDARRAY_TYPE)(i % 4));
+        }
+        checkUfunc(NDARRAY_POWER, magnitude, small, __LINE__);
+        for (int op = NDARRAY_EXP; op <= NDARRAY_ABS; op++)
+        {
+            checkUfunc(op, op == NDARRAY_EXP ? a : magnitude, 0, __LINE__);
+        }
+        NDArray_free(small);
+        NDArray_free(magnitude);
+        NDArray_free(same);
+        NDArray_free(b);
+        NDArray_free(a);
+    }
+
+    struct NDArray *a = randomArray(shapeA, 3);
+    struct NDArray *b = randomArray(shapeB, 3);
+    struct NDArray *(*shorthands[])(struct NDArray *, struct NDArray *) = {
+        NDArray_add, NDArray_subtract, NDArray_multiply, NDArray_divide, NDArray_power,
+        NDArray_minimum, NDArray_maximum, NDArray_equal, NDArray_notEqual, NDArray_less,
+        NDArray_lessEqual, NDArray_greater, NDArray_greaterEqual};
+    for (int op = NDARRAY_ADD; op <= NDARRAY_GREATER_EQUAL; op++)
+    {
+        struct NDArray *expected = NDArray_binary(op, a, b);
+        struct NDArray *actual = shorthands[op](a, b);
+        CHECK(actual != 0 && expected != 0 &&
+              memcmp(actual->data, expected->data, sizeof(NDARRAY_TYPE) * actual->dataCount) == 0);
+        NDArray_free(actual);
+        NDArray_free(expected);
+    }
+    struct NDArray *(*unaryShorthands[])(struct NDArray *) = {NDArray_exp, NDArray_log, NDArray_sqrt,
+                                                              NDArray_abs};
+    struct NDArray *positive = NDArray_abs(a);
+    for (int op = NDARRAY_EXP; op <= NDARRAY_ABS; op++)
+    {
+        struct NDArray *expected = NDArray_unary(op, positive);
+        struct NDArray *actual = unaryShorthands[op - NDARRAY_EXP](positive);
+        CHECK(actual != 0 && expected != 0 &&
+              memcmp(actual->data, expected->data, sizeof(NDARRAY_TYPE) * actual->dataCount) == 0);
+        NDArray_free(actual);
+        NDArray_free(expected);
+    }
+
+    // Unary ops through NDArray_binary and the other way round, shapes that don't broadcast,
+    // and an out of the wrong shape
+    CHECK(NDArray_binary(NDARRAY_EXP, a, b) == 0);
+    CHECK(NDArray_unary(NDARRAY_ADD, a) == 0);
+    CHECK(NDArray_binary((enum NDArrayUfunc)100, a, b) == 0);
+    struct NDArray *wrong = randomArray((int[]){3, 4, 4}, 3);
+    CHECK(NDArray_binary(NDARRAY_LESS, a, wrong) == 0);
+    CHECK(NDArray_binary_out(NDARRAY_LESS, a, b, wrong) == 2);
+    CHECK(NDArray_unary_out(NDARRAY_SQRT, positive, wrong) == 2);
+
+    // In place, with out as one of the inputs
+    struct NDArray *out = NDArray_ascontiguous(positive);
+    CHECK(NDArray_unary_out(NDARRAY_SQRT, out, out) == 0);
+    double expected[15];
+    for (int i = 0; i < 15; i++)
+    {
+        expected[i] = sqrt(element(positive, i));
+    }
+    CHECK_ARRAY(out, expected, shapeA, 3);
+    NDArray_free(out);
+    NDArray_free(wrong);
+    NDArray_free(positive);
+    NDArray_free(b);
+    NDArray_free(a);
+}
+
+static void checkSame(struct NDArray *actual, struct NDArray *expected, int line)
+{
+    if (expected == 0)
+    {
+        printf("line %d: no reference result\n", line);
+        failures++;
+        return;
+    }
+    long count = elementCount(expected->shape, expected->ndim);
+    double *values = malloc(sizeof(double) * (count > 0 ? count : 1));
+    for (long i = 0; i < count; i++)
+    {
+        values[i] = element(expected, i);
+    }
+    checkArray(actual, values, expected->shape, expected->ndim, "expression", line);
+    free(values);
+}
+
+// Expressions against the same ops run one at a time
+static void testExpr(void)
+{
+    int shapeA[] = {3, 1, 70};
+    int shapeB[] = {1, 4, 70};
+    struct NDArray *a = randomArray(shapeA, 3);
+    struct NDArray *b = randomArray(shapeB, 3);
+    struct NDArray *c = randomTyped(shapeB, 3, NDARRAY_INT32);
+    struct NDArray *t = randomArray((int[]){70, 4, 3}, 3);
+    CHECK(NDArray_transpose(t, (int[]){2, 1, 0}) == 0);
+
+    // a * b + c - sqrt(|t|), with broadcasting, an integer leaf and a transposed one
+    struct NDArrayExpr *expr = NDArray_exprBinary(
+        NDARRAY_SUBTRACT,
+        NDArray_exprBinary(NDARRAY_ADD,
+                           NDArray_exprBinary(NDARRAY_MULTIPLY, NDArray_exprArray(a), NDArray_exprArray(b)),
+                           NDArray_exprArray(c)),
+        NDArray_exprUnary(NDARRAY_SQRT, NDArray_exprUnary(NDARRAY_ABS, NDArray_exprArray(t))));
+    struct NDArray *product = NDArray_multiply(a, b);
+    struct NDArray *plus = NDArray_add(product, c);
+    struct NDArray *magnitude = NDArray_abs(t);
+    struct NDArray *root = NDArray_sqrt(magnitude);
+    struct NDArray *eager = NDArray_subtract(plus, root);
+    struct NDArray *lazy = NDArray_exprEval(expr);
+    checkSame(lazy, eager, __LINE__);
+
+    // Sums along each axis, including of an expression
+    for (int axis = 0; axis < 3; axis++)
+    {
+        struct NDArray *sum = NDArray_sum(eager, axis);
+        struct NDArrayExpr *sumExpr = NDArray_exprSum(NDArray_exprRetain(expr), axis);
+        struct NDArray *lazySum = NDArray_exprEval(sumExpr);
+        checkSame(lazySum, sum, __LINE__);
+        NDArray_free(lazySum);
+        NDArray_exprFree(sumExpr);
+        NDArray_free(sum);
+        sum = NDArray_sum(t, axis);
+        sumExpr = NDArray_exprSum(NDArray_exprArray(t), axis);
+        lazySum = NDArray_exprEval(sumExpr);
+        checkSame(lazySum, sum, __LINE__);
+        NDArray_free(lazySum);
+        NDArray_exprFree(sumExpr);
+        NDArray_free(sum);
+    }
+    NDArray_exprFree(expr);
+
+    // A node used twice is computed from one set of inputs, and outlives the expressions
+    // using it for as long as it's retained
+    struct NDArrayExpr *shared = NDArray_exprBinary(NDARRAY_ADD, NDArray_exprArray(a), NDArray_exprArray(b));
+    struct NDArrayExpr *square = NDArray_exprBinary(NDARRAY_MULTIPLY, NDArray_exprRetain(shared),
+                                                    NDArray_exprRetain(shared));
+    struct NDArray *sum = NDArray_add(a, b);
+    struct NDArray *squared = NDArray_multiply(sum, sum);
+    struct NDArray *result = NDArray_exprEval(square);
+    checkSame(result, squared, __LINE__);
+    NDArray_free(result);
+    NDArray_exprFree(square);
+    result = NDArray_exprEval(shared);
+    checkSame(result, sum, __LINE__);
+    NDArray_free(result);
+    NDArray_exprFree(shared);
+
+    // Invalid input gives 0 and releases the inputs it was given
+    CHECK(NDArray_exprUnary(NDARRAY_ADD, NDArray_exprArray(a)) == 0);
+    CHECK(NDArray_exprBinary(NDARRAY_EXP, NDArray_exprArray(a), NDArray_exprArray(b)) == 0);
+    struct NDArray *mismatched = randomArray((int[]){2, 4, 70}, 3);
+    CHECK(NDArray_exprBinary(NDARRAY_ADD, NDArray_exprArray(a), NDArray_exprArray(mismatched)) == 0);
+    NDArray_free(mismatched);
+    CHECK(NDArray_exprBinary(NDARRAY_ADD, 0, NDArray_exprArray(b)) == 0);
+    CHECK(NDArray_exprSum(NDArray_exprArray(a), 3) == 0);
+    CHECK(NDArray_exprSum(NDArray_exprSum(NDArray_exprArray(a), 0), 0) == 0);
+    CHECK(NDArray_exprUnary(NDARRAY_EXP, NDArray_exprSum(NDArray_exprArray(a), 0)) == 0);
+    CHECK(NDArray_exprEval(0) == 0);
+    // Out of memory, where the inputs are released too
+    struct NDArrayExpr *left = NDArray_exprArray(a);
+    struct NDArrayExpr *right = NDArray_exprArray(b);
+    struct CountingAllocator full = {.allocations = 64};
+    struct NDArrayAllocator failing = {countingAllocate, countingRelease, &full};
+    NDArray_setAllocator(&failing);
+    CHECK(NDArray_exprArray(a) == 0);
+    CHECK(NDArray_exprBinary(NDARRAY_ADD, left, right) == 0);
+    NDArray_setAllocator(0);
+    struct NDArrayExpr *copy = NDArray_exprArray(a);
+    CHECK(NDArray_exprEval_out(copy, b) == 2);
+    struct NDArray *integers = NDArray_zerosDType(shapeA, 3, NDARRAY_INT32);
+    CHECK(NDArray_exprEval_out(copy, integers) == 2);
+    NDArray_free(integers);
+    NDArray_exprFree(copy);
+
+    // Summing 10^7 copies of 0.1 stays as accurate as NDArray_sum, which is compensated
+    int length[] = {10000000};
+    struct NDArray *tenths = NDArray_zeros(length, 1);
+    for (int i = 0; i < length[0]; i++)
+    {
+        tenths->data[i] = (NDARRAY_TYPE)0.1;
+    }
+    struct NDArray *total = NDArray_sum(tenths, 0);
+    struct NDArrayExpr *totalExpr = NDArray_exprSum(NDArray_exprArray(tenths), 0);
+    struct NDArray *lazyTotal = NDArray_exprEval(totalExpr);
+    NDArray_exprFree(totalExpr);
+    CHECK(total != 0 && lazyTotal != 0 && lazyTotal->ndim == 0);
+    CHECK(fabs(element(total, 0) - 1e6) < 1);
+    CHECK(fabs(element(lazyTotal, 0) - element(total, 0)) < 1);
+    NDArray_free(lazyTotal);
+    NDArray_free(total);
+    NDArray_free(tenths);
+
+    NDArray_free(squared);
+    NDArray_free(sum);
+    NDArray_free(lazy);
+    NDArray_free(eager);
+    NDArray_free(root);
+    NDArray_free(magnitude);
+    NDArray_free(plus);
+    NDArray_free(product);
+    NDArray_free(t);
+    NDArray_free(c);
+    NDArray_free(b);
+    NDArray_free(a);
+}
+
+// value as storing it in dtype would leave it
+static double convertTo(double value, enum NDArrayDType dtype)
+{
+    switch (dtype)
+    {
+    case NDARRAY_FLOAT32:
+        return (float)value;
+    case NDARRAY_FLOAT64:
+        return value;
+    default:
+        return trunc(value);
+    }
+}
+
+// Random values of dtype with magnitude at least 1, for dividing by
+static struct NDArray *randomDivisors(int *shape, int ndim, enum NDArrayDType dtype)
+{
+    struct NDArray *array = randomTyped(shape, ndim, dtype);
+    for (int i = 0; i < array->dataCount; i++)
+    {
+        int index[ndim];
+        for (int j = ndim - 1, rest = i; j >= 0; j--)
+        {
+            index[j] = rest % shape[j];
+            rest /= shape[j];
+        }
+        double value = NDArray_get(array, index);
+        if (fabs(value) < 1)
+        {
+            NDArray_set(array, index, (NDARRAY_TYPE)(value < 0 ? value - 1 : value + 1));
+        }
+    }
+    return array;
+}
+
+// Conversions, promotion, and ops whose operands and output have different dtypes, which
+// convert through buffers of a few hundred elements at a time
+static void testDTypes(void)
+{
+    enum NDArrayDType dtypes[] = {NDARRAY_FLOAT32, NDARRAY_FLOAT64, NDARRAY_INT32, NDARRAY_INT64};
+    enum NDArrayDType promoted[4][4] = {
+        {NDARRAY_FLOAT32, NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_FLOAT64},
+        {NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_FLOAT64},
+        {NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_INT32, NDARRAY_INT64},
+        {NDARRAY_FLOAT64, NDARRAY_FLOAT64, NDARRAY_INT64, NDARRAY_INT64},
+    };
+    int shapeA[] = {2, 300};
+    int shapeB[] = {1, 300};
+    double *expected = malloc(sizeof(double) * 600);
+    for (int i = 0; i < 4; i++)
+    {
+        CHECK(NDArray_itemSize(dtypes[i]) == (i % 2 == 0 ? 4 : 8));
+        for (int j = 0; j < 4; j++)
+        {
+            CHECK(NDArray_promoteTypes(dtypes[i], dtypes[j]) == promoted[i][j]);
+        }
+    }
+
+    for (int i = 0; i < 4; i++)
+    {
+        // Every other column of a wider array, so the conversions read through steps
+        struct NDArray *wide = randomTyped((int[]){2, 600}, 2, dtypes[i]);
+        struct NDArraySlice everyOther[] = {NDARRAY_SLICE_ALL, {1, INT_MAX, 2}};
+        struct NDArray *a = NDArray_slice(wide, everyOther, 2);
+        for (int j = 0; j < 4; j++)
+        {
+            for (long k = 0; k < 600; k++)
+            {
+                expected[k] = convertTo(element(a, k), dtypes[j]);
+            }
+            struct NDArray *converted = NDArray_astype(a, dtypes[j]);
+            CHECK(converted != 0 && converted->dtype == dtypes[j]);
+            CHECK_ARRAY(converted, expected, shapeA, 2);
+            struct NDArray *out = NDArray_zerosDType(shapeA, 2, dtypes[j]);
+            CHECK(NDArray_astype_out(a, out) == 0);
+            CHECK_ARRAY(out, expected, shapeA, 2);
+            struct NDArray *wrong = NDArray_zerosDType(shapeB, 2, dtypes[j]);
+            CHECK(NDArray_astype_out(a, wrong) == 2);
+            NDArray_free(wrong);
+            NDArray_free(out);
+            NDArray_free(converted);
+
+            // add and divide on every pair, into their own dtype and into outs of every dtype
+            struct NDArray *b = randomDivisors(shapeB, 2, dtypes[j]);
+            enum NDArrayUfunc ops[] = {NDARRAY_ADD, NDARRAY_DIVIDE};
+            for (int o = 0; o < 2; o++)
+            {
+                enum NDArrayDType dtype = promoted[i][j];
+                if (ops[o] == NDARRAY_DIVIDE && dtype != NDARRAY_FLOAT32)
+                {
+                    dtype = NDARRAY_FLOAT64;
+                }
+                for (long k = 0; k < 600; k++)
+                {
+                    expected[k] = convertTo(naiveUfunc(ops[o], element(a, k), element(b, k % 300)), dtype);
+                }
+                struct NDArray *result = NDArray_binary(ops[o], a, b);
+                CHECK(result != 0 && result->dtype == dtype);
+                CHECK_ARRAY(result, expected, shapeA, 2);
+                NDArray_free(result);
+                for (int d = 0; d < 4; d++)
+                {
+                    double converted[600];
+                    for (long k = 0; k < 600; k++)
+                    {
+                        converted[k] = convertTo(expected[k], dtypes[d]);
+                    }
+                    struct NDArray *typed = NDArray_zerosDType(shapeA, 2, dtypes[d]);
+                    CHECK(NDArray_binary_out(ops[o], a, b, typed) == 0);
+                    CHECK_ARRAY(typed, converted, shapeA, 2);
+                    NDArray_free(typed);
+                }
+            }
+            NDArray_free(b);
+
+            // Sums accumulate in a float out of either width, and argmax stores its index as
+            // any dtype
+            int axes[] = {1};
+            for (long k = 0; k < 2; k++)
+            {
+                double sum = 0;
+                int best = 0;
+                for (int m = 0; m < 300; m++)
+                {
+                    sum += element(a, k * 300 + m);
+                    best = element(a, k * 300 + m) > element(a, k * 300 + best) ? m : best;
+                }
+                expected[k] = sum;
+                expected[2 + k] = best;
+            }
+            int rows[] = {2};
+            if (j < 2)
+            {
+                struct NDArray *sum = NDArray_zerosDType(rows, 1, dtypes[j]);
+                CHECK(NDArray_reduce_out(NDARRAY_SUM, a, axes, 1, 0, sum) == 0);
+                CHECK_ARRAY(sum, expected, rows, 1);
+                NDArray_free(sum);
+            }
+            struct NDArray *index = NDArray_zerosDType(rows, 1, dtypes[j]);
+            CHECK(NDArray_reduce_out(NDARRAY_ARGMAX, a, axes, 1, 0, index) == 0);
+            CHECK_ARRAY(index, expected + 2, rows, 1);
+            NDArray_free(index);
+            if (j == 0)
+            {
+                struct NDArray *sum = NDArray_reduce(NDARRAY_SUM, a, axes, 1, 0);
+                CHECK(sum != 0 && sum->dtype == (dtypes[i] == NDARRAY_FLOAT32 ? NDARRAY_FLOAT32 : NDARRAY_FLOAT64));
+                CHECK_ARRAY(sum, expected, rows, 1);
+                struct NDArray *best = NDArray_reduce(NDARRAY_ARGMAX, a, axes, 1, 0);
+                CHECK(best != 0 && best->dtype == NDARRAY_INT64);
+                CHECK_ARRAY(best, expected + 2, rows, 1);
+                NDArray_free(best);
+                NDArray_free(sum);
+            }
+        }
+        // Integer sums need a float out
+        struct NDArray *integer = NDArray_zerosDType((int[]){2}, 1, NDARRAY_INT64);
+        CHECK(NDArray_reduce_out(NDARRAY_SUM, a, (int[]){1}, 1, 0, integer) == 2);
+        NDArray_free(integer);
+        CHECK(NDArray_astype(a, (enum NDArrayDType)4) == 0);
+        NDArray_free(a);
+        NDArray_free(wide);
+    }
+    free(expected);
+}
+
+struct Deleted
+{
+    void *data;
+    int calls;
+};
+
+static void countDeletes(void *data, void *context)
+{
+    struct Deleted *deleted = (struct Deleted *)context;
+    deleted->data = data;
+    deleted->calls++;
+}
+
+// Arrays over caller-owned memory, which is handed back exactly once when nothing uses it
+static void testFromBuffer(void)
+{
+    double values[12];
+    double expected[12];
+    for (int i = 0; i < 12; i++)
+    {
+        values[i] = i;
+    }
+    int shape[] = {3, 4};
+
+    // No steps means C order. Views keep the memory in use after the original is freed
+    struct Deleted deleted = {0, 0};
+    struct NDArray *wrapped = NDArray_fromBuffer(values, shape, 0, 2, NDARRAY_FLOAT64, countDeletes, &deleted);
+    CHECK_ARRAY(wrapped, values, shape, 2);
+    struct NDArraySlice lastRows[] = {{1, INT_MAX, 1}};
+    struct NDArray *view = NDArray_slice(wrapped, lastRows, 1);
+    struct NDArray *copy = NDArray_copy(wrapped);
+    struct NDArray *sum = NDArray_add(wrapped, wrapped);
+    NDArray_free(wrapped);
+    NDArray_free(sum);
+    CHECK(deleted.calls == 0);
+    values[4] = 40;
+    CHECK(element(view, 0) == 40);
+    NDArray_free(view);
+    CHECK(deleted.calls == 0);
+    NDArray_free(copy);
+    CHECK(deleted.calls == 1 && deleted.data == values);
+    values[4] = 4;
+
+    // A contiguous copy made in place lets go of the memory straight away
+    deleted.calls = 0;
+    wrapped = NDArray_fromBuffer(values, shape, (int[]){1, 3}, 2, NDARRAY_FLOAT64, countDeletes, &deleted);
+    for (int i = 0; i < 12; i++)
+    {
+        expected[i] = values[i / 4 + i % 4 * 3];
+    }
+    CHECK_ARRAY(wrapped, expected, shape, 2);
+    CHECK(NDArray_makeContiguous(wrapped) == 0);
+    CHECK(deleted.calls == 1);
+    CHECK_ARRAY(wrapped, expected, shape, 2);
+    NDArray_free(wrapped);
+    CHECK(deleted.calls == 1);
+
+    // Negative steps from element zero at the end of the memory run backwards through it
+    deleted.calls = 0;
+    wrapped = NDArray_fromBuffer(values + 11, shape, (int[]){-4, -1}, 2, NDARRAY_FLOAT64, countDeletes, &deleted);
+    CHECK(wrapped != 0 && wrapped->dataCount == 12);
+    for (int i = 0; i < 12; i++)
+    {
+        expected[i] = 11 - i;
+    }
+    CHECK_ARRAY(wrapped, expected, shape, 2);
+    struct NDArray *contiguous = NDArray_ascontiguous(wrapped);
+    CHECK_ARRAY(contiguous, expected, shape, 2);
+    NDArray_free(contiguous);
+    NDArray_free(wrapped);
+    CHECK(deleted.calls == 1 && deleted.data == values + 11);
+
+    // Without a deleter the memory is just left alone, and other dtypes are read as such
+    int32_t integers[] = {5, -6, 7};
+    wrapped = NDArray_fromBuffer(integers, (int[]){3}, 0, 1, NDARRAY_INT32, 0, 0);
+    CHECK(wrapped != 0 && wrapped->dtype == NDARRAY_INT32);
+    CHECK_ARRAY(wrapped, ((double[]){5, -6, 7}), ((int[]){3}), 1);
+    NDArray_free(wrapped);
+
+    // Failures leave the memory with the caller, without calling the deleter
+    deleted.calls = 0;
+    CHECK(NDArray_fromBuffer(0, shape, 0, 2, NDARRAY_FLOAT64, countDeletes, &deleted) == 0);
+    CHECK(NDArray_fromBuffer(values, (int[]){3, -4}, 0, 2, NDARRAY_FLOAT64, countDeletes, &deleted) == 0);
+    CHECK(NDArray_fromBuffer(values, shape, 0, -1, NDARRAY_FLOAT64, countDeletes, &deleted) == 0);
+    CHECK(NDArray_fromBuffer(values, shape, 0, 2, (enum NDArrayDType)4, countDeletes, &deleted) == 0);
+    CHECK(NDArray_fromBuffer(values, (int[]){65536, 65536}, 0, 2, NDARRAY_FLOAT64, countDeletes, &deleted) == 0);
+    struct CountingAllocator full = {.allocations = 64};
+    struct NDArrayAllocator failing = {countingAllocate, countingRelease, &full};
+    for (int allowed = 0; allowed < 2; allowed++)
+    {
+        full.allocations = 64 - allowed;
+        NDArray_setAllocator(&failing);
+        CHECK(NDArray_fromBuffer(values, shape, 0, 2, NDARRAY_FLOAT64, countDeletes, &deleted) == 0);
+        NDArray_setAllocator(0);
+    }
+    CHECK(deleted.calls == 0);
+}
+
+// Indices start:stop:step takes from an axis of length, as Python's slice.indices gives them.
+// Returns how many there are
+static int sliceIndices(int start, int stop, int step, int length, int *indices)
+{
+    long first, last;
+    if (step > 0)
+    {
+        first = start < 0 ? (long)start + length : start;
+        first = first < 0 ? 0 : first > length ? length : first;
+        last = stop < 0 ? (long)stop + length : stop;
+        last = last < 0 ? 0 : last > length ? length : last;
+    }
+    else
+    {
+        first = start < 0 ? (long)start + length : start;
+        first = first < 0 ? -1 : first >= length ? length - 1 : first;
+        last = stop < 0 ? (long)stop + length : stop;
+        last = last < 0 ? -1 : last >= length ? length - 1 : last;
+    }
+    int count = 0;
+    for (long i = first; step > 0 ? i < last : i > last; i += step)
+    {
+        indices[count++] = (int)i;
+    }
+    return count;
+}
+
+// Slices with every combination of bounds and steps either way, against Python's rules
+static void testSlice(void)
+{
+    int bounds[] = {INT_MIN, -9, -7, -3, -1, 0, 1, 2, 5, 6, 7, 9, INT_MAX};
+    int steps[] = {-7, -3, -2, -1, 1, 2, 3, 7};
+    int nbounds = sizeof(bounds) / sizeof(bounds[0]);
+    for (int length = 0; length <= 7; length++)
+    {
+        int shape[] = {length};
+        struct NDArray *array = randomArray(shape, 1);
+        for (int i = 0; i < nbounds; i++)
+        {
+            for (int j = 0; j < nbounds; j++)
+            {
+                for (int k = 0; k < (int)(sizeof(steps) / sizeof(steps[0])); k++)
+                {
+                    int indices[8];
+                    int count = sliceIndices(bounds[i], bounds[j], steps[k], length, indices);
+                    double expected[8];
+                    for (int m = 0; m < count; m++)
+                    {
+                        expected[m] = element(array, indices[m]);
+                    }
+                    struct NDArraySlice slice[] = {{bounds[i], bounds[j], steps[k]}};
+                    struct NDArray *view = NDArray_slice(array, slice, 1);
+                    checkArray(view, expected, &count, 1, "slice", __LINE__);
+                    NDArray_free(view);
+                }
+            }
+        }
+        NDArray_free(array);
+    }
+
+    // Reversed rows and every other column backwards, then sliced again, writing through to
+    // the original
+    int shape[] = {4, 6};
+    struct NDArray *array = randomArray(shape, 2);
+    struct NDArraySlice backwards[] = {NDARRAY_SLICE_REVERSE, {-1, INT_MIN, -2}};
+    struct NDArray *view = NDArray_slice(array, backwards, 2);
+    double expected[24];
+    for (int i = 0; i < 4; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            expected[i * 3 + j] = element(array, (3 - i) * 6 + 5 - 2 * j);
+        }
+    }
+    CHECK_ARRAY(view, expected, ((int[]){4, 3}), 2);
+    struct NDArraySlice again[] = {{2, 0, -1}, {0, INT_MAX, 2}};
+    struct NDArray *twice = NDArray_slice(view, again, 2);
+    double twiceExpected[] = {expected[6], expected[8], expected[3], expected[5]};
+    CHECK_ARRAY(twice, twiceExpected, ((int[]){2, 2}), 2);
+    NDArray_set(twice, (int[]){1, 1}, 50);
+    CHECK(element(array, 2 * 6 + 1) == 50);
+    struct NDArray *copy = NDArray_ascontiguous(twice);
+    twiceExpected[3] = 50;
+    CHECK_ARRAY(copy, twiceExpected, ((int[]){2, 2}), 2);
+
+    struct NDArraySlice zeroStep[] = {{0, INT_MAX, 0}};
+    CHECK(NDArray_slice(array, zeroStep, 1) == 0);
+    NDArray_free(copy);
+    NDArray_free(twice);
+    NDArray_free(view);
+    NDArray_free(array);
+}
+
+struct Traced
+{
+    int calls[NDARRAY_STAT_OPS];
+    uint64_t nanoseconds;
+    size_t bytes;
+};
+
+static void traceOp(enum NDArrayStatOp op, uint64_t nanoseconds, size_t bytes, void *context)
+{
+    struct Traced *traced = (struct Traced *)context;
+    traced->calls[op]++;
+    traced->nanoseconds += nanoseconds;
+    traced->bytes += bytes;
+}
+
+// Counters, live and peak bytes through each allocator, and the trace callback
+static void testStats(void)
+{
+    struct NDArrayStats stats;
+    NDArray_resetStats();
+    NDArray_getStats(&stats);
+    CHECK(stats.calls[NDARRAY_STAT_ELEMENTWISE] == 0 && stats.allocations == 0 && stats.bytesAllocated == 0);
+    CHECK(stats.peakLiveBytes == stats.liveBytes);
+    uint64_t live = stats.liveBytes;
+
+    int shape[] = {30, 40};
+    struct NDArray *a = randomArray(shape, 2);
+    struct NDArray *sum = NDArray_add(a, a);
+    struct NDArray *wide = NDArray_astype(a, NDARRAY_FLOAT64);
+    NDArray_getStats(&stats);
+    CHECK(stats.calls[NDARRAY_STAT_ELEMENTWISE] == 1 && stats.calls[NDARRAY_STAT_ASTYPE] == 1);
+    CHECK(stats.bytes[NDARRAY_STAT_ASTYPE] == 1200 * sizeof(double));
+    CHECK(stats.allocations >= 3 && stats.bytesAllocated > 1200 * (2 * sizeof(NDARRAY_TYPE) + sizeof(double)));
+    CHECK(stats.liveBytes == live + stats.bytesAllocated && stats.peakLiveBytes == stats.liveBytes);
+    NDArray_free(wide);
+    NDArray_free(sum);
+    NDArray_free(a);
+    NDArray_getStats(&stats);
+    CHECK(stats.liveBytes == live && stats.peakLiveBytes > live);
+
+    // Reshaping a transposed array has to copy it, and says so
+    a = randomArray(shape, 2);
+    CHECK(NDArray_transpose(a, (int[]){1, 0}) == 0);
+    NDArray_resetStats();
+    CHECK(NDArray_reshape(a, (int[]){1200}, 1) == 0);
+    struct NDArray *copy = NDArray_ascontiguous(a);
+    NDArray_getStats(&stats);
+    CHECK(stats.calls[NDARRAY_STAT_IMPLICIT_COPY] == 1);
+    CHECK(stats.bytes[NDARRAY_STAT_IMPLICIT_COPY] == 1200 * sizeof(NDARRAY_TYPE));
+    CHECK(stats.calls[NDARRAY_STAT_MAKE_CONTIGUOUS] == 1);
+    NDArray_free(copy);
+    NDArray_free(a);
+
+    // The pool releases like malloc. The arena holds on to its blocks, freed or not, until
+    // it's reset, so frame after frame leaves nothing behind
+    NDArray_getStats(&stats);
+    live = stats.liveBytes;
+    NDArray_setAllocator(NDArray_poolAllocator());
+    a = randomArray(shape, 2);
+    NDArray_free(a);
+    NDArray_getStats(&stats);
+    CHECK(stats.liveBytes == live);
+    NDArray_setAllocator(NDArray_arenaAllocator());
+    NDArray_resetStats();
+    for (int frame = 0; frame < 100; frame++)
+    {
+        a = randomArray(shape, 2);
+        sum = NDArray_add(a, a);
+        NDArray_free(a);
+        NDArray_getStats(&stats);
+        CHECK(stats.liveBytes > live);
+        NDArray_arenaReset();
+        NDArray_getStats(&stats);
+        CHECK(stats.liveBytes == live);
+    }
+    CHECK(stats.peakLiveBytes < live + 3 * 1200 * sizeof(NDARRAY_TYPE));
+    NDArray_setAllocator(0);
+
+    // Tracing reports each op as it finishes, and times ops while it's on
+    struct Traced traced = {{0}, 0, 0};
+    NDArray_resetStats();
+    NDArray_setTrace(traceOp, &traced);
+    a = randomArray(shape, 2);
+    struct NDArray *b = randomArray((int[]){40, 30}, 2);
+    struct NDArray *product = NDArray_matmul(a, b);
+    CHECK(NDArray_transpose(a, (int[]){1, 0}) == 0);
+    CHECK(NDArray_reshape(a, (int[]){1200}, 1) == 0);
+    NDArray_setTrace(0, 0);
+    struct NDArray *untraced = NDArray_add(b, b);
+    NDArray_getStats(&stats);
+    CHECK(traced.calls[NDARRAY_STAT_MATMUL] == 1 && traced.calls[NDARRAY_STAT_IMPLICIT_COPY] == 1);
+    CHECK(traced.calls[NDARRAY_STAT_ELEMENTWISE] == 0 && stats.calls[NDARRAY_STAT_ELEMENTWISE] == 1);
+    CHECK(traced.bytes == 1200 * sizeof(NDARRAY_TYPE));
+    CHECK(traced.nanoseconds > 0 && stats.nanoseconds[NDARRAY_STAT_MATMUL] > 0);
+    NDArray_free(untraced);
+    NDArray_free(product);
+    NDArray_free(b);
+    NDArray_free(a);
+}
+
+// array's contiguous copy, and the same copy made in place, against array read element by element
+static void checkContiguous(struct NDArray *array, int line)
+{
+    long count = elementCount(array->shape, array->ndim);
+    double *expected = malloc(sizeof(double) * (count > 0 ? count : 1));
+    for (long i = 0; i < count; i++)
+    {
+        expected[i] = element(array, i);
+    }
+    struct NDArray *copy = NDArray_ascontiguous(array);
+    checkArray(copy, expected, array->shape, array->ndim, "NDArray_ascontiguous(array)", line);
+    bool rowMajor = copy != 0 && copy->dtype == array->dtype;
+    for (int i = array->ndim - 1, step = 1; rowMajor && i >= 0; i--)
+    {
+        rowMajor = copy->steps[i] == step;
+        step *= array->shape[i];
+    }
+    check(rowMajor, "the copy is row-major and keeps the dtype", line);
+
+    // A view taken before an in-place copy keeps the old data
+    struct NDArray *view = NDArray_copy(array);
+    struct NDArray *inPlace = NDArray_copy(array);
+    check(NDArray_makeContiguous(inPlace) == 0, "NDArray_makeContiguous(array) == 0", line);
+    checkArray(inPlace, expected, array->shape, array->ndim, "NDArray_makeContiguous(array)", line);
+    if (count > 0)
+    {
+        char *first = (char *)inPlace->data;
+        memset(first, 0, NDArray_itemSize(inPlace->dtype));
+        check(element(view, 0) == expected[0], "views keep the old data", line);
+    }
+    NDArray_free(inPlace);
+    NDArray_free(view);
+    NDArray_free(copy);
+    free(expected);
+}
+
+// Contiguous copies of transposed, permuted, sliced and broadcast layouts. Transposes are
+// copied in tiles of a vector's width, so the sizes straddle those
+static void testContiguous(void)
+{
+    enum NDArrayDType dtypes[] = {NDARRAY_FLOAT32, NDARRAY_FLOAT64, NDARRAY_INT32, NDARRAY_INT64};
+    int sizes[] = {1, 3, 7, 8, 9, 16, 17, 33};
+    for (int d = 0; d < 4; d++)
+    {
+        for (int i = 0; i < 8; i++)
+        {
+            for (int j = 0; j < 8; j++)
+            {
+                struct NDArray *array = randomTyped((int[]){sizes[i], sizes[j]}, 2, dtypes[d]);
+                CHECK(NDArray_transpose(array, (int[]){1, 0}) == 0);
+                checkContiguous(array, __LINE__);
+                NDArray_free(array);
+            }
+        }
+
+        // Every permutation of a 3-d array, then slices of it
+        int permutations[][3] = {{0, 1, 2}, {0, 2, 1}, {1, 0, 2}, {1, 2, 0}, {2, 0, 1}, {2, 1, 0}};
+        for (int p = 0; p < 6; p++)
+        {
+            struct NDArray *array = randomTyped((int[]){5, 18, 20}, 3, dtypes[d]);
+            CHECK(NDArray_transpose(array, permutations[p]) == 0);
+            checkContiguous(array, __LINE__);
+            struct NDArraySlice slices[] = {{1, INT_MAX, 2}, NDARRAY_SLICE_REVERSE, {-2, 0, -3}};
+            struct NDArray *sliced = NDArray_slice(array, slices, 3);
+            checkContiguous(sliced, __LINE__);
+            NDArray_free(sliced);
+            NDArray_free(array);
+        }
+    }
+
+    // A transposed slice, a broadcast view, and 0-d and empty arrays
+    struct NDArray *array = randomArray((int[]){40, 30}, 2);
+    struct NDArraySlice block[] = {{3, 37, 1}, {29, 2, -2}};
+    struct NDArray *sliced = NDArray_slice(array, block, 2);
+    CHECK(NDArray_transpose(sliced, (int[]){1, 0}) == 0);
+    checkContiguous(sliced, __LINE__);
+    struct NDArray *row = randomArray((int[]){1, 30}, 2);
+    struct NDArray *broadcast = NDArray_broadcastTo(row, (int[]){20, 30});
+    checkContiguous(broadcast, __LINE__);
+    struct NDArray *scalar = NDArray_single(3, 0);
+    checkContiguous(scalar, __LINE__);
+    struct NDArray *empty = NDArray_zeros((int[]){0, 5}, 2);
+    CHECK(NDArray_transpose(empty, (int[]){1, 0}) == 0);
+    checkContiguous(empty, __LINE__);
+    NDArray_free(empty);
+    NDArray_free(scalar);
+    NDArray_free(broadcast);
+    NDArray_free(row);
+    NDArray_free(sliced);
+    NDArray_free(array);
+}
+
+// 1 - 2 x + x^2 / 2 - x^3 / 8 by Horner's scheme in double
+static double cubic(double x)
+{
+    return ((-0.125 * x + 0.5) * x - 2) * x + 1;
+}
+
+// Vandermonde matrices, and fitting and evaluating a known cubic
+static void testPolynomials(void)
+{
+    double cubicCoefficients[] = {1, -2, 0.5, -0.125};
+
+    struct NDArray *points = NDArray_zerosDType((int[]){3}, 1, NDARRAY_FLOAT32);
+    memcpy(points->data, (float[]){2, -1, 0.5f}, sizeof(float) * 3);
+    struct NDArray *vander = NDArray_vander(points, 4);
+    CHECK(vander != 0 && vander->dtype == NDARRAY_FLOAT32);
+    double powers[] = {1, 2, 4, 8, 1, -1, 1, -1, 1, 0.5, 0.25, 0.125};
+    CHECK_ARRAY(vander, powers, ((int[]){3, 4}), 2);
+    struct NDArray *integers = NDArray_zerosDType((int[]){3}, 1, NDARRAY_INT64);
+    memcpy(integers->data, (int64_t[]){2, -1, 3}, sizeof(int64_t) * 3);
+    struct NDArray *integerVander = NDArray_vander(integers, 3);
+    CHECK(integerVander != 0 && integerVander->dtype == NDARRAY_FLOAT64);
+    CHECK_ARRAY(integerVander, ((double[]){1, 2, 4, 1, -1, 1, 1, 3, 9}), ((int[]){3, 3}), 2);
+    struct NDArray *noColumns = NDArray_vander(points, 0);
+    CHECK_ARRAY(noColumns, powers, ((int[]){3, 0}), 2);
+
+    // Points of the cubic, through a reversed view so x is read through its steps
+    int n = 12;
+    struct NDArray *x = NDArray_zeros(&n, 1);
+    struct NDArray *y = NDArray_zeros(&n, 1);
+    for (int i = 0; i < n; i++)
+    {
+        x->data[i] = (NDARRAY_TYPE)(i * 0.5 - 2);
+        y->data[i] = (NDARRAY_TYPE)cubic(i * 0.5 - 2);
+    }
+    struct NDArraySlice reverse[] = {NDARRAY_SLICE_REVERSE};
+    struct NDArray *xBackwards = NDArray_slice(x, reverse, 1);
+    struct NDArray *yBackwards = NDArray_slice(y, reverse, 1);
+    struct NDArray *fit = NDArray_polyfit(xBackwards, yBackwards, 3);
+    CHECK_ARRAY(fit, cubicCoefficients, ((int[]){4}), 1);
+    // Fitting a higher degree leaves the extra coefficients at 0
+    struct NDArray *quintic = NDArray_polyfit(x, y, 5);
+    CHECK_ARRAY(quintic, ((double[]){1, -2, 0.5, -0.125, 0, 0}), ((int[]){6}), 1);
+
+    // Evaluating on a transposed grid, long enough for the vector kernels, in the coefficients'
+    // float64 and in x's integers
+    struct NDArray *coefficients = NDArray_zerosDType((int[]){4}, 1, NDARRAY_FLOAT64);
+    memcpy(coefficients->data, cubicCoefficients, sizeof(cubicCoefficients));
+    struct NDArray *grid = randomArray((int[]){37, 5}, 2);
+    CHECK(NDArray_transpose(grid, (int[]){1, 0}) == 0);
+    double expected[185];
+    for (int i = 0; i < 185; i++)
+    {
+        expected[i] = cubic(element(grid, i));
+    }
+    struct NDArray *values = NDArray_polyval(coefficients, grid);
+    CHECK(values != 0 && values->dtype == NDARRAY_FLOAT64);
+    CHECK_ARRAY(values, expected, ((int[]){5, 37}), 2);
+    struct NDArray *nativeValues = NDArray_polyval(fit, grid);
+    CHECK_ARRAY(nativeValues, expected, ((int[]){5, 37}), 2);
+    struct NDArray *integerValues = NDArray_polyval(coefficients, integers);
+    CHECK_ARRAY(integerValues, ((double[]){cubic(2), cubic(-1), cubic(3)}), ((int[]){3}), 1);
+
+    // Coefficients read backwards, a 0-d x, an integer out, and no coefficients at all
+    struct NDArray *backwards = NDArray_slice(coefficients, reverse, 1);
+    struct NDArray *two = NDArray_single(2, 0);
+    struct NDArray *reversedValue = NDArray_polyval(backwards, two);
+    CHECK_ARRAY(reversedValue, ((double[]){-0.125 + 0.5 * 2 - 2 * 4 + 8}), 0, 0);
+    struct NDArray *integerOut = NDArray_zerosDType((int[]){3}, 1, NDARRAY_INT32);
+    CHECK(NDArray_polyval_out(coefficients, integers, integerOut) == 0);
+    CHECK_ARRAY(integerOut, ((double[]){trunc(cubic(2)), trunc(cubic(-1)), trunc(cubic(3))}), ((int[]){3}), 1);
+    struct NDArray *none = NDArray_zeros((int[]){0}, 1);
+    struct NDArray *zeros = NDArray_polyval(none, integers);
+    CHECK_ARRAY(zeros, ((double[]){0, 0, 0}), ((int[]){3}), 1);
+
+    // The documented failures: too few distinct points for the degree, a negative degree or
+    // column count, and outs or inputs of the wrong shape
+    struct NDArray *repeated = NDArray_zeros((int[]){5}, 1);
+    struct NDArray *repeatedY = NDArray_zeros((int[]){5}, 1);
+    for (int i = 0; i < 5; i++)
+    {
+        repeated->data[i] = (NDARRAY_TYPE)(i / 2);
+        repeatedY->data[i] = (NDARRAY_TYPE)cubic(i / 2);
+    }
+    struct NDArray *enough = NDArray_polyfit(repeated, repeatedY, 2);
+    CHECK(enough != 0);
+    CHECK(NDArray_polyfit(repeated, repeatedY, 3) == 0);
+    CHECK(NDArray_polyfit(x, y, -1) == 0);
+    CHECK(NDArray_polyfit(x, repeatedY, 1) == 0);
+    CHECK(NDArray_vander(points, -1) == 0);
+    CHECK(NDArray_vander(grid, 3) == 0);
+    CHECK(NDArray_polyval(grid, points) == 0);
+    CHECK(NDArray_polyval_out(coefficients, integers, integerVander) == 2);
+    struct CountingAllocator full = {.allocations = 64};
+    struct NDArrayAllocator failing = {countingAllocate, countingRelease, &full};
+    NDArray_setAllocator(&failing);
+    CHECK(NDArray_polyval_out(backwards, two, reversedValue) == 1);
+    NDArray_setAllocator(0);
+
+    NDArray_free(enough);
+    NDArray_free(repeatedY);
+    NDArray_free(repeated);
+    NDArray_free(zeros);
+    NDArray_free(none);
+    NDArray_free(integerOut);
+    NDArray_free(reversedValue);
+    NDArray_free(two);
+    NDArray_free(backwards);
+    NDArray_free(integerValues);
+    NDArray_free(nativeValues);
+    NDArray_free(values);
+    NDArray_free(grid);
+    NDArray_free(coefficients);
+    NDArray_free(quintic);
+    NDArray_free(fit);
+    NDArray_free(yBackwards);
+    NDArray_free(xBackwards);
+    NDArray_free(y);
+    NDArray_free(x);
+    NDArray_free(noColumns);
+    NDArray_free(integerVander);
+    NDArray_free(integers);
+    NDArray_free(vander);
+    NDArray_free(points);
+}
+
+// Determinant of matrix b of an LU factorization: the product of U's diagonal, negated for
+// each row swap
+static double luDeterminant(struct NDArrayLU *lu, int b, int n)
+{
+    double det = 1;
+    for (int i = 0; i < n; i++)
+    {
+        double pivot = lu->lu->data[(b * n + i) * n + i];
+        det *= lu->pivots[b * n + i] != i ? -pivot : pivot;
+    }
+    return det;
+}
+
+static void checkAgainst(struct NDArray *actual, struct NDArray *expected, int line)
+{
+    long count = elementCount(expected->shape, expected->ndim);
+    double *values = malloc(sizeof(double) * (count > 0 ? count : 1));
+    for (long i = 0; i < count; i++)
+    {
+        values[i] = element(expected, i);
+    }
+    checkArray(actual, values, expected->shape, expected->ndim, "small path against general", line);
+    free(values);
+}
+
+// Up to 8 x 8, det, solve and inv take fixed-size kernels, with cofactors up to 4 x 4, and
+// 9 x 9 takes the general LU factorization, which each is checked against. Products with every
+// dimension up to 8 take their own kernel too, checked against the brute-force product
+static void testSmallMatrices(void)
+{
+    int counts[] = {1, 3, 13};
+    for (int n = 1; n <= 9; n++)
+    {
+        struct NDArray *identity = NDArray_eye(n);
+        CHECK(NDArray_reshape(identity, (int[]){1, n, n}, 3) == 0);
+        for (int c = 0; c < (int)(sizeof(counts) / sizeof(counts[0])); c++)
+        {
+            int count = counts[c];
+            struct NDArray *batch = randomMatrices(count, n);
+            // Transposed, so the kernels read through the steps
+            if (c == 1)
+            {
+                CHECK(NDArray_swapAxes(batch, 1, 2) == 0);
+            }
+            struct NDArrayLU *lu = NDArray_lu(batch);
+            CHECK(lu != 0 && !lu->singular);
+            if (lu == 0)
+            {
+                NDArray_free(batch);
+                continue;
+            }
+
+            struct NDArray *det = NDArray_det(batch);
+            double expected[13];
+            for (int b = 0; b < count; b++)
+            {
+                expected[b] = luDeterminant(lu, b, n);
+            }
+            CHECK_ARRAY(det, expected, ((int[]){count}), 1);
+
+            int columns[] = {1, n};
+            for (int k = 0; k < 2; k++)
+            {
+                struct NDArray *b = randomArray((int[]){1, n, columns[k]}, 3);
+                struct NDArray *x = NDArray_solve(batch, b);
+                struct NDArray *general = NDArray_luSolve(lu, b);
+                checkSolution(batch, x, b, __LINE__);
+                checkAgainst(x, general, __LINE__);
+                NDArray_free(general);
+                NDArray_free(x);
+                NDArray_free(b);
+            }
+
+            struct NDArray *inverse = NDArray_inv(batch);
+            struct NDArray *general = NDArray_luSolve(lu, identity);
+            checkAgainst(inverse, general, __LINE__);
+            NDArray_free(general);
+            NDArray_free(inverse);
+            NDArray_free(det);
+            NDArray_luFree(lu);
+            NDArray_free(batch);
+        }
+
+        // Batch dimensions of their own shape the result, and a single matrix gives a 0-d one
+        struct NDArray *batch = randomMatrices(6, n);
+        CHECK(NDArray_reshape(batch, (int[]){2, 3, n, n}, 4) == 0);
+        struct NDArray *det = NDArray_det(batch);
+        CHECK(det != 0 && det->ndim == 2 && det->shape[0] == 2 && det->shape[1] == 3);
+        struct NDArraySlice one[] = {{1, 2, 1}, {2, 3, 1}};
+        struct NDArray *matrix = NDArray_slice(batch, one, 2);
+        CHECK(NDArray_squeeze(matrix, 0) == 0 && NDArray_squeeze(matrix, 0) == 0);
+        struct NDArray *single = NDArray_det(matrix);
+        CHECK(single != 0 && single->ndim == 0);
+        struct NDArray *out = NDArray_single(0, 0);
+        CHECK(NDArray_det_out(matrix, out) == 0);
+        CHECK_ARRAY(single, ((double[]){element(det, 5)}), 0, 0);
+        CHECK_ARRAY(out, ((double[]){element(det, 5)}), 0, 0);
+        CHECK(NDArray_det_out(batch, out) == 2);
+        CHECK(NDArray_det_out(matrix, det) == 2);
+
+        // A zero row gives a zero determinant exactly, and a singular matrix anywhere in the batch
+        // fails solve
+        for (int j = 0; j < n; j++)
+        {
+            batch->data[(4 * n + n / 2) * n + j] = 0;
+        }
+        CHECK(NDArray_det_out(batch, det) == 0);
+        CHECK(det != 0 && element(det, 4) == 0 && element(det, 3) != 0);
+        CHECK(NDArray_det_out(matrix, out) == 0 && element(out, 0) == element(det, 5));
+        struct NDArray *b = randomArray((int[]){1, 1, n, 2}, 4);
+        struct NDArray *x = NDArray_zeros((int[]){2, 3, n, 2}, 4);
+        CHECK(NDArray_solve_out(batch, b, x) == 3);
+        CHECK(NDArray_solve(batch, b) == 0);
+        CHECK(NDArray_inv(batch) == 0);
+        NDArray_free(x);
+        NDArray_free(b);
+        NDArray_free(out);
+        NDArray_free(single);
+        NDArray_free(matrix);
+        NDArray_free(det);
+        NDArray_free(batch);
+        NDArray_free(identity);
+    }
+
+    // The empty matrix has determinant 1, and a non-square one none
+    struct NDArray *empty = NDArray_zeros((int[]){0, 0}, 2);
+    struct NDArray *det = NDArray_det(empty);
+    CHECK_ARRAY(det, ((double[]){1}), 0, 0);
+    struct NDArray *wide = NDArray_zeros((int[]){2, 3}, 2);
+    CHECK(NDArray_det(wide) == 0);
+    CHECK(NDArray_det_out(wide, det) == 1);
+    NDArray_free(wide);
+    NDArray_free(det);
+    NDArray_free(empty);
+
+    // Every size around the small product limit, read directly, transposed and with broadcast
+    // batches, and an empty inner dimension
+    int sizes[] = {1, 2, 3, 4, 5, 7, 8, 9};
+    for (int i = 0; i < 8; i++)
+    {
+        for (int j = 0; j < 8; j++)
+        {
+            for (int p = 0; p < 8; p++)
+            {
+                struct NDArray *a = randomArray((int[]){3, 1, sizes[i], sizes[p]}, 4);
+                struct NDArray *b = randomArray((int[]){1, 2, sizes[j], sizes[p]}, 4);
+                CHECK(NDArray_swapAxes(b, 2, 3) == 0);
+                checkMatmul(a, b, __LINE__);
+                struct NDArraySlice first[] = {{0, 1, 1}, {0, 1, 1}};
+                struct NDArray *left = NDArray_slice(a, first, 2);
+                struct NDArray *right = NDArray_slice(b, first, 2);
+                checkMatmul(left, right, __LINE__);
+                NDArray_free(right);
+                NDArray_free(left);
+                NDArray_free(b);
+                NDArray_free(a);
+            }
+            struct NDArray *left = NDArray_zeros((int[]){sizes[i], 0}, 2);
+            struct NDArray *right = NDArray_zeros((int[]){0, sizes[j]}, 2);
+            checkMatmul(left, right, __LINE__);
+            NDArray_free(right);
+            NDArray_free(left);
+        }
+    }
+}
+
+// Brute-force reduction of a 3-d array over the axes set in mask, with the results in C order
+// over the kept axes. Arg reductions count in C order over the reduced axes
+static void naiveReduce(enum NDArrayReduce op, struct NDArray *array, int mask, double *expected)
+{
+    int *shape = array->shape;
+    int outCount = 1;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        outCount *= mask & (1 << axis) ? 1 : shape[axis];
+    }
+    for (int out = 0; out < outCount; out++)
+    {
+        double result = op == NDARRAY_PROD ? 1 : 0;
+        double best = 0;
+        int seen = 0;
+        int index[3];
+        for (long flat = 0; flat < elementCount(shape, 3); flat++)
+        {
+            // Skip the elements that don't reduce into out
+            long rest = flat;
+            int kept = 0;
+            int reduced = 0;
+            for (int axis = 2, keptScale = 1, reducedScale = 1; axis >= 0; axis--)
+            {
+                index[axis] = (int)(rest % shape[axis]);
+                rest /= shape[axis];
+                if (mask & (1 << axis))
+                {
+                    reduced += index[axis] * reducedScale;
+                    reducedScale *= shape[axis];
+                }
+                else
+                {
+                    kept += index[axis] * keptScale;
+                    keptScale *= shape[axis];
+                }
+            }
+            if (kept != out)
+            {
+                continue;
+            }
+            double value = NDArray_get(array, index);
+            bool lower = value < best;
+            bool higher = value > best;
+            switch (op)
+            {
+            case NDARRAY_SUM:
+            case NDARRAY_MEAN:
+                result += value;
+                break;
+            case NDARRAY_PROD:
+                result *= value;
+                break;
+            case NDARRAY_MIN:
+            case NDARRAY_ARGMIN:
+                result = seen == 0 || lower ? (op == NDARRAY_MIN ? value : reduced) : result;
+                best = seen == 0 || lower ? value : best;
+                break;
+            case NDARRAY_MAX:
+            case NDARRAY_ARGMAX:
+                result = seen == 0 || higher ? (op == NDARRAY_MAX ? value : reduced) : result;
+                best = seen == 0 || higher ? value : best;
+                break;
+            }
+            seen++;
+        }
+        expected[out] = op == NDARRAY_MEAN ? result / seen : result;
+    }
+}
+
+static void checkReduce(enum NDArrayReduce op, struct NDArray *array, int *axes, int naxes, int line)
+{
+    int mask = 0;
+    for (int i = 0; i < naxes; i++)
+    {
+        mask |= 1 << (axes[i] < 0 ? axes[i] + 3 : axes[i]);
+    }
+    double expected[64];
+    naiveReduce(op, array, mask, expected);
+
+    // Without keepdims the reduced axes go, and with it they stay with length 1
+    int shape[3];
+    int keptShape[3];
+    int ndim = 0;
+    for (int axis = 0; axis < 3; axis++)
+    {
+        keptShape[axis] = mask & (1 << axis) ? 1 : array->shape[axis];
+        if (!(mask & (1 << axis)))
+        {
+            shape[ndim++] = array->shape[axis];
+        }
+    }
+    struct NDArray *result = NDArray_reduce(op, array, axes, naxes, 0);
+    checkArray(result, expected, shape, ndim, "reduction", line);
+    struct NDArray *kept = NDArray_reduce(op, array, axes, naxes, 1);
+    checkArray(kept, expected, keptShape, 3, "reduction with keepdims", line);
+    NDArray_free(result);
+    NDArray_free(kept);
+}
+
+static void testReduce(void)
+{
+    int shape[] = {3, 4, 5};
+    struct NDArray *array = randomArray(shape, 3);
+    enum NDArrayReduce ops[] = {NDARRAY_SUM, NDARRAY_MEAN, NDARRAY_PROD, NDARRAY_MIN,
+                                NDARRAY_MAX, NDARRAY_ARGMIN, NDARRAY_ARGMAX};
+    int all[] = {0, 1, 2};
+    int outer[] = {0, 2};
+    int last[] = {-1};
+    int middle[] = {1};
+    for (int i = 0; i < 7; i++)
+    {
+        checkReduce(ops[i], array, all, 3, __LINE__);
+        checkReduce(ops[i], array, outer, 2, __LINE__);
+        checkReduce(ops[i], array, last, 1, __LINE__);
+        checkReduce(ops[i], array, middle, 1, __LINE__);
+    }
+
+    // Reversed axes have negative steps, and the arg variants still count along the view
+    struct NDArraySlice reverse[] = {NDARRAY_SLICE_ALL, NDARRAY_SLICE_REVERSE, NDARRAY_SLICE_REVERSE};
+    struct NDArray *reversed = NDArray_slice(array, reverse, 3);
+    int inner[] = {1, 2};
+    for (int i = 3; i < 7; i++)
+    {
+        checkReduce(ops[i], reversed, inner, 2, __LINE__);
+        checkReduce(ops[i], reversed, middle, 1, __LINE__);
+        checkReduce(ops[i], reversed, all, 3, __LINE__);
+    }
+
+    // A full reduction is 0-d, whether given every axis or none
+    struct NDArray *total = NDArray_reduce(NDARRAY_SUM, array, 0, 0, 0);
+    struct NDArray *totalAxes = NDArray_reduce(NDARRAY_SUM, array, all, 3, 0);
+    CHECK(total != 0 && totalAxes != 0 && total->ndim == 0);
+    CHECK_ARRAY(total, ((double[]){element(totalAxes, 0)}), 0, 0);
+
+    // A 1-d sum, directly and as the last step of an expression, gives a 0-d array
+    int five[] = {5};
+    struct NDArray *vector = NDArray_zeros(five, 1);
+    for (int i = 0; i < 5; i++)
+    {
+        vector->data[i] = i + 1;
+    }
+    struct NDArray *vectorSum = NDArray_sum(vector, 0);
+    CHECK_ARRAY(vectorSum, ((double[]){15}), 0, 0);
+    struct NDArrayExpr *squares = NDArray_exprBinary(NDARRAY_MULTIPLY, NDArray_exprArray(vector),
+                                                     NDArray_exprArray(vector));
+    struct NDArrayExpr *sumOfSquares = NDArray_exprSum(squares, 0);
+    CHECK(sumOfSquares != 0);
+    struct NDArray *evaluated = NDArray_exprEval(sumOfSquares);
+    CHECK_ARRAY(evaluated, ((double[]){55}), 0, 0);
+    NDArray_exprFree(sumOfSquares);
+
+    // min and max have nothing to give over an empty axis, while a sum is 0
+    int empty[] = {3, 0};
+    struct NDArray *nothing = NDArray_zeros(empty, 2);
+    int three[] = {3};
+    struct NDArray *out = NDArray_zeros(three, 1);
+    int second[] = {1};
+    CHECK(NDArray_reduce(NDARRAY_MIN, nothing, second, 1, 0) == 0);
+    CHECK(NDArray_reduce(NDARRAY_MAX, nothing, second, 1, 0) == 0);
+    CHECK(NDArray_reduce_out(NDARRAY_MIN, nothing, second, 1, 0, out) == 1);
+    CHECK(NDArray_reduce_out(NDARRAY_MAX, nothing, second, 1, 0, out) == 1);
+    struct NDArray *emptySum = NDArray_reduce(NDARRAY_SUM, nothing, second, 1, 0);
+    CHECK_ARRAY(emptySum, ((double[]){0, 0, 0}), three, 1);
+
+    // Compensated summation keeps 10M float32 elements to within rounding of the result. A
+    // plain float running sum stalls once the total dwarfs each element
+    int many[] = {10000000};
+    struct NDArray *floats = NDArray_zerosDType(many, 1, NDARRAY_FLOAT32);
+    for (int i = 0; i < many[0]; i++)
+    {
+        ((float *)floats->data)[i] = 0.1f;
+    }
+    struct NDArray *floatSum = NDArray_reduce(NDARRAY_SUM, floats, 0, 0, 0);
+    struct NDArray *floatMean = NDArray_reduce(NDARRAY_MEAN, floats, 0, 0, 0);
+    double exact = many[0] * (double)0.1f;
+    CHECK(floatSum != 0 && fabs(element(floatSum, 0) - exact) <= 1e-6 * exact);
+    CHECK(floatMean != 0 && fabs(element(floatMean, 0) - 0.1f) <= 1e-6 * 0.1f);
+
+    NDArray_free(floatSum);
+    NDArray_free(floatMean);
+    NDArray_free(floats);
+    NDArray_free(emptySum);
+    NDArray_free(out);
+    NDArray_free(nothing);
+    NDArray_free(evaluated);
+    NDArray_free(vectorSum);
+    NDArray_free(vector);
+    NDArray_free(total);
+    NDArray_free(totalAxes);
+    NDArray_free(reversed);
+    NDArray_free(array);
+}
+
+// Write a .npy file by hand, for layouts NDArray_save never writes. With pad, dict is padded so
+// the data starts on a 64 byte boundary, as numpy does; otherwise the header is dict alone
+static void writeNpy(const char *path, const char *dict, bool pad, const void *data, size_t size)
+{
+    char header[256];
+    int length = snprintf(header, sizeof(header), "%s", dict);
+    while (pad && (10 + length + 1) % 64 != 0)
+    {
+        header[length++] = ' ';
+    }
+    if (pad)
+    {
+        header[length++] = '\n';
+    }
+    unsigned char prefix[] = {0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0, length & 0xff, length >> 8};
+    FILE *file = fopen(path, "wb");
+    fwrite(prefix, 1, sizeof(prefix), file);
+    fwrite(header, 1, length, file);
+    fwrite(data, 1, size, file);
+    fclose(file);
+}
+
+static bool littleEndian(void)
+{
+    uint16_t one = 1;
+    return *(unsigned char *)&one == 1;
+}
+
+static void testFiles(void)
+{
+    // A transposed array is saved in its logical order, and comes back the same through
+    // NDArray_load, an .npz archive and a mapping
+    int shape[] = {3, 4};
+    struct NDArray *array = randomArray(shape, 2);
+    int order[] = {1, 0};
+    CHECK(NDArray_transpose(array, order) == 0);
+    int transposed[] = {4, 3};
+    double expected[12];
+    for (int i = 0; i < 12; i++)
+    {
+        expected[i] = element(array, i);
+    }
+    CHECK(NDArray_save("ndarray_tests_transposed.npy", array) == 0);
+    struct NDArray *loaded = NDArray_load("ndarray_tests_transposed.npy");
+    CHECK_ARRAY(loaded, expected, transposed, 2);
+    struct NDArray *mapped = NDArray_mmap("ndarray_tests_transposed.npy", NDARRAY_MAP_READ);
+    CHECK_ARRAY(mapped, expected, transposed, 2);
+
+    // Copy-on-write mappings can be written without touching the file
+    struct NDArray *copied = NDArray_mmap("ndarray_tests_transposed.npy", NDARRAY_MAP_COPY);
+    CHECK(copied != 0);
+    if (copied != 0)
+    {
+        copied->data[0] = 100;
+    }
+    struct NDArray *reloaded = NDArray_load("ndarray_tests_transposed.npy");
+    CHECK_ARRAY(reloaded, expected, transposed, 2);
+
+    // 0-d arrays and int64 elements beyond the range of an int
+    struct NDArray *scalar = NDArray_single(7, 0);
+    CHECK(NDArray_save("ndarray_tests_scalar.npy", scalar) == 0);
+    struct NDArray *scalarLoaded = NDArray_load("ndarray_tests_scalar.npy");
+    CHECK(scalarLoaded != 0 && scalarLoaded->ndim == 0);
+    CHECK_ARRAY(scalarLoaded, ((double[]){7}), 0, 0);
+
+    int four[] = {4};
+    struct NDArray *integers = NDArray_zerosDType(four, 1, NDARRAY_INT64);
+    int64_t values[] = {1, -2, ((int64_t)1 << 40) + 3, INT64_MIN};
+    memcpy(integers->data, values, sizeof(values));
+    CHECK(NDArray_save("ndarray_tests_int64.npy", integers) == 0);
+    struct NDArray *integersLoaded = NDArray_load("ndarray_tests_int64.npy");
+    CHECK(integersLoaded != 0 && integersLoaded->dtype == NDARRAY_INT64 && integersLoaded->ndim == 1 &&
+          integersLoaded->shape[0] == 4 && memcmp(integersLoaded->data, values, sizeof(values)) == 0);
+
+    // Archive members can be asked for with or without the .npy suffix numpy gives them
+    const char *names[] = {"transposed", "scalar", "integers"};
+    struct NDArray *arrays[] = {array, scalar, integers};
+    CHECK(NDArray_savez("ndarray_tests.npz", 3, names, arrays) == 0);
+    struct NDArray *member = NDArray_loadz("ndarray_tests.npz", "transposed");
+    CHECK_ARRAY(member, expected, transposed, 2);
+    struct NDArray *memberSuffix = NDArray_loadz("ndarray_tests.npz", "transposed.npy");
+    CHECK_ARRAY(memberSuffix, expected, transposed, 2);
+    struct NDArray *scalarMember = NDArray_loadz("ndarray_tests.npz", "scalar.npy");
+    CHECK_ARRAY(scalarMember, ((double[]){7}), 0, 0);
+    struct NDArray *integersMember = NDArray_loadz("ndarray_tests.npz", "integers");
+    CHECK(integersMember != 0 && integersMember->dtype == NDARRAY_INT64 &&
+          memcmp(integersMember->data, values, sizeof(values)) == 0);
+    CHECK(NDArray_loadz("ndarray_tests.npz", "transpose") == 0);
+    CHECK(NDArray_loadz("ndarray_tests.npz", "missing") == 0);
+
+    // Running out of memory while copying the transposed array out for writing, or after
+    // the header has been read for mapping, fails cleanly
+    struct CountingAllocator full = {.allocations = 64};
+    struct NDArrayAllocator failing = {countingAllocate, countingRelease, &full};
+    NDArray_setAllocator(&failing);
+    CHECK(NDArray_save("ndarray_tests_failed.npy", array) == 1);
+    full.allocations = 63;
+    CHECK(NDArray_savez("ndarray_tests_failed.npz", 1, names, arrays) == 1);
+    full.allocations = 63;
+    CHECK(NDArray_mmap("ndarray_tests_transposed.npy", NDARRAY_MAP_READ) == 0);
+    NDArray_setAllocator(0);
+
+    // Fortran order: a[i][j] = 10 i + j stored column by column
+    double fortranData[] = {0, 10, 1, 11, 2, 12};
+    char dict[128];
+    snprintf(dict, sizeof(dict), "{'descr': '%cf8', 'fortran_order': True, 'shape': (2, 3), }",
+             littleEndian() ? '<' : '>');
+    writeNpy("ndarray_tests_fortran.npy", dict, true, fortranData, sizeof(fortranData));
+    int twoByThree[] = {2, 3};
+    double fortranExpected[] = {0, 1, 2, 10, 11, 12};
+    struct NDArray *fortran = NDArray_load("ndarray_tests_fortran.npy");
+    CHECK_ARRAY(fortran, fortranExpected, twoByThree, 2);
+    struct NDArray *fortranMapped = NDArray_mmap("ndarray_tests_fortran.npy", NDARRAY_MAP_READ);
+    CHECK_ARRAY(fortranMapped, fortranExpected, twoByThree, 2);
+
+    // The other byte order is swapped on load, but can't be mapped
+    int32_t swappedData[] = {1, -2, 300000};
+    for (int i = 0; i < 3; i++)
+    {
+        uint32_t bits = (uint32_t)swappedData[i];
+        bits = bits >> 24 | (bits >> 8 & 0xff00) | (bits << 8 & 0xff0000) | bits << 24;
+        swappedData[i] = (int32_t)bits;
+    }
+    snprintf(dict, sizeof(dict), "{'descr': '%ci4', 'fortran_order': False, 'shape': (3,), }",
+             littleEndian() ? '>' : '<');
+    writeNpy("ndarray_tests_swapped.npy", dict, true, swappedData, sizeof(swappedData));
+    int three[] = {3};
+    struct NDArray *swapped = NDArray_load("ndarray_tests_swapped.npy");
+    CHECK(swapped != 0 && swapped->dtype == NDARRAY_INT32);
+    CHECK_ARRAY(swapped, ((double[]){1, -2, 300000}), three, 1);
+    CHECK(NDArray_mmap("ndarray_tests_swapped.npy", NDARRAY_MAP_READ) == 0);
+
+    // Headers cut off inside the descr value, and other malformed ones
+    const char *badDicts[] = {
+        "{'fortran_order': False, 'shape': (2,), 'descr': '",
+        "{'fortran_order': False, 'shape': (2,), 'descr': '<f",
+        "{'descr': '<c8', 'fortran_order': False, 'shape': (2,), }",
+        "{'descr': '<f8', 'fortran_order': Maybe, 'shape': (2,), }",
+        "{'descr': '<f8', 'fortran_order': False, 'shape': (2, -1), }",
+    };
+    for (int i = 0; i < 5; i++)
+    {
+        writeNpy("ndarray_tests_bad.npy", badDicts[i], i >= 2, fortranData, 2 * sizeof(double));
+        CHECK(NDArray_load("ndarray_tests_bad.npy") == 0);
+        CHECK(NDArray_mmap("ndarray_tests_bad.npy", NDARRAY_MAP_READ) == 0);
+    }
+    CHECK(NDArray_load("ndarray_tests_missing.npy") == 0);
+
+    const char *paths[] = {"ndarray_tests_transposed.npy", "ndarray_tests_scalar.npy", "ndarray_tests_int64.npy",
+                           "ndarray_tests.npz", "ndarray_tests_fortran.npy", "ndarray_tests_swapped.npy",
+                           "ndarray_tests_bad.npy", "ndarray_tests_failed.npy", "ndarray_tests_failed.npz"};
+    for (int i = 0; i < 9; i++)
+    {
+        remove(paths[i]);
+    }
+    NDArray_free(swapped);
+    NDArray_free(fortranMapped);
+    NDArray_free(fortran);
+    NDArray_free(integersMember);
+    NDArray_free(scalarMember);
+    NDArray_free(memberSuffix);
+    NDArray_free(member);
+    NDArray_free(integersLoaded);
+    NDArray_free(integers);
+    NDArray_free(scalarLoaded);
+    NDArray_free(scalar);
+    NDArray_free(reloaded);
+    NDArray_free(copied);
+    NDArray_free(mapped);
+    NDArray_free(loaded);
+    NDArray_free(array);
+}
+
+// The RLS solution worked out from scratch: NDArray_lstsq over the samples so far that are
+// still in the window, each weighted by forgetting to the power of its age, with rows adding the
+// regularization, which has been forgotten at every sample
+static struct NDArray *rlsReference(struct NDArray *x, struct NDArray *y, int count, double regularization,
+                                    double forgetting, int window)
+{
+    int p = x->shape[1], k = y->shape[1];
+    int first = window > 0 && count > window ? count - window : 0;
+    int xShape[] = {count - first + p, p};
+    int yShape[] = {count - first + p, k};
+    struct NDArray *weightedX = NDArray_zeros(xShape, 2);
+    struct NDArray *weightedY = NDArray_zeros(yShape, 2);
+    for (int s = first; s < count; s++)
+    {
+        double weight = sqrt(pow(forgetting, count - 1 - s));
+        for (int j = 0; j < p; j++)
+        {
+            weightedX->data[(s - first) * p + j] = (NDARRAY_TYPE)(weight * x->data[s * p + j]);
+        }
+        for (int j = 0; j < k; j++)
+        {
+            weightedY->data[(s - first) * k + j] = (NDARRAY_TYPE)(weight * y->data[s * k + j]);
+        }
+    }
+    for (int i = 0; i < p; i++)
+    {
+        weightedX->data[(count - first + i) * p + i] = (NDARRAY_TYPE)sqrt(pow(forgetting, count) * regularization);
+    }
+    struct NDArray *solution = NDArray_lstsq(weightedX, weightedY, NDARRAY_LSTSQ_QR);
+    NDArray_free(weightedX);
+    NDArray_free(weightedY);
+    return solution;
+}
+
+// Feed the samples to an RLS, batch rows at a time or one 1-d sample at a time if batch is 0,
+// checking the solution against rlsReference after every update
+static void checkRls(struct NDArray *x, struct NDArray *y, double regularization, double forgetting, int window,
+                     int batch, int line)
+{
+    int n = x->shape[0], p = x->shape[1], k = y->shape[1];
+    struct NDArrayRLS *rls = NDArray_rlsNew(p, k, (NDARRAY_TYPE)regularization, (NDARRAY_TYPE)forgetting, window);
+    if (rls == 0)
+    {
+        check(0, "NDArray_rlsNew", line);
+        return;
+    }
+    int shape[] = {p, k};
+    for (int count = 0; count < n;)
+    {
+        struct NDArray *xs;
+        struct NDArray *ys;
+        if (batch == 0)
+        {
+            struct NDArraySlice row[] = {{count, count + 1, 1}, NDARRAY_SLICE_ALL};
+            int features[] = {p};
+            int targets[] = {k};
+            xs = NDArray_slice(x, row, 2);
+            ys = NDArray_slice(y, row, 2);
+            NDArray_reshape(xs, features, 1);
+            NDArray_reshape(ys, targets, 1);
+            count++;
+        }
+        else
+        {
+            struct NDArraySlice rows[] = {{count, count + batch, 1}, NDARRAY_SLICE_ALL};
+            xs = NDArray_slice(x, rows, 2);
+            ys = NDArray_slice(y, rows, 2);
+            count = count + batch < n ? count + batch : n;
+        }
+        check(NDArray_rlsUpdate(rls, xs, ys) == 0, "NDArray_rlsUpdate", line);
+        NDArray_free(xs);
+        NDArray_free(ys);
+
+        struct NDArray *expected = rlsReference(x, y, count, regularization, forgetting, window);
+        struct NDArray *actual = NDArray_rlsSolve(rls);
+        double values[64];
+        for (int i = 0; i < p * k; i++)
+        {
+            values[i] = element(expected, i);
+        }
+        checkArray(actual, values, shape, 2, "NDArray_rlsSolve", line);
+        NDArray_free(expected);
+        NDArray_free(actual);
+    }
+    NDArray_rlsFree(rls);
+}
+
+static void testRls(void)
+{
+    // y = x b plus a little noise, with one sample far larger than the rest. A window can't
+    // take that one out by downdating, so the factor gets rebuilt when it leaves
+    int n = 60, p = 4, k = 2;
+    int xShape[] = {n, p};
+    int yShape[] = {n, k};
+    int bShape[] = {p, k};
+    struct NDArray *x = randomArray(xShape, 2);
+    struct NDArray *b = randomArray(bShape, 2);
+    struct NDArray *noise = randomArray(yShape, 2);
+    struct NDArray *y = NDArray_matmul(x, b);
+    for (int i = 0; i < n * k; i++)
+    {
+        y->data[i] += (NDARRAY_TYPE)0.01 * noise->data[i];
+    }
+    for (int j = 0; j < p; j++)
+    {
+        x->data[5 * p + j] *= 100;
+    }
+    for (int j = 0; j < k; j++)
+    {
+        y->data[5 * k + j] *= 100;
+    }
+
+    for (int batch = 0; batch <= 7; batch += 7)
+    {
+        checkRls(x, y, 0.01, 1, 0, batch, __LINE__);
+        checkRls(x, y, 0.01, 0.95, 0, batch, __LINE__);
+        checkRls(x, y, 0.01, 1, 15, batch, __LINE__);
+        checkRls(x, y, 0.01, 0.9, 12, batch, __LINE__);
+    }
+
+    // With few samples the regularization still carries weight, as it fades with them
+    struct NDArraySlice firstRows[] = {{0, 6, 1}, NDARRAY_SLICE_ALL};
+    struct NDArray *fewX = NDArray_slice(x, firstRows, 2);
+    struct NDArray *fewY = NDArray_slice(y, firstRows, 2);
+    struct NDArray *fewXCopy = NDArray_ascontiguous(fewX);
+    struct NDArray *fewYCopy = NDArray_ascontiguous(fewY);
+    checkRls(fewXCopy, fewYCopy, 2, 0.8, 0, 0, __LINE__);
+    checkRls(fewXCopy, fewYCopy, 2, 0.8, 3, 2, __LINE__);
+
+    // Without regularization, fewer than p samples don't determine the solution
+    struct NDArrayRLS *rls = NDArray_rlsNew(p, k, 0, 1, 0);
+    struct NDArraySlice twoRows[] = {{0, 2, 1}, NDARRAY_SLICE_ALL};
+    struct NDArray *twoX = NDArray_slice(x, twoRows, 2);
+    struct NDArray *twoY = NDArray_slice(y, twoRows, 2);
+    struct NDArray *out = NDArray_zeros(bShape, 2);
+    CHECK(NDArray_rlsUpdate(rls, twoX, twoY) == 0);
+    CHECK(NDArray_rlsSolve(rls) == 0);
+    CHECK(NDArray_rlsSolve_out(rls, out) == 3);
+    CHECK(NDArray_rlsUpdate(rls, twoX, b) == 1);
+    CHECK(NDArray_rlsNew(p, k, 0, 0, 0) == 0);
+    CHECK(NDArray_rlsNew(p, k, 0, (NDARRAY_TYPE)1.5, 0) == 0);
+
+    NDArray_rlsFree(rls);
+    NDArray_free(out);
+    NDArray_free(twoX);
+    NDArray_free(twoY);
+    NDArray_free(fewXCopy);
+    NDArray_free(fewYCopy);
+    NDArray_free(fewX);
+    NDArray_free(fewY);
+    NDArray_free(x);
+    NDArray_free(b);
+    NDArray_free(noise);
+    NDArray_free(y);
+}
+
+// Brute-force einsum in double, looping over every combination of label values. Fills in the
+// output's shape and gives its ndim, with the result, malloc'd and in C order, in *result
+static int naiveEinsum(const char *subscripts, int count, struct NDArray **operands, int *shape, double **result)
+{
+    int labels[8][8];
+    int uses[52] = {0};
+    int sizes[52];
+    int output[52];
+    int outNDim = 0;
+    const char *c = subscripts;
+    for (int op = 0, axis = 0; *c != 0 && *c != '-'; c++)
+    {
+        if (*c == ',')
+        {
+            op++;
+            axis = 0;
+            continue;
+        }
+        int label = *c >= 'a' ? *c - 'a' + 26 : *c - 'A';
+        labels[op][axis] = label;
+        sizes[label] = operands[op]->shape[axis++];
+        uses[label]++;
+    }
+    if (*c == '-')
+    {
+        for (c += 2; *c != 0; c++)
+        {
+            output[outNDim++] = *c >= 'a' ? *c - 'a' + 26 : *c - 'A';
+        }
+    }
+    else
+    {
+        // Implicit output: the labels used once, in alphabetical order
+        for (int label = 0; label < 52; label++)
+        {
+            if (uses[label] == 1)
+            {
+                output[outNDim++] = label;
+            }
+        }
+    }
+
+    long outCount = 1;
+    long total = 1;
+    for (int i = 0; i < outNDim; i++)
+    {
+        shape[i] = sizes[output[i]];
+        outCount *= shape[i];
+    }
+    for (int label = 0; label < 52; label++)
+    {
+        total *= uses[label] > 0 ? sizes[label] : 1;
+    }
+    *result = (double *)calloc(outCount > 0 ? outCount : 1, sizeof(double));
+    int values[52];
+    for (long flat = 0; flat < total; flat++)
+    {
+        long rest = flat;
+        for (int label = 51; label >= 0; label--)
+        {
+            if (uses[label] > 0)
+            {
+                values[label] = (int)(rest % sizes[label]);
+                rest /= sizes[label];
+            }
+        }
+        double product = 1;
+        for (int op = 0; op < count; op++)
+        {
+            int index[8];
+            for (int axis = 0; axis < operands[op]->ndim; axis++)
+            {
+                index[axis] = values[labels[op][axis]];
+            }
+            product *= NDArray_get(operands[op], index);
+        }
+        long out = 0;
+        for (int i = 0; i < outNDim; i++)
+        {
+            out = out * shape[i] + values[output[i]];
+        }
+        (*result)[out] += product;
+    }
+    return outNDim;
+}
+
+static void checkEinsum(const char *subscripts, int count, struct NDArray **operands, int line)
+{
+    int shape[52];
+    double *expected;
+    int ndim = naiveEinsum(subscripts, count, operands, shape, &expected);
+    struct NDArray *result = NDArray_einsum(subscripts, count, operands);
+    checkArray(result, expected, shape, ndim, subscripts, line);
+
+    // Into a float64 out as well, which can't be written straight from the matmuls
+    struct NDArray *out = NDArray_zerosDType(shape, ndim, NDARRAY_FLOAT64);
+    check(NDArray_einsum_out(subscripts, count, operands, out) == 0, subscripts, line);
+    checkArray(out, expected, shape, ndim, subscripts, line);
+    NDArray_free(out);
+    NDArray_free(result);
+    free(expected);
+}
+
+// Bytes allocated by einsum into out, to tell which order the operands were contracted in
+static uint64_t einsumBytes(const char *subscripts, int count, struct NDArray **operands, struct NDArray *out)
+{
+    struct NDArrayStats before;
+    struct NDArrayStats after;
+    NDArray_getStats(&before);
+    CHECK(NDArray_einsum_out(subscripts, count, operands, out) == 0);
+    NDArray_getStats(&after);
+    return after.bytesAllocated - before.bytesAllocated;
+}
+
+static void testEinsum(void)
+{
+    struct NDArray *a = randomArray((int[]){3, 4}, 2);
+    struct NDArray *b = randomArray((int[]){4, 5}, 2);
+    struct NDArray *square = randomArray((int[]){4, 4}, 2);
+    struct NDArray *batchA = randomArray((int[]){2, 3, 4}, 3);
+    struct NDArray *batchB = randomArray((int[]){2, 4, 5}, 3);
+    struct NDArray *t = randomArray((int[]){3, 4, 5}, 3);
+    struct NDArray *u = randomArray((int[]){5, 4, 2}, 3);
+
+    checkEinsum("ij,jk->ik", 2, (struct NDArray *[]){a, b}, __LINE__);
+    checkEinsum("ij,jk->ki", 2, (struct NDArray *[]){a, b}, __LINE__);
+    checkEinsum("bij,bjk->bik", 2, (struct NDArray *[]){batchA, batchB}, __LINE__);
+    checkEinsum("bij,bjk->kbi", 2, (struct NDArray *[]){batchA, batchB}, __LINE__);
+    checkEinsum("ii->i", 1, (struct NDArray *[]){square}, __LINE__);
+    checkEinsum("ii->", 1, (struct NDArray *[]){square}, __LINE__);
+    checkEinsum("ij->", 1, (struct NDArray *[]){a}, __LINE__);
+    checkEinsum("ijk,kjl->il", 2, (struct NDArray *[]){t, u}, __LINE__);
+    struct NDArray *diagonal[] = {randomArray((int[]){4, 4, 3}, 3), randomArray((int[]){3}, 1)};
+    checkEinsum("iij,j->i", 2, diagonal, __LINE__);
+
+    // Without "->" the labels used once come out in alphabetical order, whatever order they're in
+    checkEinsum("ij,jk", 2, (struct NDArray *[]){a, b}, __LINE__);
+    checkEinsum("ji", 1, (struct NDArray *[]){a}, __LINE__);
+    struct NDArray *unordered[] = {randomArray((int[]){5, 4}, 2), randomArray((int[]){4, 3}, 2)};
+    checkEinsum("kj,ji", 2, unordered, __LINE__);
+    checkEinsum("ii", 1, (struct NDArray *[]){square}, __LINE__);
+
+    // A chain costs far less one way round than the other, and the cheap way only makes a small
+    // intermediate. Both orientations check the order adapts to the shapes
+    struct NDArray *wide = randomArray((int[]){2, 50}, 2);
+    struct NDArray *middle = randomArray((int[]){50, 3}, 2);
+    struct NDArray *tall = randomArray((int[]){3, 40}, 2);
+    struct NDArray *chain[] = {wide, middle, tall};
+    checkEinsum("ij,jk,kl->il", 3, chain, __LINE__);
+    struct NDArray *chainOut = NDArray_zeros((int[]){2, 40}, 2);
+    CHECK(einsumBytes("ij,jk,kl->il", 3, chain, chainOut) < 50 * 40 * sizeof(NDARRAY_TYPE));
+    struct NDArray *reversed[] = {randomArray((int[]){40, 3}, 2), randomArray((int[]){3, 50}, 2),
+                                  randomArray((int[]){50, 2}, 2)};
+    checkEinsum("ij,jk,kl->il", 3, reversed, __LINE__);
+    struct NDArray *reversedOut = NDArray_zeros((int[]){40, 2}, 2);
+    CHECK(einsumBytes("ij,jk,kl->il", 3, reversed, reversedOut) < 40 * 50 * sizeof(NDARRAY_TYPE));
+
+    // Bad subscripts give 0, and 1 from the _out form
+    const char *bad[] = {"ij,jk->iq", "ij,jk->ii", "ijk,jk->ik", "ij,ik->jk", "i,jk->ik", "...j,jk->ik",
+                         "ij,jk->ik->", "ij,j1->i"};
+    struct NDArray *out = NDArray_zeros((int[]){3, 5}, 2);
+    for (int i = 0; i < 8; i++)
+    {
+        check(NDArray_einsum(bad[i], 2, (struct NDArray *[]){a, b}) == 0, bad[i], __LINE__);
+        check(NDArray_einsum_out(bad[i], 2, (struct NDArray *[]){a, b}, out) == 1, bad[i], __LINE__);
+    }
+    CHECK(NDArray_einsum("ij,jk->ik", 2, (struct NDArray *[]){a, t}) == 0);
+    CHECK(NDArray_einsum("ij->ij", 2, (struct NDArray *[]){a, b}) == 0);
+    CHECK(NDArray_einsum_out("ij,jk->ki", 2, (struct NDArray *[]){a, b}, out) == 2);
+
+    // tensordot is einsum with the paired axes sharing labels
+    int shape[52];
+    double *expected;
+    int ndim = naiveEinsum("ijk,kjl->il", 2, (struct NDArray *[]){t, u}, shape, &expected);
+    struct NDArray *dot = NDArray_tensordot(t, u, (int[]){1, 2}, (int[]){1, 0}, 2);
+    CHECK_ARRAY(dot, expected, shape, ndim);
+    NDArray_free(dot);
+    free(expected);
+    ndim = naiveEinsum("ijk,kmn->ijmn", 2, (struct NDArray *[]){t, u}, shape, &expected);
+    dot = NDArray_tensordot(t, u, (int[]){-1}, (int[]){0}, 1);
+    CHECK_ARRAY(dot, expected, shape, ndim);
+    NDArray_free(dot);
+    free(expected);
+    CHECK(NDArray_tensordot(t, u, (int[]){0}, (int[]){0}, 1) == 0);
+    CHECK(NDArray_tensordot(t, u, (int[]){2, 2}, (int[]){0, 1}, 2) == 0);
+    CHECK(NDArray_tensordot(t, u, (int[]){5}, (int[]){0}, 1) == 0);
+
+    NDArray_free(out);
+    NDArray_free(chainOut);
+    NDArray_free(reversedOut);
+    for (int i = 0; i < 3; i++)
+    {
+        NDArray_free(chain[i]);
+        NDArray_free(reversed[i]);
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        NDArray_free(diagonal[i]);
+        NDArray_free(unordered[i]);
+    }
+    NDArray_free(a);
+    NDArray_free(b);
+    NDArray_free(square);
+    NDArray_free(batchA);
+    NDArray_free(batchB);
+    NDArray_free(t);
+    NDArray_free(u);
+}
+
+int main(void)
+{
+    testBasics();
+    testZeroDim();
+    testHighRank();
+    testSimd();
+    testAllocators();
+    testMatmul();
+    testSolve();
+    testReduce();
+    testFiles();
+    testRls();
+    testEinsum();
+    testThreads();
+    testInverse();
+    testUfuncs();
+    testExpr();
+    testDTypes();
+    testFromBuffer();
+    testSlice();
+    testStats();
+    testContiguous();
+    testPolynomials();
+    testSmallMatrices();
+
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+    }
+    return failures > 0;
+}